@@ -0,0 +1,254 @@
+#
+# Copyright (c) 2014, UChicago Argonne, LLC
+# See LICENSE file.
+#
+
+# Benchmark of the FF-HEDM indexing pipeline on synthetic data.
+# ForwardSimulation generates the spots of random grains, SaveBinData bins them
+# into a private shared memory dataset (DatasetID), then the indexer,
+# FitPosOrStrains (one process per SpotID, nCPUs at a time) and ProcessGrains
+# are timed. Recall is the fraction of simulated grains that are found, a grain
+# is found if most of the matched spots of an indexed/final grain are its spots.
+# eg. python BenchmarkIndexing.py -nGrains 50 200 -nCPUs 8 -resultFile bench.csv
+
+import numpy as np
+import argparse
+import os
+import sys
+import time
+import shutil
+import tempfile
+from subprocess import call, DEVNULL
+from concurrent.futures import ThreadPoolExecutor
+from os.path import expanduser
+
+parser = argparse.ArgumentParser(description='Benchmark of the FF-HEDM indexing pipeline on ForwardSimulation data.')
+parser.add_argument('-binFolder', type=str, default='', help='Folder with the MIDAS binaries, default BINFOLDER from ~/.MIDAS/paths')
+parser.add_argument('-nGrains', type=int, nargs='+', default=[50], help='Grain counts to benchmark')
+parser.add_argument('-spaceGroup', type=int, default=225, help='Space group number')
+parser.add_argument('-latticeParameter', type=float, nargs=6, default=[4.08,4.08,4.08,90,90,90], help='a b c alpha beta gamma')
+parser.add_argument('-rings', type=int, nargs='+', default=[1,2,3], help='Ring numbers to simulate and index')
+parser.add_argument('-seedRing', type=int, default=0, help='Ring of the seed spots, default the ring with the fewest spots')
+parser.add_argument('-noisePos', type=float, default=0, help='Sigma of the noise added to y and z [microns]')
+parser.add_argument('-noiseOme', type=float, default=0, help='Sigma of the noise added to omega [degrees]')
+parser.add_argument('-nCPUs', type=int, default=1, help='Number of CPUs to use')
+parser.add_argument('-randomSeed', type=int, default=1, help='Seed for the grain orientations, positions and noise')
+parser.add_argument('-extraParams', type=str, nargs='*', default=[], help='Extra lines for paramstest.txt, eg. "ClaimSpots 1"')
+parser.add_argument('-indexOnly', type=int, default=0, help='1 to skip FitPosOrStrains and ProcessGrains')
+parser.add_argument('-workFolder', type=str, default='', help='Where to run, default a new temporary folder')
+parser.add_argument('-keep', type=int, default=0, help='1 to keep the work folder')
+parser.add_argument('-resultFile', type=str, default='', help='Append one csv line per run to this file')
+args, unparsed = parser.parse_known_args()
+
+binfolder = args.binFolder
+if binfolder == '':
+	home = expanduser("~")
+	pathsf = open(home + '/.MIDAS/paths')
+	for line in pathsf.readlines():
+		if 'BINFOLDER' in line:
+			binfolder = line.split('=')[1].split('\n')[0]
+binfolder = os.path.abspath(expanduser(binfolder))
+rng = np.random.default_rng(args.randomSeed)
+
+Wavelength = 0.22291
+Lsd = 1000000.0
+px = 200.0
+NrPixels = 2048
+Rsample = 400
+Hbeam = 200
+
+def randomOrientation():
+	q = rng.normal(size=4)
+	q /= np.linalg.norm(q)
+	a, b, c, d = q
+	return np.array([[a*a+b*b-c*c-d*d, 2*(b*c-a*d), 2*(b*d+a*c)],
+					 [2*(b*c+a*d), a*a-b*b+c*c-d*d, 2*(c*d-a*b)],
+					 [2*(b*d-a*c), 2*(c*d+a*b), a*a-b*b-c*c+d*d]])
+
+def writeGrains(fn, nGrains):
+	latC = ' '.join('%f' % x for x in args.latticeParameter)
+	f = open(fn, 'w')
+	f.write('%%NumGrains %d\n%%BeamCenter 0\n%%BeamThickness %d\n%%GlobalPosition 0\n%%NumPhases 1\n' % (nGrains, Hbeam))
+	f.write('%%PhaseInfo\n%%\tSpaceGroup:%d\n%%\tLattice Parameter: %s\n%%GrainID\n' % (args.spaceGroup, latC))
+	for i in range(nGrains):
+		om = randomOrientation()
+		r = Rsample * np.sqrt(rng.uniform()) * 0.9
+		phi = rng.uniform(0, 2*np.pi)
+		pos = [r*np.cos(phi), r*np.sin(phi), rng.uniform(-0.4*Hbeam, 0.4*Hbeam)]
+		vals = list(om.ravel()) + pos + args.latticeParameter
+		f.write('%d\t' % (i+1) + '\t'.join('%f' % x for x in vals) + '\n')
+	f.close()
+
+def writeSimParams(fn):
+	f = open(fn, 'w')
+	f.write('LatticeConstant ' + ' '.join('%f' % x for x in args.latticeParameter) + '\n')
+	f.write('SpaceGroup %d\nInFileName Grains.csv\nOutFileName sim_000001.ge3\n' % args.spaceGroup)
+	f.write('Lsd %f\nBC %d %d\ntx 0\nty 0\ntz 0\np0 0\np1 0\np2 0\nWedge 0\n' % (Lsd, NrPixels/2, NrPixels/2))
+	f.write('RhoD %f\nMaxRingRad %f\nWavelength %f\nNrPixels %d\npx %f\n' % (NrPixels*px/2, NrPixels*px/2, Wavelength, NrPixels, px))
+	f.write('OmegaStart 180\nOmegaEnd -180\nOmegaStep -60\nGaussWidth 1\nPeakIntensity 5000\nWriteSpots 1\n')
+	for ring in args.rings:
+		f.write('RingsToUse %d\n' % ring)
+	f.close()
+
+def writeParams(fn, datasetID, ringRadii, workFolder):
+	latC = ' '.join('%f' % x for x in args.latticeParameter)
+	f = open(fn, 'w')
+	f.write('SpaceGroup %d\nLatticeParameter %s\nLatticeConstant %s\n' % (args.spaceGroup, latC, latC))
+	f.write('Wavelength %f\nDistance %f\nLsd %f\npx %f\nWedge 0\n' % (Wavelength, Lsd, Lsd, px))
+	f.write('Rsample %d\nHbeam %d\nBeamThickness %d\nGlobalPosition 0\nNumPhases 1\nPhaseNr 1\n' % (Rsample, Hbeam, Hbeam))
+	f.write('StepsizePos 5\nStepsizeOrient 0.2\nMarginOme 0.5\nMarginEta 500\nMarginRadius 500\nMarginRadial 500\n')
+	f.write('EtaBinSize 0.1\nOmeBinSize 0.1\nExcludePoleAngle 6\nMinMatchesToAcceptFrac 0.8\nMinNrSpots 1\n')
+	f.write('UseFriedelPairs 1\nMargABC 0.3\nMargABG 0.3\nMaxRingRad %f\n' % (NrPixels*px/2))
+	f.write('OmegaRange -180 180\nBoxSize -1000000 1000000 -1000000 1000000\n')
+	f.write('OutputFolder %s/Output\nResultFolder %s/Results\nDatasetID %s\n' % (workFolder, workFolder, datasetID))
+	for ring in args.rings:
+		f.write('RingNumbers %d\nRingRadii %f\n' % (ring, ringRadii[ring]))
+	for line in args.extraParams:
+		f.write(line + '\n')
+	f.close()
+
+# Spot rows are written in SpotMatrixGen.csv order, so SpotID-1 is the row.
+def writeSpots(spots):
+	noise = np.zeros((spots.shape[0], 3))
+	if args.noisePos > 0:
+		noise[:,0:2] = rng.normal(0, args.noisePos, (spots.shape[0], 2))
+	if args.noiseOme > 0:
+		noise[:,2] = rng.normal(0, args.noiseOme, spots.shape[0])
+	f = open('InputAll.csv', 'w')
+	g = open('InputAllExtraInfoFittingAll.csv', 'w')
+	f.write('%YLab ZLab Omega GrainRadius SpotID RingNumber Eta Ttheta\n')
+	g.write('%YLab ZLab Omega GrainRadius SpotID RingNumber Eta Ttheta OmegaIni(NoWedgeCorr) YOrig(NoWedgeCorr) ZOrig(NoWedgeCorr) YOrig(DetCor) ZOrig(DetCor) OmegaOrig(DetCor)\n')
+	for k, s in enumerate(spots):
+		y = s[8] + noise[k,0]
+		z = s[9] + noise[k,1]
+		ome = s[2] + noise[k,2]
+		eta = np.degrees(np.arctan2(-y, z))
+		tth = np.degrees(np.arctan(np.sqrt(y*y+z*z)/Lsd))
+		row = [y, z, ome, 100, k+1, s[7], eta, tth]
+		f.write(' '.join('%12.5f' % x for x in row) + '\n')
+		g.write(' '.join('%12.5f' % x for x in row + [ome, y, z, y, z, ome]) + '\n')
+	f.close()
+	g.close()
+
+# Fraction of simulated grains that are the majority owner of the spots of some found grain.
+def recall(spotIDLists, truth, nGrains):
+	found = set()
+	for ids in spotIDLists:
+		ids = [i for i in ids if i > 0 and i <= len(truth)]
+		if len(ids) == 0:
+			continue
+		found.add(np.bincount(truth[np.array(ids)-1]).argmax())
+	return len(found) / nGrains
+
+# Spots of every indexed seed from the IndexBest.bin container.
+def indexedSpotIDs(fn, nSlots):
+	nColKey = 18
+	nColSpots = 17
+	keys = np.fromfile(fn, dtype=np.float64, count=nColKey*nSlots).reshape(-1, nColKey)
+	f = open(fn, 'rb')
+	lists = []
+	for key in keys:
+		if key[0] == 0:
+			continue
+		f.seek(int(key[17]))
+		rows = np.frombuffer(f.read(int(key[16])*nColSpots*8)).reshape(-1, nColSpots)
+		lists.append([int(x) for x in rows[:,14] if x > 0])
+	f.close()
+	return lists, len(lists)
+
+def finalSpotIDs(fn):
+	if not os.path.exists(fn):
+		return []
+	sm = np.genfromtxt(fn, skip_header=1, ndmin=2)
+	if sm.size == 0:
+		return []
+	lists = []
+	for grainID in np.unique(sm[:,0]):
+		lists.append([int(x) for x in sm[sm[:,0] == grainID, 1]])
+	return lists
+
+def timeCall(cmd):
+	t = time.time()
+	rc = call(cmd, stdout=DEVNULL)
+	if rc != 0:
+		print('%s returned %d.' % (cmd[0], rc))
+	return time.time() - t
+
+def runFitPosOrStrains(spotID):
+	return call([binfolder+'/FitPosOrStrains', 'paramstest.txt', str(spotID)], stdout=DEVNULL)
+
+def runBenchmark(nGrains, workFolder):
+	os.makedirs(workFolder + '/Output')
+	os.makedirs(workFolder + '/Results')
+	os.chdir(workFolder)
+	datasetID = 'Bench_%d_%d' % (os.getpid(), nGrains)
+	writeGrains('Grains.csv', nGrains)
+	writeSimParams('ps.txt')
+	call([binfolder+'/GetHKLList', 'ps.txt'], stdout=DEVNULL)
+	call([binfolder+'/ForwardSimulation', 'ps.txt'], stdout=DEVNULL)
+	spots = np.genfromtxt('SpotMatrixGen.csv', skip_header=1, ndmin=2)
+	truth = spots[:,0].astype(int)
+	hkls = np.genfromtxt('hkls.csv', skip_header=1, ndmin=2)
+	ringRadii = {int(h[4]): h[10] for h in hkls}
+	writeSpots(spots)
+	writeParams('paramstest.txt', datasetID, ringRadii, workFolder)
+	seedRing = args.seedRing
+	if seedRing == 0:
+		counts = {ring: np.sum(spots[:,7] == ring) for ring in args.rings}
+		seedRing = min(counts, key=counts.get)
+	seeds = [k+1 for k, s in enumerate(spots) if int(s[7]) == seedRing]
+	f = open('SpotsToIndex.csv', 'w')
+	for s in seeds:
+		f.write('%d\n' % s)
+	f.close()
+	res = {'nGrains': nGrains, 'nSpots': spots.shape[0], 'nSeeds': len(seeds)}
+	try:
+		res['tBinData'] = timeCall([binfolder+'/SaveBinData'])
+		res['tIndexer'] = timeCall([binfolder+'/IndexerLinuxArgsShm', 'paramstest.txt', 'SpotsToIndex.csv', str(args.nCPUs)])
+		lists, res['nIndexed'] = indexedSpotIDs('Output/IndexBest.bin', len(seeds))
+		res['recallIndexer'] = recall(lists, truth, nGrains)
+		res['seedsPerS'] = len(seeds) / res['tIndexer']
+		if args.indexOnly == 0:
+			t = time.time()
+			with ThreadPoolExecutor(max_workers=args.nCPUs) as pool:
+				rcs = list(pool.map(runFitPosOrStrains, seeds))
+			res['tFitPosOrStrains'] = time.time() - t
+			res['tProcessGrains'] = timeCall([binfolder+'/ProcessGrains', 'paramstest.txt'])
+			lists = finalSpotIDs('SpotMatrix.csv')
+			res['nGrainsFound'] = len(lists)
+			res['recallFinal'] = recall(lists, truth, nGrains)
+			res['grainsPerS'] = nGrains / (res['tIndexer'] + res['tFitPosOrStrains'] + res['tProcessGrains'])
+	finally:
+		# ProcessGrains drops the dataset, make sure nothing is left behind if it did not run.
+		shutil.rmtree('/dev/shm/MIDAS_' + datasetID, ignore_errors=True)
+	return res
+
+columns = ['nGrains', 'nSpots', 'nSeeds', 'tBinData', 'tIndexer', 'nIndexed', 'recallIndexer', 'seedsPerS',
+		   'tFitPosOrStrains', 'tProcessGrains', 'nGrainsFound', 'recallFinal', 'grainsPerS']
+results = []
+for nGrains in args.nGrains:
+	if args.workFolder == '':
+		workFolder = tempfile.mkdtemp(prefix='MIDASBench_')
+	else:
+		workFolder = os.path.abspath(args.workFolder) + '/nGrains_%d' % nGrains
+		shutil.rmtree(workFolder, ignore_errors=True)
+	cwd = os.getcwd()
+	res = runBenchmark(nGrains, workFolder)
+	os.chdir(cwd)
+	if args.keep == 0:
+		shutil.rmtree(workFolder, ignore_errors=True)
+	else:
+		print('Work folder: ' + workFolder)
+	results.append(res)
+	print(' '.join('%s %s' % (c, ('%.3f' % res[c]) if isinstance(res[c], float) else res[c]) for c in columns if c in res))
+	sys.stdout.flush()
+
+if args.resultFile != '':
+	newFile = not os.path.exists(args.resultFile)
+	f = open(args.resultFile, 'a')
+	if newFile:
+		f.write('SpaceGroup,Rings,noisePos,noiseOme,nCPUs,' + ','.join(columns) + '\n')
+	for res in results:
+		f.write('%d,%s,%f,%f,%d,' % (args.spaceGroup, ' '.join(str(r) for r in args.rings), args.noisePos, args.noiseOme, args.nCPUs))
+		f.write(','.join(str(res.get(c, '')) for c in columns) + '\n')
+	f.close()
@@ -7,4 +7,7 @@
 
 source ${HOME}/.MIDAS/paths
 ${BINFOLDER}/SaveBinData
-cp *.bin /dev/shm
+# With a DatasetID, SaveBinData already put the bins in /dev/shm/MIDAS_<DatasetID>.
+if ! grep -q "^DatasetID " paramstest.txt; then
+	cp *.bin /dev/shm
+fi
@@ -41,36 +41,6 @@ extern int *mapMask;
 size_t mapMaskSize = 0;
 int *mapMask;
 
-static inline
-pixelvalue**
-allocMatrixPX(int nrows, int ncols)
-{
-    pixelvalue** arr;
-    int i;
-    arr = malloc(nrows * sizeof(*arr));
-    if (arr == NULL ) {
-        return NULL;
-    }
-    for ( i = 0 ; i < nrows ; i++) {
-        arr[i] = malloc(ncols * sizeof(*arr[i]));
-        if (arr[i] == NULL ) {
-            return NULL;
-        }
-    }
-    return arr;
-}
-
-static inline
-void
-FreeMemMatrixPx(pixelvalue **mat,int nrows)
-{
-    int r;
-    for ( r = 0 ; r < nrows ; r++) {
-        free(mat[r]);
-    }
-    free(mat);
-}
-
 static inline
 int**
 allocMatrixInt(int nrows, int ncols)
@@ -160,44 +130,14 @@ MatrixMult(
 }
 
 
+// R and Eta come from the shared geometry map (GeometryMap.c).
 static inline
-void Car2Pol(int n_hkls, int nEtaBins, int y, int z, double ybc, double zbc, double px, double *R, double *Eta, double Rmins[n_hkls],
-						double Rmaxs[n_hkls], double EtaBinsLow[nEtaBins], double EtaBinsHigh[nEtaBins], int nIndices, int *NrEachIndexbin, int **Indices,
-						double tx, double ty, double tz, double p0, double p1, double p2, double p3, double RhoD, double Lsd){
+void Car2Pol(int n_hkls, int nEtaBins, int y, int z, double px, double *R, double *Eta, double Rmins[n_hkls],
+						double Rmaxs[n_hkls], double EtaBinsLow[nEtaBins], double EtaBinsHigh[nEtaBins], int nIndices, int *NrEachIndexbin, int **Indices){
 	int i, j, k, l, counter=0;
 	for (i=0;i<nIndices;i++) NrEachIndexbin[i]=0;
-	double txr, tyr, tzr;
-	txr = deg2rad*tx;
-	tyr = deg2rad*ty;
-	tzr = deg2rad*tz;
-	double Rx[3][3] = {{1,0,0},{0,cos(txr),-sin(txr)},{0,sin(txr),cos(txr)}};
-	double Ry[3][3] = {{cos(tyr),0,sin(tyr)},{0,1,0},{-sin(tyr),0,cos(tyr)}};
-	double Rz[3][3] = {{cos(tzr),-sin(tzr),0},{sin(tzr),cos(tzr),0},{0,0,1}};
-	double TRint[3][3], TRs[3][3];
-	MatrixMultF33(Ry,Rz,TRint);
-	MatrixMultF33(Rx,TRint,TRs);
-	double Yc,Zc,n0=2,n1=4,n2=2;
-	double ABC[3], ABCPr[3], XYZ[3];
-	double Rt,Rad, EtaS, RNorm, DistortFunc, EtaT;
 	for (i=0;i<z;i++){
 		for (j=0;j<y;j++){
-			Yc = (-j + ybc)*px;
-			Zc =  (i - zbc)*px;
-			ABC[0] = 0;
-			ABC[1] = Yc;
-			ABC[2] = Zc;
-			MatrixMult(TRs,ABC,ABCPr);
-			XYZ[0] = Lsd+ABCPr[0];
-			XYZ[1] = ABCPr[1];
-			XYZ[2] = ABCPr[2];
-			Rad = (Lsd/(XYZ[0]))*(sqrt(XYZ[1]*XYZ[1] + XYZ[2]*XYZ[2]));
-			EtaS = CalcEtaAngle(XYZ[1],XYZ[2]);
-			RNorm = Rad/RhoD;
-			EtaT = 90 - EtaS;
-			DistortFunc = (p0*(pow(RNorm,n0))*(cos(deg2rad*(2*EtaT)))) + (p1*(pow(RNorm,n1))*(cos(deg2rad*(4*EtaT+p3)))) + (p2*(pow(RNorm,n2))) + 1;
-			Rt = Rad * DistortFunc;
-			R[counter] = Rt;
-			Eta[counter] = EtaS;
 			for (k=0;k<n_hkls;k++){
 				if (R[counter] >= (Rmins[k]-px) && R[counter] <= (Rmaxs[k] + px)){
 					for (l=0;l<nEtaBins;l++){
@@ -233,6 +173,11 @@ void CalcWeightedMean(int nIndices, int *NrEachIndexBin, int **Indices, double *
 	}
 }
 
+// GeometryMap.c
+double *GeometryMapGet(char *Folder, int NrPixelsY, int NrPixelsZ, double px, double Ycen, double Zcen, double Lsd, double RhoD,
+	double tx, double ty, double tz, double p0, double p1, double p2, double p3);
+void GeometryMapRelease(double *R, int NrPixelsY, int NrPixelsZ);
+
 struct my_profile_func_data{
 	int NrPtsForFit;
 	double *Rs;
@@ -567,56 +512,20 @@ void CorrectTiltSpatialDistortion(int nIndices, double MaxRad, double *YMean, do
 	*StdDiff = sqrt(StdDiff2/nIndices);
 }
 
-static inline void DoImageTransformations (int NrTransOpt, int TransOpt[10], pixelvalue *Image, int NrPixels)
-{
-	int i,j,k,l,m;
-    pixelvalue **ImageTemp1, **ImageTemp2;
-    ImageTemp1 = allocMatrixPX(NrPixels,NrPixels);
-    ImageTemp2 = allocMatrixPX(NrPixels,NrPixels);
-    if (NrTransOpt == 0){
-		return;
-	}
-	for (k=0;k<NrPixels;k++){
-		for (l=0;l<NrPixels;l++){
-			ImageTemp1[k][l] = Image[(NrPixels*k)+l];
-		}
-	}
-	for (k=0;k<NrTransOpt;k++) {
-		if (TransOpt[k] == 1){
-			for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp2[l][m] = ImageTemp1[l][NrPixels-m-1]; //Inverting Y.
-		} else if (TransOpt[k] == 2){
-			for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp2[l][m] = ImageTemp1[NrPixels-l-1][m]; //Inverting Z.
-		} else if (TransOpt[k] == 3){
-			for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp2[l][m] = ImageTemp1[m][l];
-		} else if (TransOpt[k] == 0){
-			for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp2[l][m] = ImageTemp1[l][m];
-		}
-		for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp1[l][m] = ImageTemp2[l][m];
-	}
-	for (k=0;k<NrPixels;k++){
-		for (l=0;l<NrPixels;l++){
-			Image[(NrPixels*k)+l] = ImageTemp2[k][l];
-		}
-	}
-	FreeMemMatrixPx(ImageTemp1,NrPixels);
-	FreeMemMatrixPx(ImageTemp2,NrPixels);
-}
+// RawFrames.c
+struct RawFile;
+int RawPixelSize(int dType);
+struct RawFile *RawFileOpen(char *FN, int PixelSize, size_t NrPixels, size_t HeadSize, int AlignEnd);
+int RawFileNrFrames(struct RawFile *F);
+const void *RawFrame(struct RawFile *F, int FrameNr);
+void RawFrameWillNeed(struct RawFile *F, int FrameNr, int nFrames);
+void RawFileClose(struct RawFile *F);
 
-static inline void MakeSquare (int NrPixels, int NrPixelsY, int NrPixelsZ, pixelvalue *InImage, pixelvalue *OutImage)
-{
-	int i,j,k;
-	if (NrPixelsY == NrPixelsZ){
-		memcpy(OutImage,InImage,NrPixels*NrPixels*sizeof(*InImage));
-	} else {
-		if (NrPixelsY > NrPixelsZ){ // Filling along the slow direction // easy
-			memcpy(OutImage,InImage,NrPixelsY*NrPixelsZ*sizeof(*InImage));
-		} else {
-			for (i=0;i<NrPixelsZ;i++){
-				memcpy(OutImage+i*NrPixelsZ,InImage+i*NrPixelsY,NrPixelsY*sizeof(*InImage));
-			}
-		}
-	}
-}
+// ImageCorrection.c
+void ImageTransformMap(int NrTransOpt, int *TransOpt, int NrRows, int NrCols, int *Map);
+int CorrectImage(const void *Raw, int dType, int InRows, int InCols, int NrRows, int NrCols, const int *Map,
+	double BadPx, const double *Dark, const double *Flood, double Scale, const int *Mask, double Thresh,
+	double *Out, int *FgPixels);
 
 int fileReader (FILE *f,char fn[], int dType, int NrPixels, double *returnArr)
 {
@@ -740,6 +649,7 @@ int main(int argc, char *argv[])
     int makeMap = 0;
 	int HeadSize = 8192;
 	int dType = 1;
+	char GeometryMapFolder[1024] = "/dev/shm";
 	char GapFN[4096], BadPxFN[4096];
     while (fgets(aline,1000,fileParam)!=NULL){
 		str = "FileStem ";
@@ -880,6 +790,12 @@ int main(int argc, char *argv[])
             sscanf(aline,"%s %lf", dummy, &MaxRingRad);
             continue;
         }
+        str = "GeometryMapFolder ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, GeometryMapFolder);
+            continue;
+        }
         str = "Lsd ";
         LowNr = strncmp(aline,str,strlen(str));
         if (LowNr==0){
@@ -1107,7 +1023,7 @@ int main(int argc, char *argv[])
 	size_t sz;
 	char FileName[1024];
 	size_t Skip;
-	FILE *fp, *fd;
+	FILE *fp = NULL, *fd = NULL;
 	int nFrames, TotFrames=0;
 	double *Average;
 	pixelvalue *Image;
@@ -1116,9 +1032,17 @@ int main(int argc, char *argv[])
 	Image = malloc(NrPixelsY*NrPixelsZ*sizeof(*Image)); // Raw.
 	DarkFile2 = calloc(NrPixels*NrPixels,sizeof(*DarkFile2)); // Squared.
 	Image2 = calloc(NrPixels*NrPixels,sizeof(*Image2)); // Squared.
+	// Frames (NrPixelsZ rows of NrPixelsY) are padded to NrPixels x NrPixels and
+	// transformed in one pass, raw types straight from the mapped file.
+	int TransMap[6];
+	ImageTransformMap(NrTransOpt,TransOpt,NrPixels,NrPixels,TransMap);
+	const void *Frame;
+	int FrameType;
 	AverageDark = calloc(NrPixels*NrPixels,sizeof(*AverageDark)); // Squared.
 	Average = calloc(NrPixels*NrPixels,sizeof(*Average)); // Squared.
-	fd = fopen(Dark,"rb");
+	struct RawFile *Raw = NULL;
+	if (RawPixelSize(dType) != 0) Raw = RawFileOpen(Dark,RawPixelSize(dType),NrPixelsY*NrPixelsZ,HeadSize,0);
+	else fd = fopen(Dark,"rb");
 
 	uint16_t *outmatr;
 	char fnout[4096];
@@ -1126,22 +1050,30 @@ int main(int argc, char *argv[])
 	sprintf(fnout,"%s.square",Dark);
 	outmatr = calloc(NrPixels*NrPixels,sizeof(*outmatr));
 	int rc;
-	if (fd == NULL){
+	if (fd == NULL && Raw == NULL){
 		printf("Dark file %s could not be read. Making an empty array for dark.\n",Dark);
 		for (j=0;j<(NrPixels*NrPixels);j++)AverageDark[j] = 0;
 	}else{
-		fseek(fd,0L,SEEK_END);
-		sz = ftell(fd);
-		sz -= HeadSize;
-		rewind(fd);
-		nFrames = sz/(SizeFile);
 		Skip = HeadSize;
+		if (Raw != NULL){
+			nFrames = RawFileNrFrames(Raw);
+		} else {
+			fseek(fd,0L,SEEK_END);
+			sz = ftell(fd);
+			sz -= HeadSize;
+			rewind(fd);
+			nFrames = sz/(SizeFile);
+			fseek(fd,Skip,SEEK_SET);
+		}
 		printf("Reading dark file:      %s, nFrames: %d, skipping first %ld bytes.\n",Dark,nFrames,Skip);
-		fseek(fd,Skip,SEEK_SET);
 		for (i=0;i<nFrames;i++){
-			rc = fileReader(fd,Dark,dType,NrPixelsY*NrPixelsZ,DarkFile);
-			MakeSquare(NrPixels,NrPixelsY,NrPixelsZ,DarkFile,DarkFile2);
-			DoImageTransformations(NrTransOpt,TransOpt,DarkFile2,NrPixels);
+			Frame = DarkFile;
+			FrameType = 2;
+			if (Raw != NULL){
+				Frame = RawFrame(Raw,i);
+				FrameType = dType;
+			} else rc = fileReader(fd,Dark,dType,NrPixelsY*NrPixelsZ,DarkFile);
+			CorrectImage(Frame,FrameType,NrPixelsZ,NrPixelsY,NrPixels,NrPixels,TransMap,NAN,NULL,NULL,1,NULL,-INFINITY,DarkFile2,NULL);
 			if (makeMap == 1){
 				size_t badPxCounter = 0;
 				mapMaskSize = NrPixels;
@@ -1162,7 +1094,10 @@ int main(int argc, char *argv[])
 		}
 		printf("Dark file read.\n");
 		for (j=0;j<(NrPixels*NrPixels);j++)AverageDark[j]=AverageDark[j]/nFrames;
-		fclose(fd);
+		if (Raw != NULL) RawFileClose(Raw);
+		else fclose(fd);
+		Raw = NULL;
+		fd = NULL;
 	}
 	if (makeMap == 2){
 		mapMaskSize = NrPixels;
@@ -1175,8 +1110,7 @@ int main(int argc, char *argv[])
 		double *mapperSquare;
 		mapperSquare = calloc(NrPixels*NrPixels,sizeof(*mapperSquare));
 		fileReader(fd,GapFN,7,NrPixelsY*NrPixelsZ,mapper);
-		MakeSquare(NrPixels,NrPixelsY,NrPixelsZ,mapper,mapperSquare);
-		DoImageTransformations(NrTransOpt,TransOpt,mapperSquare,NrPixels);
+		CorrectImage(mapper,2,NrPixelsZ,NrPixelsY,NrPixels,NrPixels,TransMap,NAN,NULL,NULL,1,NULL,-INFINITY,mapperSquare,NULL);
 		for (i=0;i<NrPixels*NrPixels;i++){
 			if (mapperSquare[i] == 1){
 				SetBit(mapMask,i);
@@ -1184,8 +1118,7 @@ int main(int argc, char *argv[])
 			}
 		}
 		fileReader(fd,BadPxFN,7,NrPixelsY*NrPixelsZ,mapper);
-		MakeSquare(NrPixels,NrPixelsY,NrPixelsZ,mapper,mapperSquare);
-		DoImageTransformations(NrTransOpt,TransOpt,mapperSquare,NrPixels);
+		CorrectImage(mapper,2,NrPixelsZ,NrPixelsY,NrPixels,NrPixels,TransMap,NAN,NULL,NULL,1,NULL,-INFINITY,mapperSquare,NULL);
 		for (i=0;i<NrPixels*NrPixels;i++){
 			if (mapperSquare[i] == 1){
 				SetBit(mapMask,i);
@@ -1196,32 +1129,51 @@ int main(int argc, char *argv[])
 	int a;
 	double means[11];
 	for (a=0;a<11;a++) means[a] = 0;
+	// The input geometry is the same for all files.
+	double *R,*Eta;
+	R = GeometryMapGet(GeometryMapFolder,NrPixels,NrPixels,px,ybc,zbc,Lsd,MaxRingRad,tx,tyin,tzin,p0in,p1in,p2in,p3in);
+	if (R == NULL) return 1;
+	Eta = R + (NrPixels*NrPixels);
 	for (a=StartNr;a<=EndNr;a++){
 		start = clock();
 		sprintf(FileName,"%s/%s_%0*d%s",folder,fn,Padding,a,Ext);
-		fp = fopen(FileName,"rb");
-		if (fp == NULL){
+		if (RawPixelSize(dType) != 0) Raw = RawFileOpen(FileName,RawPixelSize(dType),NrPixelsY*NrPixelsZ,HeadSize,0);
+		else fp = fopen(FileName,"rb");
+		if (fp == NULL && Raw == NULL){
 			printf("File %s could not be read. Continuing to next one.\n",FileName);
 			continue;
 		}
-		fseek(fp,0L,SEEK_END);
-		sz = ftell(fp);
-		sz = sz - HeadSize;
-		nFrames = sz/(SizeFile);
 		Skip = HeadSize;
+		if (Raw != NULL){
+			nFrames = RawFileNrFrames(Raw);
+			sz = (size_t)nFrames*SizeFile;
+		} else {
+			fseek(fp,0L,SEEK_END);
+			sz = ftell(fp);
+			sz = sz - HeadSize;
+			nFrames = sz/(SizeFile);
+			rewind(fp);
+			fseek(fp,Skip,SEEK_SET);
+		}
 		printf("Reading calibrant file: %s, nFrames: %d %d %d, skipping first %ld bytes.\n",FileName,nFrames,(int)sz,(int)SizeFile,Skip);
-		rewind(fp);
-		fseek(fp,Skip,SEEK_SET);
 		for (j=0;j<nFrames;j++){
-			rc = fileReader(fp,FileName,dType,NrPixelsY*NrPixelsZ,Image);
-			MakeSquare(NrPixels,NrPixelsY,NrPixelsZ,Image,Image2);
-			DoImageTransformations(NrTransOpt,TransOpt,Image2,NrPixels);
+			Frame = Image;
+			FrameType = 2;
+			if (Raw != NULL){
+				RawFrameWillNeed(Raw,j+1,1);
+				Frame = RawFrame(Raw,j);
+				FrameType = dType;
+			} else rc = fileReader(fp,FileName,dType,NrPixelsY*NrPixelsZ,Image);
+			CorrectImage(Frame,FrameType,NrPixelsZ,NrPixelsY,NrPixels,NrPixels,TransMap,NAN,AverageDark,NULL,1,NULL,-INFINITY,Image2,NULL);
 			for(k=0;k<(NrPixels*NrPixels);k++){
-				Average[k]+=(double)(Image2[k])-AverageDark[k]; // In reality this is sum
+				Average[k]+=Image2[k]; // In reality this is sum
 			}
 		}
 		TotFrames+=nFrames;
-		fclose(fp);
+		if (Raw != NULL) RawFileClose(Raw);
+		else fclose(fp);
+		Raw = NULL;
+		fp = NULL;
 		double IdealTthetas[n_hkls], TthetaMins[n_hkls], TthetaMaxs[n_hkls];
 		for (i=0;i<n_hkls;i++){IdealTthetas[i]=2*Thetas[i];TthetaMins[i]=IdealTthetas[i]-TthetaTol;TthetaMaxs[i]=IdealTthetas[i]+TthetaTol;}
 		double IdealRs[n_hkls], Rmins[n_hkls], Rmaxs[n_hkls];
@@ -1234,15 +1186,12 @@ int main(int argc, char *argv[])
 			EtaBinsLow[i] = EtaBinSize*i - 180;
 			EtaBinsHigh[i] = EtaBinSize*(i+1) - 180;
 		}
-		double *R,*Eta;
-		R = malloc(NrPixels*NrPixels*sizeof(*R));
-		Eta = malloc(NrPixels*NrPixels*sizeof(*Eta));
 		int **Indices, nIndices;
 		nIndices = nEtaBins * n_hkls;
 		int *NrEachIndexBin;
 		NrEachIndexBin = malloc(nIndices*sizeof(*NrEachIndexBin));
 		Indices = allocMatrixInt(nIndices,20000);
-		Car2Pol(n_hkls,nEtaBins,NrPixels,NrPixels,ybc,zbc,px,R,Eta,Rmins,Rmaxs,EtaBinsLow,EtaBinsHigh,nIndices,NrEachIndexBin,Indices,tx,tyin,tzin,p0in,p1in,p2in,p3in,MaxRingRad,Lsd);
+		Car2Pol(n_hkls,nEtaBins,NrPixels,NrPixels,px,R,Eta,Rmins,Rmaxs,EtaBinsLow,EtaBinsHigh,nIndices,NrEachIndexBin,Indices);
 		double *RMean, *EtaMean, *IdealR, *IdealTtheta, *IdealRmins, *IdealRmaxs;
 		IdealR = malloc(nIndices*sizeof(*IdealR));
 		IdealRmins = malloc(nIndices*sizeof(*IdealRmins));
@@ -1336,8 +1285,6 @@ int main(int argc, char *argv[])
 		}
 		fclose(Out);
 		FreeMemMatrixInt(Indices,nIndices);
-		free(R);
-		free(Eta);
 		free(NrEachIndexBin);
 		free(IdealR);
 		free(IdealRmins);
@@ -1353,6 +1300,7 @@ int main(int argc, char *argv[])
 	    diftotal = ((double)(end-start))/CLOCKS_PER_SEC;
 	    printf("Time elapsed for this file:\t%f s.\n",diftotal);
 	}
+	GeometryMapRelease(R,NrPixels,NrPixels);
 	end0 = clock();
 	diftotal = ((double)(end0-start0))/CLOCKS_PER_SEC;
 	printf("Total time elapsed:\t%f s.\n",diftotal);
@@ -0,0 +1,225 @@
+//
+// Copyright (c) 2014, UChicago Argonne, LLC
+// See LICENSE file.
+//
+
+//
+//  ConnectedComponents.c
+//
+//  8-connected labelling of the above-threshold pixels of an image, shared by
+//  PeaksFittingPerFile (FF) and ImageProcessing (NF).
+//
+//  The input is the list of foreground pixels (row*NrCols+col, ascending), so
+//  the work scales with the number of lit pixels, not with the image size.
+//  Pixels are grouped into runs (consecutive pixels of a row), runs touching
+//  runs of the row above are joined with a union-find. Bands of rows are done
+//  in parallel and the runs across the band borders are joined afterwards.
+//  The root of every set is its first run, so regions are numbered by their
+//  first pixel in raster order, as the old recursive search did.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define CC_MIN_PIXELS_PER_TILE 4096
+#define CC_TILES_PER_THREAD 4
+
+struct TCCWork {
+	int NrRows;
+	int NrCols;
+	int *Pixels;
+	int nTiles;
+	int *TilePx;		// Tile t has pixels TilePx[t]..TilePx[t+1]-1.
+	int *TileRun;		// and runs TileRun[t]..TileRun[t+1]-1.
+	int *RunRow;
+	int *RunStart;
+	int *RunEnd;
+	int *RunFirst;		// Index in Pixels of the first pixel of the run.
+	int *Parent;
+};
+
+static inline int
+CCFind(int *Parent, int x)
+{
+	while (Parent[x] != x){
+		Parent[x] = Parent[Parent[x]];
+		x = Parent[x];
+	}
+	return x;
+}
+
+// The smaller index stays root, so the root is the first run of a region.
+static inline void
+CCUnion(int *Parent, int a, int b)
+{
+	a = CCFind(Parent,a);
+	b = CCFind(Parent,b);
+	if (a < b) Parent[b] = a;
+	else if (b < a) Parent[a] = b;
+}
+
+// Join the runs Cur..CurEnd-1 of one row with the runs Prev..PrevEnd-1 of the row above.
+static inline void
+CCLinkRows(struct TCCWork *W, int Cur, int CurEnd, int Prev, int PrevEnd)
+{
+	int r, q;
+	for (r=Cur;r<CurEnd;r++){
+		while (Prev < PrevEnd && W->RunEnd[Prev]+1 < W->RunStart[r]) Prev++;
+		for (q=Prev;q<PrevEnd && W->RunStart[q] <= W->RunEnd[r]+1;q++) CCUnion(W->Parent,r,q);
+	}
+}
+
+static inline int
+CCIsRunStart(int *Pixels, int i, int Lo, int NrCols)
+{
+	return (i == Lo || Pixels[i] != Pixels[i-1]+1 || Pixels[i]%NrCols == 0);
+}
+
+static void
+CCCountRuns(struct TCCWork *W, int t)
+{
+	int i, nRuns = 0;
+	for (i=W->TilePx[t];i<W->TilePx[t+1];i++) nRuns += CCIsRunStart(W->Pixels,i,W->TilePx[t],W->NrCols);
+	W->TileRun[t+1] = nRuns;
+}
+
+static void
+CCLabelTile(struct TCCWork *W, int t)
+{
+	int i, r = W->TileRun[t]-1;
+	int Row = -2, RowRun = W->TileRun[t], PrevRowRun = W->TileRun[t];
+	for (i=W->TilePx[t];i<W->TilePx[t+1];i++){
+		if (CCIsRunStart(W->Pixels,i,W->TilePx[t],W->NrCols) == 0){
+			W->RunEnd[r]++;
+			continue;
+		}
+		r++;
+		W->RunRow[r] = W->Pixels[i]/W->NrCols;
+		W->RunStart[r] = W->Pixels[i]%W->NrCols;
+		W->RunEnd[r] = W->RunStart[r];
+		W->RunFirst[r] = i;
+		W->Parent[r] = r;
+		if (W->RunRow[r] != Row){
+			// Runs of a row are linked once the row is complete.
+			if (Row >= 0) CCLinkRows(W,RowRun,r,PrevRowRun,RowRun);
+			PrevRowRun = (W->RunRow[r] == Row+1) ? RowRun : r;
+			RowRun = r;
+			Row = W->RunRow[r];
+		}
+	}
+	if (Row >= 0) CCLinkRows(W,RowRun,r+1,PrevRowRun,RowRun);
+}
+
+static void
+CCForEachTile(struct TCCWork *W, void (*TileFn)(struct TCCWork *W, int t))
+{
+	int t;
+	if (W->nTiles == 1){
+		TileFn(W,0);
+		return;
+	}
+#ifdef _OPENMP
+	// Called from a task (PeaksFittingPerFile), share the enclosing team.
+	if (omp_in_parallel()){
+		# pragma omp taskloop grainsize(1)
+		for (t=0;t<W->nTiles;t++) TileFn(W,t);
+		return;
+	}
+#endif
+	# pragma omp parallel for schedule(dynamic,1)
+	for (t=0;t<W->nTiles;t++) TileFn(W,t);
+}
+
+static inline int
+CCLowerBound(int *Pixels, int nPixels, int Value)
+{
+	int Lo = 0, Hi = nPixels, Mid;
+	while (Lo < Hi){
+		Mid = (Lo+Hi)/2;
+		if (Pixels[Mid] < Value) Lo = Mid+1;
+		else Hi = Mid;
+	}
+	return Lo;
+}
+
+// Label the 8-connected regions of Pixels (flat indices row*NrCols+col,
+// ascending) and return their number. Region r (1..NrRegions) consists of
+// RegionPixels[RegionStart[r]]..RegionPixels[RegionStart[r+1]-1], in raster
+// order. RegionStart needs nPixels+2 entries and RegionPixels nPixels. If
+// Labels is not NULL, Labels[Pixels[i]] is set to the region of every pixel,
+// the background is left untouched.
+int
+FindConnectedRegions(int NrRows, int NrCols, int nPixels, int *Pixels, int *RegionStart, int *RegionPixels, int *Labels)
+{
+	struct TCCWork W;
+	int t, r, i, nThreads = 1, nRuns, NrRegions = 0;
+	RegionStart[0] = 0;
+	RegionStart[1] = 0;
+	if (nPixels == 0) return 0;
+#ifdef _OPENMP
+	nThreads = omp_in_parallel() ? omp_get_num_threads() : omp_get_max_threads();
+#endif
+	W.NrRows = NrRows;
+	W.NrCols = NrCols;
+	W.Pixels = Pixels;
+	W.nTiles = nThreads*CC_TILES_PER_THREAD;
+	if (W.nTiles > nPixels/CC_MIN_PIXELS_PER_TILE) W.nTiles = nPixels/CC_MIN_PIXELS_PER_TILE;
+	if (W.nTiles > NrRows) W.nTiles = NrRows;
+	if (W.nTiles < 1) W.nTiles = 1;
+	W.TilePx = malloc((W.nTiles+1)*sizeof(*W.TilePx));
+	W.TileRun = malloc((W.nTiles+1)*sizeof(*W.TileRun));
+	for (t=0;t<W.nTiles;t++) W.TilePx[t] = CCLowerBound(Pixels,nPixels,(int)(((long)t*NrRows/W.nTiles)*NrCols));
+	W.TilePx[W.nTiles] = nPixels;
+	W.TileRun[0] = 0;
+	CCForEachTile(&W,CCCountRuns);
+	for (t=0;t<W.nTiles;t++) W.TileRun[t+1] += W.TileRun[t];
+	nRuns = W.TileRun[W.nTiles];
+	W.RunRow = malloc(nRuns*sizeof(*W.RunRow));
+	W.RunStart = malloc(nRuns*sizeof(*W.RunStart));
+	W.RunEnd = malloc(nRuns*sizeof(*W.RunEnd));
+	W.RunFirst = malloc(nRuns*sizeof(*W.RunFirst));
+	W.Parent = malloc(nRuns*sizeof(*W.Parent));
+	CCForEachTile(&W,CCLabelTile);
+	// Merge across the tile borders: first row of a tile with the row above it.
+	for (t=1;t<W.nTiles;t++){
+		int Cur = W.TileRun[t], CurEnd, Prev;
+		if (Cur == W.TileRun[t+1] || Cur == 0) continue;
+		if (W.RunRow[Cur-1] != W.RunRow[Cur]-1) continue;
+		for (CurEnd=Cur;CurEnd<W.TileRun[t+1] && W.RunRow[CurEnd] == W.RunRow[Cur];CurEnd++);
+		for (Prev=Cur-1;Prev>0 && W.RunRow[Prev-1] == W.RunRow[Cur-1];Prev--);
+		CCLinkRows(&W,Cur,CurEnd,Prev,Cur);
+	}
+	// Number the regions: a root always precedes the rest of its set.
+	int *RunLabel = malloc(nRuns*sizeof(*RunLabel));
+	for (r=0;r<nRuns;r++){
+		int Root = CCFind(W.Parent,r);
+		if (Root == r) RunLabel[r] = ++NrRegions;
+		else RunLabel[r] = RunLabel[Root];
+	}
+	int *RegionPos = calloc(NrRegions+2,sizeof(*RegionPos));
+	for (r=0;r<nRuns;r++) RegionPos[RunLabel[r]+1] += W.RunEnd[r]-W.RunStart[r]+1;
+	for (i=1;i<=NrRegions+1;i++){
+		RegionPos[i] += RegionPos[i-1];
+		RegionStart[i] = RegionPos[i];
+	}
+	for (r=0;r<nRuns;r++){
+		int Len = W.RunEnd[r]-W.RunStart[r]+1;
+		memcpy(RegionPixels+RegionPos[RunLabel[r]],Pixels+W.RunFirst[r],Len*sizeof(*RegionPixels));
+		RegionPos[RunLabel[r]] += Len;
+		if (Labels != NULL) for (i=0;i<Len;i++) Labels[Pixels[W.RunFirst[r]+i]] = RunLabel[r];
+	}
+	free(RegionPos);
+	free(RunLabel);
+	free(W.TilePx);
+	free(W.TileRun);
+	free(W.RunRow);
+	free(W.RunStart);
+	free(W.RunEnd);
+	free(W.RunFirst);
+	free(W.Parent);
+	return NrRegions;
+}
@@ -0,0 +1,992 @@
+//
+// Copyright (c) 2014, UChicago Argonne, LLC
+// See LICENSE file.
+//
+
+//
+//  DetectorMap.c
+//
+//  The pixel to (R,Eta) bin map used by Integrator (Map.bin, nMap.bin): for
+//  every bin the pixels overlapping it and the overlap areas. Bands of
+//  detector columns are mapped in parallel into their own entry buffers,
+//  which are merged into bin order with a counting sort, band after band, so
+//  the map is the same as the one built serially.
+//
+//  MapHeader.bin next to the map records the detector size, geometry,
+//  binning and a hash of the distortion maps it was built from.
+//  DetectorMapUpdate only rebuilds the map when one of these changed, which
+//  lets Integrator check it on every run.
+//
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define deg2rad 0.0174532925199433
+#define rad2deg 57.2957795130823
+#define DETECTOR_MAP_MAGIC 0x50414d44
+#define DETECTOR_MAP_VERSION 1
+#define DETECTOR_MAP_NPARAMS 18
+#define DETECTOR_MAP_BAND 8
+
+struct DetectorMapHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	int32_t NrPixelsY;
+	int32_t NrPixelsZ;
+	uint64_t Hash;			// GeometryHash of the detector size and Params.
+	uint64_t DistortionHash;	// GeometryHash of the distortion maps, 0 without.
+	int64_t TotNrOfBins;
+	// tx, ty, tz, pxY, pxZ, yCen, zCen, Lsd, RhoD, p0, p1, p2,
+	// RMin, RMax, RBinSize, EtaMin, EtaMax, EtaBinSize
+	double Params[DETECTOR_MAP_NPARAMS];
+};
+
+static double *distortionMapY;
+static double *distortionMapZ;
+
+// GeometryMap.c
+uint64_t GeometryHash(int NrPixelsY, int NrPixelsZ, double *Params, int nParams);
+
+// ImageCorrection.c
+void ImageTransformMap(int NrTransOpt, int *TransOpt, int NrRows, int NrCols, int *Map);
+int CorrectImage(const void *Raw, int dType, int InRows, int InCols, int NrRows, int NrCols, const int *Map,
+	double BadPx, const double *Dark, const double *Flood, double Scale, const int *Mask, double Thresh,
+	double *Out, int *FgPixels);
+
+static inline
+int BETWEEN(double val, double min, double max)
+{
+	return ((val < max && val > min) ? 1 : 0 );
+}
+
+static inline double signVal(double x){
+	if (x == 0) return 1.0;
+	else return x/fabs(x);
+}
+
+static inline
+void
+MatrixMult(
+           double m[3][3],
+           double  v[3],
+           double r[3])
+{
+    int i;
+    for (i=0; i<3; i++) {
+        r[i] = m[i][0]*v[0] +
+        m[i][1]*v[1] +
+        m[i][2]*v[2];
+    }
+}
+
+static inline
+void
+MatrixMultF33(
+    double m[3][3],
+    double n[3][3],
+    double res[3][3])
+{
+    int r;
+    for (r=0; r<3; r++) {
+        res[r][0] = m[r][0]*n[0][0] + m[r][1]*n[1][0] + m[r][2]*n[2][0];
+        res[r][1] = m[r][0]*n[0][1] + m[r][1]*n[1][1] + m[r][2]*n[2][1];
+        res[r][2] = m[r][0]*n[0][2] + m[r][1]*n[1][2] + m[r][2]*n[2][2];
+    }
+}
+
+static inline
+double CalcEtaAngle(double y, double z){
+	double alpha = rad2deg*acos(z/sqrt(y*y+z*z));
+	if (y>0) alpha = -alpha;
+	return alpha;
+}
+
+static inline
+void
+REta4MYZ(
+	double Y,
+	double Z,
+	double Ycen,
+	double Zcen,
+	double TRs[3][3],
+	double Lsd,
+	double RhoD,
+	double p0,
+	double p1,
+	double p2,
+	double n0,
+	double n1,
+	double n2,
+	double px,
+	double *RetVals)
+{
+	double Yc, Zc, ABC[3], ABCPr[3], XYZ[3], Rad, Eta, RNorm, DistortFunc, EtaT, Rt;
+	Yc = (-Y + Ycen)*px;
+	Zc = ( Z - Zcen)*px;
+	ABC[0] = 0;
+	ABC[1] = Yc;
+	ABC[2] = Zc;
+	MatrixMult(TRs,ABC,ABCPr);
+	XYZ[0] = Lsd+ABCPr[0];
+	XYZ[1] = ABCPr[1];
+	XYZ[2] = ABCPr[2];
+	Rad = (Lsd/(XYZ[0]))*(sqrt(XYZ[1]*XYZ[1] + XYZ[2]*XYZ[2]));
+	Eta = CalcEtaAngle(XYZ[1],XYZ[2]);
+	RNorm = Rad/RhoD;
+	EtaT = 90 - Eta;
+	DistortFunc = (p0*(pow(RNorm,n0))*(cos(deg2rad*(2*EtaT)))) + (p1*(pow(RNorm,n1))*(cos(deg2rad*(4*EtaT)))) + (p2*(pow(RNorm,n2))) + 1;
+	Rt = Rad * DistortFunc / px; // in pixels
+	RetVals[0] = Eta;
+	RetVals[1] = Rt;
+}
+
+static inline
+void YZ4mREta(double R, double Eta, double *YZ){
+	YZ[0] = -R*sin(Eta*deg2rad);
+	YZ[1] = R*cos(Eta*deg2rad);
+}
+
+static const double dy[2] = {-0.5, +0.5};
+static const double dz[2] = {-0.5, +0.5};
+
+static inline
+void
+REtaMapper(
+	double Rmin,
+	double EtaMin,
+	int nEtaBins,
+	int nRBins,
+	double EtaBinSize,
+	double RBinSize,
+	double *EtaBinsLow,
+	double *EtaBinsHigh,
+	double *RBinsLow,
+	double *RBinsHigh)
+{
+	int i;
+	for (i=0;i<nEtaBins;i++){
+		EtaBinsLow[i] = EtaBinSize*i      + EtaMin;
+		EtaBinsHigh[i] = EtaBinSize*(i+1) + EtaMin;
+	}
+	for (i=0;i<nRBins;i++){
+		RBinsLow[i] = RBinSize * i      + Rmin;
+		RBinsHigh[i] = RBinSize * (i+1) + Rmin;
+	}
+}
+
+struct Point {
+	double x;
+	double y;
+};
+
+static int cmpfunc (const struct Point *a, const struct Point *b, const struct Point *center){
+	if (a->x - center->x >= 0 && b->x - center->x < 0) return 1;
+	if (a->x - center->x < 0 && b->x - center->x >= 0) return -1;
+	if (a->x - center->x == 0 && b->x - center->x == 0) {
+		if (a->y - center->y >= 0 || b->y - center->y >= 0){
+			return a->y > b->y ? 1 : -1;
+		}
+        return b->y > a->y ? 1 : -1;
+    }
+	double det = (a->x - center->x) * (b->y - center->y) - (b->x - center->x) * (a->y - center->y);
+	if (det < 0) return 1;
+    if (det > 0) return -1;
+    int d1 = (a->x - center->x) * (a->x - center->x) + (a->y - center->y) * (a->y - center->y);
+    int d2 = (b->x - center->x) * (b->x - center->x) + (b->y - center->y) * (b->y - center->y);
+    return d1 > d2 ? 1 : -1;
+}
+
+static const double PosMatrix[4][2]={{-0.5, -0.5},
+						{-0.5,  0.5},
+						{ 0.5,  0.5},
+						{ 0.5, -0.5}};
+
+#define MAX_EDGES 50
+
+static inline
+double CalcAreaPolygon(double (*Edges)[2], int nEdges){
+	int i, j;
+	struct Point MyData[MAX_EDGES+1], t, center;
+	center.x = 0;
+	center.y = 0;
+	for (i=0;i<nEdges;i++){
+		center.x += Edges[i][0];
+		center.y += Edges[i][1];
+		MyData[i].x = Edges[i][0];
+		MyData[i].y = Edges[i][1];
+	}
+	center.x /= nEdges;
+	center.y /= nEdges;
+
+	// Stable insertion sort, same order as the qsort it replaces for these
+	// few points, and no shared center so pixels can be mapped in parallel.
+	for (i=1;i<nEdges;i++){
+		t = MyData[i];
+		for (j=i;j>0 && cmpfunc(&MyData[j-1],&t,&center) > 0;j--) MyData[j] = MyData[j-1];
+		MyData[j] = t;
+	}
+	MyData[nEdges] = MyData[0];
+
+	double Area=0;
+	for (i=0;i<nEdges;i++){
+		Area += 0.5*((MyData[i].x*MyData[i+1].y)-(MyData[i+1].x*MyData[i].y));
+	}
+	return Area;
+}
+
+static inline
+int FindUniques (double (*EdgesIn)[2], double (*EdgesOut)[2], int nEdgesIn){
+	int i,j, nEdgesOut=0, duplicate;
+	double Len;
+	for (i=0;i<nEdgesIn;i++){
+		duplicate = 0;
+		for (j=i+1;j<nEdgesIn;j++){
+			Len = sqrt((EdgesIn[i][0]-EdgesIn[j][0])*(EdgesIn[i][0]-EdgesIn[j][0])+(EdgesIn[i][1]-EdgesIn[j][1])*(EdgesIn[i][1]-EdgesIn[j][1]));
+			if (Len ==0){
+				duplicate = 1;
+			}
+		}
+		if (duplicate == 0){
+			EdgesOut[nEdgesOut][0] = EdgesIn[i][0];
+			EdgesOut[nEdgesOut][1] = EdgesIn[i][1];
+			nEdgesOut++;
+		}
+	}
+	return nEdgesOut;
+}
+
+struct data {
+	int y;
+	int z;
+	double frac;
+};
+
+// Overlaps found in a band of columns, in the order the pixels were visited.
+struct MapEntry {
+	int Bin;		// RBin*nEtaBins+EtaBin
+	int y;
+	int z;
+	double frac;
+};
+
+struct MapBand {
+	struct MapEntry *Entries;
+	size_t n;
+	size_t max;
+	int Failed;
+};
+
+static void
+mapperBand(
+	int y0,
+	int y1,
+	double TRs[3][3],
+	int NrPixelsY,
+	int NrPixelsZ,
+	double pxY,
+	double Ycen,
+	double Zcen,
+	double Lsd,
+	double RhoD,
+	double p0,
+	double p1,
+	double p2,
+	double *EtaBinsLow,
+	double *EtaBinsHigh,
+	double *RBinsLow,
+	double *RBinsHigh,
+	int nRBins,
+	int nEtaBins,
+	struct MapBand *Band)
+{
+	double n0=2.0, n1=4.0, n2=2.0;
+	double RetVals[2], RetVals2[2];
+	double Y, Z, Eta, Rt;
+	int i,j,k,l,m;
+	double EtaMi, EtaMa, RMi, RMa;
+	int RChosen[500], EtaChosen[500];
+	int nrRChosen, nrEtaChosen;
+	double EtaMiTr, EtaMaTr;
+	double YZ[2];
+	double Edges[MAX_EDGES][2];
+	double EdgesOut[MAX_EDGES][2];
+	int nEdges;
+	double RMin, RMax, EtaMin, EtaMax;
+	double yMin, yMax, zMin, zMax;
+	double boxEdge[4][2];
+	double Area;
+	double RThis, EtaThis;
+	double yTemp, zTemp, yTempMin, yTempMax, zTempMin, zTempMax;
+	long long int sumNrBins = 0;
+	long long int nrContinued=0;
+	long long int testPos;
+	double ypr,zpr;
+	struct MapEntry *newarr;
+	for (i=y0;i<y1;i++){
+		for (j=0;j<NrPixelsZ;j++){
+			EtaMi = 1800;
+			EtaMa = -1800;
+			RMi = 1E8; // In pixels
+			RMa = -1000;
+			// Calculate RMi, RMa, EtaMi, EtaMa
+			testPos = j;
+			testPos *= NrPixelsY;
+			testPos += i;
+			ypr = (double)i + distortionMapY[testPos];
+			zpr = (double)j + distortionMapZ[testPos];
+			for (k = 0; k < 2; k++){
+				for (l = 0; l < 2; l++){
+					Y = ypr + dy[k];
+					Z = zpr + dz[l];
+					REta4MYZ(Y, Z, Ycen, Zcen, TRs, Lsd, RhoD, p0, p1, p2, n0, n1, n2, pxY, RetVals);
+					Eta = RetVals[0];
+					Rt = RetVals[1]; // in pixels
+					if (Eta < EtaMi) EtaMi = Eta;
+					if (Eta > EtaMa) EtaMa = Eta;
+					if (Rt < RMi) RMi = Rt;
+					if (Rt > RMa) RMa = Rt;
+				}
+			}
+			// Get corrected Y, Z for this position.
+			REta4MYZ(ypr, zpr, Ycen, Zcen, TRs, Lsd, RhoD, p0, p1, p2, n0, n1, n2, pxY, RetVals);
+			Eta = RetVals[0];
+			Rt = RetVals[1]; // in pixels
+			YZ4mREta(Rt,Eta,RetVals2);
+			YZ[0] = RetVals2[0]; // Corrected Y position according to R, Eta, center at 0,0
+			YZ[1] = RetVals2[1]; // Corrected Z position according to R, Eta, center at 0,0
+			// Now check which eta, R ranges should have this pixel
+			nrRChosen = 0;
+			nrEtaChosen = 0;
+			for (k=0;k<nRBins;k++){
+				if (  RBinsHigh[k] >=   RMi &&   RBinsLow[k] <=   RMa){
+					RChosen[nrRChosen] = k;
+					nrRChosen ++;
+				}
+			}
+			for (k=0;k<nEtaBins;k++){ // If Eta is smaller than 0, check for eta, eta+360, if eta is greater than 0, check for eta, eta-360
+				// First check if the pixel is a special case
+				if (EtaMa - EtaMi > 180){
+					EtaMiTr = EtaMa;
+					EtaMaTr = 360 + EtaMi;
+					EtaMa = EtaMaTr;
+					EtaMi = EtaMiTr;
+				}
+				if ((EtaBinsHigh[k] >= EtaMi && EtaBinsLow[k] <= EtaMa)){
+					EtaChosen[nrEtaChosen] = k;
+					nrEtaChosen++;
+					continue;
+				}
+				if (EtaMi < 0){
+					EtaMi += 360;
+					EtaMa += 360;
+				} else {
+					EtaMi -= 360;
+					EtaMa -= 360;
+				}
+				if ((EtaBinsHigh[k] >= EtaMi && EtaBinsLow[k] <= EtaMa)){
+					EtaChosen[nrEtaChosen] = k;
+					nrEtaChosen++;
+					continue;
+				}
+			}
+			yMin = YZ[0] - 0.5;
+			yMax = YZ[0] + 0.5;
+			zMin = YZ[1] - 0.5;
+			zMax = YZ[1] + 0.5;
+			sumNrBins += nrRChosen * nrEtaChosen;
+			// Line Intercepts ordering: RMin: ymin, ymax, zmin, zmax. RMax: ymin, ymax, zmin, zmax
+			//							 EtaMin: ymin, ymax, zmin, zmax. EtaMax: ymin, ymax, zmin, zmax.
+			for (k=0;k<nrRChosen;k++){
+				RMin = RBinsLow[RChosen[k]];
+				RMax = RBinsHigh[RChosen[k]];
+				for (l=0;l<nrEtaChosen;l++){
+					EtaMin = EtaBinsLow[EtaChosen[l]];
+					EtaMax = EtaBinsHigh[EtaChosen[l]];
+					// Find YZ of the polar mask.
+					YZ4mREta(RMin,EtaMin,RetVals);
+					boxEdge[0][0] = RetVals[0];
+					boxEdge[0][1] = RetVals[1];
+					YZ4mREta(RMin,EtaMax,RetVals);
+					boxEdge[1][0] = RetVals[0];
+					boxEdge[1][1] = RetVals[1];
+					YZ4mREta(RMax,EtaMin,RetVals);
+					boxEdge[2][0] = RetVals[0];
+					boxEdge[2][1] = RetVals[1];
+					YZ4mREta(RMax,EtaMax,RetVals);
+					boxEdge[3][0] = RetVals[0];
+					boxEdge[3][1] = RetVals[1];
+					nEdges = 0;
+					// Now check if any edge of the pixel is within the polar mask
+					for (m=0;m<4;m++){
+						RThis = sqrt((YZ[0]+PosMatrix[m][0])*(YZ[0]+PosMatrix[m][0])+(YZ[1]+PosMatrix[m][1])*(YZ[1]+PosMatrix[m][1]));
+						EtaThis = CalcEtaAngle(YZ[0]+PosMatrix[m][0],YZ[1]+PosMatrix[m][1]);
+						if (EtaMin < -180 && signVal(EtaThis) != signVal(EtaMin)) EtaThis -= 360;
+						if (EtaMax >  180 && signVal(EtaThis) != signVal(EtaMax)) EtaThis += 360;
+						if (RThis   >= RMin   && RThis   <= RMax &&
+							EtaThis >= EtaMin && EtaThis <= EtaMax){
+							Edges[nEdges][0] = YZ[0]+PosMatrix[m][0];
+							Edges[nEdges][1] = YZ[1]+PosMatrix[m][1];
+							nEdges++;
+						}
+					}
+					for (m=0;m<4;m++){ // Check if any edge of the polar mask is within the pixel edges.
+						if (boxEdge[m][0] >= yMin && boxEdge[m][0] <= yMax &&
+							boxEdge[m][1] >= zMin && boxEdge[m][1] <= zMax){
+								Edges[nEdges][0] = boxEdge[m][0];
+								Edges[nEdges][1] = boxEdge[m][1];
+								nEdges ++;
+							}
+					}
+					if (nEdges < 4){
+						// Now go through Rmin, Rmax, EtaMin, EtaMax and calculate intercepts and check if within the pixel.
+						//RMin,Max and yMin,Max
+						if (RMin >= yMin) {
+							zTemp = signVal(YZ[1])*sqrt(RMin*RMin - yMin*yMin);
+							if (BETWEEN(zTemp,zMin,zMax) == 1){
+								Edges[nEdges][0] = yMin;
+								Edges[nEdges][1] = zTemp;
+								nEdges++;
+							}
+						}
+						if (RMin >= yMax) {
+							zTemp = signVal(YZ[1])*sqrt(RMin*RMin - yMax*yMax);
+							if (BETWEEN(zTemp,zMin,zMax) == 1){
+								Edges[nEdges][0] = yMax;
+								Edges[nEdges][1] = zTemp;
+								nEdges++;
+							}
+						}
+						if (RMax >= yMin) {
+							zTemp = signVal(YZ[1])*sqrt(RMax*RMax - yMin*yMin);
+							if (BETWEEN(zTemp,zMin,zMax) == 1){
+								Edges[nEdges][0] = yMin;
+								Edges[nEdges][1] = zTemp;
+								nEdges++;
+							}
+						}
+						if (RMax >= yMax) {
+							zTemp = signVal(YZ[1])*sqrt(RMax*RMax - yMax*yMax);
+							if (BETWEEN(zTemp,zMin,zMax) == 1){
+								Edges[nEdges][0] = yMax;
+								Edges[nEdges][1] = zTemp;
+								nEdges++;
+							}
+						}
+						//RMin,Max and zMin,Max
+						if (RMin >= zMin) {
+							yTemp = signVal(YZ[0])*sqrt(RMin*RMin - zMin*zMin);
+							if (BETWEEN(yTemp,yMin,yMax) == 1){
+								Edges[nEdges][0] = yTemp;
+								Edges[nEdges][1] = zMin;
+								nEdges++;
+							}
+						}
+						if (RMin >= zMax) {
+							yTemp = signVal(YZ[0])*sqrt(RMin*RMin - zMax*zMax);
+							if (BETWEEN(yTemp,yMin,yMax) == 1){
+								Edges[nEdges][0] = yTemp;
+								Edges[nEdges][1] = zMax;
+								nEdges++;
+							}
+						}
+						if (RMax >= zMin) {
+							yTemp = signVal(YZ[0])*sqrt(RMax*RMax - zMin*zMin);
+							if (BETWEEN(yTemp,yMin,yMax) == 1){
+								Edges[nEdges][0] = yTemp;
+								Edges[nEdges][1] = zMin;
+								nEdges++;
+							}
+						}
+						if (RMax >= zMax) {
+							yTemp = signVal(YZ[0])*sqrt(RMax*RMax - zMax*zMax);
+							if (BETWEEN(yTemp,yMin,yMax) == 1){
+								Edges[nEdges][0] = yTemp;
+								Edges[nEdges][1] = zMax;
+								nEdges++;
+							}
+						}
+						//EtaMin,Max and yMin,Max
+						if (fabs(EtaMin) < 1E-5 || fabs(fabs(EtaMin)-180) < 1E-5){
+							zTempMin = 0;
+							zTempMax = 0;
+						}else{
+							zTempMin = -yMin/tan(EtaMin*deg2rad);
+							zTempMax = -yMax/tan(EtaMin*deg2rad);
+						}
+						if (BETWEEN(zTempMin,zMin,zMax) == 1){
+							Edges[nEdges][0] = yMin;
+							Edges[nEdges][1] = zTempMin;
+							nEdges++;
+						}
+						if (BETWEEN(zTempMax,zMin,zMax) == 1){
+							Edges[nEdges][0] = yMax;
+							Edges[nEdges][1] = zTempMax;
+							nEdges++;
+						}
+						if (fabs(EtaMax) < 1E-5 || fabs(fabs(EtaMax)-180) < 1E-5){
+							zTempMin = 0;
+							zTempMax = 0;
+						}else{
+							zTempMin = -yMin/tan(EtaMax*deg2rad);
+							zTempMax = -yMax/tan(EtaMax*deg2rad);
+						}
+						if (BETWEEN(zTempMin,zMin,zMax) == 1){
+							Edges[nEdges][0] = yMin;
+							Edges[nEdges][1] = zTempMin;
+							nEdges++;
+						}
+						if (BETWEEN(zTempMax,zMin,zMax) == 1){
+							Edges[nEdges][0] = yMax;
+							Edges[nEdges][1] = zTempMax;
+							nEdges++;
+						}
+						//EtaMin,Max and zMin,Max
+						if (fabs(fabs(EtaMin)-90) < 1E-5){
+							yTempMin = 0;
+							yTempMax = 0;
+						}else{
+							yTempMin = -zMin*tan(EtaMin*deg2rad);
+							yTempMax = -zMax*tan(EtaMin*deg2rad);
+						}
+						if (BETWEEN(yTempMin,yMin,yMax) == 1){
+							Edges[nEdges][0] = yTempMin;
+							Edges[nEdges][1] = zMin;
+							nEdges++;
+						}
+						if (BETWEEN(yTempMax,yMin,yMax) == 1){
+							Edges[nEdges][0] = yTempMax;
+							Edges[nEdges][1] = zMax;
+							nEdges++;
+						}
+						if (fabs(fabs(EtaMax)-90) < 1E-5){
+							yTempMin = 0;
+							yTempMax = 0;
+						}else{
+							yTempMin = -zMin*tan(EtaMax*deg2rad);
+							yTempMax = -zMax*tan(EtaMax*deg2rad);
+						}
+						if (BETWEEN(yTempMin,yMin,yMax) == 1){
+							Edges[nEdges][0] = yTempMin;
+							Edges[nEdges][1] = zMin;
+							nEdges++;
+						}
+						if (BETWEEN(yTempMax,yMin,yMax) == 1){
+							Edges[nEdges][0] = yTempMax;
+							Edges[nEdges][1] = zMax;
+							nEdges++;
+						}
+					}
+					if (nEdges < 3){
+						nrContinued++;
+						continue;
+					}
+					nEdges = FindUniques(Edges,EdgesOut,nEdges);
+					// Now we have all the edges, let's calculate the area.
+					Area = CalcAreaPolygon(EdgesOut,nEdges);
+					if (Area < 1E-5){
+						nrContinued++;
+						continue;
+					}
+					// Populate the band
+					if (Band->n == Band->max){
+						Band->max = Band->max ? 2*Band->max : 4096;
+						newarr = realloc(Band->Entries, Band->max*sizeof(*newarr));
+						if (newarr == NULL){
+							Band->Failed = 1;
+							return;
+						}
+						Band->Entries = newarr;
+					}
+					Band->Entries[Band->n].Bin = RChosen[k]*nEtaBins + EtaChosen[l];
+					Band->Entries[Band->n].y = i;
+					Band->Entries[Band->n].z = j;
+					Band->Entries[Band->n].frac = Area;
+					Band->n++;
+				}
+			}
+		}
+	}
+}
+
+// Map all pixels: pxList gets the entries of all bins, bin b (RBin*nEtaBins+EtaBin)
+// has nPxList[2*b] of them starting at nPxList[2*b+1]. Returns the number of
+// entries, -1 if out of memory.
+static long long int
+mapperfcn(
+	double tx,
+	double ty,
+	double tz,
+	int NrPixelsY,
+	int NrPixelsZ,
+	double pxY,
+	double Ycen,
+	double Zcen,
+	double Lsd,
+	double RhoD,
+	double p0,
+	double p1,
+	double p2,
+	double *EtaBinsLow,
+	double *EtaBinsHigh,
+	double *RBinsLow,
+	double *RBinsHigh,
+	int nRBins,
+	int nEtaBins,
+	struct data **pxList,
+	int **nPxList)
+{
+	double txr, tyr, tzr;
+	txr = deg2rad*tx;
+	tyr = deg2rad*ty;
+	tzr = deg2rad*tz;
+	double Rx[3][3] = {{1,0,0},{0,cos(txr),-sin(txr)},{0,sin(txr),cos(txr)}};
+	double Ry[3][3] = {{cos(tyr),0,sin(tyr)},{0,1,0},{-sin(tyr),0,cos(tyr)}};
+	double Rz[3][3] = {{cos(tzr),-sin(tzr),0},{sin(tzr),cos(tzr),0},{0,0,1}};
+	double TRint[3][3], TRs[3][3];
+	MatrixMultF33(Ry,Rz,TRint);
+	MatrixMultF33(Rx,TRint,TRs);
+	int nBands = (NrPixelsY+DETECTOR_MAP_BAND-1)/DETECTOR_MAP_BAND;
+	size_t nBins = (size_t)nRBins*nEtaBins, b, e, TotNrOfBins = 0;
+	struct MapBand *Bands = calloc(nBands,sizeof(*Bands));
+	int i, Failed = 0;
+	# pragma omp parallel for schedule(dynamic,1)
+	for (i=0;i<nBands;i++){
+		int y1 = (i+1)*DETECTOR_MAP_BAND;
+		if (y1 > NrPixelsY) y1 = NrPixelsY;
+		mapperBand(i*DETECTOR_MAP_BAND,y1,TRs,NrPixelsY,NrPixelsZ,pxY,Ycen,Zcen,Lsd,RhoD,p0,p1,p2,
+			EtaBinsLow,EtaBinsHigh,RBinsLow,RBinsHigh,nRBins,nEtaBins,&Bands[i]);
+	}
+	// Counting sort of the band entries into bins, bands in order.
+	int *nPx = calloc(2*nBins,sizeof(*nPx));
+	for (i=0;i<nBands;i++){
+		Failed |= Bands[i].Failed;
+		for (e=0;e<Bands[i].n;e++) nPx[2*Bands[i].Entries[e].Bin]++;
+	}
+	for (b=0;b<nBins;b++){
+		nPx[2*b+1] = (int)TotNrOfBins;
+		TotNrOfBins += nPx[2*b];
+	}
+	size_t *Next = malloc(nBins*sizeof(*Next));
+	struct data *Px = malloc((TotNrOfBins+1)*sizeof(*Px));
+	if (Failed || Next == NULL || Px == NULL){
+		for (i=0;i<nBands;i++) free(Bands[i].Entries);
+		free(Bands); free(nPx); free(Next); free(Px);
+		return -1;
+	}
+	for (b=0;b<nBins;b++) Next[b] = nPx[2*b+1];
+	for (i=0;i<nBands;i++){
+		for (e=0;e<Bands[i].n;e++){
+			struct MapEntry *E = &Bands[i].Entries[e];
+			Px[Next[E->Bin]].y = E->y;
+			Px[Next[E->Bin]].z = E->z;
+			Px[Next[E->Bin]].frac = E->frac;
+			Next[E->Bin]++;
+		}
+		free(Bands[i].Entries);
+	}
+	free(Bands);
+	free(Next);
+	*pxList = Px;
+	*nPxList = nPx;
+	return (long long int)TotNrOfBins;
+}
+
+static inline
+int StartsWith(const char *a, const char *b)
+{
+	if (strncmp(a,b,strlen(b)) == 0) return 1;
+	return 0;
+}
+
+// Map.bin, nMap.bin and MapHeader.bin in Folder match Header.
+static int
+DetectorMapIsCurrent(char *Folder, struct DetectorMapHeader *Header)
+{
+	char fn[4096+32];
+	struct DetectorMapHeader Old;
+	struct stat s;
+	size_t nBins = (size_t)((int)ceil((Header->Params[13]-Header->Params[12])/Header->Params[14]))
+		* (int)ceil((Header->Params[16]-Header->Params[15])/Header->Params[17]);
+	sprintf(fn,"%s/MapHeader.bin",Folder);
+	FILE *f = fopen(fn,"rb");
+	if (f == NULL) return 0;
+	int nRead = fread(&Old,sizeof(Old),1,f);
+	fclose(f);
+	if (nRead != 1 || Old.Magic != DETECTOR_MAP_MAGIC || Old.Version != DETECTOR_MAP_VERSION
+		|| Old.NrPixelsY != Header->NrPixelsY || Old.NrPixelsZ != Header->NrPixelsZ
+		|| Old.Hash != Header->Hash || Old.DistortionHash != Header->DistortionHash
+		|| memcmp(Old.Params,Header->Params,sizeof(Old.Params)) != 0) return 0;
+	sprintf(fn,"%s/Map.bin",Folder);
+	if (stat(fn,&s) != 0 || (size_t)s.st_size != Old.TotNrOfBins*sizeof(struct data)) return 0;
+	sprintf(fn,"%s/nMap.bin",Folder);
+	if (stat(fn,&s) != 0 || (size_t)s.st_size != nBins*2*sizeof(int)) return 0;
+	Header->TotNrOfBins = Old.TotNrOfBins;
+	return 1;
+}
+
+// Make sure Folder has the Map.bin and nMap.bin for the geometry and binning
+// in ParamFN, building them only if MapHeader.bin shows they are missing or
+// were made for something else. With KeepIncomplete, a parameter file that
+// does not give the whole geometry (Integrator run with separate files)
+// keeps an existing map, without one it is an error: the defaults are never
+// used to build a map there. Returns 0 once the map is there.
+int
+DetectorMapUpdate(char *ParamFN, char *Folder, int KeepIncomplete)
+{
+	double tx=0.0, ty=0.0, tz=0.0, pxY=200.0, pxZ=200.0, yCen=1024.0, zCen=1024.0, Lsd=1000000.0, RhoD=200000.0,
+		p0=0.0, p1=0.0, p2=0.0, EtaBinSize=5, RBinSize=0.25, RMax=1524.0, RMin=10.0, EtaMax=180.0, EtaMin=-180.0;
+	int NrPixelsY=2048, NrPixelsZ=2048;
+	char aline[4096], dummy[4096], *str;
+	int distortionFile = 0;
+	char distortionFN[4096];
+	int NrTransOpt=0;
+	int TransOpt[10];
+	// One bit per geometry key seen, in the order of GeometryKeys.
+	char *GeometryKeys[10] = {"tx", "ty", "tz", "px", "BC", "Lsd", "RhoD", "p0", "p1", "p2"};
+	int Geometry = 0, i;
+	FILE *paramFile = fopen(ParamFN,"r");
+	if (paramFile == NULL){
+		printf("Could not read %s.\n",ParamFN);
+		return 1;
+	}
+	while (fgets(aline,4096,paramFile) != NULL){
+		str = "tx ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &tx);
+			Geometry |= 1<<0;
+		}
+		str = "ty ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &ty);
+			Geometry |= 1<<1;
+		}
+		str = "tz ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &tz);
+			Geometry |= 1<<2;
+		}
+		str = "pxY ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &pxY);
+		}
+		str = "pxZ ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &pxZ);
+		}
+		str = "px ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &pxY);
+			sscanf(aline,"%s %lf", dummy, &pxZ);
+			Geometry |= 1<<3;
+		}
+		str = "BC ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf %lf", dummy, &yCen, &zCen);
+			Geometry |= 1<<4;
+		}
+		str = "Lsd ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &Lsd);
+			Geometry |= 1<<5;
+		}
+		str = "RhoD ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &RhoD);
+			Geometry |= 1<<6;
+		}
+		str = "p0 ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &p0);
+			Geometry |= 1<<7;
+		}
+		str = "p1 ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &p1);
+			Geometry |= 1<<8;
+		}
+		str = "p2 ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &p2);
+			Geometry |= 1<<9;
+		}
+		str = "EtaBinSize ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &EtaBinSize);
+		}
+		str = "RBinSize ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &RBinSize);
+		}
+		str = "RMax ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &RMax);
+		}
+		str = "RMin ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &RMin);
+		}
+		str = "EtaMax ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &EtaMax);
+		}
+		str = "EtaMin ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %lf", dummy, &EtaMin);
+		}
+		str = "NrPixelsY ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %d", dummy, &NrPixelsY);
+		}
+		str = "NrPixelsZ ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %d", dummy, &NrPixelsZ);
+		}
+		str = "NrPixels ";
+		if (StartsWith(aline,str) == 1){
+			sscanf(aline,"%s %d", dummy, &NrPixelsY);
+			sscanf(aline,"%s %d", dummy, &NrPixelsZ);
+		}
+		str = "DistortionFile ";
+		if (StartsWith(aline,str)==1){
+			distortionFile = 1;
+			sscanf(aline,"%s %s",dummy, distortionFN);
+		}
+        str = "ImTransOpt ";
+        if (StartsWith(aline,str) == 1){
+            sscanf(aline,"%s %d", dummy, &TransOpt[NrTransOpt]);
+            NrTransOpt++;
+            continue;
+        }
+	}
+	fclose(paramFile);
+	size_t nPx = (size_t)NrPixelsY*NrPixelsZ;
+	distortionMapY = calloc(2*nPx,sizeof(double));
+	distortionMapZ = distortionMapY + nPx;
+	if (distortionFile == 1){
+		FILE *distortionFileHandle = fopen(distortionFN,"rb");
+		if (distortionFileHandle == NULL){
+			printf("Could not read distortion file %s.\n",distortionFN);
+			return 1;
+		}
+		double *distortionMapTemp;
+		distortionMapTemp = malloc(NrPixelsY*NrPixelsZ*sizeof(double));
+		int TransMap[6];
+		ImageTransformMap(NrTransOpt,TransOpt,NrPixelsZ,NrPixelsY,TransMap);
+		fread(distortionMapTemp,NrPixelsY*NrPixelsZ*sizeof(double),1,distortionFileHandle);
+		CorrectImage(distortionMapTemp,2,NrPixelsZ,NrPixelsY,NrPixelsZ,NrPixelsY,TransMap,NAN,NULL,NULL,1,NULL,-INFINITY,distortionMapY,NULL);
+		fread(distortionMapTemp,NrPixelsY*NrPixelsZ*sizeof(double),1,distortionFileHandle);
+		CorrectImage(distortionMapTemp,2,NrPixelsZ,NrPixelsY,NrPixelsZ,NrPixelsY,TransMap,NAN,NULL,NULL,1,NULL,-INFINITY,distortionMapZ,NULL);
+		fclose(distortionFileHandle);
+		free(distortionMapTemp);
+		printf("Distortion file %s was provided and read correctly.\n",distortionFN);
+	}
+	struct DetectorMapHeader Header;
+	double Params[DETECTOR_MAP_NPARAMS] = {tx, ty, tz, pxY, pxZ, yCen, zCen, Lsd, RhoD, p0, p1, p2,
+		RMin, RMax, RBinSize, EtaMin, EtaMax, EtaBinSize};
+	memset(&Header,0,sizeof(Header));
+	Header.Magic = DETECTOR_MAP_MAGIC;
+	Header.Version = DETECTOR_MAP_VERSION;
+	Header.NrPixelsY = NrPixelsY;
+	Header.NrPixelsZ = NrPixelsZ;
+	memcpy(Header.Params,Params,sizeof(Params));
+	Header.Hash = GeometryHash(NrPixelsY,NrPixelsZ,Params,DETECTOR_MAP_NPARAMS);
+	if (distortionFile == 1) Header.DistortionHash = GeometryHash(NrPixelsY,NrPixelsZ,distortionMapY,2*nPx);
+	char fn[4096+32], lockfn[4096+32], tmpfn[4096+64];
+	struct stat s;
+	sprintf(lockfn,"%s/MapHeader.bin.lock",Folder);
+	int lockfd = open(lockfn,O_RDWR|O_CREAT,S_IRUSR|S_IWUSR);
+	if (lockfd >= 0) flock(lockfd,LOCK_EX);
+	if (DetectorMapIsCurrent(Folder,&Header) == 1){
+		printf("Map.bin is up to date for geometry %016llx, not rebuilding it.\n",(unsigned long long)Header.Hash);
+		if (lockfd >= 0) close(lockfd);
+		free(distortionMapY);
+		return 0;
+	}
+	sprintf(fn,"%s/Map.bin",Folder);
+	if (KeepIncomplete && Geometry != (1<<10)-1){
+		if (stat(fn,&s) == 0){
+			printf("%s does not give the whole geometry, using the Map.bin found.\n",ParamFN);
+			if (lockfd >= 0) close(lockfd);
+			free(distortionMapY);
+			return 0;
+		}
+		printf("%s does not give the whole geometry (missing:",ParamFN);
+		for (i=0;i<10;i++) if ((Geometry & (1<<i)) == 0) printf(" %s",GeometryKeys[i]);
+		printf(") and there is no %s, not building one from the defaults.\n",fn);
+		if (lockfd >= 0) close(lockfd);
+		free(distortionMapY);
+		return 1;
+	}
+    // Parameters needed: Rmax RMin RBinSize (px) EtaMax EtaMin EtaBinSize (degrees)
+	int nEtaBins, nRBins;
+	nRBins = (int) ceil((RMax-RMin)/RBinSize);
+	nEtaBins = (int)ceil((EtaMax - EtaMin)/EtaBinSize);
+	printf("Creating a mapper for integration, geometry %016llx.\nNumber of eta bins: %d, number of R bins: %d.\n",
+		(unsigned long long)Header.Hash,nEtaBins,nRBins);
+	double *EtaBinsLow, *EtaBinsHigh;
+	double *RBinsLow, *RBinsHigh;
+	EtaBinsLow = malloc(nEtaBins*sizeof(*EtaBinsLow));
+	EtaBinsHigh = malloc(nEtaBins*sizeof(*EtaBinsHigh));
+	RBinsLow = malloc(nRBins*sizeof(*RBinsLow));
+	RBinsHigh = malloc(nRBins*sizeof(*RBinsHigh));
+	REtaMapper(RMin, EtaMin, nEtaBins, nRBins, EtaBinSize, RBinSize, EtaBinsLow, EtaBinsHigh, RBinsLow, RBinsHigh);
+	struct data *pxListStore;
+	int *nPxListStore;
+    // Parameters needed: tx, ty, tz, NrPixelsY, NrPixelsZ, pxY, yCen, zCen, Lsd, RhoD, p0, p1, p2
+    long long int TotNrOfBins = mapperfcn(tx, ty, tz, NrPixelsY, NrPixelsZ, pxY, yCen,
+								zCen, Lsd, RhoD, p0, p1, p2, EtaBinsLow,
+								EtaBinsHigh, RBinsLow, RBinsHigh, nRBins,
+								nEtaBins, &pxListStore, &nPxListStore);
+	free(distortionMapY);
+	free(EtaBinsLow); free(EtaBinsHigh); free(RBinsLow); free(RBinsHigh);
+	if (TotNrOfBins < 0){
+		printf("Could not allocate the map.\n");
+		if (lockfd >= 0) close(lockfd);
+		return 1;
+	}
+	printf("Total Number of bins %lld\n",TotNrOfBins); fflush(stdout);
+	long long int LengthNPxList = nRBins * nEtaBins;
+	Header.TotNrOfBins = TotNrOfBins;
+
+	// Write out, the header last so an interrupted write is rebuilt next time.
+	sprintf(fn,"%s/MapHeader.bin",Folder);
+	unlink(fn);
+	int Written = 1;
+	sprintf(fn,"%s/Map.bin",Folder);
+	FILE *mapfile = fopen(fn,"wb");
+	sprintf(fn,"%s/nMap.bin",Folder);
+	FILE *nmapfile = fopen(fn,"wb");
+	if (mapfile == NULL || nmapfile == NULL) Written = 0;
+	else {
+		if (TotNrOfBins > 0 && fwrite(pxListStore,TotNrOfBins*sizeof(*pxListStore),1,mapfile) != 1) Written = 0;
+		if (fwrite(nPxListStore,LengthNPxList*2*sizeof(*nPxListStore),1,nmapfile) != 1) Written = 0;
+	}
+	if (mapfile != NULL && fclose(mapfile) != 0) Written = 0;
+	if (nmapfile != NULL && fclose(nmapfile) != 0) Written = 0;
+	free(pxListStore);
+	free(nPxListStore);
+	if (Written == 0){
+		printf("Could not write Map.bin and nMap.bin in %s: %s\n",Folder,strerror(errno));
+		if (lockfd >= 0) close(lockfd);
+		return 1;
+	}
+	sprintf(fn,"%s/MapHeader.bin",Folder);
+	sprintf(tmpfn,"%s.%d.tmp",fn,(int)getpid());
+	FILE *hdrfile = fopen(tmpfn,"wb");
+	if (hdrfile == NULL || fwrite(&Header,sizeof(Header),1,hdrfile) != 1 || fclose(hdrfile) != 0 || rename(tmpfn,fn) != 0){
+		// The map itself is fine, it is only rebuilt on the next run.
+		printf("Could not write %s: %s\n",fn,strerror(errno));
+		unlink(tmpfn);
+	}
+	if (lockfd >= 0) close(lockfd);
+	return 0;
+}
@@ -27,6 +27,13 @@
 
 typedef uint16_t pixelvalue;
 
+// RawFrames.c
+struct RawFile;
+struct RawFile *RawFileOpen(char *FN, int PixelSize, size_t NrPixels, size_t HeadSize, int AlignEnd);
+int RawFileNrFrames(struct RawFile *F);
+const void *RawFrame(struct RawFile *F, int FrameNr);
+void RawFileClose(struct RawFile *F);
+
 int main (int argc, char *argv[])
 {
 	if (argc != 9){
@@ -46,68 +53,47 @@ int main (int argc, char *argv[])
     ext = argv[6];
     darkName = argv[7];
     int satInt = atoi(argv[8]);
-    int i,j,k,nrPixels;
+    int i,j,f;
     int nrSaturatedPixels;
     char filename[2048];
-    FILE *fileread;
-    int sz=0, sz_previous,nFramesDark,nFrames;
-    pixelvalue *Image = NULL;
-    pixelvalue *Dark;
-    int NrSatPxDark=0,NrPixels;
+    int nFramesDark,nFrames;
+    size_t FramePx = 2048*2048;
+    const pixelvalue *Image;
+    struct RawFile *Raw;
+    int NrSatPxDark=0;
     char darkfilename[2048];
     sprintf(darkfilename,"%s/%s",folder,darkName);
-    fileread = fopen(darkfilename,"r");
-    if (fileread == NULL){
+    Raw = RawFileOpen(darkfilename,sizeof(pixelvalue),FramePx,8192,0);
+    if (Raw == NULL){
 		printf("Could not read the dark file: %s. Exiting.\n",darkfilename);
 		return 1;
 	}
-	fseek(fileread,0L,SEEK_END);
-	sz_previous = sz;
-	sz = ftell(fileread) - 8192;
-	NrPixels = sz/sizeof(pixelvalue);
-	nFramesDark = sz / (8*1024*1024);
-	fseek(fileread,8192,SEEK_SET);
-	if (sz > sz_previous){
-		Image = realloc(Image,sz);
-	}
-    fread(Image,sz,1,fileread);
-    fclose(fileread);
-    for (j=0;j<NrPixels;j++){
-		NrSatPxDark += Image[j] >= satInt;
+	nFramesDark = RawFileNrFrames(Raw);
+	for (f=0;f<nFramesDark;f++){
+		Image = RawFrame(Raw,f);
+		for (j=0;j<FramePx;j++) NrSatPxDark += Image[j] >= satInt;
 	}
-	NrSatPxDark /= nFramesDark;
+	RawFileClose(Raw);
+	if (nFramesDark > 0) NrSatPxDark /= nFramesDark;
 	printf("Number of saturated pixels per dark frame = %d.\n",NrSatPxDark);
     for (i=startNr;i<=endNr;i++){
-		nrSaturatedPixels = 0 - NrSatPxDark;
 		sprintf(filename,"%s/%s_%0*d%s",folder,filestem,Padding,i,ext);
-		fileread = fopen(filename,"r");
-		if (fileread == NULL){
+		Raw = RawFileOpen(filename,sizeof(pixelvalue),FramePx,8192,0);
+		if (Raw == NULL){
 			printf("Could not read the input file: %s. Exiting.\n",filename);
 			return 1;
 		}
-		fseek(fileread,0L,SEEK_END);
-		sz_previous = sz;
-		sz = ftell(fileread) - 8192;
-		nFrames = sz/(8*1024*1024);
-		fseek(fileread,8192,SEEK_SET);
-		if (sz > sz_previous){
-			Image = realloc(Image,sz);
-		}
+		nFrames = RawFileNrFrames(Raw);
 		printf("Reading file: %s\n",filename);
-		fread(Image,sz,1,fileread);
-		fclose(fileread);
-		NrPixels = sz/sizeof(pixelvalue);
 		printf("Number of saturated pixels more than the dark image in file: \n%s\n",filename);
-		for (j=0;j<NrPixels;j++) {
-			if ((j+1) % (2048*2048) == 0){
-				printf("Frame %03d of %d %d.\n",
-							((j+1)/(2048*2048)),nFrames,nrSaturatedPixels);
-				nrSaturatedPixels = 0 - NrSatPxDark;
-			}
-			nrSaturatedPixels += Image[j] >= satInt;
+		for (f=0;f<nFrames;f++){
+			Image = RawFrame(Raw,f);
+			nrSaturatedPixels = 0 - NrSatPxDark;
+			for (j=0;j<FramePx;j++) nrSaturatedPixels += Image[j] >= satInt;
+			printf("Frame %03d of %d %d.\n",f+1,nFrames,nrSaturatedPixels);
 		}
+		RawFileClose(Raw);
 	}
-	free(Image);
 	end = clock();
 	diftotal = ((double)(end-start))/CLOCKS_PER_SEC;
     printf("Time elapsed: %f s.\n",diftotal);
@@ -37,6 +37,7 @@
 #include <sys/shm.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #define deg2rad 0.0174532925199433
 #define rad2deg 57.2957795130823
@@ -48,6 +49,11 @@
 #define CalcNorm2(x,y) sqrt((x)*(x) + (y)*(y))
 #define TestBit(A,k)  (A[(k/32)] &   (1 << (k%32)))
 #define MAXNOMEGARANGES 2000
+// Indexer results container OutputFolder/IndexBest.bin, see IndexerLinuxArgsOptimizedShm.c.
+// Key record per row of SpotsToIndex.csv: SpotID (0 if empty), IA, OrientMatrix[9],
+// Position[3], nExpected, nObserved, nSpotRows, byte offset of the spot rows.
+#define N_COL_BESTKEY 18
+#define N_COL_BESTSPOTS 17
 
 // For detector mapping!
 extern int BigDetSize;
@@ -1228,20 +1234,70 @@ void FitPosSec(double X0[3],int nSpotsComp,double **spotsYZO,int nhkls,double **
 	FreeMemMatrix(f_data.hkls,nhkls);
 }
 
-long long int ReadBigDet(){
-	int fd;
-	struct stat s;
-	int status;
+// Returns 0 if there is no result for SpotID SpId in this slot, 1 otherwise.
+int ReadIndexBest(char *FileName, int rowNr, int SpId, double BestKey[N_COL_BESTKEY], double *BestSpots, int *nBestRows)
+{
+	int fd = open(FileName,O_RDONLY);
+	if (fd < 0) return 0;
+	size_t SizeKey = N_COL_BESTKEY*sizeof(double);
+	size_t OffStKey = SizeKey;
+	OffStKey *= rowNr;
+	if (pread(fd,BestKey,SizeKey,OffStKey) != SizeKey || BestKey[0] == 0 || BestKey[16] > MaxNSpotsBest){
+		close(fd);
+		return 0;
+	}
+	if ((int)BestKey[0] != SpId){
+		printf("Slot %d of %s holds SpotID %d, not %d. Ignoring it.\n", rowNr, FileName, (int)BestKey[0], SpId);
+		close(fd);
+		return 0;
+	}
+	*nBestRows = (int)BestKey[16];
+	size_t SizeSpots = *nBestRows * N_COL_BESTSPOTS * sizeof(double);
+	int rc = pread(fd,BestSpots,SizeSpots,(off_t)BestKey[17]);
+	close(fd);
+	if (rc != SizeSpots) return 0;
+	return 1;
+}
+
+// Same as ReadIndexBest for the per seed BestPos_%09d.csv text files of older indexers.
+int ReadBestPosText(char *FileName, double BestKey[N_COL_BESTKEY], double *BestSpots, int *nBestRows)
+{
+	char line[5024];
+	int c;
+	double *row;
+	FILE *BestFile = fopen(FileName,"r");
+	if (BestFile == NULL) return 0;
+	for (c=0;c<3;c++){
+		if (fgets(line,5000,BestFile) == NULL){
+			fclose(BestFile);
+			return 0;
+		}
+	}
+	for (c=0;c<N_COL_BESTKEY;c++) BestKey[c] = 0;
+	sscanf(line,"%lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf",
+			&BestKey[1],&BestKey[2],&BestKey[3],&BestKey[4],&BestKey[5],&BestKey[6],&BestKey[7],
+			&BestKey[8],&BestKey[9],&BestKey[10],&BestKey[11],&BestKey[12],&BestKey[13],&BestKey[14],&BestKey[15]);
+	*nBestRows = 0;
+	while (fgets(line,5000,BestFile) != NULL && *nBestRows < MaxNSpotsBest){
+		row = &BestSpots[*nBestRows * N_COL_BESTSPOTS];
+		row[1] = 999.0;
+		sscanf(line,"%lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf,",&row[0],&row[2],
+			&row[3],&row[4],&row[5],&row[6],&row[7],&row[8],&row[9],&row[10],&row[11],&row[12],&row[13],&row[14],
+			&row[15],&row[16]);
+		(*nBestRows)++;
+	}
+	fclose(BestFile);
+	BestKey[16] = *nBestRows;
+	return 1;
+}
+
+// SharedMemDataset.c
+void ShmDatasetAttach(char *DatasetID);
+void *ShmDatasetMap(char *DatasetID, char *FileName, size_t *Size);
+
+long long int ReadBigDet(char *DatasetID){
 	size_t size;
-	const char *filename = "/dev/shm/BigDetectorMask.bin";
-	int rc;
-	fd = open(filename,O_RDONLY);
-	check(fd < 0, "open %s failed: %s", filename, strerror(errno));
-	status = fstat (fd , &s);
-	check (status < 0, "stat %s failed: %s", filename, strerror(errno));
-	size = s.st_size;
-	BigDetector = mmap(0,size,PROT_READ,MAP_SHARED,fd,0);
-	check (BigDetector == MAP_FAILED,"mmap %s failed: %s", filename, strerror(errno));
+	BigDetector = ShmDatasetMap(DatasetID, "BigDetectorMask.bin", &size);
 	return (long long int) size;
 }
 
@@ -1266,7 +1322,7 @@ int main(int argc, char *argv[])
     double wedge,MinEta,OmegaRanges[MAXNOMEGARANGES][2],BoxSizes[MAXNOMEGARANGES][4], MaxRingRad;
     int RingNumbers[200],cs=0,cs2=0,nOmeRanges=0,nBoxSizes=0,CellStruct;
     double Rsample, Hbeam,RingRadii[200],MargABC=0.3,MargABG=0.3;
-  	char OutputFolder[1024],ResultFolder[1024];
+  	char OutputFolder[1024],ResultFolder[1024],DatasetID[1024]="";
   	int DiscModel = 0, TopLayer = 0, TakeGrainMax = 0;
   	int GrainTracking = 0;
   	int cntrdet=0;
@@ -1392,6 +1448,12 @@ int main(int argc, char *argv[])
         if (LowNr==0){
             sscanf(aline,"%s %s", dummy, OutputFolder);
             continue;
+        }
+		str = "DatasetID ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, DatasetID);
+            continue;
         }
 		str = "ResultFolder ";
         LowNr = strncmp(aline,str,strlen(str));
@@ -1477,23 +1539,12 @@ int main(int argc, char *argv[])
 		}
 	}
 	double *AllSpots;
-	int fd;
-	struct stat s;
-	int status;
 	size_t size;
-	size_t size2;
-	const char *filename = "/dev/shm/ExtraInfo.bin";
-	int rc;
-	fd = open(filename,O_RDONLY);
-	check(fd < 0, "open %s failed: %s", filename, strerror(errno));
-	status = fstat (fd , &s);
-	check (status < 0, "stat %s failed: %s", filename, strerror(errno));
-	size = s.st_size;
-	AllSpots = mmap(0,size,PROT_READ,MAP_SHARED,fd,0);
-	check (AllSpots == MAP_FAILED,"mmap %s failed: %s", filename, strerror(errno));
+	ShmDatasetAttach(DatasetID);
+	AllSpots = ShmDatasetMap(DatasetID, "ExtraInfo.bin", &size);
 	int nSpots =  (int) size/(14*sizeof(double));
 	if (BigDetSize != 0){
-		long long int size2 = ReadBigDet();
+		long long int size2 = ReadBigDet(DatasetID);
 		totNrPixelsBigDetector = BigDetSize;
 		totNrPixelsBigDetector *= BigDetSize;
 		totNrPixelsBigDetector /= 32;
@@ -1509,36 +1560,29 @@ int main(int argc, char *argv[])
 	sprintf(header,"%s%s",h1,h2);
 	int nSpID = 0;
 	printf("Spot ID being processed: %d.\n",SpId);
-	char FileName[2048],SpotsCompFN[2048];
+	char FileName[2048],SpotsCompFN[2048],IndexBestFN[2048];
 	sprintf(FileName,"%s/BestPos_%09d.csv",OutputFolder,SpId);
+	sprintf(IndexBestFN,"%s/IndexBest.bin",OutputFolder);
 	int nSpotsBest=0,*spotIDS;
 	spotIDS = malloc(MaxNSpotsBest*sizeof(*spotIDS));
+	double Orient0[9], Pos0[3], IA0, Euler0[3], Orient0_3[3][3],NrExpected,NrObserved,meanRadius=0,thisRadius,completeness;
+	double BestKey[N_COL_BESTKEY], *BestSpots;
+	int nBestRows = 0, rcBest = 0;
 	FILE *BestFile;
-	BestFile = fopen(FileName,"r");
-	if (BestFile == NULL){
-		printf("The BestPos file did not exist. Exiting.\n");
-		char KeyFN[1024];
-		sprintf(KeyFN,"%s/Key.bin",ResultFolder);
-		int resultKeyFN = open(KeyFN, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
-		if (resultKeyFN <= 0){
-			printf("Could not open output file.\n");
-			return 1;
-		}
-		int SizeKeyFile 		= 2  * sizeof(int);
-		size_t OffStKeyFile = SizeKeyFile;
-		OffStKeyFile *= rowNr;
-		int KeyInfo[2] = {0, 0};
-		int rc = pwrite(resultKeyFN,KeyInfo,SizeKeyFile,OffStKeyFile);
-	    if (rc < 0){
-			printf("Could not write to output file.\n");
-			return 1;
+	if (GrainTracking == 0){
+		BestSpots = malloc(MaxNSpotsBest*N_COL_BESTSPOTS*sizeof(*BestSpots));
+		rcBest = ReadIndexBest(IndexBestFN,rowNr,SpId,BestKey,BestSpots,&nBestRows);
+		if (rcBest == 0) rcBest = ReadBestPosText(FileName,BestKey,BestSpots,&nBestRows);
+	} else {
+		BestFile = fopen(FileName,"r");
+		if (BestFile != NULL){
+			fseek(BestFile,0L,SEEK_END);
+			if (ftell(BestFile) != 0) rcBest = 1;
+			else fclose(BestFile);
 		}
-		return 0;
 	}
-	fseek(BestFile,0L,SEEK_END);
-	int sz = ftell(BestFile);
-	if (sz == 0){
-		printf("The BestPos file did not exist. Exiting.\n");
+	if (rcBest == 0){
+		printf("No indexing result for SpotID %d. Exiting.\n",SpId);
 		char KeyFN[1024];
 		sprintf(KeyFN,"%s/Key.bin",ResultFolder);
 		int resultKeyFN = open(KeyFN, O_CREAT|O_WRONLY, S_IRUSR|S_IWUSR);
@@ -1557,25 +1601,22 @@ int main(int argc, char *argv[])
 		}
 		return 0;
 	}
-	rewind(BestFile);
-	double Orient0[9], Pos0[3], IA0, Euler0[3], Orient0_3[3][3],NrExpected,NrObserved,meanRadius=0,thisRadius,completeness;
 
 	if (GrainTracking == 0){
-		fgets(line,5000,BestFile);
-		fgets(line,5000,BestFile);
-		fgets(line,5000,BestFile);
-		sscanf(line,"%lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf",
-				&IA0,&Orient0[0],&Orient0[1],&Orient0[2],&Orient0[3],&Orient0[4],&Orient0[5],
-				&Orient0[6],&Orient0[7],&Orient0[8],&Pos0[0],&Pos0[1],&Pos0[2],&NrExpected,&NrObserved);
+		IA0 = BestKey[1];
+		for (i=0;i<9;i++) Orient0[i] = BestKey[2+i];
+		for (i=0;i<3;i++) Pos0[i] = BestKey[11+i];
+		NrExpected = BestKey[14];
+		NrObserved = BestKey[15];
 		completeness = NrObserved/NrExpected;
-		double dummy1,dummy2,dummy3,dummy4,dummy5,dummy6,dummy7,dummy8,dummy9,dummy10,dummy11,dummy12,dummy13,dummy14,dummy15,TempID;
-		double Ytempr, Ztempr, EtaTempr, MaxRadTot=-100;
+		double Ytempr, Ztempr, EtaTempr, MaxRadTot=-100, *row;
 		int nSpotsRad = 0;
-		while (fgets(line,5000,BestFile) != NULL){
-			sscanf(line,"%lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf,",&dummy1,&Ytempr,
-				&dummy3,&dummy4,&Ztempr,&dummy6,&dummy7,&dummy8,&dummy9,&dummy10,&dummy11,&thisRadius,&dummy13,&TempID,
-				&dummy14,&dummy15);
-			if (dummy1 >= 0){
+		for (k=0;k<nBestRows;k++){
+			row = &BestSpots[k*N_COL_BESTSPOTS];
+			Ytempr = row[2];
+			Ztempr = row[5];
+			thisRadius = row[12];
+			if (row[0] >= 0){
 				if (TopLayer == 1){
 					EtaTempr = CalcEtaAngle(Ytempr,Ztempr);
 					if (EtaTempr > 90){
@@ -1596,7 +1637,7 @@ int main(int argc, char *argv[])
 						}
 					}
 				}
-				spotIDS[nSpotsBest] = (int)TempID;
+				spotIDS[nSpotsBest] = (int)row[14];
 				nSpotsBest++;
 			}
 		}
@@ -1604,7 +1645,9 @@ int main(int argc, char *argv[])
 		if (TakeGrainMax == 1){
 			meanRadius = MaxRadTot;
 		}
+		free(BestSpots);
 	} else if (GrainTracking == 1){
+		rewind(BestFile);
 		fgets(line,5000,BestFile);
 		fgets(line,5000,BestFile);
 		sscanf(line,"%lf, %lf, %lf, %lf, %lf, %lf",&LatCin[0],&LatCin[1],
@@ -1621,8 +1664,8 @@ int main(int argc, char *argv[])
 			nSpotsBest++;
 		}
 		meanRadius /= nSpotsBest;
+		fclose(BestFile);
 	}
-	fclose(BestFile);
 
 	double a=LatCin[0],b=LatCin[1],c=LatCin[2],alph=LatCin[3],bet=LatCin[4],gamm=LatCin[5];
 	for (i=0;i<3;i++) for (j=0;j<3;j++) Orient0_3[i][j] = Orient0[i*3+j];
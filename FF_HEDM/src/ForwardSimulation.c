@@ -601,6 +601,14 @@ usage(void)
 	"<ParameterFile>\n");
 }
 
+// SparseFrames.c
+struct SparseStore;
+uint64_t SparseFrameKey(char *Description);
+struct SparseStore *SparseStoreOpen(char *Folder, char *ScanStem, int RingNr, int NrPixels, uint64_t Key, int Writable);
+void SparseStoreClose(struct SparseStore *S);
+int SparseStoreWrite(struct SparseStore *S, int FrameNr, double Omega, double Threshold,
+	uint64_t Key, int nPixels, int *Pixels, double *Image);
+
 int
 main(int argc, char *argv[])
 {
@@ -624,7 +632,7 @@ main(int argc, char *argv[])
 	int LowNr;
 	char *str, dummy[4096], aline[4096];
 	fileParam = fopen(ParamFN,"r");
-	char InFileName[4096], OutFileName[4096];
+	char InFileName[4096], OutFileName[4096], SparseFolder[4096] = "";
 	int Padding=6, NrPixels;
 	double Lsd, tx, ty, tz, yBC, zBC, OmegaStep, OmegaStart, OmegaEnd, px;
 	int RingsToUse[500], nRings=0;
@@ -805,6 +813,12 @@ main(int argc, char *argv[])
 			sscanf(aline,"%s %lf",dummy,&PeakIntensity);
 			continue;
 		}
+		str="SparseFolder ";
+		LowNr = strncmp(aline,str,strlen(str));
+		if (LowNr == 0){
+			sscanf(aline,"%s %s",dummy,SparseFolder);
+			continue;
+		}
 		str="IsBinary ";
 		LowNr = strncmp(aline,str,strlen(str));
 		if (LowNr == 0){
@@ -1290,6 +1304,37 @@ main(int argc, char *argv[])
 	fwrite(header,8192,1,outfile);
 	fwrite(outArr,ImageArrSize*sizeof(*outArr),1,outfile);
 	fclose(outfile);
+	if (SparseFolder[0] != '\0'){
+		// Same frames as a sparse store, in PeaksFittingPerFile orientation (transposed), for comparisons.
+		char SparseStem[4096], *Slash, *Dot;
+		Slash = strrchr(OutFileName,'/');
+		strcpy(SparseStem,Slash == NULL ? OutFileName : Slash+1);
+		Dot = strrchr(SparseStem,'.');
+		if (Dot != NULL) *Dot = '\0';
+		size_t FrameSize = (size_t)NrPixels*NrPixels, y, z;
+		int nFramesSim = (int)(ImageArrSize/FrameSize), FrameNr, nPx;
+		int *SparsePixels = malloc(FrameSize*sizeof(*SparsePixels));
+		double *SparseImage = malloc(FrameSize*sizeof(*SparseImage));
+		uint64_t SparseKey = SparseFrameKey("ForwardSimulation");
+		struct SparseStore *Sparse = SparseStoreOpen(SparseFolder,SparseStem,0,NrPixels,SparseKey,1);
+		for (FrameNr=0;FrameNr<nFramesSim && Sparse != NULL;FrameNr++){
+			uint16_t *Frame = outArr + FrameNr*FrameSize;
+			nPx = 0;
+			for (y=0;y<NrPixels;y++){
+				for (z=0;z<NrPixels;z++){
+					if (Frame[z*NrPixels+y] == 0) continue;
+					SparsePixels[nPx] = y*NrPixels+z;
+					SparseImage[y*NrPixels+z] = Frame[z*NrPixels+y];
+					nPx++;
+				}
+			}
+			SparseStoreWrite(Sparse,FrameNr+1,OmegaStart+FrameNr*OmegaStep,0,SparseKey,nPx,SparsePixels,SparseImage);
+		}
+		if (Sparse != NULL) printf("Wrote %d sparse frames to %s/%s_0.sparse.\n",nFramesSim,SparseFolder,SparseStem);
+		SparseStoreClose(Sparse);
+		free(SparsePixels);
+		free(SparseImage);
+	}
 	end = clock();
 	diftotal = ((double)(end-start0))/CLOCKS_PER_SEC;
 	printf("Time elapsed in making diffraction spots: %f [s]\n",diftotal);
@@ -26,6 +26,14 @@
 typedef uint16_t pixelvalue;
 pixelvalue quick_select(pixelvalue a[], int n) ;
 
+// RawFrames.c
+struct RawFile;
+struct RawFile *RawFileOpen(char *FN, int PixelSize, size_t NrPixels, size_t HeadSize, int AlignEnd);
+int RawFileNrFrames(struct RawFile *F);
+const void *RawFrame(struct RawFile *F, int FrameNr);
+void RawFrameWillNeed(struct RawFile *F, int FrameNr, int nFrames);
+void RawFileClose(struct RawFile *F);
+
 #define PIX_SWAP(a,b) { pixelvalue temp=(a);(a)=(b);(b)=temp; }
 pixelvalue quick_select(pixelvalue a[], int n) 
 {
@@ -109,36 +117,45 @@ int main(int argc, char *argv[]){
 	int nrPixels = 2048;
 	FILE *fileIn, *fileOut;
 	fileIn = fopen(inFN,"rb");
-	fileOut = fopen(outFN,"wb");
-	size_t sz;
+	if (fileIn == NULL){
+		printf("Could not read %s.\n",inFN);
+		return 1;
+	}
 	int *skipContent;
 	skipContent = malloc(8192);
 	fread(skipContent,8192,1,fileIn);
-	pixelvalue *median, *image, *subArr;
+	fclose(fileIn);
+	// The frames are used in place from the mapped file, read ahead as a whole
+	// since every pixel visits all frames.
+	struct RawFile *Raw = RawFileOpen(inFN,sizeof(pixelvalue),(size_t)nrPixels*nrPixels,8192,0);
+	if (Raw == NULL) return 1;
+	int nFrames = RawFileNrFrames(Raw);
+	if (nFrames == 0){
+		printf("No frames in %s.\n",inFN);
+		return 1;
+	}
+	RawFrameWillNeed(Raw,0,nFrames);
+	fileOut = fopen(outFN,"wb");
+	const pixelvalue *image;
+	pixelvalue *median, *subArr;
 	// Median : nrPixels * nrPixels (1d), Image : nrPixels * nrPixels * nFrames (1d)
 	// subArr : nFrames (1d)
 	median = malloc(nrPixels*nrPixels*sizeof(*median));
-	fseek(fileIn,0L,SEEK_END);
-	sz = ftell(fileIn) - 8192;
-	long long int nElements = sz/sizeof(pixelvalue);
-	rewind(fileIn);
-	image = malloc(sz);
-	int nFrames = sz/(8*1024*1024);
-	fseek(fileIn,8192,SEEK_SET);
-	fread(image,nElements*sizeof(pixelvalue),1,fileIn);
+	image = RawFrame(Raw,0);
 	printf("Read file %s.\n",inFN);
 	fflush(stdout);
 	subArr = malloc(nFrames*sizeof(*subArr));
 	int i,j,k;
 	for (i=0;i<nrPixels*nrPixels;i++){
 		for (j=0;j<nFrames;j++){ // Fill subarr
-			//printf("%d %zu %lld\n",j,nElements,j*nrPixels*nrPixels + i);
-			fflush(stdout);
-			subArr[j] = image[j*nrPixels*nrPixels + i];
+			subArr[j] = image[(size_t)j*nrPixels*nrPixels + i];
 		}
 		// Calc Median
 		median[i] = quick_select(subArr,nFrames);
 	}
 	fwrite(skipContent,8192,1,fileOut);
 	fwrite(median,nrPixels*nrPixels*sizeof(pixelvalue),1,fileOut);
+	fclose(fileOut);
+	RawFileClose(Raw);
+	return 0;
 }
@@ -0,0 +1,264 @@
+//
+// Copyright (c) 2014, UChicago Argonne, LLC
+// See LICENSE file.
+//
+
+//
+//  GeometryMap.c
+//
+//  Per-pixel tilt and distortion corrected radius and eta of a detector.
+//  The map only depends on the geometry (pixel size, beam center, Lsd, RhoD,
+//  tilts and p0..p3), so it is computed once and kept in a file named by a
+//  hash of those values. Every tool using the same geometry maps that file
+//  instead of redoing the NrPixels^2 loop.
+//
+//  Layout: R[NrPixelsY*NrPixelsZ] (microns) followed by Eta (degrees), pixel
+//  (y,z) at index z*NrPixelsY+y, y measured like the raw detector columns
+//  (Yc = (-y+Ycen)*px, Zc = (z-Zcen)*px).
+//
+//  Only the GEOMETRY_MAP_MAX_FILES most recently used maps are kept in a
+//  folder, older ones are deleted when a new map is built.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+
+#define deg2rad 0.0174532925199433
+#define rad2deg 57.2957795130823
+#define GEOMETRY_MAP_MAGIC 0x4d47454f
+#define GEOMETRY_MAP_VERSION 1
+#define GEOMETRY_MAP_NPARAMS 12
+#define GEOMETRY_MAP_DATA_OFFSET 4096
+#define GEOMETRY_MAP_MAX_FILES 8
+#define GEOMETRY_MAP_PREFIX "MIDAS_GeometryMap_"
+
+struct GeometryMapHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	int32_t NrPixelsY;
+	int32_t NrPixelsZ;
+	double Params[GEOMETRY_MAP_NPARAMS];
+};
+
+static inline double
+GeometryEtaAngle(double y, double z)
+{
+	double alpha = rad2deg*acos(z/sqrt(y*y+z*z));
+	if (y>0) alpha = -alpha;
+	return alpha;
+}
+
+// FNV-1a over the geometry values and detector size.
+uint64_t
+GeometryHash(int NrPixelsY, int NrPixelsZ, double *Params, int nParams)
+{
+	uint64_t h = 1469598103934665603ULL;
+	unsigned char *p;
+	int i;
+	int32_t Size[2] = {NrPixelsY, NrPixelsZ};
+	p = (unsigned char *) Size;
+	for (i=0;i<(int)sizeof(Size);i++){ h ^= p[i]; h *= 1099511628211ULL; }
+	p = (unsigned char *) Params;
+	for (i=0;i<nParams*(int)sizeof(double);i++){ h ^= p[i]; h *= 1099511628211ULL; }
+	return h;
+}
+
+void
+GeometryMapCompute(int NrPixelsY, int NrPixelsZ, double px, double Ycen, double Zcen, double Lsd, double RhoD,
+	double tx, double ty, double tz, double p0, double p1, double p2, double p3, double *R, double *Eta)
+{
+	double txr = deg2rad*tx, tyr = deg2rad*ty, tzr = deg2rad*tz;
+	double Rx[3][3] = {{1,0,0},{0,cos(txr),-sin(txr)},{0,sin(txr),cos(txr)}};
+	double Ry[3][3] = {{cos(tyr),0,sin(tyr)},{0,1,0},{-sin(tyr),0,cos(tyr)}};
+	double Rz[3][3] = {{cos(tzr),-sin(tzr),0},{sin(tzr),cos(tzr),0},{0,0,1}};
+	double TRint[3][3], TRs[3][3];
+	int i, j, k;
+	for (i=0;i<3;i++) for (j=0;j<3;j++){
+		TRint[i][j] = 0;
+		for (k=0;k<3;k++) TRint[i][j] += Ry[i][k]*Rz[k][j];
+	}
+	for (i=0;i<3;i++) for (j=0;j<3;j++){
+		TRs[i][j] = 0;
+		for (k=0;k<3;k++) TRs[i][j] += Rx[i][k]*TRint[k][j];
+	}
+	int z;
+	# pragma omp parallel for schedule(static)
+	for (z=0;z<NrPixelsZ;z++){
+		int y;
+		int r;
+		double Yc, Zc, ABC[3], ABCPr[3], XYZ[3], Rad, EtaS, RNorm, EtaT, DistortFunc;
+		double n0=2, n1=4, n2=2;
+		for (y=0;y<NrPixelsY;y++){
+			Yc = (-y + Ycen)*px;
+			Zc =  (z - Zcen)*px;
+			ABC[0] = 0;
+			ABC[1] = Yc;
+			ABC[2] = Zc;
+			for (r=0;r<3;r++) ABCPr[r] = TRs[r][0]*ABC[0] + TRs[r][1]*ABC[1] + TRs[r][2]*ABC[2];
+			XYZ[0] = Lsd+ABCPr[0];
+			XYZ[1] = ABCPr[1];
+			XYZ[2] = ABCPr[2];
+			Rad = (Lsd/(XYZ[0]))*(sqrt(XYZ[1]*XYZ[1] + XYZ[2]*XYZ[2]));
+			EtaS = GeometryEtaAngle(XYZ[1],XYZ[2]);
+			RNorm = Rad/RhoD;
+			EtaT = 90 - EtaS;
+			DistortFunc = (p0*(pow(RNorm,n0))*(cos(deg2rad*(2*EtaT)))) + (p1*(pow(RNorm,n1))*(cos(deg2rad*(4*EtaT+p3)))) + (p2*(pow(RNorm,n2))) + 1;
+			R[((size_t)z*NrPixelsY)+y] = Rad * DistortFunc;
+			Eta[((size_t)z*NrPixelsY)+y] = EtaS;
+		}
+	}
+}
+
+struct GeometryMapFile {
+	char Name[256];
+	double MTime;
+};
+
+static int
+CmpGeometryMapFiles(const void *a, const void *b)
+{
+	const struct GeometryMapFile *fa = a, *fb = b;
+	if (fa->MTime > fb->MTime) return -1;
+	if (fa->MTime < fb->MTime) return 1;
+	return 0;
+}
+
+// Delete all but the GEOMETRY_MAP_MAX_FILES newest maps in Folder. Processes
+// that still have a deleted map mapped keep their copy.
+static void
+GeometryMapEvict(char *Folder)
+{
+	DIR *dir = opendir(Folder);
+	struct dirent *ent;
+	struct stat s;
+	struct GeometryMapFile *Files = NULL;
+	int nFiles = 0, maxFiles = 0, i;
+	size_t lenPrefix = strlen(GEOMETRY_MAP_PREFIX), len;
+	char fn[4096+256+8];
+	if (dir == NULL) return;
+	while ((ent = readdir(dir)) != NULL){
+		len = strlen(ent->d_name);
+		if (strncmp(ent->d_name,GEOMETRY_MAP_PREFIX,lenPrefix) != 0 || len < 4 || len >= sizeof(Files[0].Name)
+			|| strcmp(ent->d_name+len-4,".bin") != 0) continue;
+		sprintf(fn,"%s/%s",Folder,ent->d_name);
+		if (stat(fn,&s) != 0) continue;
+		if (nFiles == maxFiles){
+			maxFiles = 2*maxFiles + 16;
+			Files = realloc(Files,maxFiles*sizeof(*Files));
+		}
+		strcpy(Files[nFiles].Name,ent->d_name);
+		Files[nFiles].MTime = s.st_mtim.tv_sec + 1e-9*s.st_mtim.tv_nsec;
+		nFiles++;
+	}
+	closedir(dir);
+	if (nFiles > GEOMETRY_MAP_MAX_FILES){
+		qsort(Files,nFiles,sizeof(*Files),CmpGeometryMapFiles);
+		for (i=GEOMETRY_MAP_MAX_FILES;i<nFiles;i++){
+			sprintf(fn,"%s/%s",Folder,Files[i].Name);
+			printf("Removing old geometry map %s.\n",fn);
+			unlink(fn);
+			strcat(fn,".lock");
+			unlink(fn);
+		}
+	}
+	free(Files);
+}
+
+// Returns the R map (Eta follows at R + NrPixelsY*NrPixelsZ), mapped read-only
+// from Folder/MIDAS_GeometryMap_<hash>.bin, building the file on a miss. The
+// builder holds a lock, so processes started together compute it once.
+// Give it back with GeometryMapRelease.
+double *
+GeometryMapGet(char *Folder, int NrPixelsY, int NrPixelsZ, double px, double Ycen, double Zcen, double Lsd, double RhoD,
+	double tx, double ty, double tz, double p0, double p1, double p2, double p3)
+{
+	double Params[GEOMETRY_MAP_NPARAMS] = {px, Ycen, Zcen, Lsd, RhoD, tx, ty, tz, p0, p1, p2, p3};
+	uint64_t Hash = GeometryHash(NrPixelsY,NrPixelsZ,Params,GEOMETRY_MAP_NPARAMS);
+	size_t nPx = (size_t)NrPixelsY*NrPixelsZ;
+	size_t Size = GEOMETRY_MAP_DATA_OFFSET + 2*nPx*sizeof(double);
+	char fn[4096], lockfn[4096+8], tmpfn[4096+32];
+	struct GeometryMapHeader Header;
+	struct stat s;
+	int fd, lockfd, Valid = 0;
+	sprintf(fn,"%s/" GEOMETRY_MAP_PREFIX "%016llx.bin",Folder,(unsigned long long)Hash);
+	sprintf(lockfn,"%s.lock",fn);
+	lockfd = open(lockfn,O_RDWR|O_CREAT,S_IRUSR|S_IWUSR);
+	if (lockfd >= 0) flock(lockfd,LOCK_EX);
+	fd = open(fn,O_RDONLY);
+	if (fd >= 0){
+		if (fstat(fd,&s) == 0 && (size_t)s.st_size == Size && pread(fd,&Header,sizeof(Header),0) == sizeof(Header)
+			&& Header.Magic == GEOMETRY_MAP_MAGIC && Header.Version == GEOMETRY_MAP_VERSION
+			&& Header.NrPixelsY == NrPixelsY && Header.NrPixelsZ == NrPixelsZ
+			&& memcmp(Header.Params,Params,sizeof(Params)) == 0) Valid = 1;
+		if (Valid == 0) close(fd);
+		else utimensat(AT_FDCWD,fn,NULL,0); // Most recently used, for GeometryMapEvict.
+	}
+	if (Valid == 0){
+		printf("Building geometry map %s.\n",fn);
+		// Anonymous mapping with the file layout, so an uncached map is released the same way.
+		char *Anon = mmap(0,Size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+		if (Anon == MAP_FAILED){
+			printf("Could not allocate the geometry map.\n");
+			if (lockfd >= 0) close(lockfd);
+			return NULL;
+		}
+		double *Map = (double *)(Anon + GEOMETRY_MAP_DATA_OFFSET);
+		GeometryMapCompute(NrPixelsY,NrPixelsZ,px,Ycen,Zcen,Lsd,RhoD,tx,ty,tz,p0,p1,p2,p3,Map,Map+nPx);
+		char Pad[GEOMETRY_MAP_DATA_OFFSET];
+		memset(Pad,0,sizeof(Pad));
+		memset(&Header,0,sizeof(Header));
+		Header.Magic = GEOMETRY_MAP_MAGIC;
+		Header.Version = GEOMETRY_MAP_VERSION;
+		Header.NrPixelsY = NrPixelsY;
+		Header.NrPixelsZ = NrPixelsZ;
+		memcpy(Header.Params,Params,sizeof(Params));
+		memcpy(Pad,&Header,sizeof(Header));
+		sprintf(tmpfn,"%s.%d.tmp",fn,(int)getpid());
+		int Written = 0;
+		FILE *out = fopen(tmpfn,"wb");
+		if (out != NULL){
+			Written = (fwrite(Pad,sizeof(Pad),1,out) == 1 && fwrite(Map,2*nPx*sizeof(*Map),1,out) == 1);
+			if (fclose(out) != 0) Written = 0;
+		}
+		if (Written == 0 || rename(tmpfn,fn) != 0){
+			// Not cacheable (read-only or full folder), hand out the private copy.
+			printf("Could not write geometry map %s: %s. Not caching it.\n",fn,strerror(errno));
+			unlink(tmpfn);
+			if (lockfd >= 0) close(lockfd);
+			return Map;
+		}
+		munmap(Anon,Size);
+		fd = open(fn,O_RDONLY);
+		GeometryMapEvict(Folder);
+	}
+	if (lockfd >= 0) close(lockfd);
+	if (fd < 0){
+		printf("Could not open geometry map %s: %s\n",fn,strerror(errno));
+		return NULL;
+	}
+	char *p = mmap(0,Size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (p == MAP_FAILED){
+		printf("mmap %s failed: %s\n",fn,strerror(errno));
+		return NULL;
+	}
+	return (double *)(p + GEOMETRY_MAP_DATA_OFFSET);
+}
+
+void
+GeometryMapRelease(double *R, int NrPixelsY, int NrPixelsZ)
+{
+	if (R == NULL) return;
+	munmap((char *)R - GEOMETRY_MAP_DATA_OFFSET, GEOMETRY_MAP_DATA_OFFSET + 2*(size_t)NrPixelsY*NrPixelsZ*sizeof(double));
+}
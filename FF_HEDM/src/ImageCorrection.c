@@ -0,0 +1,199 @@
+//
+// Copyright (c) 2014, UChicago Argonne, LLC
+// See LICENSE file.
+//
+
+//
+//  ImageCorrection.c
+//
+//  One pass from a raw frame to the corrected image used by the FF tools:
+//  type conversion, the ImTransOpt flips/transposes, dark subtraction, flood
+//  division, scaling, masking and thresholding.
+//
+//  The transformations only move pixels, so the whole ImTransOpt chain is
+//  folded into one affine map from an output pixel (r,c) to the raw pixel
+//  (R0+Rr*r+Rc*c, C0+Cr*r+Cc*c). The output is written in 64x64 tiles so the
+//  raw reads of a transpose stay in cache, bands of tiles run in parallel.
+//
+//  ImTransOpt: 0 nothing, 1 flip columns (Y), 2 flip rows (Z), 3 transpose
+//  (square images only), applied in the order given.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define IC_TILE 64
+
+// Raw pixel of output pixel (r,c) after one option, on a NrRows x NrCols image.
+static inline void
+ICStep(int Opt, int NrRows, int NrCols, int *r, int *c)
+{
+	int t;
+	if (Opt == 1) *c = NrCols-1-*c;
+	else if (Opt == 2) *r = NrRows-1-*r;
+	else if (Opt == 3){ t = *r; *r = *c; *c = t; }
+}
+
+static inline void
+ICSource(int NrTransOpt, int *TransOpt, int NrRows, int NrCols, int r, int c, int *sr, int *sc)
+{
+	int k;
+	// out = in o S1 o S2 ... o Sn, so the last option is applied first.
+	for (k=NrTransOpt-1;k>=0;k--) ICStep(TransOpt[k],NrRows,NrCols,&r,&c);
+	*sr = r;
+	*sc = c;
+}
+
+// Map[6] = {R0,Rr,Rc,C0,Cr,Cc} for the chain TransOpt[0..NrTransOpt-1].
+void
+ImageTransformMap(int NrTransOpt, int *TransOpt, int NrRows, int NrCols, int *Map)
+{
+	int r0, c0, r1, c1;
+	ICSource(NrTransOpt,TransOpt,NrRows,NrCols,0,0,&r0,&c0);
+	Map[0] = r0;
+	Map[3] = c0;
+	ICSource(NrTransOpt,TransOpt,NrRows,NrCols,1,0,&r1,&c1);
+	Map[1] = r1-r0;
+	Map[4] = c1-c0;
+	ICSource(NrTransOpt,TransOpt,NrRows,NrCols,0,1,&r1,&c1);
+	Map[2] = r1-r0;
+	Map[5] = c1-c0;
+}
+
+struct TICWork {
+	const void *Raw;
+	int dType;
+	int InRows;
+	int InCols;
+	int NrRows;
+	int NrCols;
+	const int *Map;
+	double BadPx;
+	const double *Dark;
+	const double *Flood;
+	double Scale;
+	const int *Mask;
+	double Thresh;
+	double *Out;
+	int *FgPixels;
+	int nBands;
+	int *BandFg;		// Foreground pixels of band b start at BandFg[b].
+};
+
+#define IC_ROW(T) { \
+	const T *In = (const T *)W->Raw; \
+	for (c=c0;c<c1;c++,sr+=Rc,sc+=Cc){ \
+		if (sr < 0 || sr >= W->InRows || sc < 0 || sc >= W->InCols) v = 0; \
+		else { \
+			v = (double)In[(size_t)sr*W->InCols+sc]; \
+			if (v == W->BadPx) v = 0; \
+		} \
+		o = (size_t)r*W->NrCols+c; \
+		if (W->Dark != NULL) v -= W->Dark[o]; \
+		if (W->Flood != NULL) v /= W->Flood[o]; \
+		v *= W->Scale; \
+		if (W->Mask != NULL && W->Mask[o] == 0) v = 0; \
+		else if (v < W->Thresh) v = 0; \
+		W->Out[o] = v; \
+	} \
+	}
+
+static void
+ICCorrectBand(struct TICWork *W, int b)
+{
+	int r, c, c0, c1, sr, sc, nFg = 0;
+	int r0 = b*IC_TILE, r1 = r0+IC_TILE;
+	int Rc = W->Map[2], Cc = W->Map[5];
+	size_t o;
+	double v;
+	if (r1 > W->NrRows) r1 = W->NrRows;
+	for (c0=0;c0<W->NrCols;c0+=IC_TILE){
+		c1 = c0+IC_TILE;
+		if (c1 > W->NrCols) c1 = W->NrCols;
+		for (r=r0;r<r1;r++){
+			sr = W->Map[0] + W->Map[1]*r + Rc*c0;
+			sc = W->Map[3] + W->Map[4]*r + Cc*c0;
+			switch (W->dType){
+				case 1: IC_ROW(uint16_t); break;
+				case 2: IC_ROW(double); break;
+				case 3: IC_ROW(float); break;
+				case 4: IC_ROW(uint32_t); break;
+				case 5: IC_ROW(int32_t); break;
+			}
+		}
+	}
+	if (W->FgPixels == NULL) return;
+	for (o=(size_t)r0*W->NrCols;o<(size_t)r1*W->NrCols;o++) nFg += (W->Out[o] != 0);
+	W->BandFg[b+1] = nFg;
+}
+
+static void
+ICListBand(struct TICWork *W, int b)
+{
+	int r0 = b*IC_TILE, r1 = r0+IC_TILE, n = W->BandFg[b];
+	size_t o;
+	if (r1 > W->NrRows) r1 = W->NrRows;
+	for (o=(size_t)r0*W->NrCols;o<(size_t)r1*W->NrCols;o++) if (W->Out[o] != 0) W->FgPixels[n++] = (int)o;
+}
+
+static void
+ICForEachBand(struct TICWork *W, void (*BandFn)(struct TICWork *W, int b))
+{
+	int b;
+#ifdef _OPENMP
+	// Called from a task (PeaksFittingPerFile), share the enclosing team.
+	if (omp_in_parallel()){
+		# pragma omp taskloop grainsize(1)
+		for (b=0;b<W->nBands;b++) BandFn(W,b);
+		return;
+	}
+#endif
+	# pragma omp parallel for schedule(dynamic,1)
+	for (b=0;b<W->nBands;b++) BandFn(W,b);
+}
+
+// Out (NrRows x NrCols) from the raw frame Raw (InRows x InCols of dType, as
+// in RawFrames.c), pixels mapped outside the raw frame are 0:
+//   v = raw (0 if raw == BadPx, NAN for none)
+//   v = (v - Dark)/Flood*Scale (Dark and Flood can be NULL)
+//   v = 0 where Mask is 0 (Mask can be NULL) or v < Thresh (-INFINITY for none).
+// If FgPixels is not NULL, the non-zero pixels of Out are listed there in
+// ascending order and their number is returned.
+int
+CorrectImage(const void *Raw, int dType, int InRows, int InCols, int NrRows, int NrCols, const int *Map,
+	double BadPx, const double *Dark, const double *Flood, double Scale, const int *Mask, double Thresh,
+	double *Out, int *FgPixels)
+{
+	struct TICWork W;
+	int b, nFg = 0;
+	W.Raw = Raw;
+	W.dType = dType;
+	W.InRows = InRows;
+	W.InCols = InCols;
+	W.NrRows = NrRows;
+	W.NrCols = NrCols;
+	W.Map = Map;
+	W.BadPx = BadPx;
+	W.Dark = Dark;
+	W.Flood = Flood;
+	W.Scale = Scale;
+	W.Mask = Mask;
+	W.Thresh = Thresh;
+	W.Out = Out;
+	W.FgPixels = FgPixels;
+	W.nBands = (NrRows+IC_TILE-1)/IC_TILE;
+	W.BandFg = NULL;
+	if (FgPixels != NULL) W.BandFg = calloc(W.nBands+1,sizeof(*W.BandFg));
+	ICForEachBand(&W,ICCorrectBand);
+	if (FgPixels == NULL) return 0;
+	for (b=0;b<W.nBands;b++) W.BandFg[b+1] += W.BandFg[b];
+	ICForEachBand(&W,ICListBand);
+	nFg = W.BandFg[W.nBands];
+	free(W.BandFg);
+	return nFg;
+}
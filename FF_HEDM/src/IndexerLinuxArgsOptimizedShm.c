@@ -11,6 +11,7 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <fcntl.h>
@@ -18,6 +19,8 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <omp.h>
 
 static void
 check (int test, const char * message, ...)
@@ -35,6 +38,20 @@ check (int test, const char * message, ...)
 
 #define RealType double
 
+// Per-spot arrays of the compare hot path (ObsSpotsCmp, TTheorSpots). Their
+// tolerances are far coarser than float precision, building with
+// -DINDEXER_FLOAT32 (make indexerf32) halves their footprint and doubles the
+// SIMD width of DisplaceTheorSpots.
+#ifdef INDEXER_FLOAT32
+#define SpotType float
+#define SpotSqrt sqrtf
+#define SpotFabs fabsf
+#else
+#define SpotType double
+#define SpotSqrt sqrt
+#define SpotFabs fabs
+#endif
+
 // conversions constants
 #define deg2rad 0.0174532925199433
 #define rad2deg 57.2957795130823
@@ -47,17 +64,55 @@ check (int test, const char * message, ...)
 #define MAX_N_RINGS 500
 #define MAX_N_HKLS 5000
 #define MAX_N_OMEGARANGES 2000
-#define N_COL_THEORSPOTS 14
 #define N_COL_OBSSPOTS 9
+#define N_COL_OBSSPOTSCMP 4
 #define N_COL_GRAINSPOTS 17
 #define N_COL_GRAINMATCHES 16
+#define N_COL_BESTKEY 18
+
+// Clone the hot kernels for AVX-512/AVX2, dispatched at load time.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define SIMD_CLONES
+#endif
 
 // Globals
 RealType *ObsSpotsLab;
+// Columns of ObsSpotsLab used by CompareSpots packed per spot:
+// radial distance to ideal ring, radius, eta, omega. The float32 build maps
+// SpotsCompact.bin from SaveBinData (ObsSpotsCmpMapped) if it exists.
+SpotType *ObsSpotsCmp;
+int ObsSpotsCmpMapped = 0;
 int n_spots = 0;
-
-// To store the orientation matrices
-RealType OrMat[MAX_N_OR][3][3];
+// Per row of ObsSpotsLab: number of accepted grains that matched the spot.
+// Shared between all indexer processes on a node through /dev/shm. The file
+// starts with a TClaimsHeader, the counters follow. The claims are cleared by
+// the first process that maps the file with another ClaimRunID.
+struct TClaimsHeader {
+	long long int RunID;
+	long long int nSpots;
+};
+struct TClaimsHeader *ClaimsHeader = NULL;
+unsigned char *SpotsClaimed = NULL;
+// Row of ObsSpotsLab for every SpotID (-1 if none), for ClaimSpots.
+int *SpotRowOfID = NULL;
+int MaxSpotIDObs = -1;
+// Results container OutputFolder/IndexBest.bin, one slot per row of the SpotIDs
+// file. Key records (N_COL_BESTKEY doubles) for all slots come first:
+// SpotID (0 if empty), IA, OrientMatrix[9], Position[3], nExpected, nObserved,
+// nSpotRows, byte offset of the spot rows. Then every slot owns room for
+// nBestRowsPerSlot spot rows of N_COL_GRAINSPOTS doubles. Slots are disjoint,
+// so any number of indexer processes can pwrite into the same file.
+int BestFD = -1;
+int nBestSlots = 0;
+int nBestRowsPerSlot = 0;
+// Legacy single-seed runs without SpotsToIndex.csv write OutputFolder/BestPos_%09d.csv
+// instead (BestFD stays -1).
+char *BestPosFolder = NULL;
+// OutputFolder/IndexerStats.csv (IndexerStats 1), one line per seed, appended
+// with single writes so several indexer processes can share it. -1 if off.
+int StatsFD = -1;
 
 // hkls to use
 double hkls[MAX_N_HKLS][7];
@@ -65,6 +120,10 @@ int n_hkls = 0;
 int HKLints[MAX_N_HKLS][4];
 double ABCABG[6];
 
+// hkl and 2theta of each ring, used for the seed spot
+double RingHKL[MAX_N_RINGS][3];
+RealType RingTtheta[MAX_N_RINGS];
+
 // For detector mapping!
 int BigDetSize = 0;
 int *BigDetector;
@@ -323,18 +382,87 @@ void CalcOmega(RealType x,RealType y,RealType z,RealType theta,RealType omegas[4
 	}
 }
 
-void CalcDiffrSpots_Furnace(RealType OrientMatrix[3][3],RealType LatticeConstant,RealType Wavelength ,RealType distance,RealType RingRadii[],RealType OmegaRange[][2],RealType BoxSizes[][4],int NOmegaRanges,RealType ExcludePoleAngle,RealType **spots,int *nspots)
+// Theoretical spots of one candidate orientation, stored column-wise. The
+// quantities that do not depend on the grain position (unit diffracted beam,
+// sin/cos of omega, ideal ring radius) are filled once per orientation so the
+// per-position update in DisplaceTheorSpots is a plain arithmetic loop.
+struct TTheorSpots {
+	int nSpots;
+	int *ringNr;
+	SpotType *yl, *zl, *omega, *etaIdeal, *ringRad;
+	SpotType *xn, *yn, *zn, *sinOme, *cosOme;
+	SpotType *yDispl, *zDispl, *eta, *radDiff;
+};
+
+RealType* allocAlignedArray(int n)
+{
+	void *arr;
+	if (posix_memalign(&arr, 64, n * sizeof(RealType)) != 0) {
+		return NULL;
+	}
+	return (RealType *) arr;
+}
+
+SpotType* allocSpotArray(int n)
+{
+	void *arr;
+	if (posix_memalign(&arr, 64, n * sizeof(SpotType)) != 0) {
+		return NULL;
+	}
+	return (SpotType *) arr;
+}
+
+int AllocTheorSpots(struct TTheorSpots *TS, int nrows)
+{
+	TS->nSpots = 0;
+	TS->ringNr = malloc(nrows * sizeof(*TS->ringNr));
+	TS->yl = allocSpotArray(nrows);
+	TS->zl = allocSpotArray(nrows);
+	TS->omega = allocSpotArray(nrows);
+	TS->etaIdeal = allocSpotArray(nrows);
+	TS->ringRad = allocSpotArray(nrows);
+	TS->xn = allocSpotArray(nrows);
+	TS->yn = allocSpotArray(nrows);
+	TS->zn = allocSpotArray(nrows);
+	TS->sinOme = allocSpotArray(nrows);
+	TS->cosOme = allocSpotArray(nrows);
+	TS->yDispl = allocSpotArray(nrows);
+	TS->zDispl = allocSpotArray(nrows);
+	TS->eta = allocSpotArray(nrows);
+	TS->radDiff = allocSpotArray(nrows);
+	if (TS->ringNr == NULL || TS->yl == NULL || TS->zl == NULL || TS->omega == NULL ||
+		TS->etaIdeal == NULL || TS->ringRad == NULL || TS->xn == NULL || TS->yn == NULL || TS->zn == NULL ||
+		TS->sinOme == NULL || TS->cosOme == NULL || TS->yDispl == NULL ||
+		TS->zDispl == NULL || TS->eta == NULL || TS->radDiff == NULL) {
+		return 1;
+	}
+	return 0;
+}
+
+void FreeTheorSpots(struct TTheorSpots *TS)
+{
+	free(TS->ringNr);
+	free(TS->yl);
+	free(TS->zl);
+	free(TS->omega);
+	free(TS->etaIdeal);
+	free(TS->ringRad);
+	free(TS->xn);
+	free(TS->yn);
+	free(TS->zn);
+	free(TS->sinOme);
+	free(TS->cosOme);
+	free(TS->yDispl);
+	free(TS->zDispl);
+	free(TS->eta);
+	free(TS->radDiff);
+}
+
+void CalcDiffrSpots_Furnace(RealType OrientMatrix[3][3],RealType LatticeConstant,RealType Wavelength ,RealType distance,RealType RingRadii[],RealType OmegaRange[][2],RealType BoxSizes[][4],int NOmegaRanges,RealType ExcludePoleAngle,struct TTheorSpots *spots)
 {
 	int i, OmegaRangeNo;
-	RealType DSpacings[MAX_N_HKLS];
-	RealType thetas[MAX_N_HKLS];
-	RealType ds;
 	RealType theta;
 	int KeepSpot;
-	for (i = 0 ;i < n_hkls; i++) {
-		DSpacings[i] = hkls[i][4];
-		thetas[i] = hkls[i][5];
-	}
 	double Ghkl[3];
 	int indexhkl;
 	RealType Gc[3];
@@ -344,8 +472,6 @@ void CalcDiffrSpots_Furnace(RealType OrientMatrix[3][3],RealType LatticeConstant
 	RealType zl;
 	int nspotsPlane;
 	int spotnr = 0;
-	int spotid = 0;
-	int OrientID = 0;
 	int ringnr = 0;
 	int YCInt, ZCInt;
 	long long int idx;
@@ -356,8 +482,7 @@ void CalcDiffrSpots_Furnace(RealType OrientMatrix[3][3],RealType LatticeConstant
 		ringnr = (int)(hkls[indexhkl][3]);
 		RealType RingRadius = RingRadii[ringnr];
 		MatrixMultF(OrientMatrix,Ghkl, Gc);
-		ds    = DSpacings[indexhkl];
-		theta = thetas[indexhkl];
+		theta = hkls[indexhkl][5];
 		CalcOmega(Gc[0], Gc[1], Gc[2], theta, omegas, etas, &nspotsPlane);
 		for (i=0 ; i<nspotsPlane ; i++) {
 			RealType Omega = omegas[i];
@@ -386,45 +511,87 @@ void CalcDiffrSpots_Furnace(RealType OrientMatrix[3][3],RealType LatticeConstant
 				}
 			}
 			if (KeepSpot) {
-				spots[spotnr][0] = OrientID;
-				spots[spotnr][1] = spotid;
-				spots[spotnr][2] = indexhkl;
-				spots[spotnr][3] = distance;
-				spots[spotnr][4] = yl;
-				spots[spotnr][5] = zl;
-				spots[spotnr][6] = omegas[i];
-				spots[spotnr][7] = etas[i];
-				spots[spotnr][8] = theta;
-				spots[spotnr][9] = ringnr;
+				RealType lenInv = 1/sqrt(distance*distance + yl*yl + zl*zl);
+				RealType OmegaRad = deg2rad * Omega;
+				spots->ringNr[spotnr] = ringnr;
+				spots->yl[spotnr] = yl;
+				spots->zl[spotnr] = zl;
+				spots->omega[spotnr] = Omega;
+				spots->etaIdeal[spotnr] = Eta;
+				spots->ringRad[spotnr] = RingRadius;
+				spots->xn[spotnr] = distance*lenInv;
+				spots->yn[spotnr] = yl*lenInv;
+				spots->zn[spotnr] = zl*lenInv;
+				spots->sinOme[spotnr] = sin(OmegaRad);
+				spots->cosOme[spotnr] = cos(OmegaRad);
 				spotnr++;
-				spotid++;
 			}
 		}
 	}
-	*nspots = spotnr;
+	spots->nSpots = spotnr;
+}
+
+// Moves all theoretical spots of the current orientation to the grain position
+// (a,b,c), see displacement_spot_needed_COM, and updates eta and the distance
+// to the ideal ring. Cloned for AVX-512/AVX2, the loader picks the best one.
+SIMD_CLONES
+void DisplaceTheorSpots(struct TTheorSpots *TS,RealType aPos,RealType bPos,RealType cPos)
+{
+	int sp;
+	int nSpots = TS->nSpots;
+	SpotType a = aPos, b = bPos, c = cPos;
+	SpotType *yl = TS->yl, *zl = TS->zl, *ringRad = TS->ringRad;
+	SpotType *xn = TS->xn, *yn = TS->yn, *zn = TS->zn;
+	SpotType *sinOme = TS->sinOme, *cosOme = TS->cosOme;
+	SpotType *yDispl = TS->yDispl, *zDispl = TS->zDispl, *radDiff = TS->radDiff;
+	RealType eta;
+	#pragma omp simd
+	for (sp = 0 ; sp < nSpots ; sp++) {
+		SpotType t = (a*cosOme[sp] - b*sinOme[sp])/xn[sp];
+		SpotType Displ_y = ((a*sinOme[sp])+(b*cosOme[sp])) -(t*yn[sp]);
+		SpotType Displ_z = c - t*zn[sp];
+		SpotType y = yl[sp] + Displ_y;
+		SpotType z = zl[sp] + Displ_z;
+		yDispl[sp] = y;
+		zDispl[sp] = z;
+		radDiff[sp] = SpotSqrt(y*y + z*z) - ringRad[sp];
+	}
+	// acos has no vector variant without -ffast-math, keep eta in its own loop.
+	for (sp = 0 ; sp < nSpots ; sp++) {
+		CalcEtaAngle(yDispl[sp], zDispl[sp], &eta);
+		TS->eta[sp] = eta;
+	}
 }
 
-void CompareSpots(RealType **TheorSpots,int   nTheorSpots,RealType *ObsSpots,RealType RefRad,RealType MarginRad,RealType MarginRadial,RealType etamargins[],RealType omemargins[],int   *nMatch,RealType **GrainSpots)
+// If MatchedTheorSpot is not NULL it gets the theoretical spot of each match.
+void CompareSpots(struct TTheorSpots *TheorSpots,RealType *ObsSpots,RealType RefRad,RealType MarginRad,RealType MarginRadial,RealType etamargins[],RealType omemargins[],int   *nMatch,RealType **GrainSpots,int *MatchedTheorSpot)
 {
 	int nMatched = 0;
 	int nNonMatched = 0;
+	int nTheorSpots = TheorSpots->nSpots;
 	int sp;
 	int RingNr;
 	int iOme, iEta;
 	int spotRow, spotRowBest;
 	int MatchFound ;
-	RealType diffOme;
-	RealType diffOmeBest;
+	SpotType diffOme;
+	SpotType diffOmeBest;
 	int iRing;
 	int iSpot;
-	RealType etamargin, omemargin;
+	SpotType etamargin, omemargin;
+	SpotType theorEta, theorOme, theorRadDiff;
+	SpotType refRad = RefRad, marginRad = MarginRad, marginRadial = MarginRadial;
+	SpotType *obs;
 	for ( sp = 0 ; sp < nTheorSpots ; sp++ )  {
-		RingNr = (int) TheorSpots[sp][9];
+		RingNr = TheorSpots->ringNr[sp];
+		theorEta = TheorSpots->eta[sp];
+		theorOme = TheorSpots->omega[sp];
+		theorRadDiff = TheorSpots->radDiff[sp];
 		iRing = RingNr-1;
-		iEta = floor((180+TheorSpots[sp][12])/EtaBinSize);
-		iOme = floor((180+TheorSpots[sp][6])/OmeBinSize);
+		iEta = floor((180+theorEta)/EtaBinSize);
+		iOme = floor((180+theorOme)/OmeBinSize);
 		etamargin = etamargins[RingNr];
-		omemargin = omemargins[(int) floor(fabs(TheorSpots[sp][12]))];
+		omemargin = omemargins[(int) floor(fabs(theorEta))];
 		MatchFound = 0;
 		diffOmeBest = 100000;
 		long long int Pos = iRing*n_eta_bins*n_ome_bins + iEta*n_ome_bins + iOme;
@@ -432,10 +599,11 @@ void CompareSpots(RealType **TheorSpots,int   nTheorSpots,RealType *ObsSpots,Rea
 		long long int DataPos = ndata[Pos*2+1];
 		for ( iSpot = 0 ; iSpot < nspots; iSpot++ ) {
 			spotRow = data[DataPos + iSpot];
-			if ( fabs(TheorSpots[sp][13] - ObsSpots[spotRow*9+8]) < MarginRadial )  {
-				if ( fabs(RefRad - ObsSpots[spotRow*9+3]) < MarginRad ) {
-				if ( fabs(TheorSpots[sp][12] - ObsSpots[spotRow*9+6]) < etamargin ) {
-					diffOme = fabs(TheorSpots[sp][6] - ObsSpots[spotRow*9+2]);
+			obs = &ObsSpotsCmp[spotRow*N_COL_OBSSPOTSCMP];
+			if ( SpotFabs(theorRadDiff - obs[0]) < marginRadial )  {
+				if ( SpotFabs(refRad - obs[1]) < marginRad ) {
+				if ( SpotFabs(theorEta - obs[2]) < etamargin ) {
+					diffOme = SpotFabs(theorOme - obs[3]);
 					if ( diffOme < diffOmeBest ) {
 						diffOmeBest = diffOme;
 						spotRowBest = spotRow;
@@ -448,32 +616,33 @@ void CompareSpots(RealType **TheorSpots,int   nTheorSpots,RealType *ObsSpots,Rea
 		if (MatchFound == 1) {
 			GrainSpots[nMatched][0] = nMatched;
 			GrainSpots[nMatched][1] = 999.0;
-			GrainSpots[nMatched][2] = TheorSpots[sp][10];
+			GrainSpots[nMatched][2] = TheorSpots->yDispl[sp];
 			GrainSpots[nMatched][3] = ObsSpots[spotRowBest*9+0];
-			GrainSpots[nMatched][4] = ObsSpots[spotRowBest*9+0] - TheorSpots[sp][10];
-			GrainSpots[nMatched][5] = TheorSpots[sp][11];
+			GrainSpots[nMatched][4] = ObsSpots[spotRowBest*9+0] - TheorSpots->yDispl[sp];
+			GrainSpots[nMatched][5] = TheorSpots->zDispl[sp];
 			GrainSpots[nMatched][6] = ObsSpots[spotRowBest*9+1];
-			GrainSpots[nMatched][7] = ObsSpots[spotRowBest*9+1] - TheorSpots[sp][11];
-			GrainSpots[nMatched][8] = TheorSpots[sp][6];
+			GrainSpots[nMatched][7] = ObsSpots[spotRowBest*9+1] - TheorSpots->zDispl[sp];
+			GrainSpots[nMatched][8] = theorOme;
 			GrainSpots[nMatched][9] = ObsSpots[spotRowBest*9+2];
-			GrainSpots[nMatched][10]= ObsSpots[spotRowBest*9+2] - TheorSpots[sp][6];
+			GrainSpots[nMatched][10]= ObsSpots[spotRowBest*9+2] - theorOme;
 			GrainSpots[nMatched][11] = RefRad;
 			GrainSpots[nMatched][12] = ObsSpots[spotRowBest*9+3];
 			GrainSpots[nMatched][13] = ObsSpots[spotRowBest*9+3] - RefRad;
 			GrainSpots[nMatched][14] = ObsSpots[spotRowBest*9+4];
+			if (MatchedTheorSpot != NULL) MatchedTheorSpot[nMatched] = sp;
 			nMatched++;
 		} else {
 			nNonMatched++;
 			int idx = nTheorSpots-nNonMatched;
 			GrainSpots[idx][0] = -nNonMatched;
 			GrainSpots[idx][1] = 999.0;
-			GrainSpots[idx][2] = TheorSpots[sp][10];
+			GrainSpots[idx][2] = TheorSpots->yDispl[sp];
 			GrainSpots[idx][3] = 0;
 			GrainSpots[idx][4] = 0;
-			GrainSpots[idx][5] = TheorSpots[sp][11];
+			GrainSpots[idx][5] = TheorSpots->zDispl[sp];
 			GrainSpots[idx][6] = 0;
 			GrainSpots[idx][7] = 0;
-			GrainSpots[idx][8] = TheorSpots[sp][6];
+			GrainSpots[idx][8] = theorOme;
 			GrainSpots[idx][9] = 0;
 			GrainSpots[idx][10] = 0;
 			GrainSpots[idx][11] = 0;
@@ -485,6 +654,39 @@ void CompareSpots(RealType **TheorSpots,int   nTheorSpots,RealType *ObsSpots,Rea
 	*nMatch = nMatched;
 }
 
+// Upper bound on the number of spots of this orientation that can be matched at
+// any grain position at most MaxPosLen away from the origin. Omega does not
+// change with the position, eta moves by at most the angle subtended by the
+// largest displacement, so a spot can only match if one of the eta bins in that
+// window (at its omega bin) holds observed spots.
+int CalcMaxMatches(struct TTheorSpots *TheorSpots,RealType MaxPosLen)
+{
+	int sp, nMaxMatches = 0;
+	int iRing, iEta, iEta0, iEtaMin, iEtaMax, iOme;
+	RealType MaxDispl, dEta;
+	long long int Pos;
+	for ( sp = 0 ; sp < TheorSpots->nSpots ; sp++ ) {
+		MaxDispl = MaxPosLen * (2 + (fabs(TheorSpots->yn[sp]) + fabs(TheorSpots->zn[sp]))/TheorSpots->xn[sp]);
+		if (MaxDispl >= TheorSpots->ringRad[sp]) dEta = 180;
+		else dEta = rad2deg * asin(MaxDispl/TheorSpots->ringRad[sp]);
+		iRing = TheorSpots->ringNr[sp]-1;
+		iOme = floor((180+TheorSpots->omega[sp])/OmeBinSize);
+		iEtaMin = floor((180+TheorSpots->etaIdeal[sp]-dEta)/EtaBinSize);
+		iEtaMax = floor((180+TheorSpots->etaIdeal[sp]+dEta)/EtaBinSize);
+		if (iEtaMax - iEtaMin >= n_eta_bins) iEtaMax = iEtaMin + n_eta_bins - 1;
+		for ( iEta0 = iEtaMin ; iEta0 <= iEtaMax ; iEta0++ ) {
+			iEta = iEta0 % n_eta_bins;
+			if ( iEta < 0 ) iEta = iEta + n_eta_bins;
+			Pos = iRing*n_eta_bins*n_ome_bins + iEta*n_ome_bins + iOme;
+			if (ndata[Pos*2] > 0) {
+				nMaxMatches++;
+				break;
+			}
+		}
+	}
+	return nMaxMatches;
+}
+
 void AxisAngle2RotMatrix(RealType axis[3],RealType angle,RealType R[3][3])
 {
 	if ( (axis[0] == 0) && (axis[1] == 0) && (axis[2] == 0) ) {
@@ -1056,6 +1258,7 @@ GenerateIdealSpotsFriedelMixed(RealType ys,RealType zs,RealType Ttheta,RealType
 					}
 				}
 			}
+			free(spotRows);
 		}
 	}
 	int i;
@@ -1099,6 +1302,14 @@ struct TParams {
    char SpotsFileName[4096];
    char IDsFileName [4096];
    int UseFriedelPairs;
+   int ClaimSpots;
+   long long int ClaimRunID;
+   int MinNrSpots;
+   char DatasetID[4096];
+   int OrientationSpaceIndexing;
+   RealType OrientationGridStep;
+   RealType GVectorTolerance;
+   int IndexerStats;
 };
 
 int ReadParams(char FileName[],struct TParams * Params)
@@ -1113,6 +1324,14 @@ int ReadParams(char FileName[],struct TParams * Params)
 	int NoRingNumbers = 0;
 	Params->NrOfRings = 0;
 	Params->NoOfOmegaRanges = 0;
+	Params->ClaimSpots = 0;
+	Params->ClaimRunID = 0;
+	Params->MinNrSpots = 1;
+	Params->DatasetID[0] = '\0';
+	Params->OrientationSpaceIndexing = 0;
+	Params->OrientationGridStep = 1;
+	Params->GVectorTolerance = 0;
+	Params->IndexerStats = 0;
 	fp = fopen(FileName, "r");
 	if (fp==NULL) {
 		printf("Cannot open file: %s.\n", FileName);
@@ -1134,7 +1353,6 @@ int ReadParams(char FileName[],struct TParams * Params)
 			totNrPixelsBigDetector *= BigDetSize;
 			totNrPixelsBigDetector /= 32;
 			totNrPixelsBigDetector ++;
-			long long int sz = ReadBigDet();
 			continue;
 		}
 		str = "px ";
@@ -1284,6 +1502,54 @@ int ReadParams(char FileName[],struct TParams * Params)
 			sscanf(line, "%s %d", dummy, &(Params->UseFriedelPairs) );
 			continue;
 		}
+		str = "IndexerStats ";
+		cmpres = strncmp(line, str, strlen(str));
+		if (cmpres == 0) {
+			sscanf(line, "%s %d", dummy, &(Params->IndexerStats) );
+			continue;
+		}
+		str = "ClaimSpots ";
+		cmpres = strncmp(line, str, strlen(str));
+		if (cmpres == 0) {
+			sscanf(line, "%s %d", dummy, &(Params->ClaimSpots) );
+			continue;
+		}
+		str = "ClaimRunID ";
+		cmpres = strncmp(line, str, strlen(str));
+		if (cmpres == 0) {
+			sscanf(line, "%s %lld", dummy, &(Params->ClaimRunID) );
+			continue;
+		}
+		str = "MinNrSpots ";
+		cmpres = strncmp(line, str, strlen(str));
+		if (cmpres == 0) {
+			sscanf(line, "%s %d", dummy, &(Params->MinNrSpots) );
+			continue;
+		}
+		str = "OrientationSpaceIndexing ";
+		cmpres = strncmp(line, str, strlen(str));
+		if (cmpres == 0) {
+			sscanf(line, "%s %d", dummy, &(Params->OrientationSpaceIndexing) );
+			continue;
+		}
+		str = "OrientationGridStep ";
+		cmpres = strncmp(line, str, strlen(str));
+		if (cmpres == 0) {
+			sscanf(line, "%s %lf", dummy, &(Params->OrientationGridStep) );
+			continue;
+		}
+		str = "GVectorTolerance ";
+		cmpres = strncmp(line, str, strlen(str));
+		if (cmpres == 0) {
+			sscanf(line, "%s %lf", dummy, &(Params->GVectorTolerance) );
+			continue;
+		}
+		str = "DatasetID ";
+		cmpres = strncmp(line, str, strlen(str));
+		if (cmpres == 0) {
+			sscanf(line, "%s %s", dummy, Params->DatasetID );
+			continue;
+		}
 		str = "OutputFolder ";
 		cmpres = strncmp(line, str, strlen(str));
 		if (cmpres == 0) {
@@ -1301,6 +1567,7 @@ int ReadParams(char FileName[],struct TParams * Params)
 	int i;
 	for (i = 0 ; i < MAX_N_RINGS ; i++ ) Params->RingRadii[i] = 0;
 	for (i = 0 ; i < Params->NrOfRings ; i++ ) Params->RingRadii[Params->RingNumbers[i]] = Params->RingRadiiUser[i];
+	if (Params->GVectorTolerance == 0) Params->GVectorTolerance = Params->OrientationGridStep;
 	return(0);
 }
 
@@ -1323,25 +1590,20 @@ RealType CalcAvgIA(RealType *Arr, int n)
 	else return total / nnum;
 }
 
+// Text result of one seed, the format FitPosOrStrains reads if there is no IndexBest.bin.
 int
-WriteBestMatch(char *FileName,RealType **GrainMatches,int ngrains,RealType **AllGrainSpots,int nrows,char *FileName2)
+WriteBestPos(int SpotID,RealType **GrainMatches,int bestGrainIdx,RealType **AllGrainSpots,int nrows)
 {
-	int r, g, c;
-	RealType smallestIA = 99999;
-	int bestGrainIdx = -1;
-	for ( g = 0 ; g < ngrains ; g++ ) {
-		if ( GrainMatches[g][15] < smallestIA ) {
-			smallestIA = GrainMatches[g][15];
-			bestGrainIdx = g;
-		}
+	int r, c;
+	char fn[4096+30];
+	FILE *fp2;
+	sprintf(fn, "%s/BestPos_%09d.csv", BestPosFolder, SpotID);
+	fp2 = fopen(fn,"w");
+	if (fp2==NULL) {
+		printf("Cannot open file: %s\n", fn);
+		return(1);
 	}
 	if (bestGrainIdx != -1) {
-		FILE *fp2;
-		fp2 = fopen(FileName2,"w");
-		if (fp2==NULL) {
-			printf("Cannot open file: %s\n", FileName2);
-			return(1);
-		}
 		RealType bestGrainID =  GrainMatches[bestGrainIdx][14];
 		fprintf(fp2, "%lf\n%lf\n",bestGrainID,bestGrainID);
 		fprintf(fp2,"%lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf, %lf\n",
@@ -1358,16 +1620,136 @@ WriteBestMatch(char *FileName,RealType **GrainMatches,int ngrains,RealType **All
 				fprintf(fp2, "\n");
 			}
 		}
-		fclose(fp2);
 	}
-	else {
-		FILE *fp2;
-		fp2 = fopen(FileName2,"w");
-		fclose(fp2);
+	fclose(fp2);
+	return (0);
+}
+
+int
+WriteBestMatch(int SlotNr,int SpotID,RealType **GrainMatches,int ngrains,RealType **AllGrainSpots,int nrows)
+{
+	int r, g, c, i;
+	RealType smallestIA = 99999;
+	int bestGrainIdx = -1;
+	double BestKey[N_COL_BESTKEY];
+	double *BestSpots = NULL;
+	int nBestRows = 0;
+	size_t OffStKey = N_COL_BESTKEY*sizeof(double);
+	OffStKey *= SlotNr;
+	size_t OffStSpots = N_COL_BESTKEY*sizeof(double);
+	OffStSpots *= nBestSlots;
+	size_t SizeSlot = nBestRowsPerSlot*N_COL_GRAINSPOTS*sizeof(double);
+	SizeSlot *= SlotNr;
+	OffStSpots += SizeSlot;
+	for (c = 0; c < N_COL_BESTKEY; c++) BestKey[c] = 0;
+	for ( g = 0 ; g < ngrains ; g++ ) {
+		if ( GrainMatches[g][15] < smallestIA ) {
+			smallestIA = GrainMatches[g][15];
+			bestGrainIdx = g;
+		}
+	}
+	if (BestFD == -1) return WriteBestPos(SpotID, GrainMatches, bestGrainIdx, AllGrainSpots, nrows);
+	if (bestGrainIdx != -1) {
+		RealType bestGrainID =  GrainMatches[bestGrainIdx][14];
+		BestSpots = malloc(nrows*N_COL_GRAINSPOTS*sizeof(*BestSpots));
+		for (r = 0 ; r < nrows ; r++ ) {
+			if (AllGrainSpots[r][15] == bestGrainID && nBestRows < nBestRowsPerSlot) {
+				for (c = 0; c < N_COL_GRAINSPOTS; c++) BestSpots[nBestRows*N_COL_GRAINSPOTS+c] = AllGrainSpots[r][c];
+				nBestRows++;
+			}
+		}
+		BestKey[0] = SpotID;
+		BestKey[1] = GrainMatches[bestGrainIdx][15];
+		for (i = 0; i < 14; i++) BestKey[2+i] = GrainMatches[bestGrainIdx][i];
+		BestKey[16] = nBestRows;
+		BestKey[17] = OffStSpots;
+		size_t SizeSpots = nBestRows*N_COL_GRAINSPOTS*sizeof(double);
+		if (pwrite(BestFD,BestSpots,SizeSpots,OffStSpots) != (ssize_t)SizeSpots) {
+			printf("Could not write the spots of SpotID %d to the results file.\n", SpotID);
+			free(BestSpots);
+			return(1);
+		}
+		free(BestSpots);
+	}
+	// The key goes last, readers only look at the spot rows of filled keys.
+	if (pwrite(BestFD,BestKey,N_COL_BESTKEY*sizeof(double),OffStKey) != N_COL_BESTKEY*sizeof(double)) {
+		printf("Could not write the result of SpotID %d to the results file.\n", SpotID);
+		return(1);
 	}
 	return (0);
 }
 
+// Open (and size) the results container shared by all indexer processes.
+void OpenBestContainer(char *OutputFolder,int nSlots,int nRowsPerSlot)
+{
+	struct stat s;
+	int status;
+	char fn[4096+20];
+	sprintf(fn, "%s/IndexBest.bin", OutputFolder);
+	nBestSlots = nSlots;
+	nBestRowsPerSlot = nRowsPerSlot;
+	off_t size = N_COL_BESTKEY*sizeof(double);
+	size *= nSlots;
+	off_t SizeSpots = nRowsPerSlot*N_COL_GRAINSPOTS*sizeof(double);
+	SizeSpots *= nSlots;
+	size += SizeSpots;
+	BestFD = open(fn, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+	check (BestFD < 0, "open %s failed: %s", fn, strerror(errno));
+	status = fstat (BestFD, &s);
+	check (status < 0, "stat %s failed: %s", fn, strerror(errno));
+	if (s.st_size < size) {
+		status = ftruncate(BestFD, size);
+		check (status < 0, "ftruncate %s failed: %s", fn, strerror(errno));
+	}
+}
+
+// Work done for one seed. Only filled in when StatsFD is open.
+struct TIndexStats {
+	int nPlaneNormals;
+	int usingFriedelPair;
+	long long int nOrient;         // orientations generated
+	long long int nOrientSkipped;  // rejected by CalcMaxMatches
+	long long int nPosSteps;       // positions tried (DisplaceTheorSpots calls)
+	long long int nCompareCalls;
+	long long int nBinLookups;     // theoretical spots looked up in the bins
+	long long int nMatchedSpots;
+	double tDiffrSpots;            // seconds in CalcDiffrSpots_Furnace
+	double tDisplace;
+	double tCompare;
+};
+
+static inline double StatsClock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9*ts.tv_nsec;
+}
+
+void OpenStatsFile(char *OutputFolder)
+{
+	char fn[4096+20];
+	struct stat s;
+	sprintf(fn, "%s/IndexerStats.csv", OutputFolder);
+	StatsFD = open(fn, O_WRONLY|O_CREAT|O_APPEND, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	check (StatsFD < 0, "open %s failed: %s", fn, strerror(errno));
+	fstat(StatsFD, &s);
+	if (s.st_size == 0) {
+		char *hdr = "SpotID,rc,nPlaneNormals,FriedelPair,nOrient,nOrientSkipped,nPosSteps,nCompareCalls,"
+			"nBinLookups,nMatchedSpots,nTheorBest,nMatchesBest,tDiffrSpots,tDisplace,tCompare,tTotal\n";
+		check (write(StatsFD, hdr, strlen(hdr)) != (ssize_t)strlen(hdr), "write %s failed: %s", fn, strerror(errno));
+	}
+}
+
+void WriteIndexStats(int SpotID,int rc,struct TIndexStats *St,int nTheorBest,int nMatchesBest,double tTotal)
+{
+	char line[1024];
+	int len = snprintf(line, sizeof(line), "%d,%d,%d,%d,%lld,%lld,%lld,%lld,%lld,%lld,%d,%d,%.6f,%.6f,%.6f,%.6f\n",
+		SpotID, rc, St->nPlaneNormals, St->usingFriedelPair, St->nOrient, St->nOrientSkipped, St->nPosSteps,
+		St->nCompareCalls, St->nBinLookups, St->nMatchedSpots, nTheorBest, nMatchesBest,
+		St->tDiffrSpots, St->tDisplace, St->tCompare, tTotal);
+	if (write(StatsFD, line, len) != len) printf("Could not write the indexer statistics of SpotID %d.\n", SpotID);
+}
+
 void CalcIA(RealType **GrainMatches,int ngrains,RealType **AllGrainSpots,RealType distance)
 {
 	RealType *IAgrainspots;
@@ -1419,9 +1801,40 @@ void MakeFullFileName(char* fullFileName, char* aPath, char* aFileName)
 	}
 }
 
-int DoIndexing(int SpotIDs,int nSpotIDs,struct TParams Params )
+// Bump the claim counters of the observed spots matched by an accepted grain.
+void ClaimSpots(RealType **GrainSpots,int nrows)
+{
+	int r, SpotID, SpotRow;
+	for (r = 0 ; r < nrows ; r++) {
+		if (GrainSpots[r][0] < 0) continue;
+		SpotID = (int) GrainSpots[r][14];
+		if (SpotID < 0 || SpotID > MaxSpotIDObs) continue;
+		SpotRow = SpotRowOfID[SpotID];
+		if (SpotRow == -1) continue;
+		unsigned char old;
+		do {
+			old = SpotsClaimed[SpotRow];
+			if (old == UCHAR_MAX) break;
+		} while (!__sync_bool_compare_and_swap(&SpotsClaimed[SpotRow], old, old+1));
+	}
+}
+
+// Eta and omega tolerances for CompareSpots, widened by half an orientation step.
+void CalcMargins(struct TParams *Params,RealType etamargins[MAX_N_RINGS],RealType omemargins[181])
+{
+	int i;
+	for ( i = 1 ; i < 180 ; i++) omemargins[i] = Params->MarginOme + ( 0.5 * Params->StepsizeOrient / fabs(sin(i * deg2rad)));
+	omemargins[0] = omemargins[1];
+	omemargins[180] = omemargins[1];
+	for ( i = 0 ; i < MAX_N_RINGS ; i++) {
+		if ( Params->RingRadii[i] == 0) etamargins[i] = 0;
+		else etamargins[i] = rad2deg * atan(Params->MarginEta/Params->RingRadii[i]) + 0.5 * Params->StepsizeOrient;
+	}
+}
+
+int DoIndexing(int SpotID,int SlotNr,struct TParams Params )
 {
-	clock_t start, end;
+	double start, end;
 	double dif;
 	RealType HalfBeam = Params.Hbeam /2 ;
 	RealType MinMatchesToAccept;
@@ -1432,11 +1845,10 @@ int DoIndexing(int SpotIDs,int nSpotIDs,struct TParams Params )
 	int   matchNr;
 	int   nOrient;
 	RealType hklnormal[3];
-	RealType Displ_y;
-	RealType Displ_z;
 	int   or;
-	int   sp;
 	int   nMatches;
+	int   nOrientSkipped, MaxMatches;
+	RealType MaxPosLen, PosLen;
 	int   r,c, i;
 	RealType y0_vector[MAX_N_STEPS];
 	RealType z0_vector[MAX_N_STEPS];
@@ -1447,29 +1859,46 @@ int DoIndexing(int SpotIDs,int nSpotIDs,struct TParams Params )
 	RealType xi, yi, zi;
 	int   n_max, n_min, n;
 	RealType y0, z0;
-	RealType RingTtheta[MAX_N_RINGS];
-	int   RingMult[MAX_N_RINGS];
-	double   RingHKL[MAX_N_RINGS][3];
 	int   orDelta, ispDelta, nDelta;
 	RealType fracMatches;
 	int   rownr;
 	int   SpotRowNo;
 	int usingFriedelPair;
-	RealType **BestMatches;
+	struct TIndexStats Stats = {0};
+	int DoStats = (StatsFD != -1);
+	double t0 = 0;
 
 	RealType omemargins[181];
 	RealType etamargins[MAX_N_RINGS];
-	char fn[1000];
-	char ffn[1000];
-	char fn2[1000];
-	char ffn2[1000];
+	RealType (*OrMat)[3][3];
 	RealType **GrainMatches;
-	RealType **TheorSpots;
+	struct TTheorSpots TheorSpots;
 	RealType **GrainSpots;
 	RealType **AllGrainSpots;
 	RealType **GrainMatchesT;
 	RealType **AllGrainSpotsT;
 	int nRowsOutput = MAX_N_MATCHES * 2 * n_hkls;
+	start = omp_get_wtime();
+	RealType MinInternalAngle=1000;
+	matchNr = 0;
+	rownr = 0;
+	FindInMatrix(&ObsSpotsLab[0*9+0], n_spots, N_COL_OBSSPOTS, 4, (RealType) SpotID, &SpotRowNo);
+	if (SpotRowNo == -1) {
+		printf("WARNING: SpotId %d not found in spots file! Ignoring this spotID.\n", SpotID);
+		return 1;
+	}
+	// ProcessGrains wants MinNrSpots solutions per grain, so a seed is only
+	// redundant once its spot was matched by that many accepted grains.
+	if (SpotsClaimed != NULL && SpotsClaimed[SpotRowNo] >= Params.MinNrSpots) {
+		printf("SpotID %d already matched by %d grains, skipping.\n", SpotID, (int)SpotsClaimed[SpotRowNo]);
+		if (DoStats) WriteIndexStats(SpotID, 2, &Stats, 0, 0, omp_get_wtime()-start);
+		return 2;
+	}
+	OrMat = malloc(MAX_N_OR * sizeof(*OrMat));
+	if (OrMat == NULL ) {
+		printf("Memory error: could not allocate memory for orientation matrices. Memory full?\n");
+		return 1;
+	}
 	AllGrainSpots = allocMatrix(nRowsOutput, N_COL_GRAINSPOTS);
 	if (AllGrainSpots == NULL ) {
 		printf("Memory error: could not allocate memory for output matrix. Memory full?\n");
@@ -1492,215 +1921,697 @@ int DoIndexing(int SpotIDs,int nSpotIDs,struct TParams Params )
 	}
 	int nRowsPerGrain = 2 * n_hkls;
 	GrainSpots = allocMatrix(nRowsPerGrain, N_COL_GRAINSPOTS );
-	TheorSpots = allocMatrix(nRowsPerGrain, N_COL_THEORSPOTS);
-	if (TheorSpots == NULL ) {
+	if (AllocTheorSpots(&TheorSpots, nRowsPerGrain) != 0 ) {
 		printf("Memory error: could not allocate memory for output matrix. Memory full?\n");
 		return 1;
 	}
-	BestMatches = allocMatrix(nSpotIDs, 5);
-	if (BestMatches == NULL ) {
-		printf("Memory error: could not allocate memory for output matrix. Memory full?\n");
-		return 1;
-	}
-	for ( i = 1 ; i < 180 ; i++) omemargins[i] = Params.MarginOme + ( 0.5 * Params.StepsizeOrient / fabs(sin(i * deg2rad)));
-	omemargins[0] = omemargins[1];
-	omemargins[180] = omemargins[1];
-	for ( i = 0 ; i < MAX_N_RINGS ; i++) {
-		if ( Params.RingRadii[i] == 0) etamargins[i] = 0;
-		else etamargins[i] = rad2deg * atan(Params.MarginEta/Params.RingRadii[i]) + 0.5 * Params.StepsizeOrient;
+	CalcMargins(&Params, etamargins, omemargins);
+	RealType ys     = ObsSpotsLab[SpotRowNo*9+0];
+	RealType zs     = ObsSpotsLab[SpotRowNo*9+1];
+	RealType omega  = ObsSpotsLab[SpotRowNo*9+2];
+	RealType RefRad = ObsSpotsLab[SpotRowNo*9+3];
+	RealType eta    = ObsSpotsLab[SpotRowNo*9+6];
+	RealType ttheta = ObsSpotsLab[SpotRowNo*9+7];
+	int   ringnr = (int) ObsSpotsLab[SpotRowNo*9+5];
+	hkl[0] = RingHKL[ringnr][0];
+	hkl[1] = RingHKL[ringnr][1];
+	hkl[2] = RingHKL[ringnr][2];
+	printf("\n--------------------------------------------------------------------------\n");
+	printf("%8s %10s %9s %9s %9s %9s %9s %7s\n", "SpotID", "SpotRowNo", "ys", "zs", "omega", "eta", "ttheta", "ringno");
+	printf("%8d %10d %9.2f %9.2f %9.3f %9.3f %9.3f %7d\n\n", SpotID, SpotRowNo, ys, zs, omega, eta, ttheta, ringnr);
+	nPlaneNormals = 0;
+	usingFriedelPair = 0;
+	if (Params.UseFriedelPairs == 1) {
+		usingFriedelPair = 1;
+		GenerateIdealSpotsFriedel(ys, zs, RingTtheta[ringnr], eta, omega, ringnr,
+		Params.RingRadii[ringnr], Params.Rsample, Params.Hbeam, Params.MarginOme, Params.MarginRadial,
+		y0_vector, z0_vector, &nPlaneNormals);
+		if (nPlaneNormals == 0 ) {
+			GenerateIdealSpotsFriedelMixed(ys, zs, RingTtheta[ringnr], eta, omega, ringnr,
+			Params.RingRadii[ringnr], Params.Distance, Params.Rsample, Params.Hbeam, Params.StepsizePos,
+			Params.MarginOme, Params.MarginRadial, Params.MarginEta,
+			y0_vector, z0_vector, &nPlaneNormals);
+		}
 	}
-	int SpotIDIdx;
-	printf("Starting indexing...\n");
-	for ( SpotIDIdx=0 ; SpotIDIdx < nSpotIDs ; SpotIDIdx++) {
-		start = clock();
-		RealType MinInternalAngle=1000;
-		matchNr = 0;
-		rownr = 0;
-		RealType SpotID = SpotIDs;
-		FindInMatrix(&ObsSpotsLab[0*9+0], n_spots, N_COL_OBSSPOTS, 4, SpotID, &SpotRowNo);
-		if (SpotRowNo == -1) {
-			printf("WARNING: SpotId %lf not found in spots file! Ignoring this spotID.\n", SpotID);
-			continue;
+	if ( nPlaneNormals == 0 ) {
+		if (usingFriedelPair == 1){
+			printf("No Friedel pair found, will try everything.\n");
 		}
-		RealType ys     = ObsSpotsLab[SpotRowNo*9+0];
-		RealType zs     = ObsSpotsLab[SpotRowNo*9+1];
-		RealType omega  = ObsSpotsLab[SpotRowNo*9+2];
-		RealType RefRad = ObsSpotsLab[SpotRowNo*9+3];
-		RealType eta    = ObsSpotsLab[SpotRowNo*9+6];
-		RealType ttheta = ObsSpotsLab[SpotRowNo*9+7];
-		int   ringnr = (int) ObsSpotsLab[SpotRowNo*9+5];
-		char *hklfn = "hkls.csv";
-		FILE *hklf = fopen(hklfn,"r");
-		char aline[1024], dummy[1000];
-		fgets(aline,1000,hklf);
-		int Rnr;
-		double hc,kc,lc,tth;
-		for (i=0;i<MAX_N_RINGS;i++) RingMult[i] = 0;
-		while (fgets(aline,1000,hklf)!=NULL){
-			sscanf(aline, "%s %s %s %s %d %lf %lf %lf %s %lf %s",dummy,dummy,dummy,dummy,&Rnr,&hc,&kc,&lc,dummy,&tth,dummy);
-			RingMult[Rnr]++;
-			RingHKL[Rnr][0] = hc;
-			RingHKL[Rnr][1] = kc;
-			RingHKL[Rnr][2] = lc;
-			RingTtheta[Rnr] = tth;
-		}
-		hkl[0] = RingHKL[ringnr][0];
-		hkl[1] = RingHKL[ringnr][1];
-		hkl[2] = RingHKL[ringnr][2];
-		printf("\n--------------------------------------------------------------------------\n");
-		printf("Spot number being processed %d of %d\n\n",SpotIDIdx, nSpotIDs);
-		printf("%8s %10s %9s %9s %9s %9s %9s %7s\n", "SpotID", "SpotRowNo", "ys", "zs", "omega", "eta", "ttheta", "ringno");
-		printf("%8.0f %10d %9.2f %9.2f %9.3f %9.3f %9.3f %7d\n\n", SpotID, SpotRowNo, ys, zs, omega, eta, ttheta, ringnr);
-		long long int SpotID2 = (int) SpotIDs;
-		nPlaneNormals = 0;
 		usingFriedelPair = 0;
-		if (Params.UseFriedelPairs == 1) {
-			usingFriedelPair = 1;
-			GenerateIdealSpotsFriedel(ys, zs, RingTtheta[ringnr], eta, omega, ringnr,
-			Params.RingRadii[ringnr], Params.Rsample, Params.Hbeam, Params.MarginOme, Params.MarginRadial,
-			y0_vector, z0_vector, &nPlaneNormals);
-			if (nPlaneNormals == 0 ) {
-				GenerateIdealSpotsFriedelMixed(ys, zs, RingTtheta[ringnr], eta, omega, ringnr,
-				Params.RingRadii[ringnr], Params.Distance, Params.Rsample, Params.Hbeam, Params.StepsizePos,
-				Params.MarginOme, Params.MarginRadial, Params.MarginEta,
-				y0_vector, z0_vector, &nPlaneNormals);
-			}
+		printf("Trying all plane normals.\n");
+		GenerateIdealSpots(ys, zs, RingTtheta[ringnr], eta, Params.RingRadii[ringnr], Params.Rsample, Params.Hbeam, Params.StepsizePos, y0_vector, z0_vector, &nPlaneNormals);
+	}
+	printf("No of Plane normals: %d\n\n", nPlaneNormals);
+	Stats.nPlaneNormals = nPlaneNormals;
+	Stats.usingFriedelPair = usingFriedelPair;
+	bestnMatchesIsp = -1;
+	bestnTspotsIsp = 0;
+	isp = 0;
+	int bestMatchFound = 0;
+	while (isp < nPlaneNormals) {
+		y0 = y0_vector[isp];
+		z0 = z0_vector[isp];
+		MakeUnitLength(Params.Distance, y0, z0, &xi, &yi, &zi );
+		spot_to_gv(xi, yi, zi, omega,  &g1, &g2, &g3);
+		hklnormal[0] = g1;
+		hklnormal[1] = g2;
+		hklnormal[2] = g3;
+		GenerateCandidateOrientationsF(hkl, hklnormal, Params.StepsizeOrient, OrMat, &nOrient,ringnr);
+		Stats.nOrient += nOrient;
+		// The grain positions tried along this plane normal do not depend on
+		// the orientation, find the one farthest from the origin for the bound.
+		calc_n_max_min(xi, yi, ys, y0, Params.Rsample, Params.StepsizePos, &n_max, &n_min);
+		MaxPosLen = 0;
+		for (n = n_min ; n <= n_max ; n++) {
+			spot_to_unrotated_coordinates(xi, yi, zi, ys, zs, y0, z0, Params.StepsizePos, n, omega, &ga, &gb, &gc );
+			if (fabs(gc) > HalfBeam) continue;
+			PosLen = CalcLength(ga, gb, gc);
+			if (PosLen > MaxPosLen) MaxPosLen = PosLen;
 		}
-		if ( nPlaneNormals == 0 ) {
-			if (usingFriedelPair == 1){
-				printf("No Friedel pair found, will try everything.\n");
+		nOrientSkipped = 0;
+		bestnMatchesRot = -1;
+		bestnTspotsRot = 0;
+		or = 0;
+		orDelta = 1;
+		while (or < nOrient) {
+			if (DoStats) t0 = StatsClock();
+			CalcDiffrSpots_Furnace(OrMat[or], Params.LatticeConstant, Params.Wavelength , Params.Distance, Params.RingRadii, Params.OmegaRanges, Params.BoxSizes, Params.NoOfOmegaRanges, Params.ExcludePoleAngle, &TheorSpots);
+			if (DoStats) Stats.tDiffrSpots += StatsClock() - t0;
+			nTspots = TheorSpots.nSpots;
+			MinMatchesToAccept = nTspots * Params.MinMatchesToAcceptFrac;
+			// Only skip an orientation that can neither give a match nor raise
+			// bestnMatchesRot, which sets the plane normal step below.
+			MaxMatches = CalcMaxMatches(&TheorSpots, MaxPosLen);
+			if (MaxMatches < MinMatchesToAccept && MaxMatches <= bestnMatchesRot) {
+				nOrientSkipped++;
+				or = or + orDelta;
+				continue;
 			}
-			usingFriedelPair = 0;
-			printf("Trying all plane normals.\n");
-			GenerateIdealSpots(ys, zs, RingTtheta[ringnr], eta, Params.RingRadii[ringnr], Params.Rsample, Params.Hbeam, Params.StepsizePos, y0_vector, z0_vector, &nPlaneNormals);
-		}
-		printf("No of Plane normals: %d\n\n", nPlaneNormals);
-		bestnMatchesIsp = -1;
-		bestnTspotsIsp = 0;
-		isp = 0;
-		int bestMatchFound = 0;
-		while (isp < nPlaneNormals) {
-			y0 = y0_vector[isp];
-			z0 = z0_vector[isp];
-			MakeUnitLength(Params.Distance, y0, z0, &xi, &yi, &zi );
-			spot_to_gv(xi, yi, zi, omega,  &g1, &g2, &g3);
-			hklnormal[0] = g1;
-			hklnormal[1] = g2;
-			hklnormal[2] = g3;
-			GenerateCandidateOrientationsF(hkl, hklnormal, Params.StepsizeOrient, OrMat, &nOrient,ringnr);
-			bestnMatchesRot = -1;
-			bestnTspotsRot = 0;
-			or = 0;
-			orDelta = 1;
-			while (or < nOrient) {
-				int t;
-				CalcDiffrSpots_Furnace(OrMat[or], Params.LatticeConstant, Params.Wavelength , Params.Distance, Params.RingRadii, Params.OmegaRanges, Params.BoxSizes, Params.NoOfOmegaRanges, Params.ExcludePoleAngle, TheorSpots, &nTspots);
-				MinMatchesToAccept = nTspots * Params.MinMatchesToAcceptFrac;
-				bestnMatchesPos = -1;
-				bestnTspotsPos =  0;
-				calc_n_max_min(xi, yi, ys, y0, Params.Rsample, Params.StepsizePos, &n_max, &n_min);
-				n = n_min;
-				while (n <= n_max) {
-					spot_to_unrotated_coordinates(xi, yi, zi, ys, zs, y0, z0, Params.StepsizePos, n, omega, &ga, &gb, &gc );
-					if (fabs(gc) > HalfBeam) {
-						n++;
-						continue;
-					}
-					for (sp = 0 ; sp < nTspots ; sp++) {
-						displacement_spot_needed_COM(ga, gb, gc, TheorSpots[sp][3], TheorSpots[sp][4],
-						TheorSpots[sp][5], TheorSpots[sp][6], &Displ_y, &Displ_z );
-						TheorSpots[sp][10] = TheorSpots[sp][4] +  Displ_y;
-						TheorSpots[sp][11] = TheorSpots[sp][5] +  Displ_z;
-						CalcEtaAngle( TheorSpots[sp][10], TheorSpots[sp][11], &TheorSpots[sp][12] );
-						TheorSpots[sp][13] = sqrt(TheorSpots[sp][10] * TheorSpots[sp][10] + TheorSpots[sp][11] * TheorSpots[sp][11]) -
-						Params.RingRadii[(int)TheorSpots[sp][9]];
-					}
-					CompareSpots(TheorSpots, nTspots, ObsSpotsLab, RefRad,
-					Params.MarginRad, Params.MarginRadial, etamargins, omemargins,
-					&nMatches, GrainSpots);
-					if (nMatches > bestnMatchesPos) {
-						bestnMatchesPos = nMatches;
-						bestnTspotsPos = nTspots;
-					}
-					if ( (nMatches > 0) &&
-						 (matchNr < 100) &&
-						 (nMatches >= MinMatchesToAccept) ) {
-						bestMatchFound = 1;
-						for (i = 0 ;  i < 9 ; i ++) GrainMatchesT[0][i] = OrMat[or][i/3][i%3];
-						GrainMatchesT[0][9]  = ga;
-						GrainMatchesT[0][10] = gb;
-						GrainMatchesT[0][11] = gc;
-						GrainMatchesT[0][12] = nTspots;
-						GrainMatchesT[0][13] = nMatches;
-						GrainMatchesT[0][14] = 1;
-						for (r = 0 ; r < nTspots ; r++) {
-							for (c = 0 ; c < 15 ; c++) AllGrainSpotsT[r][c] = GrainSpots[r][c];
-							AllGrainSpotsT[r][15] = 1;
-						}
-						CalcIA(GrainMatchesT, 1, AllGrainSpotsT, Params.Distance );
-						if (GrainMatchesT[0][15] < MinInternalAngle){
-							MinInternalAngle = GrainMatchesT[0][15];
-							rownr = nTspots;
-							matchNr = 1;
-							for (i=0;i<17;i++) GrainMatches[0][i] = GrainMatchesT[0][i];
-							for (r = 0 ; r < nTspots ; r++) for (c = 0 ; c < 17 ; c++) AllGrainSpots[r][c] = AllGrainSpotsT[r][c];
-							for (r = nTspots; r < nRowsOutput; r++) for (c=0;c<17;c++) AllGrainSpots[r][c] = 0;
-						}
+			bestnMatchesPos = -1;
+			bestnTspotsPos =  0;
+			calc_n_max_min(xi, yi, ys, y0, Params.Rsample, Params.StepsizePos, &n_max, &n_min);
+			n = n_min;
+			while (n <= n_max) {
+				spot_to_unrotated_coordinates(xi, yi, zi, ys, zs, y0, z0, Params.StepsizePos, n, omega, &ga, &gb, &gc );
+				if (fabs(gc) > HalfBeam) {
+					n++;
+					continue;
+				}
+				if (DoStats) t0 = StatsClock();
+				DisplaceTheorSpots(&TheorSpots, ga, gb, gc);
+				if (DoStats) {
+					double t1 = StatsClock();
+					Stats.tDisplace += t1 - t0;
+					t0 = t1;
+				}
+				CompareSpots(&TheorSpots, ObsSpotsLab, RefRad,
+				Params.MarginRad, Params.MarginRadial, etamargins, omemargins,
+				&nMatches, GrainSpots, NULL);
+				if (DoStats) {
+					Stats.tCompare += StatsClock() - t0;
+					Stats.nPosSteps++;
+					Stats.nCompareCalls++;
+					Stats.nBinLookups += nTspots;
+					Stats.nMatchedSpots += nMatches;
+				}
+				if (nMatches > bestnMatchesPos) {
+					bestnMatchesPos = nMatches;
+					bestnTspotsPos = nTspots;
+				}
+				if ( (nMatches > 0) &&
+					 (matchNr < 100) &&
+					 (nMatches >= MinMatchesToAccept) ) {
+					bestMatchFound = 1;
+					for (i = 0 ;  i < 9 ; i ++) GrainMatchesT[0][i] = OrMat[or][i/3][i%3];
+					GrainMatchesT[0][9]  = ga;
+					GrainMatchesT[0][10] = gb;
+					GrainMatchesT[0][11] = gc;
+					GrainMatchesT[0][12] = nTspots;
+					GrainMatchesT[0][13] = nMatches;
+					GrainMatchesT[0][14] = 1;
+					for (r = 0 ; r < nTspots ; r++) {
+						for (c = 0 ; c < 15 ; c++) AllGrainSpotsT[r][c] = GrainSpots[r][c];
+						AllGrainSpotsT[r][15] = 1;
 					}
-					nDelta = 1;
-					if (nTspots != 0) {
-						fracMatches = (RealType)nMatches/nTspots;
-						if (fracMatches < 0.5) { nDelta = 10 - round(fracMatches * (10-1) / 0.5); }
+					CalcIA(GrainMatchesT, 1, AllGrainSpotsT, Params.Distance );
+					if (GrainMatchesT[0][15] < MinInternalAngle){
+						MinInternalAngle = GrainMatchesT[0][15];
+						rownr = nTspots;
+						matchNr = 1;
+						for (i=0;i<N_COL_GRAINMATCHES;i++) GrainMatches[0][i] = GrainMatchesT[0][i];
+						for (r = 0 ; r < nTspots ; r++) for (c = 0 ; c < 17 ; c++) AllGrainSpots[r][c] = AllGrainSpotsT[r][c];
+						for (r = nTspots; r < nRowsOutput; r++) for (c=0;c<17;c++) AllGrainSpots[r][c] = 0;
 					}
-					n = n + nDelta;
 				}
-				if (bestnMatchesPos > bestnMatchesRot) {
-					bestnMatchesRot = bestnMatchesPos;
-					bestnTspotsRot = bestnTspotsPos;
+				nDelta = 1;
+				if (nTspots != 0) {
+					fracMatches = (RealType)nMatches/nTspots;
+					if (fracMatches < 0.5) { nDelta = 10 - round(fracMatches * (10-1) / 0.5); }
 				}
-				or = or + orDelta;
-			}
-			if (bestnMatchesRot > bestnMatchesIsp) {
-				bestnMatchesIsp = bestnMatchesRot;
-				bestnTspotsIsp = bestnTspotsRot;
-			}
-			ispDelta = 1;
-			if ((!usingFriedelPair) && (bestnTspotsRot != 0)) {
-				fracMatches = (RealType) bestnMatchesRot/bestnTspotsRot;
-				if (fracMatches < 0.5) ispDelta = 5 - round(fracMatches * (5-1) / 0.5);
+				n = n + nDelta;
 			}
-			printf("==> planenormal #pns #or #pos #Theor #Matches: %d %d %d %d %d %d\n", isp, nPlaneNormals, nOrient, 2*n_max+1, bestnTspotsRot, bestnMatchesRot);
-			isp = isp + ispDelta;
-			if (matchNr >= 100) {
-				printf("Warning: the number of grain matches exceeds maximum (%d). Not all output is saved!\n", MAX_N_MATCHES );
+			if (bestnMatchesPos > bestnMatchesRot) {
+				bestnMatchesRot = bestnMatchesPos;
+				bestnTspotsRot = bestnTspotsPos;
 			}
+			or = or + orDelta;
 		}
-
-		fracMatches = (RealType) bestnMatchesIsp/bestnTspotsIsp;
-		printf("\n==> Best Match: No_of_theoretical_spots No_of_spots_found fraction: %d %d %0.2f\n", bestnTspotsIsp, bestnMatchesIsp, fracMatches );
-		if (fracMatches > 1 || fracMatches < 0 || (int)bestnTspotsIsp == 0 || (int)bestnMatchesIsp == -1 || bestMatchFound == 0){
-			printf("Nothing good was found. Exiting.\n");
-			exit(0);
-		}
-		BestMatches[SpotIDIdx][0] = SpotIDIdx+1;
-		BestMatches[SpotIDIdx][1] = SpotID;
-		BestMatches[SpotIDIdx][2] = bestnTspotsIsp;
-		BestMatches[SpotIDIdx][3] = bestnMatchesIsp;
-		BestMatches[SpotIDIdx][4] = fracMatches;
-		end = clock();
-		dif = ((double)(end-start))/CLOCKS_PER_SEC;
-		printf("Time elapsed [s] [min]: %f %f\n", dif, dif/60);
-		CreateNumberedFilenameW("BestGrain_", (int) SpotID, 9, ".txt", fn);
-		MakeFullFileName(ffn, Params.OutputFolder, fn);
-		CreateNumberedFilenameW("BestPos_", (int) SpotID, 9, ".csv", fn2);
-		MakeFullFileName(ffn2, Params.OutputFolder, fn2);
-		WriteBestMatch(ffn, GrainMatches, matchNr, AllGrainSpots, rownr, ffn2);
+		Stats.nOrientSkipped += nOrientSkipped;
+		if (bestnMatchesRot > bestnMatchesIsp) {
+			bestnMatchesIsp = bestnMatchesRot;
+			bestnTspotsIsp = bestnTspotsRot;
+		}
+		ispDelta = 1;
+		if ((!usingFriedelPair) && (bestnTspotsRot != 0)) {
+			fracMatches = (RealType) bestnMatchesRot/bestnTspotsRot;
+			if (fracMatches < 0.5) ispDelta = 5 - round(fracMatches * (5-1) / 0.5);
+		}
+		printf("==> SpotID %d planenormal #pns #or #orSkipped #pos #Theor #Matches: %d %d %d %d %d %d %d\n", SpotID, isp, nPlaneNormals, nOrient, nOrientSkipped, 2*n_max+1, bestnTspotsRot, bestnMatchesRot);
+		isp = isp + ispDelta;
+	}
+	int rc = 0;
+	fracMatches = (RealType) bestnMatchesIsp/bestnTspotsIsp;
+	printf("\n==> SpotID %d Best Match: No_of_theoretical_spots No_of_spots_found fraction: %d %d %0.2f\n", SpotID, bestnTspotsIsp, bestnMatchesIsp, fracMatches );
+	if (fracMatches > 1 || fracMatches < 0 || (int)bestnTspotsIsp == 0 || (int)bestnMatchesIsp == -1 || bestMatchFound == 0){
+		printf("Nothing good was found for SpotID %d.\n", SpotID);
+		rc = 1;
+	} else {
+		end = omp_get_wtime();
+		dif = end - start;
+		printf("SpotID %d Time elapsed [s] [min]: %f %f\n", SpotID, dif, dif/60);
+		WriteBestMatch(SlotNr, SpotID, GrainMatches, matchNr, AllGrainSpots, rownr);
+		if (SpotsClaimed != NULL) ClaimSpots(AllGrainSpots, rownr);
 	}
+	if (DoStats) WriteIndexStats(SpotID, rc, &Stats, bestnTspotsIsp, bestnMatchesIsp, omp_get_wtime()-start);
+	free(OrMat);
 	FreeMemMatrix( GrainMatches, MAX_N_MATCHES);
-	FreeMemMatrix( TheorSpots, nRowsPerGrain);
+	FreeMemMatrix( GrainMatchesT, MAX_N_MATCHES);
+	FreeTheorSpots(&TheorSpots);
 	FreeMemMatrix( GrainSpots, nRowsPerGrain);
 	FreeMemMatrix( AllGrainSpots, nRowsOutput);
-	FreeMemMatrix( BestMatches, nSpotIDs);
+	FreeMemMatrix( AllGrainSpotsT, nRowsOutput);
+	return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Orientation-space indexing (OrientationSpaceIndexing 1).
+// Instead of starting from seed spots, a grid over the fundamental zone is
+// tested directly: every orientation rotates the crystal g-vectors into the
+// sample frame and looks them up in a hash of the observed g-vectors (grain
+// at the origin, rotated back by omega). Orientations that explain enough
+// g-vectors are refined (orientation from the matched g-vectors, position by
+// least squares on the spot displacements) and checked with CompareSpots
+// exactly like a seed solution. The result is written to the slot of every
+// seed in SpotsToIndex.csv that the grain explains.
+
+// GetMisorientation.c
+int MakeSymmetries(int SGNr, double Sym[24][4]);
+double GetMisOrientationAngle(double quat1[4], double quat2[4], double *Angle, int NrSymmetries, double Sym[24][4]);
+
+#define GV_HASH_EMPTY LLONG_MIN
+#define GV_HASH_OFFSET (1<<20)
+#define MAX_N_ENGINE_GRAINS 100000
+#define ENGINE_BATCH 64
+
+RealType *ObsGv;               // unit g-vector of every observed spot, 3 per row
+long long int *GvHashKeys;     // open addressing on (ring, cell) keys
+int *GvHashStart, *GvHashCount, *GvHashRows;
+long long int GvHashSize = 0;
+RealType GvCellSize;
+
+struct TEngineCandidate {
+	double q[4];
+	RealType frac;
+	long long int gp;
+};
+
+struct TEngineGrain {
+	double q[4];
+	int nTspots;
+	int nMatches;
+	RealType **GrainMatches;
+	RealType **GrainSpots;
+};
+
+void QuatToOrientMat(double q[4],RealType m[3][3])
+{
+	m[0][0] = 1 - 2*(q[2]*q[2] + q[3]*q[3]);
+	m[0][1] = 2*(q[1]*q[2] - q[0]*q[3]);
+	m[0][2] = 2*(q[1]*q[3] + q[0]*q[2]);
+	m[1][0] = 2*(q[1]*q[2] + q[0]*q[3]);
+	m[1][1] = 1 - 2*(q[1]*q[1] + q[3]*q[3]);
+	m[1][2] = 2*(q[2]*q[3] - q[0]*q[1]);
+	m[2][0] = 2*(q[1]*q[3] - q[0]*q[2]);
+	m[2][1] = 2*(q[2]*q[3] + q[0]*q[1]);
+	m[2][2] = 1 - 2*(q[1]*q[1] + q[2]*q[2]);
+}
+
+static inline long long int GvKey(int ring,int ix,int iy,int iz)
+{
+	return ((((long long int)ring*2*GV_HASH_OFFSET + ix+GV_HASH_OFFSET)*2*GV_HASH_OFFSET + iy+GV_HASH_OFFSET)*2*GV_HASH_OFFSET) + iz+GV_HASH_OFFSET;
+}
+
+static inline long long int GvSlot(long long int key)
+{
+	unsigned long long int h = (unsigned long long int)key * 0x9E3779B97F4A7C15ULL;
+	return (long long int)(h >> 20) & (GvHashSize-1);
+}
+
+// Slot of key, or of the empty slot where it would go.
+static inline long long int GvFind(long long int key)
+{
+	long long int slot = GvSlot(key);
+	while (GvHashKeys[slot] != GV_HASH_EMPTY && GvHashKeys[slot] != key) slot = (slot+1) & (GvHashSize-1);
+	return slot;
+}
+
+struct TGvKeyRow {
+	long long int key;
+	int row;
+};
+
+int CmpGvKeyRows(const void *a,const void *b)
+{
+	long long int ka = ((struct TGvKeyRow *)a)->key, kb = ((struct TGvKeyRow *)b)->key;
+	return (ka > kb) - (ka < kb);
+}
+
+// Hash all observed g-vectors by ring and cube cell of side CellSize.
+void BuildGvHash(RealType Distance,RealType CellSize)
+{
+	int i, j;
+	RealType xi, yi, zi, g[3], len;
+	struct TGvKeyRow *keys = malloc(n_spots*sizeof(*keys));
+	ObsGv = malloc(n_spots*3*sizeof(*ObsGv));
+	GvHashRows = malloc(n_spots*sizeof(*GvHashRows));
+	GvCellSize = CellSize;
+	for (i = 0 ; i < n_spots ; i++) {
+		MakeUnitLength(Distance, ObsSpotsLab[i*9+0], ObsSpotsLab[i*9+1], &xi, &yi, &zi);
+		spot_to_gv(xi, yi, zi, ObsSpotsLab[i*9+2], &g[0], &g[1], &g[2]);
+		len = CalcLength(g[0], g[1], g[2]);
+		for (j = 0 ; j < 3 ; j++) ObsGv[i*3+j] = g[j]/len;
+		keys[i].key = GvKey((int)ObsSpotsLab[i*9+5], (int)floor(ObsGv[i*3+0]/CellSize),
+			(int)floor(ObsGv[i*3+1]/CellSize), (int)floor(ObsGv[i*3+2]/CellSize));
+		keys[i].row = i;
+	}
+	qsort(keys, n_spots, sizeof(*keys), CmpGvKeyRows);
+	GvHashSize = 1;
+	while (GvHashSize < 2*(long long int)n_spots) GvHashSize *= 2;
+	GvHashKeys = malloc(GvHashSize*sizeof(*GvHashKeys));
+	GvHashStart = malloc(GvHashSize*sizeof(*GvHashStart));
+	GvHashCount = calloc(GvHashSize,sizeof(*GvHashCount));
+	for (i = 0 ; i < GvHashSize ; i++) GvHashKeys[i] = GV_HASH_EMPTY;
+	for (i = 0 ; i < n_spots ; i++) {
+		long long int slot = GvFind(keys[i].key);
+		GvHashRows[i] = keys[i].row;
+		if (GvHashKeys[slot] == GV_HASH_EMPTY) {
+			GvHashKeys[slot] = keys[i].key;
+			GvHashStart[slot] = i;
+		}
+		GvHashCount[slot]++;
+	}
+	free(keys);
+}
+
+void FreeGvHash()
+{
+	free(ObsGv);
+	free(GvHashKeys);
+	free(GvHashStart);
+	free(GvHashCount);
+	free(GvHashRows);
+}
+
+// Row of the observed spot of this ring closest to the unit g-vector g, if
+// closer than sqrt(MaxDist2), else -1. Cells are twice the tolerance, so only
+// the 2x2x2 cells around g can hold a match.
+int FindGvMatch(int ring,RealType g[3],RealType MaxDist2)
+{
+	int c[3][2], i, j, k, d, n, row, best = -1;
+	RealType f, dx, dy, dz, dist2, bestDist2 = MaxDist2;
+	for (d = 0 ; d < 3 ; d++) {
+		f = g[d]/GvCellSize;
+		c[d][0] = (int)floor(f);
+		c[d][1] = (f - c[d][0] < 0.5) ? c[d][0]-1 : c[d][0]+1;
+	}
+	for (i = 0 ; i < 2 ; i++) for (j = 0 ; j < 2 ; j++) for (k = 0 ; k < 2 ; k++) {
+		long long int slot = GvFind(GvKey(ring, c[0][i], c[1][j], c[2][k]));
+		if (GvHashKeys[slot] == GV_HASH_EMPTY) continue;
+		for (n = GvHashStart[slot] ; n < GvHashStart[slot] + GvHashCount[slot] ; n++) {
+			row = GvHashRows[n];
+			dx = ObsGv[row*3+0] - g[0];
+			dy = ObsGv[row*3+1] - g[1];
+			dz = ObsGv[row*3+2] - g[2];
+			dist2 = dx*dx + dy*dy + dz*dz;
+			if (dist2 < bestDist2) {
+				bestDist2 = dist2;
+				best = row;
+			}
+		}
+	}
+	return best;
+}
+
+// Number of hkls whose rotated g-vector has an observed match. nObservable
+// counts the hkls whose spots are not inside the excluded pole (|eta| < ExcludePoleAngle).
+int CountGvMatches(RealType OM[3][3],RealType (*HklUnit)[3],RealType *CosPole,RealType MaxDist2,int *nObservable,int *MatchRows)
+{
+	int i, nMatch = 0;
+	RealType g[3];
+	*nObservable = 0;
+	for (i = 0 ; i < n_hkls ; i++) {
+		MatrixMultF(OM, HklUnit[i], g);
+		MatchRows[i] = -1;
+		if (fabs(g[2]) >= CosPole[i]) continue;
+		(*nObservable)++;
+		MatchRows[i] = FindGvMatch((int)hkls[i][3], g, MaxDist2);
+		if (MatchRows[i] != -1) nMatch++;
+	}
+	return nMatch;
+}
+
+// Rotation taking the crystal unit vectors onto the matched observed g-vectors
+// (Horn's quaternion method, largest eigenvector by power iteration started at q).
+void RefineOrientationGv(RealType (*HklUnit)[3],int *MatchRows,double q[4])
+{
+	int i, j, k, it;
+	double S[3][3] = {{0}}, N[4][4], v[4], len, shift = 0;
+	for (i = 0 ; i < n_hkls ; i++) {
+		if (MatchRows[i] == -1) continue;
+		for (j = 0 ; j < 3 ; j++) for (k = 0 ; k < 3 ; k++) S[j][k] += HklUnit[i][j] * ObsGv[MatchRows[i]*3+k];
+		shift += 1;
+	}
+	N[0][0] =  S[0][0] + S[1][1] + S[2][2];
+	N[1][1] =  S[0][0] - S[1][1] - S[2][2];
+	N[2][2] = -S[0][0] + S[1][1] - S[2][2];
+	N[3][3] = -S[0][0] - S[1][1] + S[2][2];
+	N[0][1] = N[1][0] = S[1][2] - S[2][1];
+	N[0][2] = N[2][0] = S[2][0] - S[0][2];
+	N[0][3] = N[3][0] = S[0][1] - S[1][0];
+	N[1][2] = N[2][1] = S[0][1] + S[1][0];
+	N[1][3] = N[3][1] = S[2][0] + S[0][2];
+	N[2][3] = N[3][2] = S[1][2] + S[2][1];
+	for (i = 0 ; i < 4 ; i++) N[i][i] += shift;
+	for (it = 0 ; it < 100 ; it++) {
+		for (i = 0 ; i < 4 ; i++) {
+			v[i] = 0;
+			for (j = 0 ; j < 4 ; j++) v[i] += N[i][j] * q[j];
+		}
+		len = sqrt(v[0]*v[0] + v[1]*v[1] + v[2]*v[2] + v[3]*v[3]);
+		if (len == 0) return;
+		for (i = 0 ; i < 4 ; i++) q[i] = v[i]/len;
+	}
+}
+
+// Least squares grain position from the matched spots, using the same linear
+// displacement model as DisplaceTheorSpots. Returns 1 if it could be solved.
+int FitPositionSpots(struct TTheorSpots *TS,RealType **GrainSpots,int *MatchedTheorSpot,int nMatches,RealType Pos[3])
+{
+	int k, sp, i, j;
+	double A[3][3] = {{0}}, B[3] = {0}, Jy[3], Jz[3], ry, rz, det, Ainv[3][3];
+	for (k = 0 ; k < nMatches ; k++) {
+		sp = MatchedTheorSpot[k];
+		Jy[0] = TS->sinOme[sp] - TS->cosOme[sp]*TS->yn[sp]/TS->xn[sp];
+		Jy[1] = TS->cosOme[sp] + TS->sinOme[sp]*TS->yn[sp]/TS->xn[sp];
+		Jy[2] = 0;
+		Jz[0] = -TS->cosOme[sp]*TS->zn[sp]/TS->xn[sp];
+		Jz[1] = TS->sinOme[sp]*TS->zn[sp]/TS->xn[sp];
+		Jz[2] = 1;
+		ry = GrainSpots[k][3] - TS->yl[sp];
+		rz = GrainSpots[k][6] - TS->zl[sp];
+		for (i = 0 ; i < 3 ; i++) {
+			for (j = 0 ; j < 3 ; j++) A[i][j] += Jy[i]*Jy[j] + Jz[i]*Jz[j];
+			B[i] += Jy[i]*ry + Jz[i]*rz;
+		}
+	}
+	det = A[0][0]*(A[1][1]*A[2][2]-A[1][2]*A[2][1]) - A[0][1]*(A[1][0]*A[2][2]-A[1][2]*A[2][0]) + A[0][2]*(A[1][0]*A[2][1]-A[1][1]*A[2][0]);
+	if (fabs(det) < 1e-12) return 0;
+	Ainv[0][0] =  (A[1][1]*A[2][2]-A[1][2]*A[2][1])/det;
+	Ainv[0][1] = -(A[0][1]*A[2][2]-A[0][2]*A[2][1])/det;
+	Ainv[0][2] =  (A[0][1]*A[1][2]-A[0][2]*A[1][1])/det;
+	Ainv[1][0] = -(A[1][0]*A[2][2]-A[1][2]*A[2][0])/det;
+	Ainv[1][1] =  (A[0][0]*A[2][2]-A[0][2]*A[2][0])/det;
+	Ainv[1][2] = -(A[0][0]*A[1][2]-A[0][2]*A[1][0])/det;
+	Ainv[2][0] =  (A[1][0]*A[2][1]-A[1][1]*A[2][0])/det;
+	Ainv[2][1] = -(A[0][0]*A[2][1]-A[0][1]*A[2][0])/det;
+	Ainv[2][2] =  (A[0][0]*A[1][1]-A[0][1]*A[1][0])/det;
+	for (i = 0 ; i < 3 ; i++) Pos[i] = Ainv[i][0]*B[0] + Ainv[i][1]*B[1] + Ainv[i][2]*B[2];
+	return 1;
+}
+
+int CmpCandidates(const void *a,const void *b)
+{
+	const struct TEngineCandidate *ca = a, *cb = b;
+	if (ca->frac != cb->frac) return (ca->frac < cb->frac) - (ca->frac > cb->frac);
+	return (ca->gp > cb->gp) - (ca->gp < cb->gp);
+}
+
+// 1 if q is within MaxAngle of one of the grains found so far.
+int IsKnownGrain(double q[4],struct TEngineGrain *Grains,int nGrains,RealType MaxAngle,int NrSym,double Sym[24][4])
+{
+	int g;
+	double Angle;
+	for (g = 0 ; g < nGrains ; g++) {
+		GetMisOrientationAngle(q, Grains[g].q, &Angle, NrSym, Sym);
+		if (Angle < MaxAngle) return 1;
+	}
+	return 0;
+}
+
+int DoOrientationSpaceIndexing(struct TParams Params,int nSpotIDs,int *SpotIDs,int *SlotNrs,int numProcs)
+{
+	int i, j, d, r, NrSym;
+	double Sym[24][4];
+	RealType SymM[24][3][3];
+	RealType omemargins[181];
+	RealType etamargins[MAX_N_RINGS];
+	RealType (*HklUnit)[3] = malloc(n_hkls*sizeof(*HklUnit));
+	RealType *CosPole = malloc(n_hkls*sizeof(*CosPole));
+	RealType GridStep = Params.OrientationGridStep * deg2rad;
+	RealType Tol = Params.GVectorTolerance * deg2rad;
+	RealType MaxDist2 = Tol*Tol;
+	RealType HalfBeam = Params.Hbeam / 2;
+	RealType OmeCoverage = 0;
+	double start = omp_get_wtime();
+	NrSym = MakeSymmetries(Params.SpaceGroupNum, Sym);
+	for (i = 0 ; i < NrSym ; i++) QuatToOrientMat(Sym[i], SymM[i]);
+	for (i = 0 ; i < n_hkls ; i++) {
+		RealType len = CalcLength(hkls[i][0], hkls[i][1], hkls[i][2]);
+		for (d = 0 ; d < 3 ; d++) HklUnit[i][d] = hkls[i][d] / len;
+		// z of the sample frame g-vector is cos(theta)cos(eta) for both omega solutions.
+		CosPole[i] = cos(hkls[i][5]*deg2rad) * cos(Params.ExcludePoleAngle*deg2rad);
+	}
+	for (i = 0 ; i < Params.NoOfOmegaRanges ; i++) OmeCoverage += (Params.OmegaRanges[i][1] - Params.OmegaRanges[i][0]) / 360;
+	if (OmeCoverage > 1) OmeCoverage = 1;
+	CalcMargins(&Params, etamargins, omemargins);
+	BuildGvHash(Params.Distance, 2*Tol);
+	printf("Orientation-space indexing: grid step %f deg, g-vector tolerance %f deg, %d symmetry operators.\n",
+		Params.OrientationGridStep, Params.GVectorTolerance, NrSym);
+
+	// Pass 1: every grid point in the fundamental zone. The grid is the surface of
+	// the 4D cube (one face per largest quaternion component, q and -q are the same
+	// rotation), projected onto the unit sphere.
+	int nGrid = (int)ceil(4/GridStep);
+	long long int nGridTot = 4LL*nGrid*nGrid*nGrid, gp;
+	long long int nFZ = 0;
+	int nCand = 0, maxNCand = 1024;
+	struct TEngineCandidate *Cand = malloc(maxNCand*sizeof(*Cand));
+	# pragma omp parallel num_threads(numProcs)
+	{
+		int *MatchRows = malloc(n_hkls*sizeof(*MatchRows));
+		RealType OM[3][3];
+		# pragma omp for schedule(dynamic,4096) reduction(+:nFZ)
+		for (gp = 0 ; gp < nGridTot ; gp++) {
+			int face = (int)(gp / ((long long int)nGrid*nGrid*nGrid));
+			long long int rest = gp % ((long long int)nGrid*nGrid*nGrid);
+			double q[4], u[3], len;
+			int s, d, nObservable, nMatch, isFZ = 1;
+			u[0] = -1 + (rest / (nGrid*nGrid) + 0.5) * 2.0 / nGrid;
+			u[1] = -1 + ((rest / nGrid) % nGrid + 0.5) * 2.0 / nGrid;
+			u[2] = -1 + (rest % nGrid + 0.5) * 2.0 / nGrid;
+			for (s = 0, d = 0 ; s < 4 ; s++) q[s] = (s == face) ? 1 : u[d++];
+			len = sqrt(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+			for (s = 0 ; s < 4 ; s++) q[s] /= len;
+			// In the fundamental zone if no symmetric equivalent q*sym is closer to identity.
+			for (s = 1 ; s < NrSym ; s++) {
+				double w = q[0]*Sym[s][0] - q[1]*Sym[s][1] - q[2]*Sym[s][2] - q[3]*Sym[s][3];
+				if (fabs(w) > fabs(q[0])) {
+					isFZ = 0;
+					break;
+				}
+			}
+			if (!isFZ) continue;
+			nFZ++;
+			QuatToOrientMat(q, OM);
+			nMatch = CountGvMatches(OM, HklUnit, CosPole, MaxDist2, &nObservable, MatchRows);
+			if (nObservable == 0 || nMatch < Params.MinMatchesToAcceptFrac * OmeCoverage * nObservable) continue;
+			# pragma omp critical (EngineCandidates)
+			{
+				if (nCand == maxNCand) {
+					maxNCand *= 2;
+					Cand = realloc(Cand, maxNCand*sizeof(*Cand));
+				}
+				for (s = 0 ; s < 4 ; s++) Cand[nCand].q[s] = q[s];
+				Cand[nCand].frac = (RealType)nMatch/nObservable;
+				Cand[nCand].gp = gp;
+				nCand++;
+			}
+		}
+		free(MatchRows);
+	}
+	qsort(Cand, nCand, sizeof(*Cand), CmpCandidates);
+	printf("Tested %lld orientations in the fundamental zone, %d candidates. Time: %f s.\n", nFZ, nCand, omp_get_wtime()-start);
+
+	// Pass 2: refine the candidates, best first, skipping those close to a grain
+	// that was already found. A batch of candidates is refined in parallel and
+	// then accepted in order, so the grains do not depend on the thread count.
+	struct TEngineGrain *Grains = malloc(MAX_N_ENGINE_GRAINS*sizeof(*Grains));
+	int nGrains = 0, nRefined = 0, b0, nb;
+	long long int nCompareCalls = 0, nBinLookups = 0, nMatchedSpots = 0;
+	RealType MergeAngle = 2*Params.GVectorTolerance;
+	int nRowsPerGrain = 2 * n_hkls;
+	struct TEngineGrain *Refined = malloc(ENGINE_BATCH*sizeof(*Refined));
+	check (Grains == NULL || Refined == NULL, "Could not allocate the orientation-space grains.");
+	for (i = 0 ; i < ENGINE_BATCH ; i++) {
+		Refined[i].GrainMatches = allocMatrix(1, N_COL_GRAINMATCHES);
+		Refined[i].GrainSpots = allocMatrix(nRowsPerGrain, N_COL_GRAINSPOTS);
+	}
+	for (b0 = 0 ; b0 < nCand ; b0 += ENGINE_BATCH) {
+		nb = (nCand - b0 < ENGINE_BATCH) ? nCand - b0 : ENGINE_BATCH;
+		# pragma omp parallel num_threads(numProcs)
+		{
+			int *MatchRows = malloc(n_hkls*sizeof(*MatchRows));
+			int *MatchedTheorSpot = malloc(nRowsPerGrain*sizeof(*MatchedTheorSpot));
+			struct TTheorSpots TheorSpots;
+			RealType OM[3][3];
+			AllocTheorSpots(&TheorSpots, nRowsPerGrain);
+			# pragma omp for schedule(dynamic,1) reduction(+:nRefined,nCompareCalls,nBinLookups,nMatchedSpots)
+			for (j = 0 ; j < nb ; j++) {
+				struct TEngineGrain *G = &Refined[j];
+				RealType **GrainSpots = G->GrainSpots;
+				double q[4];
+				RealType Pos[3] = {0, 0, 0}, RefRad = 0, MinMatchesToAccept;
+				int s, k, r, c, it, nObservable, nMatches = 0, nTspots;
+				G->nMatches = 0;
+				for (s = 0 ; s < 4 ; s++) q[s] = Cand[b0+j].q[s];
+				// Grains only grows between the batches.
+				if (IsKnownGrain(q, Grains, nGrains, MergeAngle, NrSym, Sym)) continue;
+				nRefined++;
+				for (it = 0 ; it < 2 ; it++) {
+					QuatToOrientMat(q, OM);
+					CountGvMatches(OM, HklUnit, CosPole, MaxDist2, &nObservable, MatchRows);
+					RefineOrientationGv(HklUnit, MatchRows, q);
+				}
+				QuatToOrientMat(q, OM);
+				CountGvMatches(OM, HklUnit, CosPole, MaxDist2, &nObservable, MatchRows);
+				for (k = 0, s = 0 ; k < n_hkls ; k++) {
+					if (MatchRows[k] == -1) continue;
+					RefRad += ObsSpotsLab[MatchRows[k]*9+3];
+					s++;
+				}
+				if (s == 0) continue;
+				RefRad /= s;
+				CalcDiffrSpots_Furnace(OM, Params.LatticeConstant, Params.Wavelength, Params.Distance, Params.RingRadii,
+					Params.OmegaRanges, Params.BoxSizes, Params.NoOfOmegaRanges, Params.ExcludePoleAngle, &TheorSpots);
+				nTspots = TheorSpots.nSpots;
+				MinMatchesToAccept = nTspots * Params.MinMatchesToAcceptFrac;
+				if (nTspots == 0) continue;
+				// Position from the spots matched at the origin, then once more from the
+				// spots matched at that position.
+				for (it = 0 ; it < 3 ; it++) {
+					DisplaceTheorSpots(&TheorSpots, Pos[0], Pos[1], Pos[2]);
+					CompareSpots(&TheorSpots, ObsSpotsLab, RefRad, Params.MarginRad, Params.MarginRadial,
+						etamargins, omemargins, &nMatches, GrainSpots, MatchedTheorSpot);
+					nCompareCalls++;
+					nBinLookups += nTspots;
+					nMatchedSpots += nMatches;
+					if (it == 2 || nMatches < 3) break;
+					if (FitPositionSpots(&TheorSpots, GrainSpots, MatchedTheorSpot, nMatches, Pos) == 0) break;
+					if (fabs(Pos[2]) > HalfBeam || CalcLength(Pos[0], Pos[1], 0) > Params.Rsample) break;
+				}
+				if (nMatches < MinMatchesToAccept || nMatches == 0) continue;
+				for (r = 0 ; r < 3 ; r++) for (c = 0 ; c < 3 ; c++) G->GrainMatches[0][r*3+c] = OM[r][c];
+				for (r = 0 ; r < 3 ; r++) G->GrainMatches[0][9+r] = Pos[r];
+				G->GrainMatches[0][12] = nTspots;
+				G->GrainMatches[0][13] = nMatches;
+				G->GrainMatches[0][14] = 1;
+				for (r = 0 ; r < nTspots ; r++) GrainSpots[r][15] = 1;
+				CalcIA(G->GrainMatches, 1, GrainSpots, Params.Distance);
+				for (s = 0 ; s < 4 ; s++) G->q[s] = q[s];
+				G->nTspots = nTspots;
+				G->nMatches = nMatches;
+			}
+			free(MatchRows);
+			free(MatchedTheorSpot);
+			FreeTheorSpots(&TheorSpots);
+		}
+		for (j = 0 ; j < nb ; j++) {
+			struct TEngineGrain *G = &Refined[j];
+			if (G->nMatches == 0 || nGrains == MAX_N_ENGINE_GRAINS) continue;
+			if (IsKnownGrain(Cand[b0+j].q, Grains, nGrains, MergeAngle, NrSym, Sym) ||
+				IsKnownGrain(G->q, Grains, nGrains, MergeAngle, NrSym, Sym)) continue;
+			Grains[nGrains] = *G;
+			G->GrainMatches = allocMatrix(1, N_COL_GRAINMATCHES);
+			G->GrainSpots = allocMatrix(nRowsPerGrain, N_COL_GRAINSPOTS);
+			nGrains++;
+			printf("Grain %d: %d of %d spots, IA %f, position %f %f %f\n", nGrains, G->nMatches, G->nTspots,
+				Grains[nGrains-1].GrainMatches[0][15], Grains[nGrains-1].GrainMatches[0][9],
+				Grains[nGrains-1].GrainMatches[0][10], Grains[nGrains-1].GrainMatches[0][11]);
+		}
+	}
+	for (i = 0 ; i < ENGINE_BATCH ; i++) {
+		FreeMemMatrix(Refined[i].GrainMatches, 1);
+		FreeMemMatrix(Refined[i].GrainSpots, nRowsPerGrain);
+	}
+	free(Refined);
+	printf("Refined %d candidates, found %d grains. Time: %f s.\n", nRefined, nGrains, omp_get_wtime()-start);
+	// The work is shared by all seeds, every stats record gets the totals.
+	struct TIndexStats Stats;
+	double tTotal = omp_get_wtime()-start;
+	memset(&Stats, 0, sizeof(Stats));
+	Stats.nOrient = nFZ;
+	Stats.nOrientSkipped = nFZ - nCand;
+	Stats.nPosSteps = nCompareCalls;
+	Stats.nCompareCalls = nCompareCalls;
+	Stats.nBinLookups = nBinLookups;
+	Stats.nMatchedSpots = nMatchedSpots;
+
+	// Every seed a grain explains gets that grain, the first (best) grain wins.
+	int MaxSpotID = 0, nWritten = 0;
+	for (i = 0 ; i < nSpotIDs ; i++) if (SpotIDs[i] > MaxSpotID) MaxSpotID = SpotIDs[i];
+	int *SeedIdx = malloc((MaxSpotID+1)*sizeof(*SeedIdx));
+	char *Written = calloc(nSpotIDs, sizeof(*Written));
+	check (SeedIdx == NULL || Written == NULL, "Could not allocate the seed index for SpotID %d.", MaxSpotID);
+	for (i = 0 ; i <= MaxSpotID ; i++) SeedIdx[i] = -1;
+	for (i = 0 ; i < nSpotIDs ; i++) if (SpotIDs[i] >= 0) SeedIdx[SpotIDs[i]] = i;
+	for (j = 0 ; j < nGrains ; j++) {
+		for (r = 0 ; r < Grains[j].nTspots ; r++) {
+			if (Grains[j].GrainSpots[r][0] < 0) continue;
+			int ID = (int)Grains[j].GrainSpots[r][14];
+			if (ID < 0 || ID > MaxSpotID || SeedIdx[ID] == -1 || Written[SeedIdx[ID]]) continue;
+			WriteBestMatch(SlotNrs[SeedIdx[ID]], ID, Grains[j].GrainMatches, 1, Grains[j].GrainSpots, Grains[j].nTspots);
+			Written[SeedIdx[ID]] = 1;
+			nWritten++;
+			if (StatsFD != -1) WriteIndexStats(ID, 0, &Stats, Grains[j].nTspots, Grains[j].nMatches, tTotal);
+		}
+		if (SpotsClaimed != NULL) ClaimSpots(Grains[j].GrainSpots, Grains[j].nTspots);
+		FreeMemMatrix(Grains[j].GrainMatches, 1);
+		FreeMemMatrix(Grains[j].GrainSpots, nRowsPerGrain);
+	}
+	for (i = 0 ; i < nSpotIDs ; i++) {
+		if (Written[i]) continue;
+		WriteBestMatch(SlotNrs[i], SpotIDs[i], NULL, 0, NULL, 0);
+		if (StatsFD != -1) WriteIndexStats(SpotIDs[i], 1, &Stats, 0, 0, tTotal);
+	}
+	printf("%d of %d SpotIDs explained by the grains found.\n", nWritten, nSpotIDs);
+	free(SeedIdx);
+	free(Written);
+	free(Grains);
+	free(Cand);
+	free(HklUnit);
+	free(CosPole);
+	FreeGvHash();
+	return nWritten;
 }
 
 void
@@ -1711,107 +2622,119 @@ ConcatStr(char *str1, char *str2, char *resStr)
 }
 
 
-int ReadBins()
+// SharedMemDataset.c
+void ShmDatasetPath(char *DatasetID, char *FileName, char *Path);
+void ShmDatasetAttach(char *DatasetID);
+void *ShmDatasetMap(char *DatasetID, char *FileName, size_t *Size);
+
+size_t SizeData, SizeNData, SizeSpots;
+
+int ReadBins(char *DatasetID)
 {
-	int fd;
-	struct stat s;
-	int status;
-	size_t size;
-	const char * file_name = "/dev/shm/Data.bin";
-	int rc;
-	fd = open (file_name, O_RDONLY);
-	check (fd < 0, "open %s failed: %s", file_name, strerror (errno));
-	status = fstat (fd, & s);
-	check (status < 0, "stat %s failed: %s", file_name, strerror (errno));
-	size = s.st_size;
-	data = mmap (0, size, PROT_READ, MAP_SHARED, fd, 0);
-	check (data == MAP_FAILED, "mmap %s failed: %s",file_name, strerror (errno));
-	int fd2;
-	struct stat s2;
-	int status2;
-	const char* file_name2 = "/dev/shm/nData.bin";
-	fd2 = open (file_name2, O_RDONLY);
-	check (fd2 < 0, "open %s failed: %s", file_name2, strerror (errno));
-	status2 = fstat (fd2, & s2);
-	check (status2 < 0, "stat %s failed: %s", file_name2, strerror (errno));
-	size_t size2 = s2.st_size;
-	ndata = mmap (0, size2, PROT_READ, MAP_SHARED, fd2, 0);
-	printf("%lld %d %lld \n",(long long int)size2,(int)sizeof(int),(long long int)(size2/sizeof(int)));
+	data = ShmDatasetMap(DatasetID, "Data.bin", &SizeData);
+	ndata = ShmDatasetMap(DatasetID, "nData.bin", &SizeNData);
+	printf("%lld %d %lld \n",(long long int)SizeNData,(int)sizeof(int),(long long int)(SizeNData/sizeof(int)));
 	fflush(stdout);
-	check (ndata == MAP_FAILED, "mmap %s failed: %s",file_name, strerror (errno));
 	return 1;
 }
 
-int ReadSpots()
+int ReadSpots(char *DatasetID)
+{
+	ObsSpotsLab = ShmDatasetMap(DatasetID, "Spots.bin", &SizeSpots);
+	return (int) SizeSpots/(9*sizeof(double));
+}
+
+// The float32 build maps the float columns SaveBinData wrote to SpotsCompact.bin,
+// otherwise (or if that file is missing/stale) they are packed from Spots.bin.
+void ReadSpotsCompact(char *DatasetID)
 {
-	int fd;
+	int i;
+	size_t size;
 	struct stat s;
-	int status;
+	char filename[4096];
+	if (sizeof(SpotType) == sizeof(float)) {
+		ShmDatasetPath(DatasetID, "SpotsCompact.bin", filename);
+		if (stat(filename,&s) == 0 && s.st_size == (off_t)(n_spots*N_COL_OBSSPOTSCMP*sizeof(float))) {
+			ObsSpotsCmp = ShmDatasetMap(DatasetID, "SpotsCompact.bin", &size);
+			ObsSpotsCmpMapped = 1;
+			printf("Using float32 spots table %s.\n", filename);
+			return;
+		}
+	}
+	ObsSpotsCmp = allocSpotArray(n_spots*N_COL_OBSSPOTSCMP);
+	for (i=0;i<n_spots;i++){
+		ObsSpotsCmp[i*N_COL_OBSSPOTSCMP+0] = ObsSpotsLab[i*9+8];
+		ObsSpotsCmp[i*N_COL_OBSSPOTSCMP+1] = ObsSpotsLab[i*9+3];
+		ObsSpotsCmp[i*N_COL_OBSSPOTSCMP+2] = ObsSpotsLab[i*9+6];
+		ObsSpotsCmp[i*N_COL_OBSSPOTSCMP+3] = ObsSpotsLab[i*9+2];
+	}
+}
+
+void FreeSpotsCompact()
+{
+	if (ObsSpotsCmpMapped) munmap(ObsSpotsCmp, n_spots*N_COL_OBSSPOTSCMP*sizeof(*ObsSpotsCmp));
+	else free(ObsSpotsCmp);
+}
+
+int ReadBigDet(char *DatasetID)
+{
 	size_t size;
-	const char *filename = "/dev/shm/Spots.bin";
-	int rc;
-	fd = open(filename,O_RDONLY);
-	check(fd < 0, "open %s failed: %s", filename, strerror(errno));
-	status = fstat (fd , &s);
-	check (status < 0, "stat %s failed: %s", filename, strerror(errno));
-	size = s.st_size;
-	ObsSpotsLab = mmap(0,size,PROT_READ,MAP_SHARED,fd,0);
-	check (ObsSpotsLab == MAP_FAILED,"mmap %s failed: %s", filename, strerror(errno));
-	return (int) size/(9*sizeof(double));
+	BigDetector = ShmDatasetMap(DatasetID, "BigDetectorMask.bin", &size);
+	return (long long int) size;
 }
 
-int ReadBigDet()
+// Map SpotsClaimed.bin read-write so claims are seen by every indexer on the
+// node. Created (zeroed) if SaveBinData/SHM.sh did not put it there. Claims
+// stored by another ClaimRunID are cleared, ClaimRunID 0 keeps them.
+int ReadSpotsClaimed(char *DatasetID,long long int RunID)
 {
-	int fd;
+	int fd, i;
 	struct stat s;
 	int status;
-	size_t size;
-	const char *filename = "/dev/shm/BigDetectorMask.bin";
-	int rc;
-	fd = open(filename,O_RDONLY);
+	size_t size = sizeof(*ClaimsHeader) + (size_t)n_spots*sizeof(*SpotsClaimed);
+	char filename[4096];
+	ShmDatasetPath(DatasetID, "SpotsClaimed.bin", filename);
+	fd = open(filename,O_RDWR|O_CREAT,S_IRUSR|S_IWUSR);
 	check(fd < 0, "open %s failed: %s", filename, strerror(errno));
+	status = flock(fd, LOCK_EX);
+	check (status < 0, "flock %s failed: %s", filename, strerror(errno));
 	status = fstat (fd , &s);
 	check (status < 0, "stat %s failed: %s", filename, strerror(errno));
-	size = s.st_size;
-	BigDetector = mmap(0,size,PROT_READ,MAP_SHARED,fd,0);
-	check (BigDetector == MAP_FAILED,"mmap %s failed: %s", filename, strerror(errno));
-	return (long long int) size;
+	if ((size_t)s.st_size != size) {
+		printf("%s has %lld bytes for %d spots, resetting claims.\n", filename, (long long int)s.st_size, n_spots);
+		status = ftruncate(fd, 0);
+		check (status < 0, "ftruncate %s failed: %s", filename, strerror(errno));
+		status = ftruncate(fd, size);
+		check (status < 0, "ftruncate %s failed: %s", filename, strerror(errno));
+	}
+	ClaimsHeader = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	check (ClaimsHeader == MAP_FAILED,"mmap %s failed: %s", filename, strerror(errno));
+	SpotsClaimed = (unsigned char *)(ClaimsHeader + 1);
+	if (ClaimsHeader->nSpots != n_spots || (RunID != 0 && ClaimsHeader->RunID != RunID)) {
+		memset(SpotsClaimed, 0, n_spots*sizeof(*SpotsClaimed));
+		ClaimsHeader->nSpots = n_spots;
+		ClaimsHeader->RunID = RunID;
+		printf("Cleared the spot claims of earlier runs in %s for ClaimRunID %lld.\n", filename, RunID);
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+	for (i = 0 ; i < n_spots ; i++) if ((int)ObsSpotsLab[i*9+4] > MaxSpotIDObs) MaxSpotIDObs = (int)ObsSpotsLab[i*9+4];
+	SpotRowOfID = malloc((MaxSpotIDObs+1)*sizeof(*SpotRowOfID));
+	for (i = 0 ; i <= MaxSpotIDObs ; i++) SpotRowOfID[i] = -1;
+	for (i = 0 ; i < n_spots ; i++) if ((int)ObsSpotsLab[i*9+4] >= 0) SpotRowOfID[(int)ObsSpotsLab[i*9+4]] = i;
+	return 1;
 }
 
 int UnMap()
 {
-	int fd;
-	struct stat s;
-	int status;
-	size_t size;
-	const char * file_name = "/dev/shm/Data.bin";
 	int rc;
-	fd = open (file_name, O_RDONLY);
-	check (fd < 0, "open %s failed: %s", file_name, strerror (errno));
-	status = fstat (fd, & s);
-	check (status < 0, "stat %s failed: %s", file_name, strerror (errno));
-	size = s.st_size;
-	rc = munmap (data,size);
-	int fd2;
-	struct stat s2;
-	int status2;
-	const char* file_name2 = "/dev/shm/nData.bin";
-	fd2 = open (file_name2, O_RDONLY);
-	check (fd2 < 0, "open %s failed: %s", file_name2, strerror (errno));
-	status2 = fstat (fd2, & s2);
-	check (status2 < 0, "stat %s failed: %s", file_name2, strerror (errno));
-	size_t size2 = s2.st_size;
-	rc = munmap (ndata,size2);
-	int fd3;
-	struct stat s3;
-	int status3;
-	const char *filename3 = "/dev/shm/Spots.bin";
-	fd3 = open(filename3,O_RDONLY);
-	check(fd3 < 0, "open %s failed: %s", filename3, strerror(errno));
-	status3 = fstat (fd3 , &s3);
-	check (status3 < 0, "stat %s failed: %s", filename3, strerror(errno));
-	size_t size3 = s3.st_size;
-	rc = munmap(ObsSpotsLab,size3);
+	rc = munmap(data,SizeData);
+	rc = munmap(ndata,SizeNData);
+	rc = munmap(ObsSpotsLab,SizeSpots);
+	if (SpotsClaimed != NULL) {
+		rc = munmap(ClaimsHeader,sizeof(*ClaimsHeader)+(size_t)n_spots*sizeof(*SpotsClaimed));
+		free(SpotRowOfID);
+	}
 	return 1;
 }
 
@@ -1819,20 +2742,25 @@ int
 main(int argc, char *argv[])
 {
 	printf("\n\n\t\tIndexer v5.0\nContact hsharma@anl.gov in case of questions about the MIDAS project.\n\n");
-	clock_t end, start0;
+	double end, start0;
 	double diftotal;
 	int returncode;
 	struct TParams Params;
-	int SpotIDs;
+	int SpotID;
 	int nSpotIDs;
+	int *SpotIDs;
+	int *SlotNrs;
+	int nSlots = 0;
+	int numProcs = 1;
 	char *ParamFN;
 	char fn[1024];
-	if (argc != 3) {
-		printf("Supply a parameter file and a spotID as argument: ie %s param.txt SpotID\n\n", argv[0]);
+	if (argc != 3 && argc != 4 && argc != 6) {
+		printf("Supply a parameter file and a spotID as argument: ie %s param.txt SpotID\n", argv[0]);
+		printf("or a parameter file, a file with SpotIDs, nCPUs and optionally a row range (0-based, inclusive) to index many seeds in one process:\n");
+		printf("\t%s param.txt SpotsToIndex.csv nCPUs [startRowNr endRowNr]\n\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 	ParamFN = argv[1];
-	SpotIDs = atoi(argv[2]);
 	printf("Reading parameters from file: %s.\n", ParamFN);
 	returncode = ReadParams(ParamFN, &Params);
 	if ( returncode != 0 ) {
@@ -1841,15 +2769,25 @@ main(int argc, char *argv[])
 	}
 	printf("SpaceGroup: %d\n",Params.SpaceGroupNum);
 	printf("Finished reading parameters.\n");
+	ShmDatasetAttach(Params.DatasetID);
+	if (BigDetSize != 0) ReadBigDet(Params.DatasetID);
 	char *hklfn = "hkls.csv";
 	FILE *hklf = fopen(hklfn,"r");
-	char aline[1024],dummy[1024];
+	if (hklf == NULL){
+		printf("Could not read the hkl file %s. Exiting.\n", hklfn);
+		exit(EXIT_FAILURE);
+	}
+	char aline[1024];
 	fgets(aline,1000,hklf);
 	int Rnr,i;
 	int hi,ki,li;
-	double hc,kc,lc,RRd,Ds,tht;
+	double hc,kc,lc,RRd,Ds,tht,Tth;
 	while (fgets(aline,1000,hklf)!=NULL){
-		sscanf(aline, "%d %d %d %lf %d %lf %lf %lf %lf %s %lf",&hi,&ki,&li,&Ds,&Rnr,&hc,&kc,&lc,&tht,dummy,&RRd);
+		sscanf(aline, "%d %d %d %lf %d %lf %lf %lf %lf %lf %lf",&hi,&ki,&li,&Ds,&Rnr,&hc,&kc,&lc,&tht,&Tth,&RRd);
+		RingHKL[Rnr][0] = hc;
+		RingHKL[Rnr][1] = kc;
+		RingHKL[Rnr][2] = lc;
+		RingTtheta[Rnr] = Tth;
 		for (i=0;i<Params.NrOfRings;i++){
 			if (Rnr == Params.RingNumbers[i]){
 				HKLints[n_hkls][0] = hi;
@@ -1867,12 +2805,71 @@ main(int argc, char *argv[])
 			}
 		}
 	}
+	fclose(hklf);
 	printf("No of hkl's: %d\n", n_hkls);
-	int t;
-	n_spots = ReadSpots();
-	nSpotIDs = 1;
+	if (argc == 3) {
+		// The result slot is the row of the SpotID in SpotsToIndex.csv, as for FitPosOrStrains.
+		// Without that file (or the SpotID in it) the result goes to BestPos_%09d.csv.
+		SpotIDs = malloc(sizeof(*SpotIDs));
+		SlotNrs = malloc(sizeof(*SlotNrs));
+		SpotIDs[0] = atoi(argv[2]);
+		SlotNrs[0] = -1;
+		nSpotIDs = 1;
+		FILE *SpFile = fopen("SpotsToIndex.csv","r");
+		if (SpFile != NULL){
+			while (fgets(aline,1000,SpFile)!=NULL){
+				if (sscanf(aline,"%d",&SpotID) != 1) continue;
+				if (SpotID == SpotIDs[0] && SlotNrs[0] == -1) SlotNrs[0] = nSlots;
+				nSlots++;
+			}
+			fclose(SpFile);
+		}
+		if (SlotNrs[0] == -1){
+			printf("No SpotsToIndex.csv entry for SpotID %d, writing BestPos_%09d.csv.\n", SpotIDs[0], SpotIDs[0]);
+			BestPosFolder = Params.OutputFolder;
+			SlotNrs[0] = 0;
+		}
+	} else {
+		FILE *SpFile = fopen(argv[2],"r");
+		if (SpFile == NULL){
+			printf("Could not read the SpotIDs file %s. Exiting.\n", argv[2]);
+			exit(EXIT_FAILURE);
+		}
+		numProcs = atoi(argv[3]);
+		int startRowNr = 0, endRowNr = INT_MAX, rowNr = 0, maxNSpotIDs = 1024;
+		if (argc == 6){
+			startRowNr = atoi(argv[4]);
+			endRowNr = atoi(argv[5]);
+		}
+		SpotIDs = malloc(maxNSpotIDs*sizeof(*SpotIDs));
+		SlotNrs = malloc(maxNSpotIDs*sizeof(*SlotNrs));
+		nSpotIDs = 0;
+		while (fgets(aline,1000,SpFile)!=NULL){
+			if (sscanf(aline,"%d",&SpotID) != 1) continue;
+			if (rowNr >= startRowNr && rowNr <= endRowNr){
+				if (nSpotIDs == maxNSpotIDs){
+					maxNSpotIDs *= 2;
+					SpotIDs = realloc(SpotIDs,maxNSpotIDs*sizeof(*SpotIDs));
+					SlotNrs = realloc(SlotNrs,maxNSpotIDs*sizeof(*SlotNrs));
+				}
+				SpotIDs[nSpotIDs] = SpotID;
+				SlotNrs[nSpotIDs] = rowNr;
+				nSpotIDs++;
+			}
+			rowNr++;
+		}
+		fclose(SpFile);
+		nSlots = rowNr;
+	}
+	printf("No of SpotIDs to index: %d using %d threads.\n", nSpotIDs, numProcs);
+	n_spots = ReadSpots(Params.DatasetID);
+	ReadSpotsCompact(Params.DatasetID);
+	if (Params.ClaimSpots == 1) {
+		ReadSpotsClaimed(Params.DatasetID, Params.ClaimRunID);
+		printf("Skipping seeds whose spot was matched by at least %d accepted grains.\n", Params.MinNrSpots);
+	}
 	printf("Binned data...\n");
-	int rc = ReadBins();
+	ReadBins(Params.DatasetID);
 	int HighestRingNo = 0;
 	for (i = 0 ; i < MAX_N_RINGS ; i++ ) {
 		if ( Params.RingRadii[i] != 0) HighestRingNo = i;
@@ -1887,11 +2884,45 @@ main(int argc, char *argv[])
 	printf("No of bins for omega : %d\n", n_ome_bins);
 	printf("Total no of bins     : %d\n\n", n_ring_bins * n_eta_bins * n_ome_bins);
 	printf("Finished binning.\n\n");
-	start0 = clock();
-	DoIndexing(SpotIDs,  nSpotIDs, Params );
-	end = clock();
-	diftotal = ((double)(end-start0))/CLOCKS_PER_SEC;
+	if (BestPosFolder == NULL) OpenBestContainer(Params.OutputFolder, nSlots, 2 * n_hkls);
+	if (Params.IndexerStats == 1) OpenStatsFile(Params.OutputFolder);
+	if (Params.OrientationSpaceIndexing == 1) {
+		if (nSpotIDs < nSlots) printf("Warning: every block of SpotIDs repeats the whole orientation search.\n");
+		start0 = omp_get_wtime();
+		DoOrientationSpaceIndexing(Params, nSpotIDs, SpotIDs, SlotNrs, numProcs);
+		diftotal = omp_get_wtime()-start0;
+		printf("\nTotal time elapsed [s] [min]: %f %f\n", diftotal, diftotal/60);
+		free(SpotIDs);
+		free(SlotNrs);
+		FreeSpotsCompact();
+		if (BestFD != -1) close(BestFD);
+		UnMap();
+		return(0);
+	}
+	printf("Starting indexing...\n");
+	start0 = omp_get_wtime();
+	int nIndexed = 0, nSkipped = 0;
+	// Seeds differ a lot in cost (number of plane normals, Friedel pair found or not),
+	// so hand them out one at a time to whichever thread is free.
+	# pragma omp parallel for num_threads(numProcs) schedule(dynamic,1) reduction(+:nIndexed,nSkipped)
+	for (i=0;i<nSpotIDs;i++){
+		int rcIdx = DoIndexing(SpotIDs[i], SlotNrs[i], Params);
+		if (rcIdx == 0) nIndexed++;
+		else {
+			// Clear the slot, the file may hold a result from an earlier run.
+			WriteBestMatch(SlotNrs[i], SpotIDs[i], NULL, 0, NULL, 0);
+			if (rcIdx == 2) nSkipped++;
+		}
+	}
+	end = omp_get_wtime();
+	diftotal = end-start0;
+	printf("\nIndexed %d of %d SpotIDs, %d skipped as already claimed.\n", nIndexed, nSpotIDs, nSkipped);
 	printf("\nTotal time elapsed [s] [min]: %f %f\n", diftotal, diftotal/60);
-	int tc = UnMap();
+	free(SpotIDs);
+	free(SlotNrs);
+	FreeSpotsCompact();
+	if (BestFD != -1) close(BestFD);
+	if (StatsFD != -1) close(StatsFD);
+	UnMap();
 	return(0);
 }
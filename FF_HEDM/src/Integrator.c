@@ -29,6 +29,8 @@
 #include <stdint.h>
 #include <tiffio.h>
 #include <libgen.h>
+#include <dirent.h>
+#include <unistd.h>
 
 typedef double pixelvalue;
 
@@ -112,6 +114,158 @@ int ReadBins(){
 	return 1;
 }
 
+// The map as a sparse matrix (bins x raw pixels) in CSR form: the pixels of
+// bin b are Px[BinStart[b]]..Px[BinStart[b+1]-1] with weights Frac. Px index
+// the raw frame as read, the ImTransOpt map (TransMap, as in ImageCorrection.c)
+// is applied to the pixel indices once here instead of to every frame.
+// Masked pixels are left out, Area is the summed weight of each bin and Dark
+// the weighted sum of the average dark over the bin, so the dark is
+// subtracted once per bin. Pixels the transformations move outside the raw
+// frame read as 0 and only count in Area and Dark.
+struct TIntegMap {
+	int nBins;
+	size_t *BinStart;
+	int *Px;
+	double *Frac;
+	double *Area;
+	double *Dark;
+};
+
+static void
+BuildIntegMap(struct TIntegMap *M, int nBins, int NrPixelsY, int NrPixelsZ, int *TransMap, double *AverageDark,
+	int *mapMask, size_t mapMaskSize)
+{
+	int b, l, sr, sc;
+	size_t n = 0, testPos;
+	for (b=0;b<nBins;b++) n += nPxList[2*b];
+	M->nBins = nBins;
+	M->BinStart = malloc((nBins+1)*sizeof(*M->BinStart));
+	M->Px = malloc((n+1)*sizeof(*M->Px));
+	M->Frac = malloc((n+1)*sizeof(*M->Frac));
+	M->Area = malloc(nBins*sizeof(*M->Area));
+	M->Dark = malloc(nBins*sizeof(*M->Dark));
+	n = 0;
+	for (b=0;b<nBins;b++){
+		M->BinStart[b] = n;
+		M->Area[b] = 0;
+		M->Dark[b] = 0;
+		for (l=0;l<nPxList[2*b];l++){
+			struct data ThisVal = pxList[nPxList[2*b+1] + l];
+			testPos = ThisVal.z;
+			testPos *= NrPixelsY;
+			testPos += ThisVal.y;
+			if (mapMaskSize != 0 && TestBit(mapMask,testPos)) continue;
+			M->Area[b] += ThisVal.frac;
+			M->Dark[b] += AverageDark[testPos]*ThisVal.frac;
+			sr = TransMap[0] + TransMap[1]*ThisVal.z + TransMap[2]*ThisVal.y;
+			sc = TransMap[3] + TransMap[4]*ThisVal.z + TransMap[5]*ThisVal.y;
+			if (sr < 0 || sr >= NrPixelsZ || sc < 0 || sc >= NrPixelsY) continue;
+			M->Px[n] = sr*NrPixelsY + sc;
+			M->Frac[n] = ThisVal.frac;
+			n++;
+		}
+	}
+	M->BinStart[nBins] = n;
+	printf("Integration map: %d bins, %lld pixel weights after masking.\n",nBins,(long long int)n);
+}
+
+#define INTEG_GATHER(T) { \
+	const T *Fr[nImages]; \
+	for (f=0;f<nImages;f++) Fr[f] = (const T *)Frames[f]; \
+	for (e=M->BinStart[b];e<M->BinStart[b+1];e++){ \
+		int Px = M->Px[e]; \
+		double Frac = M->Frac[e]; \
+		for (f=0;f<nImages;f++) Acc[f] += (double)Fr[f][Px]*Frac; \
+	} \
+	}
+
+// Intensity of every bin for nImages frames at once, so the map is read once
+// per batch. Frames are raw frames of dType (as in RawFrames.c), the pixels
+// are read in their own type, nothing is converted or copied per frame.
+// Out[f*nBins+b] is the weighted sum of bin b in frame f less the bin's
+// dark, divided by the bin area with Normalize.
+static void
+IntegrateBatch(struct TIntegMap *M, int nImages, const void **Frames, int dType, int Normalize, double *Out)
+{
+	int b;
+	# pragma omp parallel for schedule(dynamic,64)
+	for (b=0;b<M->nBins;b++){
+		double Acc[nImages];
+		size_t e;
+		int f;
+		for (f=0;f<nImages;f++) Acc[f] = 0;
+		switch (dType){
+			case 1: INTEG_GATHER(uint16_t); break;
+			case 2: INTEG_GATHER(double); break;
+			case 3: INTEG_GATHER(float); break;
+			case 4: INTEG_GATHER(uint32_t); break;
+			case 5: INTEG_GATHER(int32_t); break;
+		}
+		for (f=0;f<nImages;f++){
+			Acc[f] -= M->Dark[b];
+			if (Acc[f] != 0 && Normalize == 1) Acc[f] /= M->Area[b];
+			Out[(size_t)f*M->nBins+b] = Acc[f];
+		}
+	}
+}
+
+// All frames of a file go to one <ImageName>_integrated.bin: the header
+// below, padded to INTEG_CUBE_DATA_OFFSET bytes, then the axes as doubles,
+// RMean[nRBins] (px), TwoTheta[nRBins] (degrees), EtaMean[nEtaBins] (degrees)
+// and Area[nRBins*nEtaBins], then the float32 cube Intensity[nFrames][nRBins]
+// [nEtaBins], one frame written at a time. utils/IntegratorCube.py reads it.
+#define INTEG_CUBE_MAGIC 0x42554349
+#define INTEG_CUBE_VERSION 1
+#define INTEG_CUBE_DATA_OFFSET 4096
+
+struct IntegCubeHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	int32_t nFrames;
+	int32_t nRBins;
+	int32_t nEtaBins;
+	int32_t Normalize;
+	double RMin;
+	double RBinSize;
+	double EtaMin;
+	double EtaBinSize;
+	double Lsd;
+	double px;
+};
+
+static FILE *
+IntegCubeOpen(char *FN, struct IntegCubeHeader *Header, double *RMean, double *TwoTheta, double *EtaMean, double *Area)
+{
+	char Pad[INTEG_CUBE_DATA_OFFSET];
+	int nR = Header->nRBins, nEta = Header->nEtaBins, ok;
+	FILE *f = fopen(FN,"wb");
+	if (f == NULL){
+		printf("Could not write %s: %s\n",FN,strerror(errno));
+		return NULL;
+	}
+	memset(Pad,0,sizeof(Pad));
+	memcpy(Pad,Header,sizeof(*Header));
+	ok = (fwrite(Pad,sizeof(Pad),1,f) == 1);
+	ok = ok && fwrite(RMean,nR*sizeof(*RMean),1,f) == 1;
+	ok = ok && fwrite(TwoTheta,nR*sizeof(*TwoTheta),1,f) == 1;
+	ok = ok && fwrite(EtaMean,nEta*sizeof(*EtaMean),1,f) == 1;
+	ok = ok && fwrite(Area,(size_t)nR*nEta*sizeof(*Area),1,f) == 1;
+	if (!ok){
+		printf("Could not write %s: %s\n",FN,strerror(errno));
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+static int
+IntegCubeWriteFrame(FILE *f, double *BinInt, size_t nBins, float *Buf)
+{
+	size_t b;
+	for (b=0;b<nBins;b++) Buf[b] = (float)BinInt[b];
+	return (fwrite(Buf,nBins*sizeof(*Buf),1,f) == 1) ? 0 : 1;
+}
+
 static inline
 int StartsWith(const char *a, const char *b)
 {
@@ -154,28 +308,227 @@ REtaMapper(
 	}
 }
 
-static inline void DoImageTransformations (int NrTransOpt, int TransOpt[10], pixelvalue *ImageIn, pixelvalue *ImageOut, int NrPixelsY, int NrPixelsZ)
+// RawFrames.c
+struct RawFile;
+int RawPixelSize(int dType);
+struct RawFile *RawFileOpen(char *FN, int PixelSize, size_t NrPixels, size_t HeadSize, int AlignEnd);
+int RawFileNrFrames(struct RawFile *F);
+const void *RawFrame(struct RawFile *F, int FrameNr);
+void RawFrameWillNeed(struct RawFile *F, int FrameNr, int nFrames);
+void RawFileClose(struct RawFile *F);
+
+// DetectorMap.c
+int DetectorMapUpdate(char *ParamFN, char *Folder, int KeepIncomplete);
+
+// ImageCorrection.c
+void ImageTransformMap(int NrTransOpt, int *TransOpt, int NrRows, int NrCols, int *Map);
+int CorrectImage(const void *Raw, int dType, int InRows, int InCols, int NrRows, int NrCols, const int *Map,
+	double BadPx, const double *Dark, const double *Flood, double Scale, const int *Mask, double Thresh,
+	double *Out, int *FgPixels);
+
+// LiveMode: frames are integrated as they are written and published to a
+// ring of LiveSlots results in /dev/shm/<LiveShm>, for the GUI to read
+// without going to disk. Layout: the header below padded to
+// INTEG_CUBE_DATA_OFFSET, the axes as in the cube file, then LiveSlots slots,
+// each a struct IntegLiveSlot followed by nRBins*nEtaBins float32. A slot is
+// being written while its Seq is odd, a reader copies it and checks Seq did
+// not change. The newest frame is in slot (nPublished-1)%nSlots.
+#define INTEG_LIVE_MAGIC 0x45564c49
+#define INTEG_LIVE_VERSION 1
+
+struct IntegLiveHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	int32_t nSlots;
+	int32_t nRBins;
+	int32_t nEtaBins;
+	int32_t Normalize;
+	uint64_t nPublished;
+};
+
+struct IntegLiveSlot {
+	uint64_t Seq;
+	int64_t FrameNr;	// Frames published before this one.
+	int32_t FileNr;		// File in the order followed, 0 for a single file.
+	int32_t FileFrameNr;
+	char Pad[40];
+};
+
+struct TIntegLive {
+	char *Map;
+	size_t Size;
+	size_t SlotOffset;
+	size_t SlotSize;
+	size_t nBins;
+	int nSlots;
+};
+
+static int
+IntegLiveOpen(struct TIntegLive *L, char *Name, int nSlots, struct IntegCubeHeader *Cube,
+	double *RMean, double *TwoTheta, double *EtaMean, double *Area)
 {
-	int i,j,k,l,m;
-	if (NrTransOpt == 0 || (NrTransOpt==1 && TransOpt[0]==0)){
-		memcpy(ImageOut,ImageIn,NrPixelsY*NrPixelsZ*sizeof(*ImageIn)); // Nothing to do
-		return;
+	char fn[4096], tmpfn[4096+32];
+	struct IntegLiveHeader Header;
+	int nR = Cube->nRBins, nEta = Cube->nEtaBins;
+	size_t Pos;
+	L->nBins = (size_t)nR*nEta;
+	L->nSlots = nSlots;
+	L->SlotOffset = INTEG_CUBE_DATA_OFFSET + sizeof(double)*(2*nR+nEta+L->nBins);
+	L->SlotOffset = (L->SlotOffset+63)/64*64;
+	L->SlotSize = (sizeof(struct IntegLiveSlot) + L->nBins*sizeof(float) + 63)/64*64;
+	L->Size = L->SlotOffset + nSlots*L->SlotSize;
+	// Built under a temporary name and renamed into place: a reader still
+	// mapping the region of an earlier run keeps its (now unlinked) file instead
+	// of seeing it truncated under it.
+	sprintf(fn,"/dev/shm/%s",Name);
+	sprintf(tmpfn,"%s.%d.tmp",fn,(int)getpid());
+	int fd = open(tmpfn,O_RDWR|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (fd < 0 || ftruncate(fd,L->Size) != 0){
+		printf("Could not create %s: %s\n",tmpfn,strerror(errno));
+		if (fd >= 0){
+			close(fd);
+			unlink(tmpfn);
+		}
+		return 1;
 	}
-    for (i=0;i<NrTransOpt;i++){
-		if (TransOpt[i] == 1){
-			for (k=0;k<NrPixelsY;k++){
-				for (l=0;l<NrPixelsZ;l++){
-					ImageOut[l*NrPixelsY+k] = ImageIn[l*NrPixelsY+(NrPixelsY-k-1)]; // Invert Y
-				}
-			}
-		}else if (TransOpt[i] == 2){
-			for (k=0;k<NrPixelsY;k++){
-				for (l=0;l<NrPixelsZ;l++){
-					ImageOut[l*NrPixelsY+k] = ImageIn[(NrPixelsZ-l-1)*NrPixelsY+k]; // Invert Z
-				}
+	L->Map = mmap(0,L->Size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (L->Map == MAP_FAILED){
+		printf("mmap %s failed: %s\n",tmpfn,strerror(errno));
+		unlink(tmpfn);
+		return 1;
+	}
+	Pos = INTEG_CUBE_DATA_OFFSET;
+	memcpy(L->Map+Pos,RMean,nR*sizeof(double)); Pos += nR*sizeof(double);
+	memcpy(L->Map+Pos,TwoTheta,nR*sizeof(double)); Pos += nR*sizeof(double);
+	memcpy(L->Map+Pos,EtaMean,nEta*sizeof(double)); Pos += nEta*sizeof(double);
+	memcpy(L->Map+Pos,Area,L->nBins*sizeof(double));
+	memset(&Header,0,sizeof(Header));
+	Header.Version = INTEG_LIVE_VERSION;
+	Header.nSlots = nSlots;
+	Header.nRBins = nR;
+	Header.nEtaBins = nEta;
+	Header.Normalize = Cube->Normalize;
+	memcpy(L->Map,&Header,sizeof(Header));
+	// The magic goes in last, a reader seeing it sees the complete header.
+	__atomic_store_n((uint32_t *)L->Map,INTEG_LIVE_MAGIC,__ATOMIC_RELEASE);
+	if (rename(tmpfn,fn) != 0){
+		printf("Could not rename %s to %s: %s\n",tmpfn,fn,strerror(errno));
+		munmap(L->Map,L->Size);
+		unlink(tmpfn);
+		return 1;
+	}
+	printf("Publishing integrated frames to %s, %d slots.\n",fn,nSlots);
+	return 0;
+}
+
+static void
+IntegLivePublish(struct TIntegLive *L, int64_t FrameNr, int FileNr, int FileFrameNr, double *BinInt)
+{
+	struct IntegLiveHeader *Header = (struct IntegLiveHeader *)L->Map;
+	struct IntegLiveSlot *Slot = (struct IntegLiveSlot *)(L->Map + L->SlotOffset + (FrameNr % L->nSlots)*L->SlotSize);
+	float *Data = (float *)(Slot+1);
+	size_t b;
+	__atomic_store_n(&Slot->Seq,Slot->Seq+1,__ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	Slot->FrameNr = FrameNr;
+	Slot->FileNr = FileNr;
+	Slot->FileFrameNr = FileFrameNr;
+	for (b=0;b<L->nBins;b++) Data[b] = (float)BinInt[b];
+	__atomic_store_n(&Slot->Seq,Slot->Seq+1,__ATOMIC_RELEASE);
+	__atomic_store_n(&Header->nPublished,(uint64_t)FrameNr+1,__ATOMIC_RELEASE);
+}
+
+// First file in Dir named after Cur (all files if Cur is empty), skipping
+// hidden files. Returns 0 and its name in Next if there is one.
+static int
+LiveNextFile(char *Dir, char *Cur, char *Next)
+{
+	DIR *d = opendir(Dir);
+	struct dirent *e;
+	struct stat s;
+	char fn[4096+256];
+	int Found = 0;
+	if (d == NULL) return 1;
+	while ((e = readdir(d)) != NULL){
+		if (e->d_name[0] == '.') continue;
+		if (strcmp(e->d_name,Cur) <= 0) continue;
+		if (Found && strcmp(e->d_name,Next) >= 0) continue;
+		sprintf(fn,"%s/%s",Dir,e->d_name);
+		if (stat(fn,&s) != 0 || !S_ISREG(s.st_mode)) continue;
+		strcpy(Next,e->d_name);
+		Found = 1;
+	}
+	closedir(d);
+	return Found ? 0 : 1;
+}
+
+// Follow Path, a file being written or a folder getting new files, and
+// integrate every frame once it is complete. Polling is used rather than
+// inotify, which misses writes made on other hosts of a network file system.
+// Stops after Timeout seconds without new frames (never if 0).
+static int
+IntegrateLive(char *Path, int dType, int HeadSize, int NrPixelsY, int NrPixelsZ, struct TIntegMap *IntegMap, int Normalize, int FrameBatch, struct TIntegLive *L, int PollMs, double Timeout)
+{
+	struct stat s;
+	struct RawFile *Raw = NULL;
+	char FN[4096+256], Cur[256] = "", Next[256];
+	int IsDir = (stat(Path,&s) == 0 && S_ISDIR(s.st_mode));
+	int FileNr = 0, Done = 0, nAvail, HaveNext, n, f;
+	int64_t FrameNr = 0;
+	size_t FrameSize = (size_t)RawPixelSize(dType)*NrPixelsY*NrPixelsZ;
+	double Idle = 0;
+	if (FrameSize == 0){
+		printf("LiveMode needs a raw DataType (1-5).\n");
+		return 1;
+	}
+	const void **Frames = malloc(FrameBatch*sizeof(*Frames));
+	double *BinInt = malloc((size_t)FrameBatch*L->nBins*sizeof(*BinInt));
+	if (IsDir){
+		if (LiveNextFile(Path,Cur,Next) == 0) strcpy(Cur,Next);
+		sprintf(FN,"%s/%s",Path,Cur);
+	} else sprintf(FN,"%s",Path);
+	printf("Following %s%s.\n",Path,IsDir ? " (folder)" : "");
+	while (1){
+		// Check for a newer file first: once it exists, the current one is complete.
+		HaveNext = (IsDir && LiveNextFile(Path,Cur,Next) == 0);
+		nAvail = 0;
+		if ((!IsDir || Cur[0] != '\0') && stat(FN,&s) == 0 && (size_t)s.st_size > (size_t)HeadSize){
+			int nOnDisk = (int)((s.st_size-HeadSize)/FrameSize);
+			if (nOnDisk > Done && (Raw == NULL || RawFileNrFrames(Raw) < nOnDisk)){
+				RawFileClose(Raw);
+				Raw = RawFileOpen(FN,RawPixelSize(dType),(size_t)NrPixelsY*NrPixelsZ,HeadSize,0);
 			}
+			if (Raw != NULL) nAvail = RawFileNrFrames(Raw)-Done;
 		}
+		if (nAvail > 0){
+			n = nAvail < FrameBatch ? nAvail : FrameBatch;
+			for (f=0;f<n;f++) Frames[f] = RawFrame(Raw,Done+f);
+			IntegrateBatch(IntegMap,n,Frames,dType,Normalize,BinInt);
+			for (f=0;f<n;f++) IntegLivePublish(L,FrameNr+f,FileNr,Done+f,BinInt+(size_t)f*L->nBins);
+			printf("Integrated frames %d to %d of %s.\n",Done,Done+n-1,FN);
+			fflush(stdout);
+			Done += n;
+			FrameNr += n;
+			Idle = 0;
+			continue;
+		}
+		if (HaveNext){
+			RawFileClose(Raw);
+			Raw = NULL;
+			if (Cur[0] != '\0') FileNr++;
+			strcpy(Cur,Next);
+			sprintf(FN,"%s/%s",Path,Cur);
+			Done = 0;
+			continue;
+		}
+		if (Timeout > 0 && Idle >= Timeout) break;
+		usleep(PollMs*1000);
+		Idle += PollMs/1000.0;
 	}
+	printf("No new frames for %.1f s, %lld frames integrated.\n",Timeout,(long long int)FrameNr);
+	RawFileClose(Raw);
+	return 0;
 }
 
 int fileReader (FILE *f,char fn[], int dType, int NrPixels, double *returnArr)
@@ -287,6 +640,8 @@ int main(int argc, char **argv)
 		".\n");
 		return(1);
 	}
+	// (Re)build Map.bin and nMap.bin if they were made for another geometry.
+	if (DetectorMapUpdate(argv[1],".",1) != 0) return 1;
     system("cp Map.bin nMap.bin /dev/shm");
 	int rc = ReadBins();
 	double RMax, RMin, RBinSize, EtaMax, EtaMin, EtaBinSize, Lsd, px;
@@ -307,6 +662,11 @@ int main(int argc, char **argv)
 	int dType = 1;
 	char GapFN[4096], BadPxFN[4096], outputFolder[4096];
 	int sumImages=0, separateFolder=0;
+	// The per-frame text files are still read by the GUI and scripts, WriteCSV 0 writes only the cube.
+	int FrameBatch = 8, WriteCSV = 1;
+	int LiveMode = 0, LiveSlots = 32, LivePollMs = 100;
+	double LiveTimeout = 0;
+	char LiveShm[1024] = "IntegratorLive";
 	while (fgets(aline,4096,paramFile) != NULL){
 		str = "GapFile ";
 		if (StartsWith(aline,str) == 1){
@@ -398,6 +758,44 @@ int main(int argc, char **argv)
             NrTransOpt++;
             continue;
         }
+        str = "FrameBatch ";
+        if (StartsWith(aline,str) == 1){
+            sscanf(aline,"%s %d", dummy, &FrameBatch);
+            if (FrameBatch < 1) FrameBatch = 1;
+            continue;
+        }
+        str = "WriteCSV ";
+        if (StartsWith(aline,str) == 1){
+            sscanf(aline,"%s %d", dummy, &WriteCSV);
+            continue;
+        }
+        str = "LiveMode ";
+        if (StartsWith(aline,str) == 1){
+            sscanf(aline,"%s %d", dummy, &LiveMode);
+            continue;
+        }
+        str = "LiveShm ";
+        if (StartsWith(aline,str) == 1){
+            sscanf(aline,"%s %s", dummy, LiveShm);
+            continue;
+        }
+        str = "LiveSlots ";
+        if (StartsWith(aline,str) == 1){
+            sscanf(aline,"%s %d", dummy, &LiveSlots);
+            if (LiveSlots < 1) LiveSlots = 1;
+            continue;
+        }
+        str = "LivePollMs ";
+        if (StartsWith(aline,str) == 1){
+            sscanf(aline,"%s %d", dummy, &LivePollMs);
+            if (LivePollMs < 1) LivePollMs = 1;
+            continue;
+        }
+        str = "LiveTimeout ";
+        if (StartsWith(aline,str) == 1){
+            sscanf(aline,"%s %lf", dummy, &LiveTimeout);
+            continue;
+        }
         str = "SumImages ";
         if (StartsWith(aline,str) == 1){
 			sumImages=1;
@@ -423,18 +821,18 @@ int main(int argc, char **argv)
         else if (TransOpt[i] == 1) printf("Flip Left Right.\n");
         else if (TransOpt[i] == 2) printf("Flip Top Bottom.\n");
     }
-	double *Image;
-	pixelvalue *ImageIn;
 	pixelvalue *DarkIn;
 	pixelvalue *ImageInT;
-	pixelvalue *DarkInT;
 	double *AverageDark;
 	DarkIn = malloc(NrPixelsY*NrPixelsZ*sizeof(*DarkIn));
-	DarkInT = malloc(NrPixelsY*NrPixelsZ*sizeof(*DarkInT));
 	AverageDark = calloc(NrPixelsY*NrPixelsZ,sizeof(*AverageDark));
-	ImageIn = malloc(NrPixelsY*NrPixelsZ*sizeof(*ImageIn));
 	ImageInT = malloc(NrPixelsY*NrPixelsZ*sizeof(*ImageInT));
-	Image = malloc(NrPixelsY*NrPixelsZ*sizeof(*Image));
+	// Frames are NrPixelsZ rows of NrPixelsY. Dark frames are read and
+	// transformed in one pass, TIFF ones come through ImageInT as doubles.
+	int TransMap[6];
+	ImageTransformMap(NrTransOpt,TransOpt,NrPixelsZ,NrPixelsY,TransMap);
+	const void *Frame = ImageInT;
+	int FrameType = 2;
 	size_t pxSize;
 	if (dType == 1){ // Uint16
 		pxSize = sizeof(uint16_t);
@@ -458,20 +856,30 @@ int main(int argc, char **argv)
 	size_t sz;
 	int Skip = HeadSize;
 	FILE *fp, *fd;
+	struct RawFile *Raw = NULL;
 	char *darkFN;
 	int nrdone = 0;
 	if (argc > 3){
 		darkFN = argv[3];
-		fd = fopen(darkFN,"rb");
-		fseek(fd,0L,SEEK_END);
-		sz = ftell(fd);
-		rewind(fd);
-		nFrames = sz / (SizeFile);
+		if (RawPixelSize(dType) != 0){
+			Raw = RawFileOpen(darkFN,RawPixelSize(dType),NrPixelsY*NrPixelsZ,Skip,0);
+			if (Raw == NULL) return 1;
+			nFrames = RawFileNrFrames(Raw);
+		} else {
+			fd = fopen(darkFN,"rb");
+			fseek(fd,0L,SEEK_END);
+			sz = ftell(fd);
+			rewind(fd);
+			nFrames = sz / (SizeFile);
+			fseek(fd,Skip,SEEK_SET);
+		}
 		printf("Reading dark file:      %s, nFrames: %d, skipping first %d bytes.\n",darkFN,nFrames,Skip);
-		fseek(fd,Skip,SEEK_SET);
 		for (i=0;i<nFrames;i++){
-			rc = fileReader(fd,darkFN,dType,NrPixelsY*NrPixelsZ,DarkInT);
-			DoImageTransformations(NrTransOpt,TransOpt,DarkInT,DarkIn,NrPixelsY,NrPixelsZ);
+			if (Raw != NULL){
+				Frame = RawFrame(Raw,i);
+				FrameType = dType;
+			} else rc = fileReader(fd,darkFN,dType,NrPixelsY*NrPixelsZ,ImageInT);
+			CorrectImage(Frame,FrameType,NrPixelsZ,NrPixelsY,NrPixelsZ,NrPixelsY,TransMap,NAN,NULL,NULL,1,NULL,-INFINITY,DarkIn,NULL);
 			if (makeMap == 1){
 				mapMaskSize = NrPixelsY;
 				mapMaskSize *= NrPixelsZ;
@@ -489,6 +897,8 @@ int main(int argc, char **argv)
 			}
 			for(j=0;j<NrPixelsY*NrPixelsZ;j++) AverageDark[j] += (double)DarkIn[j]/nFrames;
 		}
+		RawFileClose(Raw);
+		Raw = NULL;
 		printf("Dark file read\n");
 	}
 	if (makeMap == 2){
@@ -502,7 +912,7 @@ int main(int argc, char **argv)
 		double *mapperOut;
 		mapperOut = calloc(NrPixelsY*NrPixelsZ,sizeof(*mapperOut));
 		fileReader(fd,GapFN,7,NrPixelsY*NrPixelsZ,mapper);
-		DoImageTransformations(NrTransOpt,TransOpt,mapper,mapperOut,NrPixelsY,NrPixelsZ);
+		CorrectImage(mapper,2,NrPixelsZ,NrPixelsY,NrPixelsZ,NrPixelsY,TransMap,NAN,NULL,NULL,1,NULL,-INFINITY,mapperOut,NULL);
 		for (i=0;i<NrPixelsY*NrPixelsZ;i++){
 			if (mapperOut[i] != 0){
 				SetBit(mapMask,i);
@@ -511,7 +921,7 @@ int main(int argc, char **argv)
 			}
 		}
 		fileReader(fd,BadPxFN,7,NrPixelsY*NrPixelsZ,mapper);
-		DoImageTransformations(NrTransOpt,TransOpt,mapper,mapperOut,NrPixelsY,NrPixelsZ);
+		CorrectImage(mapper,2,NrPixelsZ,NrPixelsY,NrPixelsZ,NrPixelsY,TransMap,NAN,NULL,NULL,1,NULL,-INFINITY,mapperOut,NULL);
 		for (i=0;i<NrPixelsY*NrPixelsZ;i++){
 			if (mapperOut[i] != 0){
 				SetBit(mapMask,i);
@@ -523,121 +933,136 @@ int main(int argc, char **argv)
 	}
 	char *imageFN;
 	imageFN = argv[2];
-	fp = fopen(imageFN,"rb");
-	fseek(fp,0L,SEEK_END);
-	sz = ftell(fp);
-	rewind(fp);
-	fseek(fp,Skip,SEEK_SET);
-	nFrames = sz / SizeFile;
+	if (LiveMode == 1){
+		// Frames are counted as they come.
+		nFrames = 0;
+	} else if (RawPixelSize(dType) != 0){
+		Raw = RawFileOpen(imageFN,RawPixelSize(dType),NrPixelsY*NrPixelsZ,Skip,0);
+		if (Raw == NULL) return 1;
+		nFrames = RawFileNrFrames(Raw);
+	} else {
+		fp = fopen(imageFN,"rb");
+		fseek(fp,0L,SEEK_END);
+		sz = ftell(fp);
+		rewind(fp);
+		fseek(fp,Skip,SEEK_SET);
+		nFrames = sz / SizeFile;
+	}
 	printf("Number of eta bins: %d, number of R bins: %d. Number of frames in the file: %d\n",nEtaBins,nRBins,(int)nFrames);
 	long long int Pos;
-	int nPixels, dataPos;
-	struct data ThisVal;
 	char outfn[4096];
 	FILE *out;
 	char outFN1d[4096];
 	FILE *out1d;
-	double Intensity, totArea, ThisInt;
-	size_t testPos;
-	double RMean, EtaMean;
+	double Intensity, totArea;
 	double RM1d,Int1d;
 	int n1ds;
-	double *sumMatrix;
-	if (sumImages == 1){
-		sumMatrix = calloc(nEtaBins*nRBins*5,sizeof(*sumMatrix));
+	char OutStem[4096];
+	if (separateFolder == 0){
+		sprintf(OutStem,"%s",imageFN);
+	} else {
+		char fn2[4096];
+		sprintf(fn2,"%s",imageFN);
+		sprintf(OutStem,"%s/%s",outputFolder,basename(fn2));
 	}
-	for (i=0;i<nFrames;i++){
-		printf("Processing frame number: %d of %d of file %s.\n",i+1,nFrames,imageFN);
-		rc = fileReader(fp,imageFN,dType,NrPixelsY*NrPixelsZ,ImageInT);
-		DoImageTransformations(NrTransOpt,TransOpt,ImageInT,ImageIn,NrPixelsY,NrPixelsZ);
-		for (j=0;j<NrPixelsY*NrPixelsZ;j++){
-			Image[j] = (double)ImageIn[j] - AverageDark[j];
-		}
-		if (separateFolder == 0){
-			sprintf(outfn,"%s_integrated_framenr_%d.csv",imageFN,i);
-			sprintf(outFN1d,"%s_integrated_framenr_%d.1d.csv",imageFN,i);
-		} else {
-			char fn2[4096];
-			sprintf(fn2,"%s",imageFN);
-			char *bname;
-			bname = basename(fn2);
-			sprintf(outfn,"%s/%s_integrated_framenr_%d.csv",outputFolder,bname,i);
-			sprintf(outFN1d,"%s/%s_integrated_framenr_%d.1d.csv",outputFolder,bname,i);
-		}
-		out = fopen(outfn,"w");
-		fprintf(out,"%%nEtaBins:\t%d\tnRBins:\t%d\n%%Radius(px)\t2Theta(degrees)\tEta(degrees)\tIntensity(counts)\tBinArea\n",nEtaBins,nRBins);
-		out1d = fopen(outFN1d,"w");
-		fprintf(out1d,"%%nRBins:\t%d\n%%Radius(px)\t2Theta(degrees)\tIntensity(counts)\n",nRBins);
-		for (j=0;j<nRBins;j++){
-			RMean = (RBinsLow[j]+RBinsHigh[j])/2;
-			Int1d = 0;
-			n1ds = 0;
-			for (k=0;k<nEtaBins;k++){
-				Pos = j*nEtaBins + k;
-				nPixels = nPxList[2*Pos + 0];
-				dataPos = nPxList[2*Pos + 1];
-				Intensity = 0;
-				totArea = 0;
-				for (l=0;l<nPixels;l++){
-					ThisVal = pxList[dataPos + l];
-					testPos = ThisVal.z;
-					testPos *= NrPixelsY;
-					testPos += ThisVal.y;
-					if (mapMaskSize!=0){
-						if (TestBit(mapMask,testPos)){
-							continue;
-						}
-					}
-					ThisInt = Image[testPos]; // The data is arranged as y(fast) and then z(slow)
-					Intensity += ThisInt*ThisVal.frac;
-					totArea += ThisVal.frac;
-				}
-				if (Intensity != 0){
-					if (Normalize == 1){
-						Intensity /= totArea;
-					}
-				}
-				EtaMean = (EtaBinsLow[k]+EtaBinsHigh[k])/2;
-				Int1d += Intensity;
-				n1ds ++;
-				fprintf(out,"%lf\t%lf\t%lf\t%lf\t%lf\n",RMean,atand(RMean*px/Lsd),EtaMean,Intensity,totArea);
-				if (sumImages==1){
-					if (i==0){
-						sumMatrix[j*nEtaBins*5+k*5+0] = RMean;
-						sumMatrix[j*nEtaBins*5+k*5+1] = atand(RMean*px/Lsd);
-						sumMatrix[j*nEtaBins*5+k*5+2] = EtaMean;
-						sumMatrix[j*nEtaBins*5+k*5+4] = totArea;
-					}
-					sumMatrix[j*nEtaBins*5+k*5+3] += Intensity;
+	// Frames are integrated in batches straight from the raw frames.
+	struct TIntegMap IntegMap;
+	BuildIntegMap(&IntegMap,nRBins*nEtaBins,NrPixelsY,NrPixelsZ,TransMap,AverageDark,mapMask,mapMaskSize);
+	size_t nBins = (size_t)nRBins*nEtaBins;
+	double *RMean = malloc(nRBins*sizeof(*RMean));
+	double *TwoTheta = malloc(nRBins*sizeof(*TwoTheta));
+	double *EtaMean = malloc(nEtaBins*sizeof(*EtaMean));
+	for (j=0;j<nRBins;j++){
+		RMean[j] = (RBinsLow[j]+RBinsHigh[j])/2;
+		TwoTheta[j] = atand(RMean[j]*px/Lsd);
+	}
+	for (k=0;k<nEtaBins;k++) EtaMean[k] = (EtaBinsLow[k]+EtaBinsHigh[k])/2;
+	struct IntegCubeHeader CubeHeader = {INTEG_CUBE_MAGIC,INTEG_CUBE_VERSION,nFrames,nRBins,nEtaBins,Normalize,
+		RMin,RBinSize,EtaMin,EtaBinSize,Lsd,px};
+	if (LiveMode == 1){
+		struct TIntegLive Live;
+		if (IntegLiveOpen(&Live,LiveShm,LiveSlots,&CubeHeader,RMean,TwoTheta,EtaMean,IntegMap.Area) != 0) return 1;
+		return IntegrateLive(imageFN,dType,Skip,NrPixelsY,NrPixelsZ,&IntegMap,Normalize,FrameBatch,
+			&Live,LivePollMs,LiveTimeout);
+	}
+	sprintf(outfn,"%s_integrated.bin",OutStem);
+	FILE *Cube = IntegCubeOpen(outfn,&CubeHeader,RMean,TwoTheta,EtaMean,IntegMap.Area);
+	if (Cube == NULL) return 1;
+	printf("Writing %d frames of %d x %d bins to %s.\n",nFrames,nRBins,nEtaBins,outfn);
+	float *CubeFrame = malloc(nBins*sizeof(*CubeFrame));
+	double *SumInt = NULL;
+	if (sumImages == 1) SumInt = calloc(nBins,sizeof(*SumInt));
+	if (FrameBatch > nFrames && nFrames > 0) FrameBatch = nFrames;
+	const void **Frames = malloc(FrameBatch*sizeof(*Frames));
+	double **TiffFrames = NULL;
+	if (Raw == NULL){
+		// TIFF frames are read into doubles, one buffer per frame of a batch.
+		TiffFrames = malloc(FrameBatch*sizeof(*TiffFrames));
+		for (i=0;i<FrameBatch;i++) TiffFrames[i] = malloc((size_t)NrPixelsY*NrPixelsZ*sizeof(**TiffFrames));
+	}
+	double *BinInt = malloc((size_t)FrameBatch*nBins*sizeof(*BinInt));
+	int FirstFrame, nBatch, f;
+	for (FirstFrame=0;FirstFrame<nFrames;FirstFrame+=FrameBatch){
+		nBatch = nFrames-FirstFrame < FrameBatch ? nFrames-FirstFrame : FrameBatch;
+		if (Raw != NULL) RawFrameWillNeed(Raw,FirstFrame+nBatch,FrameBatch);
+		for (f=0;f<nBatch;f++){
+			i = FirstFrame+f;
+			printf("Processing frame number: %d of %d of file %s.\n",i+1,nFrames,imageFN);
+			if (Raw != NULL) Frames[f] = RawFrame(Raw,i);
+			else {
+				rc = fileReader(fp,imageFN,dType,NrPixelsY*NrPixelsZ,TiffFrames[f]);
+				Frames[f] = TiffFrames[f];
+			}
+		}
+		IntegrateBatch(&IntegMap,nBatch,Frames,Raw != NULL ? dType : 2,Normalize,BinInt);
+		for (f=0;f<nBatch;f++){
+			double *FrameInt = BinInt + (size_t)f*nBins;
+			i = FirstFrame+f;
+			if (IntegCubeWriteFrame(Cube,FrameInt,nBins,CubeFrame) != 0){
+				printf("Could not write frame %d to %s.\n",i,outfn);
+				return 1;
+			}
+			if (sumImages == 1) for (Pos=0;Pos<(long long int)nBins;Pos++) SumInt[Pos] += FrameInt[Pos];
+			if (WriteCSV == 0) continue;
+			// The old text output, two files per frame.
+			sprintf(outfn,"%s_integrated_framenr_%d.csv",OutStem,i);
+			sprintf(outFN1d,"%s_integrated_framenr_%d.1d.csv",OutStem,i);
+			out = fopen(outfn,"w");
+			fprintf(out,"%%nEtaBins:\t%d\tnRBins:\t%d\n%%Radius(px)\t2Theta(degrees)\tEta(degrees)\tIntensity(counts)\tBinArea\n",nEtaBins,nRBins);
+			out1d = fopen(outFN1d,"w");
+			fprintf(out1d,"%%nRBins:\t%d\n%%Radius(px)\t2Theta(degrees)\tIntensity(counts)\n",nRBins);
+			for (j=0;j<nRBins;j++){
+				Int1d = 0;
+				n1ds = 0;
+				for (k=0;k<nEtaBins;k++){
+					Pos = j*nEtaBins + k;
+					Intensity = FrameInt[Pos];
+					totArea = IntegMap.Area[Pos];
+					Int1d += Intensity;
+					n1ds ++;
+					fprintf(out,"%lf\t%lf\t%lf\t%lf\t%lf\n",RMean[j],TwoTheta[j],EtaMean[k],Intensity,totArea);
 				}
+				RM1d = RMean[j];
+				Int1d /= n1ds;
+				fprintf(out1d,"%lf\t%lf\t%lf\n",RM1d,TwoTheta[j],Int1d);
 			}
-			RM1d = RMean;
-			Int1d /= n1ds;
-			fprintf(out1d,"%lf\t%lf\t%lf\n",RM1d,atand(RM1d*px/Lsd),Int1d);
+			fclose(out);
+			fclose(out1d);
 		}
-		fclose(out);
-		fclose(out1d);
 	}
+	fclose(Cube);
 	if (sumImages == 1){
 		FILE *sumFile;
 		char sumFN[4096];
-		if (separateFolder == 0){
-			sprintf(sumFN,"%s_sum.csv",imageFN);
-		} else {
-			char fn2[4096];
-			sprintf(fn2,"%s",imageFN);
-			char *bname;
-			bname = basename(fn2);
-			sprintf(sumFN,"%s/%s_sum.csv",outputFolder,bname);
-		}
+		sprintf(sumFN,"%s_sum.csv",OutStem);
 		sumFile = fopen(sumFN,"w");
-		fprintf(sumFile,"%%nEtaBins:\t%d\tnRBins:\t%d\n%%Radius(px)\t2Theta(degrees)\tEta(degrees)\tIntensity(counts)\tBinArea\n");
-		for (i=0;i<nRBins*nEtaBins;i++){
-			for (k=0;k<4;k++)
-				fprintf(sumFile,"%lf\t",sumMatrix[i*5+k]);
-			fprintf(sumFile,"\n");
+		fprintf(sumFile,"%%nEtaBins:\t%d\tnRBins:\t%d\n%%Radius(px)\t2Theta(degrees)\tEta(degrees)\tIntensity(counts)\tBinArea\n",nEtaBins,nRBins);
+		for (j=0;j<nRBins;j++) for (k=0;k<nEtaBins;k++){
+			fprintf(sumFile,"%lf\t%lf\t%lf\t%lf\t\n",RMean[j],TwoTheta[j],EtaMean[k],SumInt[j*nEtaBins+k]);
 		}
+		fclose(sumFile);
 	}
+	RawFileClose(Raw);
 	end0 = clock();
 	diftotal = ((double)(end0-start0))/CLOCKS_PER_SEC;
 	printf("Total time elapsed:\t%f s.\n",diftotal);
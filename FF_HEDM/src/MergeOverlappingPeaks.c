@@ -31,8 +31,28 @@
 #define CalcNorm3(x,y,z) sqrt((x)*(x) + (y)*(y) + (z)*(z))
 #define CalcNorm2(x,y)   sqrt((x)*(x) + (y)*(y))
 #define nOverlapsMaxPerImage 10000
+// _PS.bin written by PeaksFittingPerFile in range mode: a header {uint32 Magic,
+// Version; int32 nCols, RingNr}, then one row of PS_BIN_NCOLS doubles per peak,
+// FrameNr followed by the columns of the _PS.csv.
+#define PS_BIN_MAGIC 0x4e425350
+#define PS_BIN_VERSION 1
+#define PS_BIN_NCOLS 20
 
 int UseMaximaPositions;
+int RangeStartNr, RangeEndNr;
+
+// PeaksFittingPerFile in range mode writes one file for all frames, with the
+// frame number in front of each row. Frames are read in increasing order, so
+// the file is kept open and read once. The binary file is preferred over the
+// csv. One per ring, rings are merged in parallel.
+struct TRangeInput {
+	FILE *RangeFile;
+	char RangeLine[1000];
+	int RangeLinePending;
+	FILE *RangeBin;
+	double RangeRow[PS_BIN_NCOLS];
+	int RangeRowPending;
+};
 
 static inline
 double CalcEtaAngle(double y, double z){
@@ -160,33 +180,99 @@ static inline int CheckDirectoryCreation(char Folder[1024],char FileStem[1024])
 	return 1;
 }
 
-static inline int ReadSortFiles (char OutFolderName[1024], char FileStem[1024], int FileNr, int RingNr, int Padding, double **SortedMatrix)
+static inline FILE *OpenRangeBin(char *FN, int RingNr)
+{
+	uint32_t Header[4];
+	FILE *f = fopen(FN,"rb");
+	if (f == NULL) return NULL;
+	if (fread(Header,sizeof(Header),1,f) != 1 || Header[0] != PS_BIN_MAGIC || Header[1] != PS_BIN_VERSION
+		|| Header[2] != PS_BIN_NCOLS || (int)Header[3] != RingNr){
+		printf("%s is not a peaks file of ring %d, ignoring it.\n",FN,RingNr);
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+static inline int ReadSortFiles (char OutFolderName[1024], char FileStem[1024], int FileNr, int RingNr, int Padding, double **SortedMatrix,
+	struct TRangeInput *In)
 {
 	char aline[1000],dummy[1000];
 	char InFile[1024];
 	sprintf(InFile,"%s/%s_%0*d_%d_PS.csv",OutFolderName,FileStem,Padding,FileNr,RingNr);
     FILE *infileread;
     infileread = fopen(InFile,"r");
-    if (infileread == NULL) printf("Could not read the input file %s\n",InFile);
+    if (infileread == NULL && In->RangeFile == NULL && In->RangeBin == NULL){
+		sprintf(InFile,"%s/%s_%0*d_%0*d_%d_PS.bin",OutFolderName,FileStem,Padding,RangeStartNr,Padding,RangeEndNr,RingNr);
+		In->RangeBin = OpenRangeBin(InFile,RingNr);
+		if (In->RangeBin == NULL){
+			sprintf(InFile,"%s/%s_%0*d_%0*d_%d_PS.csv",OutFolderName,FileStem,Padding,RangeStartNr,Padding,RangeEndNr,RingNr);
+			In->RangeFile = fopen(InFile,"r");
+			if (In->RangeFile != NULL) fgets(In->RangeLine,1000,In->RangeFile);
+		}
+	}
+    if (infileread == NULL && In->RangeFile == NULL && In->RangeBin == NULL) printf("Could not read the input file %s\n",InFile);
     struct InputData *MyData;
     MyData = malloc(nOverlapsMaxPerImage*sizeof(*MyData));
     int counter = 0;
-    fgets(aline,1000,infileread);
+    if (infileread != NULL) fgets(aline,1000,infileread);
     double SpotID,IntegratedIntensity,Omega,YCen,ZCen,IMax,Radius,Eta,NumberOfPixels,maxY,maxZ;
-    while (fgets(aline,1000,infileread)!=NULL){
-		sscanf(aline,"%lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %s %lf %lf",
-					&(MyData[counter].SpotID), &(MyData[counter].IntegratedIntensity), &(MyData[counter].Omega),
-					&(MyData[counter].YCen), &(MyData[counter].ZCen), &(MyData[counter].IMax), &(MyData[counter].Radius),
-					&(MyData[counter].Eta), &(MyData[counter].SigmaR), &(MyData[counter].SigmaEta), &(MyData[counter].NrPx),
-					&(MyData[counter].NrPxTot),dummy,&maxY,&maxZ);
-		printf("%s %lf %lf \n",aline,maxY,maxZ);
+    char *thisLine;
+    int FrameNr, nChars;
+    while (counter < nOverlapsMaxPerImage){
+		if (infileread == NULL && In->RangeBin != NULL){
+			double *Row = In->RangeRow;
+			if (In->RangeRowPending == 0 && fread(Row,sizeof(In->RangeRow),1,In->RangeBin) != 1) break;
+			In->RangeRowPending = 0;
+			if ((int)Row[0] < FileNr) continue;
+			if ((int)Row[0] > FileNr){
+				In->RangeRowPending = 1;
+				break;
+			}
+			MyData[counter].SpotID = Row[1];
+			MyData[counter].IntegratedIntensity = Row[2];
+			MyData[counter].Omega = Row[3];
+			MyData[counter].YCen = Row[4];
+			MyData[counter].ZCen = Row[5];
+			MyData[counter].IMax = Row[6];
+			MyData[counter].Radius = Row[7];
+			MyData[counter].Eta = Row[8];
+			MyData[counter].SigmaR = Row[9];
+			MyData[counter].SigmaEta = Row[10];
+			MyData[counter].NrPx = Row[11];
+			MyData[counter].NrPxTot = Row[12];
+			maxY = Row[14];
+			maxZ = Row[15];
+		} else {
+			if (infileread != NULL){
+				if (fgets(aline,1000,infileread) == NULL) break;
+				thisLine = aline;
+			} else {
+				if (In->RangeFile == NULL) break;
+				if (In->RangeLinePending == 0 && fgets(In->RangeLine,1000,In->RangeFile) == NULL) break;
+				In->RangeLinePending = 0;
+				if (sscanf(In->RangeLine,"%d%n",&FrameNr,&nChars) != 1) continue;
+				if (FrameNr < FileNr) continue;
+				if (FrameNr > FileNr){
+					In->RangeLinePending = 1;
+					break;
+				}
+				thisLine = In->RangeLine + nChars;
+			}
+			sscanf(thisLine,"%lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %s %lf %lf",
+						&(MyData[counter].SpotID), &(MyData[counter].IntegratedIntensity), &(MyData[counter].Omega),
+						&(MyData[counter].YCen), &(MyData[counter].ZCen), &(MyData[counter].IMax), &(MyData[counter].Radius),
+						&(MyData[counter].Eta), &(MyData[counter].SigmaR), &(MyData[counter].SigmaEta), &(MyData[counter].NrPx),
+						&(MyData[counter].NrPxTot),dummy,&maxY,&maxZ);
+		}
 		if (UseMaximaPositions==1){
 			MyData[counter].YCen = maxY;
 			MyData[counter].ZCen = maxZ;
 		}
 		counter++;
 	}
-	fclose(infileread);
+	if (counter == nOverlapsMaxPerImage) printf("Frame %d has more than %d peaks, the rest is ignored.\n",FileNr,nOverlapsMaxPerImage);
+	if (infileread != NULL) fclose(infileread);
     qsort(MyData, counter, sizeof(struct InputData), cmpfunc);
     int i,j,counter2=0;
     for (i=0;i<counter;i++){
@@ -211,93 +297,72 @@ static inline int ReadSortFiles (char OutFolderName[1024], char FileStem[1024],
     return counter2;
 }
 
-int main(int argc, char *argv[]){
-	if (argc != 3){
-		printf("Usage:\n MergeOverlappingPeaks params.txt ringNr\n");
-		return 1;
-	}
-	clock_t start, end;
-    double diftotal;
-    start = clock();
-    // Read params file.
-    char *ParamFN;
-    FILE *fileParam;
-    ParamFN = argv[1];
-    int RingNr = atoi(argv[2]);
-    printf("Arguments: %s %s\n",argv[1],argv[2]);
-    fflush(stdout);
-    char aline[1000], *str, dummy[1000];
-    fileParam = fopen(ParamFN,"r");
-    if (fileParam == NULL){
-		printf("Could not read file %s\n",ParamFN);
-		return 1;
-	}
-    int LowNr = 1;
-    char Folder[1024], FileStem[1024],*TmpFolder,fs[1024];
-    int LayerNr;
-    int StartNr, EndNr, Padding=6;
-    TmpFolder = "Temp";
-	double MarginOmegaOverlap = sqrt(4);
-	UseMaximaPositions = 0;
-    while (fgets(aline,1000,fileParam)!=NULL){
-        str = "Folder ";
-        LowNr = strncmp(aline,str,strlen(str));
-        if (LowNr==0){
-            sscanf(aline,"%s %s", dummy, Folder);
-            continue;
-        }
-        str = "FileStem ";
-        LowNr = strncmp(aline,str,strlen(str));
-        if (LowNr==0){
-            sscanf(aline,"%s %s", dummy, fs);
-            continue;
-        }
-        str = "Padding ";
-        LowNr = strncmp(aline,str,strlen(str));
-        if (LowNr==0){
-            sscanf(aline,"%s %d", dummy, &Padding);
-            continue;
-        }
-        str = "LayerNr ";
-        LowNr = strncmp(aline,str,strlen(str));
-        if (LowNr==0){
-            sscanf(aline,"%s %d", dummy, &LayerNr);
-            continue;
-        }
-        str = "StartNr ";
-        LowNr = strncmp(aline,str,strlen(str));
-        if (LowNr==0){
-            sscanf(aline,"%s %d", dummy, &StartNr);
-            continue;
-        }
-        str = "EndNr ";
-        LowNr = strncmp(aline,str,strlen(str));
-        if (LowNr==0){
-            sscanf(aline,"%s %d", dummy, &EndNr);
-            continue;
-        }
-        str = "OverlapLength ";
-        LowNr = strncmp(aline,str,strlen(str));
-        if (LowNr==0){
-            sscanf(aline,"%s %lf", dummy, &MarginOmegaOverlap);
-            continue;
-        }
-        str = "UseMaximaPositions ";
-        LowNr = strncmp(aline,str,strlen(str));
-        if (LowNr==0){
-            sscanf(aline,"%s %d", dummy, &UseMaximaPositions);
-            continue;
-        }
+// Buckets of the points (M[i][cy],M[i][cz]) on a grid with cells of at least
+// Margin, so all points closer than Margin to a position are in the 3x3 cells
+// around it. Points of a cell are kept in increasing index order.
+struct TGrid {
+	double YMin, ZMin, Cell;
+	int nY, nZ;
+	int *CellStart;
+	int *Items;
+};
+
+static inline int GridCell(struct TGrid *G, double y, double z, int *iy, int *iz)
+{
+	*iy = (int)floor((y-G->YMin)/G->Cell);
+	*iz = (int)floor((z-G->ZMin)/G->Cell);
+	if (*iy < 0) *iy = 0;
+	if (*iz < 0) *iz = 0;
+	if (*iy >= G->nY) *iy = G->nY-1;
+	if (*iz >= G->nZ) *iz = G->nZ-1;
+	return (*iy)*G->nZ + (*iz);
+}
+
+static void GridBuild(struct TGrid *G, double **M, int n, int cy, int cz, double Margin)
+{
+	int i, c, iy, iz;
+	double YMax = 0, ZMax = 0;
+	G->YMin = 0;
+	G->ZMin = 0;
+	for (i=0;i<n;i++){
+		if (i == 0 || M[i][cy] < G->YMin) G->YMin = M[i][cy];
+		if (i == 0 || M[i][cz] < G->ZMin) G->ZMin = M[i][cz];
+		if (i == 0 || M[i][cy] > YMax) YMax = M[i][cy];
+		if (i == 0 || M[i][cz] > ZMax) ZMax = M[i][cz];
 	}
-	sprintf(FileStem,"%s_%d",fs,LayerNr);
-	fclose(fileParam);
+	// About one point per cell, but never cells smaller than Margin.
+	G->Cell = sqrt(((YMax-G->YMin+1)*(ZMax-G->ZMin+1))/(n+1));
+	if (G->Cell < Margin) G->Cell = Margin;
+	if (G->Cell <= 0) G->Cell = 1;
+	G->nY = (int)((YMax-G->YMin)/G->Cell) + 1;
+	G->nZ = (int)((ZMax-G->ZMin)/G->Cell) + 1;
+	G->CellStart = calloc(G->nY*G->nZ+1,sizeof(*G->CellStart));
+	G->Items = malloc((n+1)*sizeof(*G->Items));
+	for (i=0;i<n;i++) G->CellStart[GridCell(G,M[i][cy],M[i][cz],&iy,&iz)+1]++;
+	for (c=0;c<G->nY*G->nZ;c++) G->CellStart[c+1] += G->CellStart[c];
+	for (i=0;i<n;i++) G->Items[G->CellStart[GridCell(G,M[i][cy],M[i][cz],&iy,&iz)]++] = i;
+	for (c=G->nY*G->nZ;c>0;c--) G->CellStart[c] = G->CellStart[c-1];
+	G->CellStart[0] = 0;
+}
+
+static void GridFree(struct TGrid *G)
+{
+	free(G->CellStart);
+	free(G->Items);
+}
+
+// Merge the peaks of all frames of one ring into
+// PeakSearch/FileStem/Result_StartNr_..._EndNr_..._RingNr_....csv.
+static int MergeRing(char *Folder, char *FileStem, int StartNr, int EndNr, int Padding, int RingNr, double MarginOmegaOverlap)
+{
 	int TotNrFiles = EndNr - StartNr + 1, i,j,k;
-	int nFilesMax = 50;
     char OutFolderName[1024];
-    char OutFileName[1024];
-    sprintf(OutFolderName,"%s/%s",Folder,TmpFolder);
+    char OutFileName[2048];
+    sprintf(OutFolderName,"%s/%s",Folder,"Temp");
     char header[1024] = "SpotID IntegratedIntensity Omega(degrees) YCen(px) ZCen(px)"
 					" IMax MinOme(degrees) MaxOme(degress) SigmaR SigmaEta NrPx NrPxTot\n";
+	struct TRangeInput In;
+	memset(&In,0,sizeof(In));
 
     // Read first file
     fflush(stdout);
@@ -307,7 +372,7 @@ int main(int argc, char *argv[]){
 	NewIDs = allocMatrix(nOverlapsMaxPerImage,12);
 	CurrentIDs = allocMatrix(nOverlapsMaxPerImage,16);
 	TempIDs = allocMatrix(nOverlapsMaxPerImage,16);
-    nSpots = ReadSortFiles(OutFolderName,FileStem,FileNr,RingNr,Padding,NewIDs);
+    nSpots = ReadSortFiles(OutFolderName,FileStem,FileNr,RingNr,Padding,NewIDs,&In);
     for (i=0;i<nSpots;i++){
 		CurrentIDs[i][0] = NewIDs[i][0];              // SpotID
 		CurrentIDs[i][1] = NewIDs[i][1];              // IntegratedIntensity
@@ -326,14 +391,18 @@ int main(int argc, char *argv[]){
 		CurrentIDs[i][14] = NewIDs[i][10];			  // NrPx
 		CurrentIDs[i][15] = NewIDs[i][11];			  // NrPxTot
 	}
-    int e = CheckDirectoryCreation(Folder,FileStem);
-    if (e ==0) return 1;
     sprintf(OutFileName,"%s/PeakSearch/%s/Result_StartNr_%d_EndNr_%d_RingNr_%d.csv",Folder,FileStem,StartNr,EndNr,RingNr);
 	FILE *OutFile;
 	OutFile = fopen(OutFileName,"w");
+	if (OutFile == NULL){
+		printf("Could not write %s.\n",OutFileName);
+		return 1;
+	}
 	fprintf(OutFile,"%s",header);
 	double diffLen,yThis,zThis,minLen,yFwd,zFwd,diffLenFwd;
 	int *TempIDsCurrent,*TempIDsNew,BestID,IDFound;
+	int iy, iz, cy, cz, c, m;
+	struct TGrid NewGrid, CurrentGrid;
 	TempIDsCurrent = malloc(nOverlapsMaxPerImage*sizeof(*TempIDsCurrent));
 	TempIDsNew = malloc(nOverlapsMaxPerImage*sizeof(*TempIDsNew));
 	memset(TempIDsCurrent,0,nOverlapsMaxPerImage*sizeof(*TempIDsCurrent));
@@ -347,36 +416,55 @@ int main(int argc, char *argv[]){
 		}
 	}else{ // If there are multiple files:
 		for (FileNr=(StartNr+1);FileNr<=EndNr;FileNr++){
-			nSpotsNew = ReadSortFiles(OutFolderName,FileStem,FileNr,RingNr,Padding,NewIDs);
+			nSpotsNew = ReadSortFiles(OutFolderName,FileStem,FileNr,RingNr,Padding,NewIDs,&In);
 			fflush(stdout);
+			// Only spots closer than MarginOmegaOverlap can pair up, look them up
+			// in grids instead of going through all spots of the other frame.
+			GridBuild(&NewGrid,NewIDs,nSpotsNew,3,4,MarginOmegaOverlap);
+			GridBuild(&CurrentGrid,CurrentIDs,nSpots,8,9,MarginOmegaOverlap);
 			for (i=0;i<nSpots;i++){
 				minLen = 10000000;
 				IDFound = 0;
+				BestID = -1;
 				yThis = CurrentIDs[i][8];
 				zThis = CurrentIDs[i][9];
-				for (j=0;j<nSpotsNew;j++){ // Try to find the smallest difference in Y,Z.
-					if (TempIDsNew[j]!=1){
-						diffLen = CalcNorm2(NewIDs[j][3]-yThis,NewIDs[j][4]-zThis);
-						if (diffLen < MarginOmegaOverlap && diffLen<minLen){
-							minLen = diffLen;
-							BestID = j;
-							IDFound = 1;
+				GridCell(&NewGrid,yThis,zThis,&iy,&iz);
+				for (cy=iy-1;cy<=iy+1;cy++) for (cz=iz-1;cz<=iz+1;cz++){ // Try to find the smallest difference in Y,Z.
+					if (cy < 0 || cy >= NewGrid.nY || cz < 0 || cz >= NewGrid.nZ) continue;
+					c = cy*NewGrid.nZ + cz;
+					for (m=NewGrid.CellStart[c];m<NewGrid.CellStart[c+1];m++){
+						j = NewGrid.Items[m];
+						if (TempIDsNew[j]!=1){
+							diffLen = CalcNorm2(NewIDs[j][3]-yThis,NewIDs[j][4]-zThis);
+							// Ties go to the first spot, as in a scan over all of them.
+							if (diffLen < MarginOmegaOverlap && (diffLen<minLen || (diffLen == minLen && j < BestID))){
+								minLen = diffLen;
+								BestID = j;
+								IDFound = 1;
+							}
 						}
 					}
 				}
 				if (IDFound == 1){ // If a candidate for overlapping has been detected, check if it is the best pair.
 					yFwd = NewIDs[BestID][3];
 					zFwd = NewIDs[BestID][4];
-					for (k=0;k<nSpots;k++){
-						if (k!=i && TempIDsCurrent[k]!=1){
-							diffLenFwd = CalcNorm2(CurrentIDs[k][8]-yFwd,CurrentIDs[k][9]-zFwd);
-							if (diffLenFwd < minLen){
-								IDFound = 0;
-								break;
+					GridCell(&CurrentGrid,yFwd,zFwd,&iy,&iz);
+					for (cy=iy-1;cy<=iy+1 && IDFound == 1;cy++) for (cz=iz-1;cz<=iz+1 && IDFound == 1;cz++){
+						if (cy < 0 || cy >= CurrentGrid.nY || cz < 0 || cz >= CurrentGrid.nZ) continue;
+						c = cy*CurrentGrid.nZ + cz;
+						for (m=CurrentGrid.CellStart[c];m<CurrentGrid.CellStart[c+1];m++){
+							k = CurrentGrid.Items[m];
+							if (k!=i && TempIDsCurrent[k]!=1){
+								diffLenFwd = CalcNorm2(CurrentIDs[k][8]-yFwd,CurrentIDs[k][9]-zFwd);
+								if (diffLenFwd < minLen){
+									IDFound = 0;
+									break;
+								}
 							}
 						}
 					}
 				}
+
 				if (IDFound == 1){ // If the best pair for overlapping was found, update current IDs.
 					TempIDsCurrent[i] = 1;
 					TempIDsNew[BestID] = 1;
@@ -413,11 +501,6 @@ int main(int argc, char *argv[]){
 							(CurrentIDs[i][3]/CurrentIDs[i][1]),(CurrentIDs[i][4]/CurrentIDs[i][1]),
 							CurrentIDs[i][5],CurrentIDs[i][10],CurrentIDs[i][11],CurrentIDs[i][12],
 							CurrentIDs[i][13],CurrentIDs[i][14],CurrentIDs[i][15]);
-					printf("Written: %d %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",SpotIDNr,
-							CurrentIDs[i][1],(CurrentIDs[i][2]/CurrentIDs[i][1]),
-							(CurrentIDs[i][3]/CurrentIDs[i][1]),(CurrentIDs[i][4]/CurrentIDs[i][1]),
-							CurrentIDs[i][5],CurrentIDs[i][10],CurrentIDs[i][11],CurrentIDs[i][12],
-							CurrentIDs[i][13],CurrentIDs[i][14],CurrentIDs[i][15]);
 					SpotIDNr++;
 				}
 			}
@@ -465,6 +548,8 @@ int main(int argc, char *argv[]){
 					CurrentIDs[i][j] = TempIDs[i][j];
 				}
 			}
+			GridFree(&NewGrid);
+			GridFree(&CurrentGrid);
 			nSpots = nSpotsNew;
 			memset(TempIDsCurrent,0,nOverlapsMaxPerImage*sizeof(*TempIDsCurrent));
 			memset(TempIDsNew,0,nOverlapsMaxPerImage*sizeof(*TempIDsNew));
@@ -476,21 +561,113 @@ int main(int argc, char *argv[]){
 				(CurrentIDs[i][3]/CurrentIDs[i][1]),(CurrentIDs[i][4]/CurrentIDs[i][1]),
 				CurrentIDs[i][5],CurrentIDs[i][10],CurrentIDs[i][11],CurrentIDs[i][12],
 				CurrentIDs[i][13],CurrentIDs[i][14],CurrentIDs[i][15]);
-		printf("Written %d %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",SpotIDNr,
-				CurrentIDs[i][1],(CurrentIDs[i][2]/CurrentIDs[i][1]),
-				(CurrentIDs[i][3]/CurrentIDs[i][1]),(CurrentIDs[i][4]/CurrentIDs[i][1]),
-				CurrentIDs[i][5],CurrentIDs[i][10],CurrentIDs[i][11],CurrentIDs[i][12],
-				CurrentIDs[i][13],CurrentIDs[i][14],CurrentIDs[i][15]);
 		SpotIDNr++;
 	}
-	printf("Total spots: %d\n",SpotIDNr-1);
+	printf("Ring %d, total spots: %d\n",RingNr,SpotIDNr-1);
+	fclose(OutFile);
+	if (In.RangeFile != NULL) fclose(In.RangeFile);
+	if (In.RangeBin != NULL) fclose(In.RangeBin);
 	FreeMemMatrix(NewIDs,nOverlapsMaxPerImage);
 	FreeMemMatrix(CurrentIDs,nOverlapsMaxPerImage);
 	FreeMemMatrix(TempIDs,nOverlapsMaxPerImage);
 	free(TempIDsCurrent);
 	free(TempIDsNew);
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+	if (argc < 3){
+		printf("Usage:\n MergeOverlappingPeaks params.txt ringNr [ringNr ...]\n"
+			"Several rings are merged in parallel, one output file each.\n");
+		return 1;
+	}
+	clock_t start, end;
+    double diftotal;
+    start = clock();
+    // Read params file.
+    char *ParamFN;
+    FILE *fileParam;
+    ParamFN = argv[1];
+    int nRings = argc - 2, RingNr;
+    printf("Arguments:");
+    for (RingNr=1;RingNr<argc;RingNr++) printf(" %s",argv[RingNr]);
+    printf("\n");
+    fflush(stdout);
+    char aline[1000], *str, dummy[1000];
+    fileParam = fopen(ParamFN,"r");
+    if (fileParam == NULL){
+		printf("Could not read file %s\n",ParamFN);
+		return 1;
+	}
+    int LowNr = 1;
+    char Folder[1024], FileStem[1024],fs[1024];
+    int LayerNr;
+    int StartNr, EndNr, Padding=6;
+	double MarginOmegaOverlap = sqrt(4);
+	UseMaximaPositions = 0;
+    while (fgets(aline,1000,fileParam)!=NULL){
+        str = "Folder ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, Folder);
+            continue;
+        }
+        str = "FileStem ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, fs);
+            continue;
+        }
+        str = "Padding ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %d", dummy, &Padding);
+            continue;
+        }
+        str = "LayerNr ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %d", dummy, &LayerNr);
+            continue;
+        }
+        str = "StartNr ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %d", dummy, &StartNr);
+            continue;
+        }
+        str = "EndNr ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %d", dummy, &EndNr);
+            continue;
+        }
+        str = "OverlapLength ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %lf", dummy, &MarginOmegaOverlap);
+            continue;
+        }
+        str = "UseMaximaPositions ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %d", dummy, &UseMaximaPositions);
+            continue;
+        }
+	}
+	sprintf(FileStem,"%s_%d",fs,LayerNr);
+	fclose(fileParam);
+	RangeStartNr = StartNr;
+	RangeEndNr = EndNr;
+    int e = CheckDirectoryCreation(Folder,FileStem);
+    if (e ==0) return 1;
+	int r, rc = 0;
+	# pragma omp parallel for schedule(dynamic,1) reduction(|:rc)
+	for (r=0;r<nRings;r++){
+		rc |= MergeRing(Folder,FileStem,StartNr,EndNr,Padding,atoi(argv[r+2]),MarginOmegaOverlap);
+	}
     end = clock();
 	diftotal = ((double)(end-start))/CLOCKS_PER_SEC;
     printf("Time elapsed: %f s.\n",diftotal);
-    return 0;
+    return rc;
 }
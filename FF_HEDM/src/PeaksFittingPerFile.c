@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <omp.h>
 
 #define deg2rad 0.0174532925199433
 #define rad2deg 57.2957795130823
@@ -34,6 +35,13 @@
 #define CalcNorm3(x,y,z) sqrt((x)*(x) + (y)*(y) + (z)*(z))
 #define CalcNorm2(x,y) sqrt((x)*(x) + (y)*(y))
 typedef uint16_t pixelvalue;
+#define N_FRAME_BUFFERS 2
+// Range mode also writes the peaks to a _PS.bin file for MergeOverlappingPeaks:
+// a header {uint32 Magic, Version; int32 nCols, RingNr} and then one row of
+// PS_BIN_NCOLS doubles per peak, FrameNr followed by the columns of the csv.
+#define PS_BIN_MAGIC 0x4e425350
+#define PS_BIN_VERSION 1
+#define PS_BIN_NCOLS 20
 
 long double diff(struct timespec start, struct timespec end)
 {
@@ -42,36 +50,6 @@ long double diff(struct timespec start, struct timespec end)
 	return (diff_sec * 1e6) + (diff_nsec / 1000.0);
 }
 
-static inline
-pixelvalue**
-allocMatrixPX(int nrows, int ncols)
-{
-    pixelvalue** arr;
-    int i;
-    arr = malloc(nrows * sizeof(*arr));
-    if (arr == NULL ) {
-        return NULL;
-    }
-    for ( i = 0 ; i < nrows ; i++) {
-        arr[i] = malloc(ncols * sizeof(*arr[i]));
-        if (arr[i] == NULL ) {
-            return NULL;
-        }
-    }
-    return arr;
-}
-
-static inline
-void
-FreeMemMatrixPx(pixelvalue **mat,int nrows)
-{
-    int r;
-    for ( r = 0 ; r < nrows ; r++) {
-        free(mat[r]);
-    }
-    free(mat);
-}
-
 static inline
 double CalcEtaAngle(double y, double z){
 	double alpha = rad2deg*acos(z/sqrt(y*y+z*z));
@@ -155,52 +133,9 @@ static inline double asind(double x){return rad2deg*(asin(x));}
 static inline double acosd(double x){return rad2deg*(acos(x));}
 static inline double atand(double x){return rad2deg*(atan(x));}
 
-static inline void Transposer (double *x, int n, double *y)
-{
-	int i,j;
-	for (i=0;i<n;i++){
-		for (j=0;j<n;j++){
-			y[(i*n)+j] = x[(j*n)+i];
-		}
-	}
-}
-
 const int dx[] = {+1,  0, -1,  0, +1, -1, +1, -1};
 const int dy[] = { 0, +1,  0, -1, +1, +1, -1, -1};
 
-static inline void DepthFirstSearch(int x, int y, int current_label, int NrPixels, int **BoolImage, int **ConnectedComponents,int **Positions, int *PositionTrackers)
-{
-	if (x < 0 || x == NrPixels) return;
-	if (y < 0 || y == NrPixels) return;
-	if ((ConnectedComponents[x][y]!=0)||(BoolImage[x][y]==0)) return;
-
-	ConnectedComponents[x][y] = current_label;
-	Positions[current_label][PositionTrackers[current_label]] = (x*NrPixels) + y;
-	PositionTrackers[current_label] += 1;
-	int direction;
-	for (direction=0;direction<8;++direction){
-		DepthFirstSearch(x + dx[direction], y + dy[direction], current_label, NrPixels, BoolImage, ConnectedComponents,Positions,PositionTrackers);
-	}
-}
-
-static inline int FindConnectedComponents(int **BoolImage, int NrPixels, int **ConnectedComponents, int **Positions, int *PositionTrackers){
-	int i,j;
-	for (i=0;i<NrPixels;i++){
-		for (j=0;j<NrPixels;j++){
-			ConnectedComponents[i][j] = 0;
-		}
-	}
-	int component = 0;
-	for (i=0;i<NrPixels;++i) {
-		for (j=0;j<NrPixels;++j) {
-			if ((ConnectedComponents[i][j]==0) && (BoolImage[i][j] == 1)){
-				DepthFirstSearch(i,j,++component,NrPixels,BoolImage,ConnectedComponents,Positions,PositionTrackers);
-			}
-		}
-	}
-	return component;
-}
-
 static inline unsigned FindRegionalMaxima(double *z,int **PixelPositions,
 		int NrPixelsThisRegion,int **MaximaPositions,double *MaximaValues,
 		int *IsSaturated, double IntSat)
@@ -246,6 +181,17 @@ static inline unsigned FindRegionalMaxima(double *z,int **PixelPositions,
 	return nPeaks;
 }
 
+// PseudoVoigtKernels.c
+int PseudoVoigtKernelSelect(char *Name);
+double PseudoVoigtResidual(int nPeaks, int NrPixels, const double *z, const double *Rs, const double *Etas, const double *x);
+double *PseudoVoigtJacobianAlloc(int nPeaks);
+double PseudoVoigtNormalEquationsSIMD(int nPeaks, int NrPixels, const double *z, const double *Rs, const double *Etas,
+	const double *x, double *JtJ, double *Jtr, double MinShape, double *J, int *ActivePeaks);
+
+// PeakFitKernel scalar keeps the plain C model below, used to check the
+// vectorised kernels.
+int UseScalarKernel = 0;
+
 struct func_data{
 	int NrPixels;
 	double *z;
@@ -268,6 +214,7 @@ double problem_function(
 	Etas = &(f_data->Etas[0]);
 	int nPeaks, i,j,k;
 	nPeaks = (n-1)/8;
+	if (UseScalarKernel == 0) return PseudoVoigtResidual(nPeaks,NrPixels,z,Rs,Etas,x);
 	double BG = x[0];
 	double IMAX[nPeaks], R[nPeaks], Eta[nPeaks], Mu[nPeaks], SigmaGR[nPeaks], SigmaLR[nPeaks], SigmaGEta[nPeaks],SigmaLEta[nPeaks];
 	for (i=0;i<nPeaks;i++){
@@ -338,6 +285,224 @@ static inline void CalcIntegratedIntensity(int nPeaks,double *x,double *Rs,doubl
 	}
 }
 
+// Fit2DPeaks uses Levenberg-Marquardt unless UseNelderMead is set in the
+// parameter file.
+int UseNelderMead = 0;
+
+#define LM_MAX_ITER 200
+#define LM_FTOL 1e-10
+#define LM_XTOL 1e-10
+#define LM_MIN_SHAPE 1e-10
+#define LM_BOUND_FRAC 0.5
+#define LM_BOUND_SNAP 1e-6
+#define LM_LAMBDA0 1
+
+// Sum of squared residuals of the pseudo-Voigt model together with J^T J and
+// J^T r, all in one pass over the pixels. Peaks whose shape is negligible at a
+// pixel do not contribute to that pixel's Jacobian row. With a Jacobian block
+// J from PseudoVoigtJacobianAlloc the vectorised kernel does the work.
+static double PseudoVoigtNormalEquations(int nPeaks, int NrPixels, double *z, double *Rs, double *Etas,
+	const double *x, double *JtJ, double *Jtr, double *Jrow, int *ActivePeaks, double *J)
+{
+	int n = 1 + (8*nPeaks);
+	int i, j, k, l, m, nActive, row, col;
+	double Cost = 0, r;
+	double IMax, DR, DE, Mu, SGR, SLR, SGE, SLE, a, b, L, G, Shape, ML, MG, *d;
+	if (J != NULL) return PseudoVoigtNormalEquationsSIMD(nPeaks,NrPixels,z,Rs,Etas,x,JtJ,Jtr,LM_MIN_SHAPE,J,ActivePeaks);
+	memset(JtJ,0,n*n*sizeof(*JtJ));
+	memset(Jtr,0,n*sizeof(*Jtr));
+	for (i=0;i<NrPixels;i++){
+		r = x[0] - z[i];
+		Jrow[0] = 1;
+		nActive = 0;
+		for (j=0;j<nPeaks;j++){
+			IMax = x[(8*j)+1];
+			DR = Rs[i] - x[(8*j)+2];
+			DE = Etas[i] - x[(8*j)+3];
+			Mu = x[(8*j)+4];
+			SGR = x[(8*j)+5];
+			SLR = x[(8*j)+6];
+			SGE = x[(8*j)+7];
+			SLE = x[(8*j)+8];
+			a = (DR*DR)/(SLR*SLR);
+			b = (DE*DE)/(SLE*SLE);
+			L = 1/((a+1)*(b+1));
+			G = exp(-(0.5*(DR*DR)/(SGR*SGR))-(0.5*(DE*DE)/(SGE*SGE)));
+			Shape = (Mu*L) + ((1-Mu)*G);
+			r += IMax*Shape;
+			if (Shape < LM_MIN_SHAPE) continue;
+			ML = IMax*Mu*L;
+			MG = IMax*(1-Mu)*G;
+			d = &Jrow[(8*j)+1];
+			d[0] = Shape;                                                    // IMax
+			d[1] = (ML*2*DR/(SLR*SLR*(a+1))) + (MG*DR/(SGR*SGR));            // R
+			d[2] = (ML*2*DE/(SLE*SLE*(b+1))) + (MG*DE/(SGE*SGE));            // Eta
+			d[3] = IMax*(L-G);                                               // Mu
+			d[4] = MG*DR*DR/(SGR*SGR*SGR);                                   // SigmaGR
+			d[5] = ML*2*a/(SLR*(a+1));                                       // SigmaLR
+			d[6] = MG*DE*DE/(SGE*SGE*SGE);                                   // SigmaGEta
+			d[7] = ML*2*b/(SLE*(b+1));                                       // SigmaLEta
+			ActivePeaks[nActive++] = j;
+		}
+		Cost += r*r;
+		Jtr[0] += r;
+		JtJ[0] += 1;
+		for (k=0;k<nActive;k++){
+			row = (8*ActivePeaks[k])+1;
+			for (l=0;l<8;l++){
+				Jtr[row+l] += Jrow[row+l]*r;
+				JtJ[(row+l)*n] += Jrow[row+l];
+				for (m=0;m<=k;m++){
+					col = (8*ActivePeaks[m])+1;
+					int lMax = (m == k) ? l+1 : 8, c;
+					for (c=0;c<lMax;c++) JtJ[((row+l)*n)+col+c] += Jrow[row+l]*Jrow[col+c];
+				}
+			}
+		}
+	}
+	for (k=0;k<n;k++) for (l=k+1;l<n;l++) JtJ[(k*n)+l] = JtJ[(l*n)+k];
+	return Cost;
+}
+
+// Solves A x = b in place (x returned in b) for a symmetric positive definite
+// A. Returns 1 if A is not positive definite.
+static int CholeskySolve(int n, double *A, double *b)
+{
+	int i, j, k;
+	double s;
+	for (j=0;j<n;j++){
+		s = A[(j*n)+j];
+		for (k=0;k<j;k++) s -= A[(j*n)+k]*A[(j*n)+k];
+		if (s <= 0) return 1;
+		A[(j*n)+j] = sqrt(s);
+		for (i=j+1;i<n;i++){
+			s = A[(i*n)+j];
+			for (k=0;k<j;k++) s -= A[(i*n)+k]*A[(j*n)+k];
+			A[(i*n)+j] = s/A[(j*n)+j];
+		}
+	}
+	for (i=0;i<n;i++){
+		s = b[i];
+		for (k=0;k<i;k++) s -= A[(i*n)+k]*b[k];
+		b[i] = s/A[(i*n)+i];
+	}
+	for (i=n-1;i>=0;i--){
+		s = b[i];
+		for (k=i+1;k<n;k++) s -= A[(k*n)+i]*b[k];
+		b[i] = s/A[(i*n)+i];
+	}
+	return 0;
+}
+
+// Bounded Levenberg-Marquardt on the pseudo-Voigt model. A step that would
+// cross a bound goes halfway to it instead (snapping once it is close), and
+// parameters sitting on a bound the gradient pushes against are held for that
+// iteration. Damping uses the largest diagonal of J^T J seen so far. Returns
+// nlopt style codes, so the returnCode column keeps its meaning.
+static int FitPseudoVoigtLM(int nPeaks, struct func_data *f_data, double *x, double *xl, double *xu, double *minf)
+{
+	int n = 1 + (8*nPeaks);
+	int i, j, iter, rc = NLOPT_MAXEVAL_REACHED, Accepted;
+	double Cost, TrialCost, Lambda = LM_LAMBDA0, MaxStep, Step;
+	double *JtJ, *A, *Jtr, *Delta, *XTrial, *Jrow, *Scale, *J = NULL;
+	int *Free, *ActivePeaks;
+	JtJ = malloc(n*n*sizeof(*JtJ));
+	A = malloc(n*n*sizeof(*A));
+	Jtr = malloc(n*sizeof(*Jtr));
+	Delta = malloc(n*sizeof(*Delta));
+	XTrial = malloc(n*sizeof(*XTrial));
+	Jrow = malloc(n*sizeof(*Jrow));
+	Scale = malloc(n*sizeof(*Scale));
+	Free = malloc(n*sizeof(*Free));
+	ActivePeaks = malloc(nPeaks*sizeof(*ActivePeaks));
+	// Without the Jacobian block the scalar model is used.
+	if (UseScalarKernel == 0) J = PseudoVoigtJacobianAlloc(nPeaks);
+	if (JtJ == NULL || A == NULL || Jtr == NULL || Delta == NULL || XTrial == NULL || Jrow == NULL
+		|| Scale == NULL || Free == NULL || ActivePeaks == NULL){
+		printf("Could not allocate the fit of %d peaks.\n",nPeaks);
+		Cost = 0;
+		rc = NLOPT_OUT_OF_MEMORY;
+		goto done;
+	}
+	Cost = PseudoVoigtNormalEquations(nPeaks,f_data->NrPixels,f_data->z,f_data->Rs,f_data->Etas,x,JtJ,Jtr,Jrow,ActivePeaks,J);
+	for (i=0;i<n;i++) Scale[i] = 0;
+	for (iter=0;iter<LM_MAX_ITER;iter++){
+		for (i=0;i<n;i++){
+			if (JtJ[(i*n)+i] > Scale[i]) Scale[i] = JtJ[(i*n)+i];
+			Free[i] = !((x[i] <= xl[i] && Jtr[i] > 0) || (x[i] >= xu[i] && Jtr[i] < 0));
+		}
+		Accepted = 0;
+		while (Accepted == 0){
+			for (i=0;i<n;i++){
+				for (j=0;j<n;j++) A[(i*n)+j] = (Free[i] && Free[j]) ? JtJ[(i*n)+j] : 0;
+				if (Free[i]){
+					A[(i*n)+i] += Lambda*(Scale[i] > 0 ? Scale[i] : 1);
+					Delta[i] = -Jtr[i];
+				} else {
+					A[(i*n)+i] = 1;
+					Delta[i] = 0;
+				}
+			}
+			if (CholeskySolve(n,A,Delta) == 0){
+				MaxStep = 0;
+				for (i=0;i<n;i++){
+					XTrial[i] = x[i] + Delta[i];
+					if (XTrial[i] < xl[i]){
+						XTrial[i] = x[i] - (LM_BOUND_FRAC*(x[i]-xl[i]));
+						if (XTrial[i]-xl[i] < LM_BOUND_SNAP*(xu[i]-xl[i])) XTrial[i] = xl[i];
+					}
+					if (XTrial[i] > xu[i]){
+						XTrial[i] = x[i] + (LM_BOUND_FRAC*(xu[i]-x[i]));
+						if (xu[i]-XTrial[i] < LM_BOUND_SNAP*(xu[i]-xl[i])) XTrial[i] = xu[i];
+					}
+					Step = fabs(XTrial[i]-x[i])/(fabs(x[i])+LM_XTOL);
+					if (Step > MaxStep) MaxStep = Step;
+				}
+				TrialCost = problem_function(n,XTrial,NULL,f_data);
+				if (TrialCost < Cost){
+					Accepted = 1;
+					break;
+				}
+				if (MaxStep < LM_XTOL){
+					rc = NLOPT_XTOL_REACHED;
+					goto done;
+				}
+			}
+			Lambda *= 10;
+			if (Lambda > 1e16){
+				rc = NLOPT_XTOL_REACHED;
+				goto done;
+			}
+		}
+		for (i=0;i<n;i++) x[i] = XTrial[i];
+		if (Cost - TrialCost <= LM_FTOL*Cost){
+			Cost = TrialCost;
+			rc = NLOPT_FTOL_REACHED;
+			break;
+		}
+		if (MaxStep < LM_XTOL){
+			Cost = TrialCost;
+			rc = NLOPT_XTOL_REACHED;
+			break;
+		}
+		Cost = PseudoVoigtNormalEquations(nPeaks,f_data->NrPixels,f_data->z,f_data->Rs,f_data->Etas,x,JtJ,Jtr,Jrow,ActivePeaks,J);
+		if (Lambda > 1e-12) Lambda /= 10;
+	}
+done:
+	*minf = Cost;
+	free(JtJ);
+	free(A);
+	free(Jtr);
+	free(Delta);
+	free(XTrial);
+	free(Jrow);
+	free(Scale);
+	free(Free);
+	free(ActivePeaks);
+	free(J);
+	return rc;
+}
+
 int Fit2DPeaks(unsigned nPeaks, int NrPixelsThisRegion, double *z, int **UsefulPixels, double *MaximaValues,
 				int **MaximaPositions, double *IntegratedIntensity, double *IMAX, double *YCEN, double *ZCEN,
 				double *RCens, double *EtaCens,double Ycen, double Zcen, double Thresh, int *NrPx,double *OtherInfo)
@@ -408,16 +573,21 @@ int Fit2DPeaks(unsigned nPeaks, int NrPixelsThisRegion, double *z, int **UsefulP
 	struct func_data *f_datat;
 	f_datat = &f_data;
 	void *trp = (struct func_data *)  f_datat;
-	nlopt_opt opt;
-	opt = nlopt_create(NLOPT_LN_NELDERMEAD, n);
-	nlopt_set_lower_bounds(opt, xl);
-	nlopt_set_upper_bounds(opt, xu);
-	nlopt_set_maxtime(opt, 300);
-	nlopt_set_min_objective(opt, problem_function, trp);
 	double minf;
-	int rc = nlopt_optimize(opt, x, &minf);
-	//~ printf("RC: %d\n",rc);
-	nlopt_destroy(opt);
+	int rc;
+	if (UseNelderMead == 1){
+		nlopt_opt opt;
+		opt = nlopt_create(NLOPT_LN_NELDERMEAD, n);
+		nlopt_set_lower_bounds(opt, xl);
+		nlopt_set_upper_bounds(opt, xu);
+		nlopt_set_maxtime(opt, 300);
+		nlopt_set_min_objective(opt, problem_function, trp);
+		rc = nlopt_optimize(opt, x, &minf);
+		//~ printf("RC: %d\n",rc);
+		nlopt_destroy(opt);
+	} else {
+		rc = FitPseudoVoigtLM(nPeaks,&f_data,x,xl,xu,&minf);
+	}
 	for (i=0;i<nPeaks;i++){
 		IMAX[i] = x[(8*i)+1];
 		RCens[i] = x[(8*i)+2];
@@ -455,30 +625,6 @@ static inline int CheckDirectoryCreation(char Folder[1024])
 	return 1;
 }
 
-static inline void DoImageTransformations (int NrTransOpt, int TransOpt[10], pixelvalue *Image, int NrPixels)
-{
-	int i,j,k,l,m;
-    pixelvalue **ImageTemp1, **ImageTemp2;
-    ImageTemp1 = allocMatrixPX(NrPixels,NrPixels);
-    ImageTemp2 = allocMatrixPX(NrPixels,NrPixels);
-	for (k=0;k<NrPixels;k++) for (l=0;l<NrPixels;l++) ImageTemp1[k][l] = Image[(NrPixels*k)+l];
-	for (k=0;k<NrTransOpt;k++) {
-		if (TransOpt[k] == 1){
-			for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp2[l][m] = ImageTemp1[l][NrPixels-m-1]; //Inverting Y.
-		} else if (TransOpt[k] == 2){
-			for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp2[l][m] = ImageTemp1[NrPixels-l-1][m]; //Inverting Z.
-		} else if (TransOpt[k] == 3){
-			for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp2[l][m] = ImageTemp1[m][l];
-		} else if (TransOpt[k] == 0){
-			for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp2[l][m] = ImageTemp1[l][m];
-		}
-		for (l=0;l<NrPixels;l++) for (m=0;m<NrPixels;m++) ImageTemp1[l][m] = ImageTemp2[l][m];
-	}
-	for (k=0;k<NrPixels;k++) for (l=0;l<NrPixels;l++) Image[(NrPixels*k)+l] = ImageTemp2[k][l];
-	FreeMemMatrixPx(ImageTemp1,NrPixels);
-	FreeMemMatrixPx(ImageTemp2,NrPixels);
-}
-
 static inline
 void
 MatrixMult(
@@ -509,6 +655,38 @@ MatrixMultF33(
     }
 }
 
+// GeometryMap.c
+double *GeometryMapGet(char *Folder, int NrPixelsY, int NrPixelsZ, double px, double Ycen, double Zcen, double Lsd, double RhoD,
+	double tx, double ty, double tz, double p0, double p1, double p2, double p3);
+void GeometryMapRelease(double *R, int NrPixelsY, int NrPixelsZ);
+
+// ConnectedComponents.c
+int FindConnectedRegions(int NrRows, int NrCols, int nPixels, int *Pixels, int *RegionStart, int *RegionPixels, int *Labels);
+
+// SparseFrames.c
+struct SparseStore;
+uint64_t SparseFrameKey(char *Description);
+struct SparseStore *SparseStoreOpen(char *Folder, char *ScanStem, int RingNr, int NrPixels, uint64_t Key, int Writable);
+void SparseStoreClose(struct SparseStore *S);
+int SparseStoreWrite(struct SparseStore *S, int FrameNr, double Omega, double Threshold,
+	uint64_t Key, int nPixels, int *Pixels, double *Image);
+int SparseStoreFind(struct SparseStore *S, int FrameNr, uint64_t Key);
+int SparseStoreRead(struct SparseStore *S, int FrameNr, uint64_t Key, int *nPixels, int *Pixels, double *Image);
+
+// RawFrames.c
+struct RawFile;
+struct RawFile *RawFileOpen(char *FN, int PixelSize, size_t NrPixels, size_t HeadSize, int AlignEnd);
+int RawFileNrFrames(struct RawFile *F);
+const void *RawFrame(struct RawFile *F, int FrameNr);
+void RawFrameWillNeed(struct RawFile *F, int FrameNr, int nFrames);
+void RawFileClose(struct RawFile *F);
+
+// ImageCorrection.c
+void ImageTransformMap(int NrTransOpt, int *TransOpt, int NrRows, int NrCols, int *Map);
+int CorrectImage(const void *Raw, int dType, int InRows, int InCols, int NrRows, int NrCols, const int *Map,
+	double BadPx, const double *Dark, const double *Flood, double Scale, const int *Mask, double Thresh,
+	double *Out, int *FgPixels);
+
 static void
 check (int test, const char * message, ...)
 {
@@ -522,10 +700,450 @@ check (int test, const char * message, ...)
     }
 }
 
+// Frames are read in order from the mapped raw file, the next frame is
+// prefetched while the current one is processed.
+struct TFrameReader {
+	struct RawFile *Raw;
+	int ReadFileNr;
+	int nFrames;
+	int StartFileNr;
+	int NrPixels;
+	int Padding;
+	char *RawFolder;
+	char *fs;
+	char *Ext;
+};
+
+static int ReadFrame(struct TFrameReader *Reader, int FileNr, pixelvalue *Image)
+{
+	int ReadFileNr = Reader->StartFileNr + ((FileNr-1) / Reader->nFrames);
+	int FramesToSkip = ((FileNr-1) % Reader->nFrames);
+	size_t NrPixels = (size_t)Reader->NrPixels * Reader->NrPixels;
+	if (Reader->Raw == NULL || Reader->ReadFileNr != ReadFileNr){
+		char FN[2048];
+		RawFileClose(Reader->Raw);
+		sprintf(FN,"%s/%s_%0*d%s",Reader->RawFolder,Reader->fs,Reader->Padding,ReadFileNr,Reader->Ext);
+		printf("Reading file: %s\n",FN);
+		Reader->Raw = RawFileOpen(FN,sizeof(pixelvalue),NrPixels,0,1);
+		if (Reader->Raw == NULL){
+			printf("Could not read the input file %s.\n",FN);
+			return 1;
+		}
+		Reader->ReadFileNr = ReadFileNr;
+	}
+	// The last nFrames frames of the file, whatever the header size.
+	int Frame = RawFileNrFrames(Reader->Raw) - (Reader->nFrames-FramesToSkip);
+	const void *Data = RawFrame(Reader->Raw,Frame);
+	if (Data == NULL){
+		printf("Could not read frame %d.\n",FileNr);
+		return 1;
+	}
+	memcpy(Image,Data,NrPixels*sizeof(pixelvalue));
+	RawFrameWillNeed(Reader->Raw,Frame+1,1);
+	return 0;
+}
+
+// Key of frame FileNr in the sparse store: the corrections (CorrKey) and the
+// name, size and mtime of the raw file it comes from, so frames of a replaced
+// or rewritten raw file are made again. 0 (never stored) without the raw file.
+static uint64_t SparseRecordKey(struct TFrameReader *Reader, char *CorrKey, int FileNr)
+{
+	int ReadFileNr = Reader->StartFileNr + ((FileNr-1) / Reader->nFrames);
+	char FN[2048], KeyStr[8192+2048+64];
+	struct stat s;
+	sprintf(FN,"%s/%s_%0*d%s",Reader->RawFolder,Reader->fs,Reader->Padding,ReadFileNr,Reader->Ext);
+	if (stat(FN,&s) != 0) return 0;
+	sprintf(KeyStr,"%s %s %lld %lld.%09ld",CorrKey,FN,(long long)s.st_size,(long long)s.st_mtim.tv_sec,s.st_mtim.tv_nsec);
+	return SparseFrameKey(KeyStr);
+}
+
+// Peaks fitted in one connected region.
+struct TRegionFit {
+	int Status; // 0 fitted, 1 too small or too large, 2 saturated
+	int NrPixelsThisRegion;
+	unsigned nPeaks;
+	int rc;
+	int (*MaximaPositions)[2];
+	double *MaximaValues, *IntegratedIntensity, *IMAX, *YCEN, *ZCEN, *Rads, *Etass, *OtherInfo;
+	int *NrPx;
+	long double FitTime;
+};
+
+// Per thread scratch arrays for FitRegion, room for Size pixels.
+struct TRegionWork {
+	int Size;
+	int **MaximaPositions;
+	double *MaximaValues;
+	int **UsefulPixels;
+	double *z;
+};
+
+// The intensities come from RegionValues if given, else from ImgCorrBC.
+static void FitRegion(int *RegionPositions, double *RegionValues, int NrPixelsThisRegion, double *ImgCorrBC, int NrPixels,
+	double IntSat, int minNrPx, int maxNrPx, int maxNPeaks, double Ycen, double Zcen, double Thresh,
+	struct TRegionWork *W, struct TRegionFit *Fit)
+{
+	int i, j, IsSaturated;
+	unsigned nPeaks;
+	struct timespec timer1, timer2;
+	int **MaximaPositions = W->MaximaPositions, **UsefulPixels = W->UsefulPixels;
+	double *MaximaValues = W->MaximaValues, *z = W->z;
+	Fit->NrPixelsThisRegion = NrPixelsThisRegion;
+	Fit->nPeaks = 0;
+	Fit->FitTime = 0;
+	// Size check first, the scratch arrays only hold W->Size pixels.
+	if (NrPixelsThisRegion <= minNrPx || NrPixelsThisRegion >= maxNrPx || NrPixelsThisRegion > W->Size){
+		printf("Removed peak with %d pixels, position: %d %d.\n",NrPixelsThisRegion,
+			RegionPositions[0]/NrPixels,RegionPositions[0]%NrPixels);
+		Fit->Status = 1;
+		return;
+	}
+	for (i=0;i<NrPixelsThisRegion;i++){
+		UsefulPixels[i][0] = (int)(RegionPositions[i]/NrPixels);
+		UsefulPixels[i][1] = (int)(RegionPositions[i]%NrPixels);
+		if (RegionValues != NULL) z[i] = RegionValues[i];
+		else z[i] = ImgCorrBC[((UsefulPixels[i][0])*NrPixels) + (UsefulPixels[i][1])];
+	}
+	nPeaks = FindRegionalMaxima(z,UsefulPixels,NrPixelsThisRegion,MaximaPositions,MaximaValues,&IsSaturated,IntSat);
+	if (IsSaturated == 1){ //Saturated peaks removed
+		printf("Saturated peak removed.\n");
+		Fit->Status = 2;
+		return;
+	}
+	if (nPeaks > maxNPeaks){
+		// Sort peaks by MaxIntensity, remove the smallest peaks until maxNPeaks, arrays needed MaximaPositions, MaximaValues.
+		printf("nPeaks = %d, will be reduced to %d.\n",nPeaks,maxNPeaks);
+		int MaximaPositionsT[nPeaks][2];
+		double MaximaValuesT[nPeaks];
+		double maxIntMax;
+		int maxPos;
+		for (i=0;i<maxNPeaks;i++){
+			maxIntMax = 0;
+			for (j=0;j<nPeaks;j++){
+				if (MaximaValues[j] > maxIntMax){
+					maxPos = j;
+					maxIntMax = MaximaValues[j];
+				}
+			}
+			MaximaPositionsT[i][0] = MaximaPositions[maxPos][0];
+			MaximaPositionsT[i][1] = MaximaPositions[maxPos][1];
+			MaximaValuesT[i] = MaximaValues[maxPos];
+			MaximaValues[maxPos] = 0;
+		}
+		nPeaks = maxNPeaks;
+		for (i=0;i<nPeaks;i++){
+			MaximaValues[i] = MaximaValuesT[i];
+			MaximaPositions[i][0] = MaximaPositionsT[i][0];
+			MaximaPositions[i][1] = MaximaPositionsT[i][1];
+		}
+	}
+	Fit->Status = 0;
+	Fit->nPeaks = nPeaks;
+	Fit->IntegratedIntensity = calloc(nPeaks*2,sizeof(double));
+	Fit->IMAX = malloc(nPeaks*2*sizeof(double));
+	Fit->YCEN = malloc(nPeaks*2*sizeof(double));
+	Fit->ZCEN = malloc(nPeaks*2*sizeof(double));
+	Fit->Rads = malloc(nPeaks*2*sizeof(double));
+	Fit->Etass = malloc(nPeaks*2*sizeof(double));
+	Fit->OtherInfo = malloc(nPeaks*10*sizeof(double));
+	Fit->NrPx = malloc(nPeaks*2*sizeof(int));
+	Fit->MaximaValues = malloc(nPeaks*sizeof(double));
+	Fit->MaximaPositions = malloc(nPeaks*sizeof(*Fit->MaximaPositions));
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID,&timer1);
+	Fit->rc = Fit2DPeaks(nPeaks,NrPixelsThisRegion,z,UsefulPixels,MaximaValues,MaximaPositions,Fit->IntegratedIntensity,
+		Fit->IMAX,Fit->YCEN,Fit->ZCEN,Fit->Rads,Fit->Etass,Ycen,Zcen,Thresh,Fit->NrPx,Fit->OtherInfo);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID,&timer2);
+	Fit->FitTime = diff(timer1,timer2);
+	for (i=0;i<nPeaks;i++){
+		Fit->MaximaValues[i] = MaximaValues[i];
+		Fit->MaximaPositions[i][0] = MaximaPositions[i][0];
+		Fit->MaximaPositions[i][1] = MaximaPositions[i][1];
+	}
+}
+
+static void FreeRegionFit(struct TRegionFit *Fit)
+{
+	if (Fit->Status != 0) return;
+	free(Fit->IntegratedIntensity);
+	free(Fit->IMAX);
+	free(Fit->YCEN);
+	free(Fit->ZCEN);
+	free(Fit->Rads);
+	free(Fit->Etass);
+	free(Fit->OtherInfo);
+	free(Fit->NrPx);
+	free(Fit->MaximaValues);
+	free(Fit->MaximaPositions);
+}
+
+// Segment3D: the connected regions of consecutive frames that touch in
+// (y,z) are joined into one spot, which is fitted once on its omega-summed
+// image. Regions are numbered over the whole run, BlobParent is a union-find
+// over those numbers with the first region of a spot as its root.
+struct TBlobRegion {
+	int FrameNr;
+	double Omega;
+	int nPixels;
+	int *Pixels;
+	double *Values;
+};
+
+struct TBlobFit {
+	struct TRegionFit Fit;
+	int NrVoxels;		// (frame,pixel) pairs of the spot.
+	double *Omega, *MinOme, *MaxOme, *IMax;
+	int *NrVoxelsPeak;
+};
+
+struct TBlobVoxel {
+	int Pixel;
+	int FrameNr;
+	double Omega;
+	double Value;
+};
+
+static inline int BlobFind(int *Parent, int x)
+{
+	while (Parent[x] != x){
+		Parent[x] = Parent[Parent[x]];
+		x = Parent[x];
+	}
+	return x;
+}
+
+static inline void BlobUnion(int *Parent, int a, int b)
+{
+	a = BlobFind(Parent,a);
+	b = BlobFind(Parent,b);
+	if (a < b) Parent[b] = a;
+	else if (b < a) Parent[a] = b;
+}
+
+static int cmpBlobVoxel(const void *a, const void *b)
+{
+	const struct TBlobVoxel *va = a, *vb = b;
+	if (va->Pixel != vb->Pixel) return (va->Pixel < vb->Pixel) ? -1 : 1;
+	return (va->FrameNr < vb->FrameNr) ? -1 : (va->FrameNr > vb->FrameNr);
+}
+
+// Fit the spot made of Regions[Members[0..nMembers-1]]. The peaks found on the
+// summed image get the omega centroid, omega range and voxels of the voxels
+// closest to them. IMax is the fitted IMax scaled to the brightest frame of
+// the peak, as the frame by frame fit followed by the merge reports it.
+static void FitBlob(struct TBlobRegion *Regions, int *Members, int nMembers, int NrPixels, double IntSat,
+	int minNrPx, int maxNrPx, int maxNPeaks, double Ycen, double Zcen, double Thresh, struct TRegionWork *W,
+	struct TBlobFit *BFit)
+{
+	int i, j, k, m, nVox = 0, nUnique = 0, FirstFrame, nFrames, Best;
+	double d, dBest;
+	struct TBlobVoxel *Vox;
+	for (m=0;m<nMembers;m++) nVox += Regions[Members[m]].nPixels;
+	BFit->NrVoxels = nVox;
+	BFit->Fit.Status = 1;
+	Vox = malloc(nVox*sizeof(*Vox));
+	for (m=0,k=0;m<nMembers;m++){
+		struct TBlobRegion *Reg = &Regions[Members[m]];
+		for (i=0;i<Reg->nPixels;i++,k++){
+			Vox[k].Pixel = Reg->Pixels[i];
+			Vox[k].FrameNr = Reg->FrameNr;
+			Vox[k].Omega = Reg->Omega;
+			Vox[k].Value = Reg->Values[i];
+			if (Vox[k].Value > IntSat) BFit->Fit.Status = 2;
+		}
+	}
+	if (BFit->Fit.Status == 2){
+		printf("Saturated peak removed.\n");
+		free(Vox);
+		return;
+	}
+	qsort(Vox,nVox,sizeof(*Vox),cmpBlobVoxel);
+	int *Pos = malloc(nVox*sizeof(*Pos));
+	double *Sum = malloc(nVox*sizeof(*Sum));
+	for (i=0;i<nVox;i++){
+		if (nUnique == 0 || Pos[nUnique-1] != Vox[i].Pixel){
+			Pos[nUnique] = Vox[i].Pixel;
+			Sum[nUnique++] = 0;
+		}
+		Sum[nUnique-1] += Vox[i].Value;
+	}
+	if (nUnique <= minNrPx || nUnique >= maxNrPx){
+		printf("Removed peak with %d pixels, position: %d %d.\n",nUnique,Pos[0]/NrPixels,Pos[0]%NrPixels);
+		BFit->Fit.NrPixelsThisRegion = nUnique;
+		BFit->Fit.nPeaks = 0;
+		free(Vox);
+		free(Pos);
+		free(Sum);
+		return;
+	}
+	// Saturation was checked on the single frames, not on the sums.
+	FitRegion(Pos,Sum,nUnique,NULL,NrPixels,INFINITY,minNrPx,maxNrPx,maxNPeaks,Ycen,Zcen,Thresh,W,&BFit->Fit);
+	free(Pos);
+	free(Sum);
+	if (BFit->Fit.Status != 0){
+		free(Vox);
+		return;
+	}
+	unsigned nPeaks = BFit->Fit.nPeaks;
+	FirstFrame = Regions[Members[0]].FrameNr;
+	nFrames = Regions[Members[nMembers-1]].FrameNr - FirstFrame + 1;
+	double *SumI = calloc(nPeaks,sizeof(*SumI)), *FrameI = calloc(nPeaks*nFrames,sizeof(*FrameI));
+	BFit->Omega = calloc(nPeaks,sizeof(double));
+	BFit->MinOme = malloc(nPeaks*sizeof(double));
+	BFit->MaxOme = malloc(nPeaks*sizeof(double));
+	BFit->IMax = malloc(nPeaks*sizeof(double));
+	BFit->NrVoxelsPeak = calloc(nPeaks,sizeof(int));
+	for (j=0;j<nPeaks;j++){
+		BFit->MinOme[j] = 1e10;
+		BFit->MaxOme[j] = -1e10;
+	}
+	for (i=0;i<nVox;i++){
+		Best = 0;
+		dBest = 1e30;
+		for (j=0;j<nPeaks;j++){
+			d = CalcNorm2(Vox[i].Pixel/NrPixels - BFit->Fit.YCEN[j] - Ycen,Vox[i].Pixel%NrPixels - BFit->Fit.ZCEN[j] - Zcen);
+			if (d < dBest){
+				dBest = d;
+				Best = j;
+			}
+		}
+		SumI[Best] += Vox[i].Value;
+		FrameI[(Best*nFrames)+Vox[i].FrameNr-FirstFrame] += Vox[i].Value;
+		BFit->Omega[Best] += Vox[i].Value*Vox[i].Omega;
+		if (Vox[i].Omega < BFit->MinOme[Best]) BFit->MinOme[Best] = Vox[i].Omega;
+		if (Vox[i].Omega > BFit->MaxOme[Best]) BFit->MaxOme[Best] = Vox[i].Omega;
+		BFit->NrVoxelsPeak[Best]++;
+	}
+	for (j=0;j<nPeaks;j++){
+		double MaxFrameI = 0;
+		for (k=0;k<nFrames;k++) if (FrameI[(j*nFrames)+k] > MaxFrameI) MaxFrameI = FrameI[(j*nFrames)+k];
+		if (SumI[j] > 0){
+			BFit->Omega[j] /= SumI[j];
+			BFit->IMax[j] = BFit->Fit.IMAX[j]*MaxFrameI/SumI[j];
+		} else {
+			// No voxel closer to this peak than to another one.
+			BFit->Omega[j] = Regions[Members[0]].Omega;
+			BFit->MinOme[j] = BFit->Omega[j];
+			BFit->MaxOme[j] = BFit->Omega[j];
+			BFit->IMax[j] = BFit->Fit.IMAX[j];
+		}
+	}
+	free(SumI);
+	free(FrameI);
+	free(Vox);
+}
+
+static void FreeBlobFit(struct TBlobFit *BFit)
+{
+	if (BFit->Fit.Status != 0) return;
+	free(BFit->Omega);
+	free(BFit->MinOme);
+	free(BFit->MaxOme);
+	free(BFit->IMax);
+	free(BFit->NrVoxelsPeak);
+	FreeRegionFit(&BFit->Fit);
+}
+
+struct TBlobMember {
+	int Root;
+	int Region;
+};
+
+static int cmpBlobMember(const void *a, const void *b)
+{
+	const struct TBlobMember *ma = a, *mb = b;
+	if (ma->Root != mb->Root) return (ma->Root < mb->Root) ? -1 : 1;
+	return (ma->Region < mb->Region) ? -1 : (ma->Region > mb->Region);
+}
+
+// Fit the spots made of the regions Closed[0..nClosed-1], write them to OutFile
+// in the order of their first region and free the regions. Columns are those
+// of MergeOverlappingPeaks. Returns the number of spots.
+static int FitWriteBlobs(struct TBlobRegion *Regions, int *BlobParent, int *Closed, int nClosed, int NrPixels,
+	double IntSat, int minNrPx, int maxNrPx, int maxNPeaks, double Ycen, double Zcen, double Thresh,
+	struct TRegionWork *Work, FILE *OutFile, int *SpotIDNr, long double *FitTime)
+{
+	int i, j, b, nBlobs = 0, nSpots = 0;
+	if (nClosed == 0) return 0;
+	struct TBlobMember *M = malloc(nClosed*sizeof(*M));
+	int *Members = malloc(nClosed*sizeof(*Members)), *BlobStart = malloc((nClosed+1)*sizeof(*BlobStart));
+	for (i=0;i<nClosed;i++){
+		M[i].Root = BlobFind(BlobParent,Closed[i]);
+		M[i].Region = Closed[i];
+	}
+	qsort(M,nClosed,sizeof(*M),cmpBlobMember);
+	for (i=0;i<nClosed;i++){
+		Members[i] = M[i].Region;
+		if (i == 0 || M[i].Root != M[i-1].Root) BlobStart[nBlobs++] = i;
+	}
+	BlobStart[nBlobs] = nClosed;
+	free(M);
+	struct TBlobFit *BFits = malloc(nBlobs*sizeof(*BFits));
+	# pragma omp taskloop grainsize(1)
+	for (b=0;b<nBlobs;b++){
+		FitBlob(Regions,Members+BlobStart[b],BlobStart[b+1]-BlobStart[b],NrPixels,IntSat,minNrPx,maxNrPx,maxNPeaks,
+			Ycen,Zcen,Thresh,&Work[omp_get_thread_num()],&BFits[b]);
+	}
+	for (b=0;b<nBlobs;b++){
+		struct TBlobFit *B = &BFits[b];
+		struct TRegionFit *Fit = &B->Fit;
+		for (i=BlobStart[b];i<BlobStart[b+1];i++){
+			free(Regions[Members[i]].Pixels);
+			free(Regions[Members[i]].Values);
+		}
+		if (Fit->Status != 0) continue;
+		printf("Spot from frame %d to %d: %d voxels, %d pixels, %d peaks, %llf\n",Regions[Members[BlobStart[b]]].FrameNr,
+			Regions[Members[BlobStart[b+1]-1]].FrameNr,B->NrVoxels,Fit->NrPixelsThisRegion,Fit->nPeaks,Fit->FitTime);
+		*FitTime += Fit->FitTime;
+		for (j=0;j<Fit->nPeaks;j++){
+			if (Fit->IntegratedIntensity[j] < 1) continue;
+			fprintf(OutFile,"%d %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf %lf\n",(*SpotIDNr)++,Fit->IntegratedIntensity[j],
+				B->Omega[j],Fit->YCEN[j]+Ycen,Fit->ZCEN[j]+Zcen,B->IMax[j],B->MinOme[j],B->MaxOme[j],Fit->OtherInfo[2*j],
+				Fit->OtherInfo[2*j+1],(double)B->NrVoxelsPeak[j],(double)B->NrVoxels);
+			nSpots++;
+		}
+		FreeBlobFit(B);
+	}
+	free(BFits);
+	free(Members);
+	free(BlobStart);
+	return nSpots;
+}
+
+static inline double FrameOmega(int FileNr, int StartNr, int StartFileNr, int nFrames, int fnr, double FileOmegaOmeStep[][2],
+	double OmegaFirstFile, double OmegaStep, int FrameNrOmeChange, double OmegaMissing, double MisDir)
+{
+	int Nadditions;
+	if (fnr != 0){
+		int ReadFileNr = StartFileNr + ((FileNr-1) / nFrames);
+		int FramesToSkip = ((FileNr-1) % nFrames);
+		return FileOmegaOmeStep[ReadFileNr-StartFileNr][0] + FramesToSkip*FileOmegaOmeStep[ReadFileNr-StartFileNr][1];
+	}
+	if (FileNr - StartNr + 1 < FrameNrOmeChange){
+		return OmegaFirstFile + ((FileNr-StartNr)*OmegaStep);
+	}
+	Nadditions = (int) ((FileNr - StartNr + 1) / FrameNrOmeChange)  ;
+	return OmegaFirstFile + ((FileNr-StartNr)*OmegaStep) + MisDir*OmegaMissing*Nadditions;
+}
+
+static inline int KeepFrame(double Omega, double OmegaRanges[][2], int nOmeRanges)
+{
+	int i;
+	for (i=0;i<nOmeRanges;i++){
+		if (Omega >= OmegaRanges[i][0] && Omega <= OmegaRanges[i][1]) return 1;
+	}
+	return 0;
+}
+
 int main(int argc, char *argv[]){
 	clock_t start, end;
-	if (argc != 4){
-		printf("Usage:\n PeaksFittingPerFile params.txt fileNr ringNr\n");
+	if (argc != 4 && argc != 6){
+		printf("Usage:\n PeaksFittingPerFile params.txt fileNr ringNr\n"
+			"or\n PeaksFittingPerFile params.txt firstFileNr lastFileNr ringNr nCPUs\n"
+			"The second form fits a whole range of frames in one process and writes\n"
+			"Temp/FileStem_firstFileNr_lastFileNr_ringNr_PS.csv with a FrameNr column.\n"
+			"With Segment3D 1 in params.txt, regions are joined across frames and each\n"
+			"spot is fitted once, the result is written where MergeOverlappingPeaks\n"
+			"would write it.\n");
 		return 1;
 	}
     double diftotal;
@@ -544,9 +1162,17 @@ int main(int argc, char *argv[]){
     check (fileParam == NULL,"%s file not found: %s", ParamFN, strerror(errno));
     char *str, dummy[1000], Folder[1024], FileStem[1024], *TmpFolder, darkcurrentfilename[1024], floodfilename[1024], Ext[1024],RawFolder[1024];
     TmpFolder = "Temp";
-    int LowNr,FileNr,RingNr;
-    FileNr = atoi(argv[2]);
+    int LowNr,FirstFileNr,LastFileNr,RingNr,nCPUs=1,RangeMode=0;
+    FirstFileNr = atoi(argv[2]);
+    LastFileNr = FirstFileNr;
     RingNr = atoi(argv[3]);
+    if (argc == 6){
+		RangeMode = 1;
+		LastFileNr = atoi(argv[3]);
+		RingNr = atoi(argv[4]);
+		nCPUs = atoi(argv[5]);
+		if (nCPUs < 1) nCPUs = 1;
+	}
     double Thresh, bc=1, Ycen, Zcen, IntSat, OmegaStep, OmegaFirstFile, Lsd, px, Width, Wavelength,MaxRingRad;
     int NrPixels,Padding = 6, StartNr;
     char fs[1024];
@@ -560,11 +1186,15 @@ int main(int argc, char *argv[]){
     double FileOmegaOmeStep[360][2];
     int headSize = 8192;
     int fnr = 0;
-    double RhoD, tx, ty, tz, p0, p1, p2;
+    double RhoD, tx, ty, tz, p0, p1, p2, p3 = 0;
     double OmegaRanges[2000][2];
     int nOmeRanges = 0;
     long long int BadPxIntensity = 0;
     int minNrPx=1, maxNrPx=10000, makeMap = 0, maxNPeaks=400;
+    char GeometryMapFolder[1024] = "/dev/shm";
+    char SparseFolder[1024] = "";
+    char PeakFitKernel[1024] = "auto";
+    int Segment3D = 0;
     while (fgets(aline,1000,fileParam)!=NULL){
 		//printf("%s",aline);
 		fflush(stdout);
@@ -573,6 +1203,36 @@ int main(int argc, char *argv[]){
         if (LowNr==0){
             sscanf(aline,"%s %d", dummy, &maxNPeaks);
             continue;
+        }
+		str = "GeometryMapFolder ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, GeometryMapFolder);
+            continue;
+        }
+		str = "SparseFolder ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, SparseFolder);
+            continue;
+        }
+		str = "PeakFitKernel ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, PeakFitKernel);
+            continue;
+        }
+		str = "Segment3D ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %d", dummy, &Segment3D);
+            continue;
+        }
+		str = "UseNelderMead ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %d", dummy, &UseNelderMead);
+            continue;
         }
 		str = "tx ";
         LowNr = strncmp(aline,str,strlen(str));
@@ -630,6 +1290,12 @@ int main(int argc, char *argv[]){
             sscanf(aline,"%s %lf", dummy, &p2);
             continue;
         }
+        str = "p3 ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %lf", dummy, &p3);
+            continue;
+        }
         str = "StartFileNr ";
         LowNr = strncmp(aline,str,strlen(str));
         if (LowNr==0){
@@ -842,6 +1508,14 @@ int main(int argc, char *argv[]){
     }
 	sprintf(FileStem,"%s_%d",fs,LayerNr);
 	fclose(fileParam);
+	if (strcmp(PeakFitKernel,"scalar") == 0){
+		UseScalarKernel = 1;
+		printf("Pseudo-Voigt kernel: scalar\n");
+	} else if (PseudoVoigtKernelSelect(PeakFitKernel) != 0) return 1;
+	if (Segment3D == 1 && RangeMode == 0){
+		printf("Segment3D needs the range form (firstFileNr lastFileNr ringNr nCPUs).\n");
+		return 1;
+	}
 	double MaxTtheta = rad2deg*atan(MaxRingRad/Lsd);
 	double RingRad;
 	char hklfn[2040];
@@ -865,19 +1539,15 @@ int main(int argc, char *argv[]){
 	printf("RingNr = %d RingRad = %f\n",RingNr, RingRad);
 	double Rmin=RingRad-Width, Rmax=RingRad+Width;
 	double Omega;
-	int Nadditions;
-	if (fnr == 0){
-		if (FileNr - StartNr + 1 < FrameNrOmeChange){
-			Omega = OmegaFirstFile + ((FileNr-StartNr)*OmegaStep);
-		} else {
-			Nadditions = (int) ((FileNr - StartNr + 1) / FrameNrOmeChange)  ;
-			Omega = OmegaFirstFile + ((FileNr-StartNr)*OmegaStep) + MisDir*OmegaMissing*Nadditions;
-		}
-    }
     // Dark file reading from here.
-	double *dark, *flood, *darkTemp;;
+	double *dark, *flood, *darkTemp;
 	dark = malloc(NrPixels*NrPixels*sizeof(*dark));
 	darkTemp = malloc(NrPixels*NrPixels*sizeof(*darkTemp));
+	// ImTransOpt, then the transpose to (y,z) used by the peak search.
+	int FrameMap[6], TransOptT[11];
+	for (i=0;i<NrTransOpt;i++) TransOptT[i] = TransOpt[i];
+	TransOptT[NrTransOpt] = 3;
+	ImageTransformMap(NrTransOpt+1,TransOptT,NrPixels,NrPixels,FrameMap);
 	flood = malloc(NrPixels*NrPixels*sizeof(*flood));
 	FILE *darkfile=fopen(darkcurrentfilename,"rb");
 	size_t sz;
@@ -898,17 +1568,17 @@ int main(int argc, char *argv[]){
 		printf("Reading dark file: %s, nFrames: %d, skipping first %ld bytes.\n",darkcurrentfilename,nFrames,Skip);
 		for (i=0;i<nFrames;i++){
 			fread(darkcontents,SizeFile,1,darkfile);
-			DoImageTransformations(NrTransOpt,TransOpt,darkcontents,NrPixels);
+			CorrectImage(darkcontents,1,NrPixels,NrPixels,NrPixels,NrPixels,FrameMap,NAN,NULL,NULL,1,NULL,-INFINITY,darkTemp,NULL);
 			for (j=0;j<(NrPixels*NrPixels);j++){
-				darkTemp[j] += darkcontents[j];
+				dark[j] += darkTemp[j];
 			}
 		}
 		fclose(darkfile);
 		for (i=0;i<(NrPixels*NrPixels);i++){
-			darkTemp[i] /= nFrames;
+			dark[i] /= nFrames;
 		}
 	}
-	Transposer(darkTemp,NrPixels,dark);
+	free(darkTemp);
 	free(darkcontents);
 	//Finished reading dark file.
 
@@ -927,38 +1597,17 @@ int main(int argc, char *argv[]){
 	int *GoodCoords;
 	GoodCoords = malloc(NrPixels*NrPixels*sizeof(*GoodCoords));
 	memset(GoodCoords,0,NrPixels*NrPixels*sizeof(*GoodCoords));
-	double txr, tyr, tzr;
-	txr = deg2rad*tx;
-	tyr = deg2rad*ty;
-	tzr = deg2rad*tz;
-	double Rx[3][3] = {{1,0,0},{0,cos(txr),-sin(txr)},{0,sin(txr),cos(txr)}};
-	double Ry[3][3] = {{cos(tyr),0,sin(tyr)},{0,1,0},{-sin(tyr),0,cos(tyr)}};
-	double Rz[3][3] = {{cos(tzr),-sin(tzr),0},{sin(tzr),cos(tzr),0},{0,0,1}};
-	double TRint[3][3], TRs[3][3];
-	MatrixMultF33(Ry,Rz,TRint);
-	MatrixMultF33(Rx,TRint,TRs);
-	double Yc, Zc, n0=2, n1=4, n2=2;
-	double ABC[3], ABCPr[3], XYZ[3];
-	double Rad, Eta, RNorm, DistortFunc, EtaT;
+	// Corrected radius of pixel (y,z) from the shared geometry map, GoodCoords
+	// is indexed (y-1,z-1) as before.
+	double *RMap = GeometryMapGet(GeometryMapFolder,NrPixels,NrPixels,px,Ycen,Zcen,Lsd,RhoD,tx,ty,tz,p0,p1,p2,p3);
+	if (RMap == NULL){
+		printf("Could not get the geometry map. Exiting.\n");
+		return 1;
+	}
 	int nrCoords = 0;
 	for (i=1;i<NrPixels;i++){
 		for (j=1;j<NrPixels;j++){
-			// Correct for tilts and Distortion here
-			Yc = (-i + Ycen)*px;
-			Zc =  (j - Zcen)*px;
-			ABC[0] = 0;
-			ABC[1] = Yc;
-			ABC[2] = Zc;
-			MatrixMult(TRs,ABC,ABCPr);
-			XYZ[0] = Lsd+ABCPr[0];
-			XYZ[1] = ABCPr[1];
-			XYZ[2] = ABCPr[2];
-			Rad = (Lsd/(XYZ[0]))*(sqrt(XYZ[1]*XYZ[1] + XYZ[2]*XYZ[2]));
-			Eta = CalcEtaAngle(XYZ[1],XYZ[2]);
-			RNorm = Rad/RhoD;
-			EtaT = 90 - Eta;
-			DistortFunc = (p0*(pow(RNorm,n0))*(cos(deg2rad*(2*EtaT)))) + (p1*(pow(RNorm,n1))*(cos(deg2rad*(4*EtaT)))) + (p2*(pow(RNorm,n2))) + 1;
-			Rt = Rad * DistortFunc / px;
+			Rt = RMap[(j*NrPixels)+i] / px;
 			if (Rt > Rmin && Rt < Rmax){
 				GoodCoords[((i-1)*NrPixels)+(j-1)] = 1;
 				nrCoords ++;
@@ -967,6 +1616,7 @@ int main(int argc, char *argv[]){
 			}
 		}
 	}
+	GeometryMapRelease(RMap,NrPixels,NrPixels);
 	printf("Number of coordinates: %d\n",nrCoords);
 	if (DoFullImage == 1){
 		for (i=0;i<NrPixels*NrPixels;i++) GoodCoords[i] = 1;
@@ -987,227 +1637,301 @@ int main(int argc, char *argv[]){
 	fclose(dummyFile);
 	nFrames = sz/(2*NrPixels*NrPixels);
 
-	char FN[2048];
-	int ReadFileNr;
-	ReadFileNr = StartFileNr + ((FileNr-1) / nFrames);
-	int FramesToSkip = ((FileNr-1) % nFrames);
-
-	if (fnr != 0){
-		OmegaStep = FileOmegaOmeStep[ReadFileNr-StartFileNr][1];
-		Omega = FileOmegaOmeStep[ReadFileNr-StartFileNr][0] + FramesToSkip*OmegaStep;
-	}
 	char OutFolderName[1024];
 	sprintf(OutFolderName,"%s/%s",Folder,TmpFolder);
 	int e = CheckDirectoryCreation(OutFolderName);
 	if (e == 0){ return 1;}
-	char OutFile[1024];
-	sprintf(OutFile,"%s/%s_%0*d_%d_PS.csv",OutFolderName,FileStem,Padding,FileNr,RingNr);
+	char OutFile[2048];
 	FILE *outfilewrite;
-	outfilewrite = fopen(OutFile,"w");
-	fprintf(outfilewrite,"SpotID IntegratedIntensity Omega(degrees) YCen(px) ZCen(px) IMax Radius(px) Eta(degrees) SigmaR SigmaEta NrPixels TotalNrPixelsInPeakRegion nPeaks maxY maxZ diffY diffZ rawIMax returnCode\n");
-	int KeepSpots = 0;
-	for (i=0;i<nOmeRanges;i++){
-		if (Omega >= OmegaRanges[i][0] && Omega <= OmegaRanges[i][1]) KeepSpots = 1;
-	}
-	if (KeepSpots == 0) return;
-	sprintf(FN,"%s/%s_%0*d%s",RawFolder,fs,Padding,ReadFileNr,Ext);
-	printf("Reading file: %s\n",FN);
-	FILE *ImageFile = fopen(FN,"rb");
-	if (ImageFile == NULL){
-		printf("Could not read the input file. Exiting.\n");
-		return 1;
+	if (Segment3D == 1){
+		// The merged spots go straight to where MergeOverlappingPeaks puts them.
+		sprintf(OutFile,"%s/PeakSearch",Folder);
+		if (CheckDirectoryCreation(OutFile) == 0) return 1;
+		sprintf(OutFile,"%s/PeakSearch/%s",Folder,FileStem);
+		if (CheckDirectoryCreation(OutFile) == 0) return 1;
+		sprintf(OutFile,"%s/PeakSearch/%s/Result_StartNr_%d_EndNr_%d_RingNr_%d.csv",Folder,FileStem,FirstFileNr,LastFileNr,RingNr);
+		outfilewrite = fopen(OutFile,"w");
+		fprintf(outfilewrite,"SpotID IntegratedIntensity Omega(degrees) YCen(px) ZCen(px)"
+			" IMax MinOme(degrees) MaxOme(degress) SigmaR SigmaEta NrPx NrPxTot\n");
+	} else {
+		if (RangeMode == 1) sprintf(OutFile,"%s/%s_%0*d_%0*d_%d_PS.csv",OutFolderName,FileStem,Padding,FirstFileNr,Padding,LastFileNr,RingNr);
+		else sprintf(OutFile,"%s/%s_%0*d_%d_PS.csv",OutFolderName,FileStem,Padding,FirstFileNr,RingNr);
+		outfilewrite = fopen(OutFile,"w");
+		if (RangeMode == 1) fprintf(outfilewrite,"FrameNr ");
+		fprintf(outfilewrite,"SpotID IntegratedIntensity Omega(degrees) YCen(px) ZCen(px) IMax Radius(px) Eta(degrees) SigmaR SigmaEta NrPixels TotalNrPixelsInPeakRegion nPeaks maxY maxZ diffY diffZ rawIMax returnCode\n");
 	}
-	pixelvalue *Image;
-	Image = malloc(NrPixels*NrPixels*sizeof(*Image));
-	fseek(ImageFile,0L,SEEK_END);
-	sz = ftell(ImageFile);
-	rewind(ImageFile);
-	size_t temp = (nFrames-FramesToSkip);
-	temp *= 2;
-	temp *= NrPixels;
-	temp *= NrPixels;
-	Skip = sz - temp;
-	printf("Now processing file: %s\n",FN);
-	double beamcurr=1;
-	fseek(ImageFile,Skip,SEEK_SET);
-	fread(Image,SizeFile,1,ImageFile);
-	if (makeMap == 1){
-		int badPxCounter = 0;
-		for (i=0;i<NrPixels*NrPixels;i++){
-			if (Image[i] == (pixelvalue)BadPxIntensity){
-				Image[i] = 0;
-				badPxCounter++;
-			}
-		}
-		printf("Number of badPixels %d\n",badPxCounter);
-	}
-	fclose(ImageFile);
-	DoImageTransformations(NrTransOpt,TransOpt,Image,NrPixels);
-	printf("Beam current this file: %f, Beam current scaling value: %f\n",beamcurr,bc);
-	double *ImgCorrBCTemp, *ImgCorrBC;
-	ImgCorrBC = malloc(NrPixels*NrPixels*sizeof(*ImgCorrBC));
-	ImgCorrBCTemp = malloc(NrPixels*NrPixels*sizeof(*ImgCorrBCTemp));
-	for (i=0;i<(NrPixels*NrPixels);i++)ImgCorrBCTemp[i]=Image[i];
-	free(Image);
-	Transposer(ImgCorrBCTemp,NrPixels,ImgCorrBC);
-	for (i=0;i<(NrPixels*NrPixels);i++){
-		ImgCorrBC[i] = (ImgCorrBC[i] - dark[i])/flood[i];
-		ImgCorrBC[i] = ImgCorrBC[i]*bc/beamcurr;
-		if (GoodCoords[i] == 0){
-			ImgCorrBC[i] = 0;
-		} else {
-			if (ImgCorrBC[i] < Thresh){
-				ImgCorrBC[i] = 0;
-			}
+	FILE *outfilebin = NULL;
+	if (RangeMode == 1 && Segment3D == 0){
+		uint32_t BinHeader[4] = {PS_BIN_MAGIC, PS_BIN_VERSION, PS_BIN_NCOLS, (uint32_t)RingNr};
+		sprintf(OutFile,"%s/%s_%0*d_%0*d_%d_PS.bin",OutFolderName,FileStem,Padding,FirstFileNr,Padding,LastFileNr,RingNr);
+		outfilebin = fopen(OutFile,"wb");
+		if (outfilebin != NULL) fwrite(BinHeader,sizeof(BinHeader),1,outfilebin);
+	}
+	if (RangeMode == 0){
+		Omega = FrameOmega(FirstFileNr,StartNr,StartFileNr,nFrames,fnr,FileOmegaOmeStep,OmegaFirstFile,OmegaStep,FrameNrOmeChange,OmegaMissing,MisDir);
+		if (KeepFrame(Omega,OmegaRanges,nOmeRanges) == 0){
+			fclose(outfilewrite);
+			return 0;
 		}
 	}
-	free(GoodCoords);
-	free(ImgCorrBCTemp);
-	free(dark);
-	free(flood);
-	int nOverlapsMaxPerImage = 10000;
+	struct TFrameReader Reader = {NULL,-1,nFrames,StartFileNr,NrPixels,Padding,RawFolder,fs,Ext};
+	pixelvalue *Frames[N_FRAME_BUFFERS];
+	for (i=0;i<N_FRAME_BUFFERS;i++) Frames[i] = malloc(NrPixels*NrPixels*sizeof(*Frames[i]));
+	double beamcurr=1;
+	double *ImgCorrBC;
+	ImgCorrBC = calloc(NrPixels*NrPixels,sizeof(*ImgCorrBC));
 	// Do Connected components
-	int **BoolImage, **ConnectedComponents;
-	BoolImage = allocMatrixInt(NrPixels,NrPixels);
-	ConnectedComponents = allocMatrixInt(NrPixels,NrPixels);
-	int **Positions;
-	Positions = allocMatrixInt(nOverlapsMaxPerImage,NrPixels*4);
-	int *PositionTrackers;
-	PositionTrackers = malloc(nOverlapsMaxPerImage*sizeof(*PositionTrackers));
-	for (i=0;i<nOverlapsMaxPerImage;i++)PositionTrackers[i] = 0;
-	int NrOfReg;
-	for (i=0;i<NrPixels;i++){
-		for (j=0;j<NrPixels;j++){
-			if (ImgCorrBC[(i*NrPixels)+j] != 0){
-				BoolImage[i][j] = 1;
-			}else{
-				BoolImage[i][j] = 0;
-			}
-		}
+	int nFgPixels, *FgPixels, *RegionStart, *RegionPixels;
+	FgPixels = malloc(NrPixels*NrPixels*sizeof(*FgPixels));
+	RegionStart = malloc((NrPixels*NrPixels+2)*sizeof(*RegionStart));
+	RegionPixels = malloc(NrPixels*NrPixels*sizeof(*RegionPixels));
+	int nFitsMax = 10000;
+	struct TRegionFit *Fits;
+	Fits = malloc(nFitsMax*sizeof(*Fits));
+	struct TRegionWork *Work;
+	Work = malloc(nCPUs*sizeof(*Work));
+	for (i=0;i<nCPUs;i++){
+		Work[i].Size = NrPixels*10;
+		Work[i].MaximaPositions = allocMatrixInt(NrPixels*10,2);
+		Work[i].MaximaValues = malloc(NrPixels*10*sizeof(*Work[i].MaximaValues));
+		Work[i].UsefulPixels = allocMatrixInt(NrPixels*10,2);
+		Work[i].z = malloc(NrPixels*10*sizeof(*Work[i].z));
 	}
-	NrOfReg = FindConnectedComponents(BoolImage,NrPixels,ConnectedComponents,Positions,PositionTrackers);
-	FreeMemMatrixInt(BoolImage,NrPixels);
-	/*FILE *connectedcomps;
-	char conncomp[1024];
-	pixelvalue *CCP;
-	CCP = malloc(NrPixels*NrPixels*sizeof(*CCP));
-	memset(CCP,0,NrPixels*NrPixels*sizeof(*CCP));
-	for (i=0;i<NrPixels;i++){
-		for (j=0;j<NrPixels;j++){
-			if (ConnectedComponents[i][j] != 0){
-				CCP[(i*NrPixels)+j] = ConnectedComponents[i][j];
-			}
-		}
+	int NrOfReg, RegNr, FrameNr, ReadError = 0;
+	// Segment3D state: labels of the previous and current frame, all regions
+	// seen so far and the ones whose spot may still continue.
+	int *LabelsPrev = NULL, *LabelsCur = NULL, *LabelsSwap, *BlobParent = NULL, *BlobStamp = NULL;
+	int *OpenRegions = NULL, *ClosedRegions = NULL, nRegions = 0, nRegionsMax = 0, nOpen = 0;
+	int PrevFrameNr = -2, PrevBase = 0, PrevNrOfReg = 0, SpotIDNr = 1;
+	struct TBlobRegion *Regions = NULL;
+	if (Segment3D == 1){
+		LabelsPrev = calloc(NrPixels*NrPixels,sizeof(*LabelsPrev));
+		LabelsCur = calloc(NrPixels*NrPixels,sizeof(*LabelsCur));
 	}
-	sprintf(conncomp,"%sccp",FN);
-	connectedcomps = fopen(conncomp,"w");
-	fwrite(CCP,NrPixels*NrPixels*sizeof(pixelvalue),1,connectedcomps);
-	fclose(connectedcomps);
-	free(CCP);*/
-	FreeMemMatrixInt(ConnectedComponents,NrPixels);
-	int RegNr,NrPixelsThisRegion;
-	int **MaximaPositions;
-	double *MaximaValues;
-	int **UsefulPixels;
-	double *z;
-	MaximaPositions = allocMatrixInt(NrPixels*10,2);
-	MaximaValues = malloc(NrPixels*10*sizeof(*MaximaValues));
-	UsefulPixels = allocMatrixInt(NrPixels*10,2);
-	z = malloc(NrPixels*10*sizeof(*z));
-	int IsSaturated;
-	int SpotIDStart = 1;
-	int TotNrRegions = NrOfReg;
-	struct timespec timer1, timer2;
+	int SpotIDStart, NrRegionsFrame, TotNrRegions = 0, TotNrPeaks = 0;
 	long double timex=0;
-	for (RegNr=1;RegNr<=NrOfReg;RegNr++){
-		NrPixelsThisRegion = PositionTrackers[RegNr];
-		for (i=0;i<NrPixelsThisRegion;i++){
-			UsefulPixels[i][0] = (int)(Positions[RegNr][i]/NrPixels);
-			UsefulPixels[i][1] = (int)(Positions[RegNr][i]%NrPixels);
-			z[i] = ImgCorrBC[((UsefulPixels[i][0])*NrPixels) + (UsefulPixels[i][1])];
+	// With a SparseFolder the corrected, thresholded frames are kept there and
+	// frames already in it (same corrections, unchanged raw file) are neither
+	// read nor corrected again.
+	int UseSparse = (SparseFolder[0] != '\0'), SparseThis, SparseNext = 0;
+	char SparseKeyStr[8192];
+	uint64_t SparseKey = 0, RecordKeyThis = 0, RecordKeyNext = 0;
+	struct SparseStore *Sparse = NULL;
+	nFgPixels = 0;
+	if (UseSparse){
+		if (CheckDirectoryCreation(SparseFolder) == 0) return 1;
+		sprintf(SparseKeyStr,"%s %s %d %d %d %lld %d %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g %.17g",
+			darkcurrentfilename,floodfilename,NrPixels,RingNr,makeMap,BadPxIntensity,DoFullImage,Thresh,bc,Rmin,Rmax,
+			px,Ycen,Zcen,Lsd,RhoD,tx,ty,tz,p0,p1,p2,p3);
+		for (i=0;i<NrTransOpt;i++) sprintf(SparseKeyStr+strlen(SparseKeyStr)," %d",TransOpt[i]);
+		SparseKey = SparseFrameKey(SparseKeyStr);
+		Sparse = SparseStoreOpen(SparseFolder,FileStem,RingNr,NrPixels,SparseKey,1);
+		if (Sparse == NULL) UseSparse = 0;
+		else {
+			RecordKeyNext = SparseRecordKey(&Reader,SparseKeyStr,FirstFileNr);
+			SparseNext = (SparseStoreFind(Sparse,FirstFileNr,RecordKeyNext) >= 0);
 		}
-		unsigned nPeaks;
-		nPeaks = FindRegionalMaxima(z,UsefulPixels,NrPixelsThisRegion,MaximaPositions,MaximaValues,&IsSaturated,IntSat);
-		if (NrPixelsThisRegion <= minNrPx || NrPixelsThisRegion >= maxNrPx){
-			printf("Removed peak with %d pixels, position: %d %d.\n",NrPixelsThisRegion,MaximaPositions[0][0],MaximaPositions[0][1]);
-			TotNrRegions--;
-			continue;
+	}
+	// One thread reads frame n+1 while the others fit the regions of frame n.
+	# pragma omp parallel num_threads(nCPUs)
+	# pragma omp single
+	{
+	if (SparseNext == 0) ReadError = ReadFrame(&Reader,FirstFileNr,Frames[0]);
+	for (FrameNr=FirstFileNr;FrameNr<=LastFileNr && ReadError == 0;FrameNr++){
+		pixelvalue *Image = Frames[(FrameNr-FirstFileNr)%N_FRAME_BUFFERS];
+		pixelvalue *NextImage = Frames[(FrameNr-FirstFileNr+1)%N_FRAME_BUFFERS];
+		SparseThis = SparseNext;
+		RecordKeyThis = RecordKeyNext;
+		if (FrameNr < LastFileNr){
+			if (UseSparse){
+				RecordKeyNext = SparseRecordKey(&Reader,SparseKeyStr,FrameNr+1);
+				SparseNext = (SparseStoreFind(Sparse,FrameNr+1,RecordKeyNext) >= 0);
+			}
+			if (SparseNext == 0){
+				# pragma omp task firstprivate(FrameNr,NextImage) shared(Reader,ReadError)
+				ReadError = ReadFrame(&Reader,FrameNr+1,NextImage);
+			}
 		}
-		if (IsSaturated == 1){ //Saturated peaks removed
-			printf("Saturated peak removed.\n");
-			TotNrRegions--;
+		Omega = FrameOmega(FrameNr,StartNr,StartFileNr,nFrames,fnr,FileOmegaOmeStep,OmegaFirstFile,OmegaStep,FrameNrOmeChange,OmegaMissing,MisDir);
+		if (KeepFrame(Omega,OmegaRanges,nOmeRanges) == 0){
+			# pragma omp taskwait
 			continue;
 		}
-		if (nPeaks > maxNPeaks){
-			// Sort peaks by MaxIntensity, remove the smallest peaks until maxNPeaks, arrays needed MaximaPositions, MaximaValues.
-			printf("nPeaks = %d, will be reduced to %d.\n",nPeaks,maxNPeaks);
-			int MaximaPositionsT[nPeaks][2];
-			double MaximaValuesT[nPeaks];
-			double maxIntMax;
-			int maxPos;
-			for (i=0;i<maxNPeaks;i++){
-				maxIntMax = 0;
-				for (j=0;j<nPeaks;j++){
-					if (MaximaValues[j] > maxIntMax){
-						maxPos = j;
-						maxIntMax = MaximaValues[j];
+		printf("Now processing frame: %d\n",FrameNr);
+		if (SparseThis == 1){
+			for (i=0;i<nFgPixels;i++) ImgCorrBC[FgPixels[i]] = 0;
+			nFgPixels = 0;
+			if (SparseStoreRead(Sparse,FrameNr,RecordKeyThis,&nFgPixels,FgPixels,ImgCorrBC) == 0){
+				printf("Read %d pixels of frame %d from the sparse store.\n",nFgPixels,FrameNr);
+			} else {
+				printf("Could not read sparse frame %d, using the raw frame.\n",FrameNr);
+				# pragma omp taskwait
+				ReadError = ReadFrame(&Reader,FrameNr,Image);
+				if (ReadError != 0) break;
+				SparseThis = 0;
+			}
+		}
+		if (SparseThis == 0){
+			if (makeMap == 1){
+				int badPxCounter = 0;
+				for (i=0;i<NrPixels*NrPixels;i++){
+					if (Image[i] == (pixelvalue)BadPxIntensity){
+						Image[i] = 0;
+						badPxCounter++;
 					}
 				}
-				MaximaPositionsT[i][0] = MaximaPositions[maxPos][0];
-				MaximaPositionsT[i][1] = MaximaPositions[maxPos][1];
-				MaximaValuesT[i] = MaximaValues[maxPos];
-				MaximaValues[maxPos] = 0;
+				printf("Number of badPixels %d\n",badPxCounter);
 			}
-			nPeaks = maxNPeaks;
-			for (i=0;i<nPeaks;i++){
-				MaximaValues[i] = MaximaValuesT[i];
-				MaximaPositions[i][0] = MaximaPositionsT[i][0];
-				MaximaPositions[i][1] = MaximaPositionsT[i][1];
+			printf("Beam current this file: %f, Beam current scaling value: %f\n",beamcurr,bc);
+			nFgPixels = CorrectImage(Image,1,NrPixels,NrPixels,NrPixels,NrPixels,FrameMap,NAN,dark,flood,bc/beamcurr,
+				GoodCoords,Thresh,ImgCorrBC,FgPixels);
+			if (UseSparse){
+				// Keep the stored precision, so a rerun from the store fits the same values.
+				for (i=0;i<nFgPixels;i++) ImgCorrBC[FgPixels[i]] = (float)ImgCorrBC[FgPixels[i]];
+				SparseStoreWrite(Sparse,FrameNr,Omega,Thresh,RecordKeyThis,nFgPixels,FgPixels,ImgCorrBC);
 			}
 		}
-		double *IntegratedIntensity, *IMAX, *YCEN, *ZCEN, *Rads, *Etass, *OtherInfo;
-		IntegratedIntensity = malloc(nPeaks*2*sizeof(*IntegratedIntensity));
-		memset(IntegratedIntensity,0,nPeaks*2*sizeof(*IntegratedIntensity));
-		IMAX = malloc(nPeaks*2*sizeof(*IMAX));
-		YCEN = malloc(nPeaks*2*sizeof(*YCEN));
-		ZCEN = malloc(nPeaks*2*sizeof(*ZCEN));
-		Rads = malloc(nPeaks*2*sizeof(*Rads));
-		Etass = malloc(nPeaks*2*sizeof(*Etass));
-		OtherInfo = malloc(nPeaks*10*sizeof(*OtherInfo));
-		int *NrPx;
-		NrPx = malloc(nPeaks*2*sizeof(*NrPx));
-		clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&timer1);
-		int rc = Fit2DPeaks(nPeaks,NrPixelsThisRegion,z,UsefulPixels,MaximaValues,MaximaPositions,IntegratedIntensity,IMAX,YCEN,ZCEN,Rads,Etass,Ycen,Zcen,Thresh,NrPx,OtherInfo);
-		clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&timer2);
-		printf("%d %d %d %d %llf\n",RegNr,NrOfReg,NrPixelsThisRegion,nPeaks,diff(timer1,timer2));
-		timex += diff(timer1,timer2);
-		for (i=0;i<nPeaks;i++){
-			fprintf(outfilewrite,"%d %f %f %f %f %f %f %f ",(SpotIDStart+i),IntegratedIntensity[i],Omega,YCEN[i]+Ycen,ZCEN[i]+Zcen,IMAX[i],Rads[i],Etass[i]);
-			for (j=0;j<2;j++) fprintf(outfilewrite, "%f ",OtherInfo[2*i+j]);
-			fprintf(outfilewrite,"%d %d %d %d %d %f %f %f %d\n",NrPx[i],NrPixelsThisRegion,nPeaks,MaximaPositions[i][0],MaximaPositions[i][1],(double)MaximaPositions[i][0]-YCEN[i]-Ycen,(double)MaximaPositions[i][1]-ZCEN[i]-Zcen,MaximaValues[i],rc);
+		NrOfReg = FindConnectedRegions(NrPixels,NrPixels,nFgPixels,FgPixels,RegionStart,RegionPixels,LabelsCur);
+		if (Segment3D == 1){
+			int Base = nRegions, r, y, z, dy3, dz3, q, nClosed = 0, nStillOpen = 0;
+			if (nRegions+NrOfReg > nRegionsMax){
+				nRegionsMax = 2*(nRegions+NrOfReg);
+				Regions = realloc(Regions,nRegionsMax*sizeof(*Regions));
+				BlobParent = realloc(BlobParent,nRegionsMax*sizeof(*BlobParent));
+				BlobStamp = realloc(BlobStamp,nRegionsMax*sizeof(*BlobStamp));
+				OpenRegions = realloc(OpenRegions,nRegionsMax*sizeof(*OpenRegions));
+				ClosedRegions = realloc(ClosedRegions,nRegionsMax*sizeof(*ClosedRegions));
+			}
+			for (RegNr=1;RegNr<=NrOfReg;RegNr++){
+				struct TBlobRegion *Reg = &Regions[nRegions];
+				Reg->FrameNr = FrameNr;
+				Reg->Omega = Omega;
+				Reg->nPixels = RegionStart[RegNr+1]-RegionStart[RegNr];
+				Reg->Pixels = malloc(Reg->nPixels*sizeof(*Reg->Pixels));
+				Reg->Values = malloc(Reg->nPixels*sizeof(*Reg->Values));
+				for (i=0;i<Reg->nPixels;i++){
+					Reg->Pixels[i] = RegionPixels[RegionStart[RegNr]+i];
+					Reg->Values[i] = ImgCorrBC[Reg->Pixels[i]];
+				}
+				BlobParent[nRegions] = nRegions;
+				BlobStamp[nRegions] = -1;
+				nRegions++;
+			}
+			// Join with the regions of the previous frame touching in (y,z).
+			if (PrevFrameNr == FrameNr-1){
+				for (i=0;i<nFgPixels;i++){
+					y = RegionPixels[i]/NrPixels;
+					z = RegionPixels[i]%NrPixels;
+					for (dy3=-1;dy3<=1;dy3++) for (dz3=-1;dz3<=1;dz3++){
+						if (y+dy3 < 0 || y+dy3 >= NrPixels || z+dz3 < 0 || z+dz3 >= NrPixels) continue;
+						q = LabelsPrev[((y+dy3)*NrPixels)+z+dz3];
+						if (q > 0) BlobUnion(BlobParent,Base+LabelsCur[RegionPixels[i]]-1,PrevBase+q-1);
+					}
+				}
+			}
+			// Spots without a region on this frame are complete.
+			for (r=Base;r<nRegions;r++) BlobStamp[BlobFind(BlobParent,r)] = FrameNr;
+			for (i=0;i<nOpen;i++){
+				if (BlobStamp[BlobFind(BlobParent,OpenRegions[i])] == FrameNr) OpenRegions[nStillOpen++] = OpenRegions[i];
+				else ClosedRegions[nClosed++] = OpenRegions[i];
+			}
+			for (r=Base;r<nRegions;r++) OpenRegions[nStillOpen++] = r;
+			nOpen = nStillOpen;
+			for (r=PrevBase;r<PrevBase+PrevNrOfReg;r++) for (i=0;i<Regions[r].nPixels;i++) LabelsPrev[Regions[r].Pixels[i]] = 0;
+			LabelsSwap = LabelsPrev;
+			LabelsPrev = LabelsCur;
+			LabelsCur = LabelsSwap;
+			PrevFrameNr = FrameNr;
+			PrevBase = Base;
+			PrevNrOfReg = NrOfReg;
+			TotNrRegions += NrOfReg;
+			TotNrPeaks += FitWriteBlobs(Regions,BlobParent,ClosedRegions,nClosed,NrPixels,IntSat,minNrPx,maxNrPx,maxNPeaks,
+				Ycen,Zcen,Thresh,Work,outfilewrite,&SpotIDNr,&timex);
+			# pragma omp taskwait
+			continue;
+		}
+		if (NrOfReg+1 > nFitsMax){
+			nFitsMax = NrOfReg+1;
+			Fits = realloc(Fits,nFitsMax*sizeof(*Fits));
 		}
-		SpotIDStart += nPeaks;
-		free(IntegratedIntensity);
-		free(IMAX);
-		free(YCEN);
-		free(ZCEN);
-		free(Rads);
-		free(Etass);
-		free(NrPx);
+		# pragma omp taskloop grainsize(1)
+		for (RegNr=1;RegNr<=NrOfReg;RegNr++){
+			FitRegion(RegionPixels+RegionStart[RegNr],NULL,RegionStart[RegNr+1]-RegionStart[RegNr],ImgCorrBC,NrPixels,IntSat,minNrPx,maxNrPx,
+				maxNPeaks,Ycen,Zcen,Thresh,&Work[omp_get_thread_num()],&Fits[RegNr]);
+		}
+		// Write in region order, so the output does not depend on the number of threads.
+		SpotIDStart = 1;
+		NrRegionsFrame = NrOfReg;
+		for (RegNr=1;RegNr<=NrOfReg;RegNr++){
+			struct TRegionFit *Fit = &Fits[RegNr];
+			if (Fit->Status != 0){
+				NrRegionsFrame--;
+				continue;
+			}
+			printf("%d %d %d %d %llf\n",RegNr,NrOfReg,Fit->NrPixelsThisRegion,Fit->nPeaks,Fit->FitTime);
+			timex += Fit->FitTime;
+			for (i=0;i<Fit->nPeaks;i++){
+				if (RangeMode == 1) fprintf(outfilewrite,"%d ",FrameNr);
+				fprintf(outfilewrite,"%d %f %f %f %f %f %f %f ",(SpotIDStart+i),Fit->IntegratedIntensity[i],Omega,Fit->YCEN[i]+Ycen,
+					Fit->ZCEN[i]+Zcen,Fit->IMAX[i],Fit->Rads[i],Fit->Etass[i]);
+				for (j=0;j<2;j++) fprintf(outfilewrite, "%f ",Fit->OtherInfo[2*i+j]);
+				fprintf(outfilewrite,"%d %d %d %d %d %f %f %f %d\n",Fit->NrPx[i],Fit->NrPixelsThisRegion,Fit->nPeaks,
+					Fit->MaximaPositions[i][0],Fit->MaximaPositions[i][1],(double)Fit->MaximaPositions[i][0]-Fit->YCEN[i]-Ycen,
+					(double)Fit->MaximaPositions[i][1]-Fit->ZCEN[i]-Zcen,Fit->MaximaValues[i],Fit->rc);
+				if (outfilebin != NULL){
+					double Row[PS_BIN_NCOLS] = {FrameNr, SpotIDStart+i, Fit->IntegratedIntensity[i], Omega, Fit->YCEN[i]+Ycen,
+						Fit->ZCEN[i]+Zcen, Fit->IMAX[i], Fit->Rads[i], Fit->Etass[i], Fit->OtherInfo[2*i], Fit->OtherInfo[2*i+1],
+						Fit->NrPx[i], Fit->NrPixelsThisRegion, Fit->nPeaks, Fit->MaximaPositions[i][0], Fit->MaximaPositions[i][1],
+						(double)Fit->MaximaPositions[i][0]-Fit->YCEN[i]-Ycen, (double)Fit->MaximaPositions[i][1]-Fit->ZCEN[i]-Zcen,
+						Fit->MaximaValues[i], Fit->rc};
+					fwrite(Row,sizeof(Row),1,outfilebin);
+				}
+			}
+			SpotIDStart += Fit->nPeaks;
+			FreeRegionFit(Fit);
+		}
+		TotNrRegions += NrRegionsFrame;
+		TotNrPeaks += SpotIDStart-1;
+		# pragma omp taskwait
+	}
+	if (Segment3D == 1){
+		TotNrPeaks += FitWriteBlobs(Regions,BlobParent,OpenRegions,nOpen,NrPixels,IntSat,minNrPx,maxNrPx,maxNPeaks,
+			Ycen,Zcen,Thresh,Work,outfilewrite,&SpotIDNr,&timex);
+	}
 	}
+	RawFileClose(Reader.Raw);
+	SparseStoreClose(Sparse);
 	printf("Time spent in fitting: %llf\n",timex);
 	printf("Number of regions = %d\n",TotNrRegions);
-	printf("Number of peaks = %d\n",SpotIDStart-1);
+	printf("Number of peaks = %d\n",TotNrPeaks);
 	fclose(outfilewrite);
+	if (outfilebin != NULL) fclose(outfilebin);
+	for (i=0;i<N_FRAME_BUFFERS;i++) free(Frames[i]);
+	for (i=0;i<nCPUs;i++){
+		FreeMemMatrixInt(Work[i].MaximaPositions,NrPixels*10);
+		FreeMemMatrixInt(Work[i].UsefulPixels,NrPixels*10);
+		free(Work[i].MaximaValues);
+		free(Work[i].z);
+	}
+	free(Work);
+	free(Fits);
 	free(ImgCorrBC);
-	free(PositionTrackers);
-	free(z);
-	free(MaximaValues);
-	FreeMemMatrixInt(Positions,nOverlapsMaxPerImage);
-	FreeMemMatrixInt(MaximaPositions,NrPixels*10);
-	FreeMemMatrixInt(UsefulPixels,NrPixels*10);
+	free(GoodCoords);
+	free(dark);
+	free(flood);
+	free(FgPixels);
+	free(RegionStart);
+	free(RegionPixels);
+	free(LabelsPrev);
+	free(LabelsCur);
+	free(Regions);
+	free(BlobParent);
+	free(BlobStamp);
+	free(OpenRegions);
+	free(ClosedRegions);
 	end = clock();
 	diftotal = ((double)(end-start))/CLOCKS_PER_SEC;
 	printf("Time elapsed: %f s.\n",diftotal);
+	if (ReadError != 0) return 1;
 	return 0;
 }
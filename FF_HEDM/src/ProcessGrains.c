@@ -238,6 +238,9 @@ QuatToOrientMat(
     OrientMat[8] = 1 - 2*(Q1_2+Q2_2);
 }
 
+// SharedMemDataset.c
+void ShmDatasetRelease(char *DatasetID);
+
 int main(int argc, char *argv[])
 {
 	if (argc != 2){
@@ -264,7 +267,14 @@ int main(int argc, char *argv[])
     double Distance, wavelength, LatCin[6];
     double BeamThickness = 0, GlobalPosition = 0;
     int NumPhases = 1, PhaseNr = 1;
+    char DatasetID[1000] = "";
     while (fgets(aline,1000,fileParam)!=NULL){
+		str = "DatasetID ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, DatasetID);
+            continue;
+		}
         str = "Twins ";
         LowNr = strncmp(aline,str,strlen(str));
         if (LowNr==0){
@@ -735,6 +745,8 @@ int main(int argc, char *argv[])
 		}
 		fprintf(GrainsFile,"\n");
 	}
+	// Last step of the FF chain, drop the reference SaveBinData took on the shared memory dataset.
+	ShmDatasetRelease(DatasetID);
     end = clock();
 	diftotal = ((double)(end-start))/CLOCKS_PER_SEC;
     printf("Time elapsed: %f s.\n",diftotal);
@@ -0,0 +1,316 @@
+//
+// Copyright (c) 2014, UChicago Argonne, LLC
+// See LICENSE file.
+//
+
+//
+//  PseudoVoigtKernels.c
+//
+//  Vectorised residual and normal equations of the 2D pseudo-Voigt model used
+//  by PeaksFittingPerFile (parameters BG, then per peak IMax, R, Eta, Mu,
+//  SigmaGR, SigmaLR, SigmaGEta, SigmaLEta).
+//
+//  Pixels are processed PV_VW at a time with the per-peak constants hoisted
+//  and a polynomial exp. The source is written once with GCC vector types and
+//  compiled for AVX-512, AVX2+FMA and the baseline; PseudoVoigtKernelSelect
+//  picks one at run time from what the CPU supports.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define PV_VW 8
+#define PV_CHUNK 64	// Pixels per Jacobian block in the normal equations.
+#define PV_ALWAYS_INLINE static inline __attribute__((always_inline))
+
+// The vector helpers are always inlined, no vector crosses a call boundary.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+typedef double vdouble __attribute__((vector_size(PV_VW*sizeof(double))));
+typedef int64_t vint __attribute__((vector_size(PV_VW*sizeof(int64_t))));
+
+// Per peak constants of the model.
+struct TPVPeak {
+	double IMax, R, Eta, Mu, SGR, SLR, SGE, SLE;
+	double AL, AG;			// IMax*Mu, IMax*(1-Mu)
+	double InvSLR2, InvSLE2;	// 1/SigmaL^2
+	double HInvSGR2, HInvSGE2;	// -0.5/SigmaG^2
+};
+
+PV_ALWAYS_INLINE void
+PVPeakConstants(int nPeaks, const double *x, struct TPVPeak *P)
+{
+	int j;
+	for (j=0;j<nPeaks;j++){
+		const double *p = x + (8*j) + 1;
+		P[j].IMax = p[0];
+		P[j].R = p[1];
+		P[j].Eta = p[2];
+		P[j].Mu = p[3];
+		P[j].SGR = p[4];
+		P[j].SLR = p[5];
+		P[j].SGE = p[6];
+		P[j].SLE = p[7];
+		P[j].AL = p[0]*p[3];
+		P[j].AG = p[0]*(1-p[3]);
+		P[j].InvSLR2 = 1/(p[5]*p[5]);
+		P[j].InvSLE2 = 1/(p[7]*p[7]);
+		P[j].HInvSGR2 = -0.5/(p[4]*p[4]);
+		P[j].HInvSGE2 = -0.5/(p[6]*p[6]);
+	}
+}
+
+PV_ALWAYS_INLINE vdouble
+PVSelect(vint Mask, vdouble a, vdouble b)
+{
+	return (vdouble)((Mask & (vint)a) | (~Mask & (vint)b));
+}
+
+// exp(x) to about 1 ulp: x = k ln2 + r with |r| <= ln2/2, a degree 13
+// polynomial for exp(r), 2^k put straight into the exponent bits.
+PV_ALWAYS_INLINE vdouble
+PVExp(vdouble x)
+{
+	const vdouble Shift = (vdouble){} + 6755399441055744.0; // 1.5*2^52, rounds k to an integer
+	vdouble Lo = (vdouble){} - 700, Hi = (vdouble){} + 700;
+	vdouble t, k, r, p;
+	x = PVSelect(x < Lo, Lo, x);
+	x = PVSelect(x > Hi, Hi, x);
+	t = x*1.4426950408889634 + Shift;
+	k = t - Shift;
+	r = x - k*6.93147180369123816490e-01;
+	r = r - k*1.90821492927058770002e-10;
+	p = r*(1.0/6227020800.0) + (1.0/479001600.0);
+	p = p*r + (1.0/39916800.0);
+	p = p*r + (1.0/3628800.0);
+	p = p*r + (1.0/362880.0);
+	p = p*r + (1.0/40320.0);
+	p = p*r + (1.0/5040.0);
+	p = p*r + (1.0/720.0);
+	p = p*r + (1.0/120.0);
+	p = p*r + (1.0/24.0);
+	p = p*r + (1.0/6.0);
+	p = p*r + 0.5;
+	p = p*r + 1.0;
+	p = p*r + 1.0;
+	vint e = ((vint)t - 0x4338000000000000LL + 1023) << 52;
+	return p*(vdouble)e;
+}
+
+PV_ALWAYS_INLINE double
+PVSum(vdouble v)
+{
+	double s = 0;
+	int q;
+	for (q=0;q<PV_VW;q++) s += v[q];
+	return s;
+}
+
+// Loads PV_VW pixels from i on. Past NrPixels the last pixel is repeated and
+// Valid is 0 for those lanes.
+PV_ALWAYS_INLINE void
+PVLoad(int i, int NrPixels, const double *z, const double *Rs, const double *Etas,
+	vdouble *vz, vdouble *vR, vdouble *vEta, vdouble *Valid)
+{
+	int q;
+	if (i+PV_VW <= NrPixels){
+		memcpy(vz,z+i,sizeof(*vz));
+		memcpy(vR,Rs+i,sizeof(*vR));
+		memcpy(vEta,Etas+i,sizeof(*vEta));
+		*Valid = (vdouble){} + 1;
+		return;
+	}
+	for (q=0;q<PV_VW;q++){
+		int k = (i+q < NrPixels) ? i+q : NrPixels-1;
+		(*vz)[q] = z[k];
+		(*vR)[q] = Rs[k];
+		(*vEta)[q] = Etas[k];
+		(*Valid)[q] = (i+q < NrPixels) ? 1 : 0;
+	}
+}
+
+PV_ALWAYS_INLINE double
+PVResidualKernel(int nPeaks, int NrPixels, const double *z, const double *Rs, const double *Etas, const double *x)
+{
+	struct TPVPeak P[nPeaks];
+	vdouble vz, vR, vEta, Valid, Calc, DR, DE, R2, E2, L, G, Cost = {};
+	int i, j;
+	PVPeakConstants(nPeaks,x,P);
+	for (i=0;i<NrPixels;i+=PV_VW){
+		PVLoad(i,NrPixels,z,Rs,Etas,&vz,&vR,&vEta,&Valid);
+		Calc = (vdouble){} + x[0];
+		for (j=0;j<nPeaks;j++){
+			DR = vR - P[j].R;
+			DE = vEta - P[j].Eta;
+			R2 = DR*DR;
+			E2 = DE*DE;
+			L = 1/(((R2*P[j].InvSLR2)+1)*((E2*P[j].InvSLE2)+1));
+			G = PVExp((R2*P[j].HInvSGR2)+(E2*P[j].HInvSGE2));
+			Calc += (P[j].AL*L) + (P[j].AG*G);
+		}
+		Calc = (Calc - vz)*Valid;
+		Cost += Calc*Calc;
+	}
+	return PVSum(Cost);
+}
+
+// Same sums as the scalar PseudoVoigtNormalEquations in PeaksFittingPerFile:
+// sum of squared residuals, J^T r and the full J^T J, a peak only adding to
+// the Jacobian of pixels where its shape is at least MinShape. The Jacobian
+// of PV_CHUNK pixels is kept column-wise so J^T J is built from dot products
+// over the peaks present in that block.
+PV_ALWAYS_INLINE double
+PVNormalEquationsKernel(int nPeaks, int NrPixels, const double *z, const double *Rs, const double *Etas,
+	const double *x, double *JtJ, double *Jtr, double MinShape, vdouble *J, int *ActivePeaks)
+{
+	struct TPVPeak P[nPeaks];
+	int n = 1 + (8*nPeaks);
+	int i0, b, nb, j, k, l, m, c, q, nActive, row, col;
+	vdouble r[PV_CHUNK/PV_VW], vz, vR, vEta, Valid, DR, DE, a, bb, L, G, Shape, ML, MG, Active, s, Cost = {};
+	vdouble *d;
+	vint Mask;
+	double Act[nPeaks];
+	PVPeakConstants(nPeaks,x,P);
+	memset(JtJ,0,n*n*sizeof(*JtJ));
+	memset(Jtr,0,n*sizeof(*Jtr));
+	for (i0=0;i0<NrPixels;i0+=PV_CHUNK){
+		nb = ((NrPixels-i0 < PV_CHUNK ? NrPixels-i0 : PV_CHUNK) + PV_VW - 1)/PV_VW;
+		for (j=0;j<nPeaks;j++) Act[j] = 0;
+		for (b=0;b<nb;b++){
+			PVLoad(i0+(b*PV_VW),NrPixels,z,Rs,Etas,&vz,&vR,&vEta,&Valid);
+			r[b] = x[0] - vz;
+			for (j=0;j<nPeaks;j++){
+				DR = vR - P[j].R;
+				DE = vEta - P[j].Eta;
+				a = DR*DR*P[j].InvSLR2;
+				bb = DE*DE*P[j].InvSLE2;
+				L = 1/((a+1)*(bb+1));
+				G = PVExp((DR*DR*P[j].HInvSGR2)+(DE*DE*P[j].HInvSGE2));
+				Shape = (P[j].Mu*L) + ((1-P[j].Mu)*G);
+				r[b] += P[j].IMax*Shape;
+				Mask = (Shape >= MinShape);
+				Active = PVSelect(Mask,Valid,(vdouble){});
+				for (q=0;q<PV_VW;q++) Act[j] += Active[q];
+				ML = P[j].IMax*P[j].Mu*L*Active;
+				MG = P[j].IMax*(1-P[j].Mu)*G*Active;
+				d = &J[((8*j)*(PV_CHUNK/PV_VW))+b];
+				d[0*(PV_CHUNK/PV_VW)] = Shape*Active;                                                   // IMax
+				d[1*(PV_CHUNK/PV_VW)] = (ML*2*DR*P[j].InvSLR2/(a+1)) + (MG*DR/(P[j].SGR*P[j].SGR));      // R
+				d[2*(PV_CHUNK/PV_VW)] = (ML*2*DE*P[j].InvSLE2/(bb+1)) + (MG*DE/(P[j].SGE*P[j].SGE));     // Eta
+				d[3*(PV_CHUNK/PV_VW)] = P[j].IMax*(L-G)*Active;                                         // Mu
+				d[4*(PV_CHUNK/PV_VW)] = MG*DR*DR/(P[j].SGR*P[j].SGR*P[j].SGR);                          // SigmaGR
+				d[5*(PV_CHUNK/PV_VW)] = ML*2*a/(P[j].SLR*(a+1));                                        // SigmaLR
+				d[6*(PV_CHUNK/PV_VW)] = MG*DE*DE/(P[j].SGE*P[j].SGE*P[j].SGE);                          // SigmaGEta
+				d[7*(PV_CHUNK/PV_VW)] = ML*2*bb/(P[j].SLE*(bb+1));                                      // SigmaLEta
+			}
+			r[b] *= Valid;
+			Cost += r[b]*r[b];
+			Jtr[0] += PVSum(r[b]);
+			JtJ[0] += PVSum(Valid);
+		}
+		nActive = 0;
+		for (j=0;j<nPeaks;j++) if (Act[j] > 0) ActivePeaks[nActive++] = j;
+		for (k=0;k<nActive;k++){
+			row = (8*ActivePeaks[k])+1;
+			for (l=0;l<8;l++){
+				vdouble *Jl = &J[((row-1+l)*(PV_CHUNK/PV_VW))];
+				s = (vdouble){};
+				for (b=0;b<nb;b++) s += Jl[b]*r[b];
+				Jtr[row+l] += PVSum(s);
+				s = (vdouble){};
+				for (b=0;b<nb;b++) s += Jl[b];
+				JtJ[(row+l)*n] += PVSum(s);
+				for (m=0;m<=k;m++){
+					col = (8*ActivePeaks[m])+1;
+					int lMax = (m == k) ? l+1 : 8;
+					for (c=0;c<lMax;c++){
+						vdouble *Jc = &J[((col-1+c)*(PV_CHUNK/PV_VW))];
+						s = (vdouble){};
+						for (b=0;b<nb;b++) s += Jl[b]*Jc[b];
+						JtJ[((row+l)*n)+col+c] += PVSum(s);
+					}
+				}
+			}
+		}
+	}
+	for (k=0;k<n;k++) for (l=k+1;l<n;l++) JtJ[(k*n)+l] = JtJ[(l*n)+k];
+	return PVSum(Cost);
+}
+
+#define PV_VARIANTS(SUFFIX, TARGET) \
+TARGET static double \
+PVResidual##SUFFIX(int nPeaks, int NrPixels, const double *z, const double *Rs, const double *Etas, const double *x) \
+{ \
+	return PVResidualKernel(nPeaks,NrPixels,z,Rs,Etas,x); \
+} \
+TARGET static double \
+PVNormalEquations##SUFFIX(int nPeaks, int NrPixels, const double *z, const double *Rs, const double *Etas, \
+	const double *x, double *JtJ, double *Jtr, double MinShape, vdouble *J, int *ActivePeaks) \
+{ \
+	return PVNormalEquationsKernel(nPeaks,NrPixels,z,Rs,Etas,x,JtJ,Jtr,MinShape,J,ActivePeaks); \
+}
+
+PV_VARIANTS(Generic,)
+#if defined(__x86_64__) && defined(__GNUC__)
+PV_VARIANTS(AVX2,__attribute__((target("avx2,fma"))))
+PV_VARIANTS(AVX512,__attribute__((target("avx512f"))))
+#endif
+
+static double (*PVResidual)(int, int, const double *, const double *, const double *, const double *) = PVResidualGeneric;
+static double (*PVNormalEquations)(int, int, const double *, const double *, const double *,
+	const double *, double *, double *, double, vdouble *, int *) = PVNormalEquationsGeneric;
+
+// Name is auto, avx512, avx2 or generic. Returns 1 if the CPU can not run the
+// requested kernel, the generic one stays selected then.
+int
+PseudoVoigtKernelSelect(char *Name)
+{
+	int Auto = (strcmp(Name,"auto") == 0);
+	PVResidual = PVResidualGeneric;
+	PVNormalEquations = PVNormalEquationsGeneric;
+#if defined(__x86_64__) && defined(__GNUC__)
+	__builtin_cpu_init();
+	if ((Auto || strcmp(Name,"avx512") == 0) && __builtin_cpu_supports("avx512f")){
+		PVResidual = PVResidualAVX512;
+		PVNormalEquations = PVNormalEquationsAVX512;
+		printf("Pseudo-Voigt kernel: avx512\n");
+		return 0;
+	}
+	if ((Auto || strcmp(Name,"avx2") == 0) && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+		PVResidual = PVResidualAVX2;
+		PVNormalEquations = PVNormalEquationsAVX2;
+		printf("Pseudo-Voigt kernel: avx2\n");
+		return 0;
+	}
+#endif
+	printf("Pseudo-Voigt kernel: generic\n");
+	if (Auto || strcmp(Name,"generic") == 0) return 0;
+	printf("Kernel %s is not supported on this CPU.\n",Name);
+	return 1;
+}
+
+double
+PseudoVoigtResidual(int nPeaks, int NrPixels, const double *z, const double *Rs, const double *Etas, const double *x)
+{
+	return PVResidual(nPeaks,NrPixels,z,Rs,Etas,x);
+}
+
+// Jacobian block for PseudoVoigtNormalEquationsSIMD, free with free(). NULL
+// if it can not be allocated.
+double *
+PseudoVoigtJacobianAlloc(int nPeaks)
+{
+	vdouble *J;
+	if (posix_memalign((void **)&J,sizeof(vdouble),(size_t)8*nPeaks*PV_CHUNK*sizeof(double)) != 0) return NULL;
+	return (double *)J;
+}
+
+// J from PseudoVoigtJacobianAlloc, ActivePeaks has room for nPeaks.
+double
+PseudoVoigtNormalEquationsSIMD(int nPeaks, int NrPixels, const double *z, const double *Rs, const double *Etas,
+	const double *x, double *JtJ, double *Jtr, double MinShape, double *J, int *ActivePeaks)
+{
+	return PVNormalEquations(nPeaks,NrPixels,z,Rs,Etas,x,JtJ,Jtr,MinShape,(vdouble *)J,ActivePeaks);
+}
@@ -0,0 +1,125 @@
+//
+// Copyright (c) 2014, UChicago Argonne, LLC
+// See LICENSE file.
+//
+
+//
+//  RawFrames.c
+//
+//  Raw detector files (GE and other headered binary stacks) mapped read-only
+//  instead of read with fseek/fread. The file is advised sequential, so the
+//  kernel reads ahead while frames are processed, and frames are handed out as
+//  pointers into the mapping, which CorrectImage (ImageCorrection.c) converts
+//  to double.
+//
+//  Frames of FrameSize bytes follow a header. Frames either start right after
+//  HeadSize bytes, or are aligned to the end of the file (GE files with a
+//  variable header, as PeaksFittingPerFile reads them).
+//
+//  dType as in the DataType parameter: 1 uint16, 2 double, 3 float, 4 uint32,
+//  5 int32.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+struct RawFile {
+	char *Map;
+	size_t Size;
+	size_t FrameSize;
+	size_t FirstFrame;
+	int nFrames;
+};
+
+int
+RawPixelSize(int dType)
+{
+	switch (dType){
+		case 1: return sizeof(uint16_t);
+		case 2: return sizeof(double);
+		case 3: return sizeof(float);
+		case 4: return sizeof(uint32_t);
+		case 5: return sizeof(int32_t);
+	}
+	return 0;
+}
+
+// Map FN, frames of NrPixels values of PixelSize bytes after HeadSize bytes.
+// Returns NULL if the file can not be opened. A file shorter than a frame
+// gives a handle with no frames.
+struct RawFile *
+RawFileOpen(char *FN, int PixelSize, size_t NrPixels, size_t HeadSize, int AlignEnd)
+{
+	struct stat s;
+	int fd = open(FN,O_RDONLY);
+	if (fd < 0){
+		printf("Could not open %s: %s\n",FN,strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd,&s) != 0){
+		printf("Could not stat %s: %s\n",FN,strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	struct RawFile *F = calloc(1,sizeof(*F));
+	F->Size = s.st_size;
+	F->FrameSize = (size_t)PixelSize*NrPixels;
+	if (F->FrameSize == 0 || F->Size <= HeadSize || F->Size-HeadSize < F->FrameSize){
+		close(fd);
+		return F;
+	}
+	F->nFrames = (int)((F->Size-HeadSize)/F->FrameSize);
+	F->FirstFrame = AlignEnd ? F->Size - F->nFrames*F->FrameSize : HeadSize;
+	F->Map = mmap(0,F->Size,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if (F->Map == MAP_FAILED){
+		printf("mmap %s failed: %s\n",FN,strerror(errno));
+		free(F);
+		return NULL;
+	}
+	madvise(F->Map,F->Size,MADV_SEQUENTIAL);
+	return F;
+}
+
+int
+RawFileNrFrames(struct RawFile *F)
+{
+	return F->nFrames;
+}
+
+// Frame FrameNr (0 based) inside the mapping, NULL if out of range.
+const void *
+RawFrame(struct RawFile *F, int FrameNr)
+{
+	if (F->Map == NULL || FrameNr < 0 || FrameNr >= F->nFrames) return NULL;
+	return F->Map + F->FirstFrame + (size_t)FrameNr*F->FrameSize;
+}
+
+// Ask the kernel to start reading frames FrameNr..FrameNr+nFrames-1.
+void
+RawFrameWillNeed(struct RawFile *F, int FrameNr, int nFrames)
+{
+	if (F->Map == NULL || FrameNr < 0 || FrameNr >= F->nFrames) return;
+	if (FrameNr+nFrames > F->nFrames) nFrames = F->nFrames-FrameNr;
+	size_t Page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t Start = F->FirstFrame + (size_t)FrameNr*F->FrameSize;
+	size_t End = Start + (size_t)nFrames*F->FrameSize;
+	Start -= Start % Page;
+	madvise(F->Map+Start,End-Start,MADV_WILLNEED);
+}
+
+void
+RawFileClose(struct RawFile *F)
+{
+	if (F == NULL) return;
+	if (F->Map != NULL) munmap(F->Map,F->Size);
+	free(F);
+}
@@ -25,6 +25,28 @@
 #define MAX_N_SPOTS 6000000   // max nr of observed spots that can be stored
 #define MAX_N_RINGS 500       // max nr of rings that can be stored (applies to the arrays ringttheta, ringhkl, etc)
 
+// SharedMemDataset.c
+void ShmDatasetCreate(char *DatasetID);
+void ShmDatasetPublish(char *DatasetID, char *FileName);
+
+// With a DatasetID, copy the bins into their /dev/shm namespace.
+void
+PublishBins(char *DatasetID, int nosaveall)
+{
+	struct stat s;
+	if (DatasetID[0] == '\0') return;
+	ShmDatasetCreate(DatasetID);
+	ShmDatasetPublish(DatasetID,"Spots.bin");
+	ShmDatasetPublish(DatasetID,"SpotsCompact.bin");
+	ShmDatasetPublish(DatasetID,"ExtraInfo.bin");
+	if (stat("BigDetectorMask.bin",&s) == 0) ShmDatasetPublish(DatasetID,"BigDetectorMask.bin");
+	if (nosaveall == 1) return;
+	ShmDatasetPublish(DatasetID,"Data.bin");
+	ShmDatasetPublish(DatasetID,"nData.bin");
+	ShmDatasetPublish(DatasetID,"SpotsClaimed.bin");
+	printf("Published bins to shared memory dataset %s.\n",DatasetID);
+}
+
 static inline
 double**
 allocMatrix(int nrows, int ncols)
@@ -100,7 +122,14 @@ int main(int arc, char* argv[]){
 	double omemargin0, etamargin0, rotationstep, RingRadii[MAX_N_RINGS],
 			RingRadiiUser[MAX_N_RINGS], etabinsize, omebinsize;
 	int nosaveall = 0;
+	char DatasetID[4096] = "";
 	while (fgets(aline,4096,fileParam)!=NULL){
+        str = "DatasetID ";
+        LowNr = strncmp(aline,str,strlen(str));
+        if (LowNr==0){
+            sscanf(aline,"%s %s", dummy, DatasetID);
+            continue;
+        }
         str = "NoSaveAll ";
         LowNr = strncmp(aline,str,strlen(str));
         if (LowNr==0){
@@ -185,7 +214,23 @@ int main(int arc, char* argv[]){
 	fwrite(SpotsMat,nSpots*9*sizeof(*SpotsMat),1,SpotsFile);
 	FILE *ExtraFile = fopen(ExtraFN,"wb");
 	fwrite(ExtraMat,nSpots*14*sizeof(*ExtraMat),1,ExtraFile);	
+	// The columns the indexer compares against (radial distance to the ideal
+	// ring, radius, eta, omega) as float32, used by the float32 indexer build.
+	float *CompactMat = malloc(nSpots*4*sizeof(*CompactMat));
+	for (i=0;i<nSpots;i++){
+		CompactMat[i*4+0] = ObsSpots[i][8];
+		CompactMat[i*4+1] = ObsSpots[i][3];
+		CompactMat[i*4+2] = ObsSpots[i][6];
+		CompactMat[i*4+3] = ObsSpots[i][2];
+	}
+	FILE *CompactFile = fopen("SpotsCompact.bin","wb");
+	fwrite(CompactMat,nSpots*4*sizeof(*CompactMat),1,CompactFile);
+	fclose(CompactFile);
+	free(CompactMat);
 	if (nosaveall == 1){
+		fclose(SpotsFile);
+		fclose(ExtraFile);
+		PublishBins(DatasetID,nosaveall);
 		return 0;
 	}
 	
@@ -354,6 +399,22 @@ int main(int arc, char* argv[]){
 	fwrite(DataStore,TotNumberOfBins*sizeof(*DataStore),1,DataFile);
 	FILE *nDataFile = fopen(nDataFN,"wb");
 	fwrite(nDataStore,LengthNDataStore*2*sizeof(*nDataStore),1,nDataFile);
+	// One claim counter per row of Spots.bin, bumped by the indexer (ClaimSpots 1)
+	// every time a grain it accepts matches that spot. The header holds the
+	// ClaimRunID of the claims (0) and the number of spots.
+	char *ClaimsFN = "SpotsClaimed.bin";
+	long long int ClaimsHeader[2] = {0, nSpots};
+	unsigned char *SpotsClaimed = calloc(nSpots,sizeof(*SpotsClaimed));
+	FILE *ClaimsFile = fopen(ClaimsFN,"wb");
+	fwrite(ClaimsHeader,sizeof(ClaimsHeader),1,ClaimsFile);
+	fwrite(SpotsClaimed,nSpots*sizeof(*SpotsClaimed),1,ClaimsFile);
+	fclose(ClaimsFile);
+	free(SpotsClaimed);
+	fclose(SpotsFile);
+	fclose(ExtraFile);
+	fclose(DataFile);
+	fclose(nDataFile);
+	PublishBins(DatasetID,nosaveall);
 	end = clock();
 	diftotal = ((double)(end-start))/CLOCKS_PER_SEC;
     printf("Total Time elapsed: %f s.\n",diftotal);
@@ -0,0 +1,179 @@
+//
+// Copyright (c) 2014, UChicago Argonne, LLC
+// See LICENSE file.
+//
+
+//
+//  SharedMemDataset.c
+//
+//  Binned FF datasets in /dev/shm, shared by SaveBinData, the indexer,
+//  FitPosOrStrains and ProcessGrains.
+//
+//  Without a DatasetID the files are the flat /dev/shm/<name>.bin put there
+//  by SHM.sh. With a DatasetID (parameter file) they live in
+//  /dev/shm/MIDAS_<DatasetID>/, so several layers or samples can be indexed
+//  on the same node. The directory holds a RefCount file: SaveBinData holds
+//  one reference (dropped by ProcessGrains), every running consumer holds one,
+//  and whoever drops the last reference removes the directory.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#define SHM_HUGEPAGE_MIN_SIZE (2*1024*1024)
+
+static void
+ShmCheck (int test, const char * message, ...)
+{
+	if (test) {
+		va_list args;
+		va_start (args, message);
+		vfprintf (stderr, message, args);
+		va_end (args);
+		fprintf (stderr, "\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+static int
+ShmUseNamespace(char *DatasetID)
+{
+	return (DatasetID != NULL && DatasetID[0] != '\0');
+}
+
+void
+ShmDatasetPath(char *DatasetID, char *FileName, char *Path)
+{
+	if (ShmUseNamespace(DatasetID)) sprintf(Path,"/dev/shm/MIDAS_%s/%s",DatasetID,FileName);
+	else sprintf(Path,"/dev/shm/%s",FileName);
+}
+
+static void
+ShmDatasetRemove(char *DatasetID)
+{
+	char dir[4096], fn[4096+256];
+	struct dirent *ent;
+	ShmDatasetPath(DatasetID,"",dir);
+	DIR *d = opendir(dir);
+	if (d == NULL) return;
+	while ((ent = readdir(d)) != NULL){
+		if (strcmp(ent->d_name,".") == 0 || strcmp(ent->d_name,"..") == 0) continue;
+		sprintf(fn,"%s%s",dir,ent->d_name);
+		unlink(fn);
+	}
+	closedir(d);
+	rmdir(dir);
+	printf("Removed shared memory dataset %s.\n",dir);
+}
+
+// Returns the new reference count, -1 without a namespace.
+static int
+ShmDatasetAddRef(char *DatasetID, int Delta)
+{
+	char fn[4096];
+	int count = 0;
+	if (!ShmUseNamespace(DatasetID)) return -1;
+	ShmDatasetPath(DatasetID,"RefCount",fn);
+	int fd = open(fn,O_RDWR|O_CREAT,S_IRUSR|S_IWUSR);
+	ShmCheck(fd < 0, "open %s failed: %s", fn, strerror(errno));
+	flock(fd,LOCK_EX);
+	if (pread(fd,&count,sizeof(count),0) != sizeof(count)) count = 0;
+	count += Delta;
+	if (count < 0) count = 0;
+	ShmCheck(pwrite(fd,&count,sizeof(count),0) != sizeof(count), "write %s failed: %s", fn, strerror(errno));
+	if (count == 0) ShmDatasetRemove(DatasetID);
+	flock(fd,LOCK_UN);
+	close(fd);
+	return count;
+}
+
+// Called by SaveBinData. A new namespace starts with the creator's reference,
+// rewriting an existing one keeps its count.
+void
+ShmDatasetCreate(char *DatasetID)
+{
+	char dir[4096];
+	if (!ShmUseNamespace(DatasetID)) return;
+	ShmDatasetPath(DatasetID,"",dir);
+	if (mkdir(dir,S_IRWXU) == 0) ShmDatasetAddRef(DatasetID,1);
+	else ShmCheck(errno != EEXIST, "mkdir %s failed: %s", dir, strerror(errno));
+}
+
+// Copy FileName from the working directory into the namespace. The copy is
+// renamed into place, so running consumers keep their old mapping.
+void
+ShmDatasetPublish(char *DatasetID, char *FileName)
+{
+	char path[4096], tmppath[4096+8];
+	char buf[1<<16];
+	ssize_t n;
+	if (!ShmUseNamespace(DatasetID)) return;
+	int in = open(FileName,O_RDONLY);
+	ShmCheck(in < 0, "open %s failed: %s", FileName, strerror(errno));
+	ShmDatasetPath(DatasetID,FileName,path);
+	sprintf(tmppath,"%s.tmp",path);
+	int out = open(tmppath,O_WRONLY|O_CREAT|O_TRUNC,S_IRUSR|S_IWUSR);
+	ShmCheck(out < 0, "open %s failed: %s", tmppath, strerror(errno));
+	while ((n = read(in,buf,sizeof(buf))) > 0){
+		ShmCheck(write(out,buf,n) != n, "write %s failed: %s", tmppath, strerror(errno));
+	}
+	close(in);
+	close(out);
+	ShmCheck(rename(tmppath,path) != 0, "rename %s failed: %s", tmppath, strerror(errno));
+}
+
+// Drop a reference, used by ProcessGrains for the one SaveBinData holds.
+void
+ShmDatasetRelease(char *DatasetID)
+{
+	ShmDatasetAddRef(DatasetID,-1);
+}
+
+static char ShmAttachedID[4096];
+
+static void
+ShmDatasetDetach(void)
+{
+	ShmDatasetRelease(ShmAttachedID);
+}
+
+// Hold a reference until the process exits, whichever way main returns.
+void
+ShmDatasetAttach(char *DatasetID)
+{
+	if (ShmDatasetAddRef(DatasetID,1) < 0) return;
+	printf("Using shared memory dataset %s.\n",DatasetID);
+	strcpy(ShmAttachedID,DatasetID);
+	atexit(ShmDatasetDetach);
+}
+
+// Map a dataset file read-only. Large arrays ask for transparent huge pages,
+// which tmpfs honours when shmem_enabled (or the huge= mount option) is advise.
+void *
+ShmDatasetMap(char *DatasetID, char *FileName, size_t *Size)
+{
+	char path[4096];
+	struct stat s;
+	ShmDatasetPath(DatasetID,FileName,path);
+	int fd = open(path,O_RDONLY);
+	ShmCheck(fd < 0, "open %s failed: %s", path, strerror(errno));
+	ShmCheck(fstat(fd,&s) < 0, "stat %s failed: %s", path, strerror(errno));
+	*Size = s.st_size;
+	void *p = mmap(0,*Size,PROT_READ,MAP_SHARED,fd,0);
+	ShmCheck(p == MAP_FAILED, "mmap %s failed: %s", path, strerror(errno));
+	close(fd);
+#ifdef MADV_HUGEPAGE
+	if (*Size >= SHM_HUGEPAGE_MIN_SIZE) madvise(p,*Size,MADV_HUGEPAGE);
+#endif
+	return p;
+}
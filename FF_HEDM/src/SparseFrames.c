@@ -0,0 +1,241 @@
+//
+// Copyright (c) 2014, UChicago Argonne, LLC
+// See LICENSE file.
+//
+
+//
+//  SparseFrames.c
+//
+//  Thresholded frames stored as their lit pixels only. PeaksFittingPerFile
+//  keeps the frames of a scan after dark/flood correction, the image
+//  transformations and the ring threshold, and reads them back instead of
+//  the raw frames on the next run. ForwardSimulation writes its frames in the
+//  same format, utils/SparseFrames.py reads them in python.
+//
+//  File <Folder>/<ScanStem>_<RingNr>.sparse holds all frames of one scan and
+//  ring: the store header below, then one record per frame in the order the
+//  frames were made, a record header followed by nPixels
+//  {uint16 Row, uint16 Col, float Intensity} in raster order. Row and Col
+//  index the corrected image as PeaksFittingPerFile uses it (Row is y, Col
+//  is z, raw frames are transposed). RingNr 0 means the full image.
+//
+//  The store Key identifies the corrections, a store with an other key is
+//  emptied when it is opened for writing. The record Key identifies the data
+//  the frame was made from, a record with an other key is treated as missing.
+//  Records are appended under a lock, so processes working on different frame
+//  ranges of a scan share the store. The frame index is built when the store
+//  is opened, a later record of a frame replaces an earlier one.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#define SPARSE_FRAME_MAGIC 0x4652504d
+#define SPARSE_FRAME_VERSION 2
+
+struct SparseStoreHeader {
+	uint32_t Magic;
+	uint32_t Version;
+	int32_t NrPixels;
+	int32_t RingNr;
+	uint64_t Key;
+};
+
+struct SparseRecordHeader {
+	int32_t FrameNr;
+	int32_t nPixels;
+	double Omega;
+	double Threshold;
+	uint64_t Key;
+};
+
+struct SparsePixel {
+	uint16_t Row;
+	uint16_t Col;
+	float Intensity;
+};
+
+struct SparseStore {
+	int fd;
+	int NrPixels;
+	char Path[4096+64];
+	int nIndex;          // Frame numbers 0..nIndex-1 have room in the index.
+	off_t *Offset;       // Of the record header, 0 if the frame is not stored.
+	uint64_t *RecordKey;
+	int *nPixels;
+};
+
+// FNV-1a of a text describing the corrections.
+uint64_t
+SparseFrameKey(char *Description)
+{
+	uint64_t h = 1469598103934665603ULL;
+	unsigned char *p;
+	for (p=(unsigned char *)Description;*p!='\0';p++){ h ^= *p; h *= 1099511628211ULL; }
+	return h;
+}
+
+static void
+SparseStoreIndexAdd(struct SparseStore *S, int FrameNr, off_t Offset, int nPixels, uint64_t Key)
+{
+	int i, n;
+	if (FrameNr >= S->nIndex){
+		n = 2*FrameNr + 64;
+		S->Offset = realloc(S->Offset,n*sizeof(*S->Offset));
+		S->RecordKey = realloc(S->RecordKey,n*sizeof(*S->RecordKey));
+		S->nPixels = realloc(S->nPixels,n*sizeof(*S->nPixels));
+		for (i=S->nIndex;i<n;i++) S->Offset[i] = 0;
+		S->nIndex = n;
+	}
+	S->Offset[FrameNr] = Offset;
+	S->RecordKey[FrameNr] = Key;
+	S->nPixels[FrameNr] = nPixels;
+}
+
+// Opens (Writable: creates) the store of a scan and ring and indexes the
+// frames in it. Returns NULL if it can not be opened, or for reading if it
+// was made with other corrections than Key.
+struct SparseStore *
+SparseStoreOpen(char *Folder, char *ScanStem, int RingNr, int NrPixels, uint64_t Key, int Writable)
+{
+	struct SparseStore *S = calloc(1,sizeof(*S));
+	struct SparseStoreHeader Header;
+	struct SparseRecordHeader Rec;
+	struct stat s;
+	off_t Off;
+	sprintf(S->Path,"%s/%s_%d.sparse",Folder,ScanStem,RingNr);
+	S->NrPixels = NrPixels;
+	S->fd = open(S->Path,Writable ? O_RDWR|O_CREAT : O_RDONLY,S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+	if (S->fd < 0){
+		if (Writable) printf("Could not open sparse store %s: %s\n",S->Path,strerror(errno));
+		free(S);
+		return NULL;
+	}
+	flock(S->fd,Writable ? LOCK_EX : LOCK_SH);
+	if (pread(S->fd,&Header,sizeof(Header),0) != sizeof(Header) || Header.Magic != SPARSE_FRAME_MAGIC
+		|| Header.Version != SPARSE_FRAME_VERSION || Header.NrPixels != NrPixels || Header.RingNr != RingNr
+		|| Header.Key != Key){
+		if (Writable == 0){
+			close(S->fd);
+			free(S);
+			return NULL;
+		}
+		memset(&Header,0,sizeof(Header));
+		Header.Magic = SPARSE_FRAME_MAGIC;
+		Header.Version = SPARSE_FRAME_VERSION;
+		Header.NrPixels = NrPixels;
+		Header.RingNr = RingNr;
+		Header.Key = Key;
+		if (ftruncate(S->fd,0) != 0 || pwrite(S->fd,&Header,sizeof(Header),0) != sizeof(Header)){
+			printf("Could not write sparse store %s: %s\n",S->Path,strerror(errno));
+			close(S->fd);
+			free(S);
+			return NULL;
+		}
+	}
+	fstat(S->fd,&s);
+	// A record cut short (crashed writer) ends the index.
+	for (Off=sizeof(Header);Off+(off_t)sizeof(Rec)<=s.st_size;Off+=sizeof(Rec)+(off_t)Rec.nPixels*sizeof(struct SparsePixel)){
+		if (pread(S->fd,&Rec,sizeof(Rec),Off) != sizeof(Rec) || Rec.FrameNr < 0 || Rec.nPixels < 0
+			|| Off+(off_t)sizeof(Rec)+(off_t)Rec.nPixels*sizeof(struct SparsePixel) > s.st_size) break;
+		SparseStoreIndexAdd(S,Rec.FrameNr,Off,Rec.nPixels,Rec.Key);
+	}
+	flock(S->fd,LOCK_UN);
+	return S;
+}
+
+void
+SparseStoreClose(struct SparseStore *S)
+{
+	if (S == NULL) return;
+	close(S->fd);
+	free(S->Offset);
+	free(S->RecordKey);
+	free(S->nPixels);
+	free(S);
+}
+
+// Append the pixels Pixels[0..nPixels-1] (flat Row*NrPixels+Col, ascending)
+// of Image as frame FrameNr.
+int
+SparseStoreWrite(struct SparseStore *S, int FrameNr, double Omega, double Threshold,
+	uint64_t Key, int nPixels, int *Pixels, double *Image)
+{
+	struct SparseRecordHeader Rec;
+	struct stat s;
+	size_t Size = sizeof(Rec) + (size_t)nPixels*sizeof(struct SparsePixel);
+	char *Buf = malloc(Size);
+	struct SparsePixel *Px = (struct SparsePixel *)(Buf + sizeof(Rec));
+	int i, rc = 0;
+	memset(&Rec,0,sizeof(Rec));
+	Rec.FrameNr = FrameNr;
+	Rec.nPixels = nPixels;
+	Rec.Omega = Omega;
+	Rec.Threshold = Threshold;
+	Rec.Key = Key;
+	memcpy(Buf,&Rec,sizeof(Rec));
+	for (i=0;i<nPixels;i++){
+		Px[i].Row = (uint16_t)(Pixels[i]/S->NrPixels);
+		Px[i].Col = (uint16_t)(Pixels[i]%S->NrPixels);
+		Px[i].Intensity = (float)Image[Pixels[i]];
+	}
+	flock(S->fd,LOCK_EX);
+	if (fstat(S->fd,&s) != 0 || pwrite(S->fd,Buf,Size,s.st_size) != (ssize_t)Size) rc = 1;
+	flock(S->fd,LOCK_UN);
+	free(Buf);
+	if (rc != 0){
+		printf("Could not write frame %d to sparse store %s.\n",FrameNr,S->Path);
+		return 1;
+	}
+	SparseStoreIndexAdd(S,FrameNr,s.st_size,nPixels,Key);
+	return 0;
+}
+
+// Number of pixels of frame FrameNr made with Key, from the index only, -1
+// if the store does not have it.
+int
+SparseStoreFind(struct SparseStore *S, int FrameNr, uint64_t Key)
+{
+	if (S == NULL || FrameNr < 0 || FrameNr >= S->nIndex || S->Offset[FrameNr] == 0 || S->RecordKey[FrameNr] != Key) return -1;
+	return S->nPixels[FrameNr];
+}
+
+// Returns 0 and the number of pixels if the store holds frame FrameNr made
+// with Key, 1 otherwise. The flat indices go to Pixels and the intensities to
+// Image[Pixels[i]]; the rest of Image is not touched. One read per frame.
+int
+SparseStoreRead(struct SparseStore *S, int FrameNr, uint64_t Key, int *nPixels, int *Pixels, double *Image)
+{
+	struct SparseRecordHeader Rec;
+	struct SparsePixel *Px;
+	int i, n = SparseStoreFind(S,FrameNr,Key);
+	if (n < 0) return 1;
+	size_t Size = sizeof(Rec) + (size_t)n*sizeof(*Px);
+	char *Buf = malloc(Size);
+	if (pread(S->fd,Buf,Size,S->Offset[FrameNr]) != (ssize_t)Size){
+		printf("Frame %d in sparse store %s is truncated.\n",FrameNr,S->Path);
+		free(Buf);
+		return 1;
+	}
+	memcpy(&Rec,Buf,sizeof(Rec));
+	if (Rec.FrameNr != FrameNr || Rec.Key != Key || Rec.nPixels != n){
+		free(Buf);
+		return 1;
+	}
+	Px = (struct SparsePixel *)(Buf + sizeof(Rec));
+	for (i=0;i<n;i++){
+		Pixels[i] = Px[i].Row*S->NrPixels + Px[i].Col;
+		Image[Pixels[i]] = Px[i].Intensity;
+	}
+	*nPixels = n;
+	free(Buf);
+	return 0;
+}
@@ -24,7 +24,6 @@
 #define ClearBit(A,k) (A[(k/32)] &= ~(1 << (k%32)))
 #define TestBit(A,k)  (A[(k/32)] &   (1 << (k%32)))
 #define float32_t float
-#define MAX_N_OVERLAPS 355000
 typedef uint16_t pixelvalue;
 
 #define PIX_SORT(a,b) { if ((a)>(b)) PIX_SWAP((a),(b)); }
@@ -100,6 +99,9 @@ FreeMemMatrixInt(int **mat,int nrows)
     free(mat);
 }
 
+// ConnectedComponents.c
+int FindConnectedRegions(int NrRows, int NrCols, int nPixels, int *Pixels, int *RegionStart, int *RegionPixels, int *Labels);
+
 void FindPeakPositions(
 	int LoGMaskRadius,
 	double sigma,
@@ -155,6 +157,8 @@ void FindPeakPositions(
 	int *ImageEdges; //Edges in LoG filtered image, but just binarized!
 	ImageEdges = malloc((NrPixels*NrPixels*sizeof(*ImageEdges))/32);
 	memset(ImageEdges,0,(NrPixels*NrPixels*sizeof(*ImageEdges))/32);
+	int *EdgePixels, nEdgePixels = 0;
+	EdgePixels = malloc(NrPixels*NrPixels*sizeof(*EdgePixels));
 	for (i=NrPixels+1;i<((NrPixels*NrPixels)-(NrPixels+1));i++){
 		if (Image2[i]!=0 && ((Image3[i] < 0 && Image3[i-1] >= 0)
 			|| (Image3[i] >= 0 && Image3[i-1] < 0)
@@ -165,270 +169,20 @@ void FindPeakPositions(
 			|| (Image3[i] == 0 && Image3[i-NrPixels] < 0 && Image3[i+NrPixels] > 0)
 			|| (Image3[i] == 0 && Image3[i-NrPixels] > 0 && Image3[i+NrPixels] < 0))){
 			SetBit(ImageEdges,i);
+			EdgePixels[nEdgePixels++] = i;
 		}
 	}
 	printf("Carrying out connected components labeling.\n");
-	int PeakID=1;
-	int AlreadyFound=0, Pos;
-	int LargerVal,SmallerVal;
-	int *ImagePeakIDs; // Edges from LoG filtered images, but not unique IDs!
-	ImagePeakIDs = malloc(NrPixels*NrPixels*sizeof(*ImagePeakIDs));
-	for (i=0;i<NrPixels*NrPixels;i++){
-		if (TestBit(ImageEdges,i)){
-			Pos = i-NrPixels-1;
-			if (TestBit(ImageEdges,Pos)){
-				ImagePeakIDs[i] = ImagePeakIDs[Pos];
-				AlreadyFound = 1;
-			}
-			Pos = i-NrPixels;
-			if (TestBit(ImageEdges,Pos)){
-				if (AlreadyFound == 0){
-					ImagePeakIDs[i] = ImagePeakIDs[Pos];
-					AlreadyFound = 1;
-				}
-			}
-			Pos = i-NrPixels+1;
-			if (TestBit(ImageEdges,Pos)){
-				if (AlreadyFound == 0){
-					ImagePeakIDs[i] = ImagePeakIDs[Pos];
-					AlreadyFound = 1;
-				}
-			}
-			Pos = i-1;
-			if (TestBit(ImageEdges,Pos)){
-				if (AlreadyFound == 0){
-					ImagePeakIDs[i] = ImagePeakIDs[Pos];
-					AlreadyFound = 1;
-				}
-			}
-			if (AlreadyFound==0){
-				ImagePeakIDs[i] = PeakID;
-				PeakID++;
-			}
-		}else{
-			ImagePeakIDs[i] = 0;
-		}
-		AlreadyFound = 0;
-	}
-	int **PeakConnectedIDs; // Connected EdgeIDs!
-	int *PeakConnectedIDsMap;
-	int *PeakConnectedIDsMin;
-	int *PeakConnectedIDsTracker;
-	PeakConnectedIDs = allocMatrixInt(PeakID,MAX_N_OVERLAPS);
-	PeakConnectedIDsMap = malloc(PeakID*sizeof(*PeakConnectedIDsMap));
-	PeakConnectedIDsMin = malloc(PeakID*sizeof(*PeakConnectedIDsMin));
-	PeakConnectedIDsTracker = malloc(PeakID*sizeof(*PeakConnectedIDsTracker));
-	for (i=0;i<PeakID;i++){
-		PeakConnectedIDsMap[i]=0;
-		PeakConnectedIDsTracker[i]=0;
-		PeakConnectedIDsMin[i]=0;
-	}
-	int Smaller, Larger, ID1, ID2, RowNr, RowNr2, Number1, Number2, Min, TotNr;
-	int LastRowNr = 1;
-	for (i=0;i<NrPixels*NrPixels;i++){
-		if (TestBit(ImageEdges,i)){
-			Pos = i-NrPixels;
-			if (TestBit(ImageEdges,Pos)){
-				if (ImagePeakIDs[i] != ImagePeakIDs[Pos]){
-					ID1 = ImagePeakIDs[i];
-					ID2 = ImagePeakIDs[Pos];
-					Smaller = ID1 < ID2 ? ID1 : ID2;
-					Larger = ID1 > ID2 ? ID1 : ID2;
-					RowNr = PeakConnectedIDsMap[ID1];
-					RowNr2 = PeakConnectedIDsMap[ID2];
-					if (RowNr!=0 && RowNr2!=0 && RowNr == RowNr2){
-						continue;
-					}else if (RowNr == 0 && RowNr2!=0){
-						PeakConnectedIDsMap[ID1] = RowNr2;
-						Number2 = PeakConnectedIDsTracker[RowNr2];
-						PeakConnectedIDs[RowNr2][Number2] = ID1;
-						Min = ID1;
-						for (j=0;j<Number2;j++){
-							if (PeakConnectedIDs[RowNr2][j] < Min){
-								Min = PeakConnectedIDs[RowNr2][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr2] = Min;
-						PeakConnectedIDsTracker[RowNr2]+= 1;
-					}else if (RowNr !=0 && RowNr2 == 0){
-						PeakConnectedIDsMap[ID2] = RowNr;
-						Number1 = PeakConnectedIDsTracker[RowNr];
-						PeakConnectedIDs[RowNr][Number1] = ID2;
-						Min = ID2;
-						for (j=0;j<Number1;j++){
-							if (PeakConnectedIDs[RowNr][j] < Min){
-								Min = PeakConnectedIDs[RowNr][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr] = Min;
-						PeakConnectedIDsTracker[RowNr]+= 1;
-					}else if (RowNr !=0 && RowNr2 !=0){
-						Number1 = PeakConnectedIDsTracker[RowNr];
-						Number2 = PeakConnectedIDsTracker[RowNr2];
-						TotNr = Number1 + Number2;
-						for (j=0;j<Number2;j++){
-							PeakConnectedIDs[RowNr][Number1+j] = PeakConnectedIDs[RowNr2][j];
-							PeakConnectedIDsMap[PeakConnectedIDs[RowNr2][j]] = RowNr;
-							PeakConnectedIDs[RowNr2][j] = 0;
-						}
-						Min = ID1;
-						for (j=0;j<TotNr;j++){
-							if (PeakConnectedIDs[RowNr][j] < Min){
-								Min = PeakConnectedIDs[RowNr][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr] = Min;
-						PeakConnectedIDsTracker[RowNr] = TotNr;
-					}else{
-						PeakConnectedIDsMap[ID1] = LastRowNr;
-						PeakConnectedIDsMap[ID2] = LastRowNr;
-						PeakConnectedIDsMin[LastRowNr] = Smaller;
-						PeakConnectedIDsTracker[LastRowNr] = 2;
-						PeakConnectedIDs[LastRowNr][0] = Smaller;
-						PeakConnectedIDs[LastRowNr][1] = Larger;
-						LastRowNr++;
-					}
-				}
-			}
-			Pos = i-NrPixels+1;
-			if (TestBit(ImageEdges,Pos)){
-				if (ImagePeakIDs[i] != ImagePeakIDs[Pos]){
-					ID1 = ImagePeakIDs[i];
-					ID2 = ImagePeakIDs[Pos];
-					Smaller = ID1 < ID2 ? ID1 : ID2;
-					Larger = ID1 > ID2 ? ID1 : ID2;
-					RowNr = PeakConnectedIDsMap[ID1];
-					RowNr2 = PeakConnectedIDsMap[ID2];
-					if (RowNr!=0 && RowNr2!=0 && RowNr == RowNr2){
-						continue;
-					}else if (RowNr == 0 && RowNr2!=0){
-						PeakConnectedIDsMap[ID1] = RowNr2;
-						Number2 = PeakConnectedIDsTracker[RowNr2];
-						PeakConnectedIDs[RowNr2][Number2] = ID1;
-						Min = ID1;
-						for (j=0;j<Number2;j++){
-							if (PeakConnectedIDs[RowNr2][j] < Min){
-								Min = PeakConnectedIDs[RowNr2][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr2] = Min;
-						PeakConnectedIDsTracker[RowNr2]+= 1;
-					}else if (RowNr !=0 && RowNr2 == 0){
-						PeakConnectedIDsMap[ID2] = RowNr;
-						Number1 = PeakConnectedIDsTracker[RowNr];
-						PeakConnectedIDs[RowNr][Number1] = ID2;
-						Min = ID2;
-						for (j=0;j<Number1;j++){
-							if (PeakConnectedIDs[RowNr][j] < Min){
-								Min = PeakConnectedIDs[RowNr][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr] = Min;
-						PeakConnectedIDsTracker[RowNr]+= 1;
-					}else if (RowNr !=0 && RowNr2 !=0){
-						Number1 = PeakConnectedIDsTracker[RowNr];
-						Number2 = PeakConnectedIDsTracker[RowNr2];
-						TotNr = Number1 + Number2;
-						for (j=0;j<Number2;j++){
-							PeakConnectedIDs[RowNr][Number1+j] = PeakConnectedIDs[RowNr2][j];
-							PeakConnectedIDsMap[PeakConnectedIDs[RowNr2][j]] = RowNr;
-							PeakConnectedIDs[RowNr2][j] = 0;
-						}
-						Min = ID1;
-						for (j=0;j<TotNr;j++){
-							if (PeakConnectedIDs[RowNr][j] < Min){
-								Min = PeakConnectedIDs[RowNr][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr] = Min;
-						PeakConnectedIDsTracker[RowNr] = TotNr;
-					}else{
-						PeakConnectedIDsMap[ID1] = LastRowNr;
-						PeakConnectedIDsMap[ID2] = LastRowNr;
-						PeakConnectedIDsMin[LastRowNr] = Smaller;
-						PeakConnectedIDsTracker[LastRowNr] = 2;
-						PeakConnectedIDs[LastRowNr][0] = Smaller;
-						PeakConnectedIDs[LastRowNr][1] = Larger;
-						LastRowNr++;
-					}
-				}
-			}
-			Pos = i-1;
-			if (TestBit(ImageEdges,Pos)){
-				if (ImagePeakIDs[i] != ImagePeakIDs[Pos]){
-					ID1 = ImagePeakIDs[i];
-					ID2 = ImagePeakIDs[Pos];
-					Smaller = ID1 < ID2 ? ID1 : ID2;
-					Larger = ID1 > ID2 ? ID1 : ID2;
-					RowNr = PeakConnectedIDsMap[ID1];
-					RowNr2 = PeakConnectedIDsMap[ID2];
-					if (RowNr!=0 && RowNr2!=0 && RowNr == RowNr2){
-						continue;
-					}else if (RowNr == 0 && RowNr2!=0){
-						PeakConnectedIDsMap[ID1] = RowNr2;
-						Number2 = PeakConnectedIDsTracker[RowNr2];
-						PeakConnectedIDs[RowNr2][Number2] = ID1;
-						Min = ID1;
-						for (j=0;j<Number2;j++){
-							if (PeakConnectedIDs[RowNr2][j] < Min){
-								Min = PeakConnectedIDs[RowNr2][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr2] = Min;
-						PeakConnectedIDsTracker[RowNr2]+= 1;
-					}else if (RowNr !=0 && RowNr2 == 0){
-						PeakConnectedIDsMap[ID2] = RowNr;
-						Number1 = PeakConnectedIDsTracker[RowNr];
-						PeakConnectedIDs[RowNr][Number1] = ID2;
-						Min = ID2;
-						for (j=0;j<Number1;j++){
-							if (PeakConnectedIDs[RowNr][j] < Min){
-								Min = PeakConnectedIDs[RowNr][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr] = Min;
-						PeakConnectedIDsTracker[RowNr]+= 1;
-					}else if (RowNr !=0 && RowNr2 !=0){
-						Number1 = PeakConnectedIDsTracker[RowNr];
-						Number2 = PeakConnectedIDsTracker[RowNr2];
-						TotNr = Number1 + Number2;
-						for (j=0;j<Number2;j++){
-							PeakConnectedIDs[RowNr][Number1+j] = PeakConnectedIDs[RowNr2][j];
-							PeakConnectedIDsMap[PeakConnectedIDs[RowNr2][j]] = RowNr;
-							PeakConnectedIDs[RowNr2][j] = 0;
-						}
-						Min = ID1;
-						for (j=0;j<TotNr;j++){
-							if (PeakConnectedIDs[RowNr][j] < Min){
-								Min = PeakConnectedIDs[RowNr][j];
-							}
-						}
-						PeakConnectedIDsMin[RowNr] = Min;
-						PeakConnectedIDsTracker[RowNr] = TotNr;
-					}else{
-						PeakConnectedIDsMap[ID1] = LastRowNr;
-						PeakConnectedIDsMap[ID2] = LastRowNr;
-						PeakConnectedIDsMin[LastRowNr] = Smaller;
-						PeakConnectedIDsTracker[LastRowNr] = 2;
-						PeakConnectedIDs[LastRowNr][0] = Smaller;
-						PeakConnectedIDs[LastRowNr][1] = Larger;
-						LastRowNr++;
-					}
-				}
-			}
-		}
-	}
-	int *ImagePeakIDsCorrected; // Corrected unique EdgeIDs!
+	int Pos;
+	int *ImagePeakIDsCorrected; // Unique EdgeIDs, only set on the edges!
 	ImagePeakIDsCorrected = malloc(NrPixels*NrPixels*sizeof(*ImagePeakIDsCorrected));
-	for (i=0;i<NrPixels*NrPixels;i++){
-		if (TestBit(ImageEdges,i)){
-			if (PeakConnectedIDsMap[ImagePeakIDs[i]]!=0){
-			ImagePeakIDsCorrected[i] = PeakConnectedIDsMin[PeakConnectedIDsMap[ImagePeakIDs[i]]];
-			}else{
-				ImagePeakIDsCorrected[i] = ImagePeakIDs[i];
-			}
-		}
-	}
+	int *RegionStart, *RegionPixels;
+	RegionStart = malloc((nEdgePixels+2)*sizeof(*RegionStart));
+	RegionPixels = malloc((nEdgePixels+1)*sizeof(*RegionPixels));
+	FindConnectedRegions(NrPixels,NrPixels,nEdgePixels,EdgePixels,RegionStart,RegionPixels,ImagePeakIDsCorrected);
+	free(EdgePixels);
+	free(RegionStart);
+	free(RegionPixels);
 	memset(Image4,0,NrPixels*NrPixels*sizeof(int));
 	int *FilledEdges; //Edges in LoG filtered image, but just binarized!
 	FilledEdges = malloc((NrPixels*NrPixels*sizeof(*FilledEdges))/32);
@@ -608,50 +362,10 @@ void FindPeakPositions(
 	printf("Total Number of Peaks = %d\n",PeakNumber-1);
 	free(Image3);
 	free(ImageEdges);
-	free(ImagePeakIDs);
-	FreeMemMatrixInt(PeakConnectedIDs,PeakID);
-	free(PeakConnectedIDsMap);
-	free(PeakConnectedIDsMin);
-	free(PeakConnectedIDsTracker);
 	free(ImagePeakIDsCorrected);
 	free(FilledEdges);
 }
 
-const int dx[] = {+1,  0, -1,  0, +1, -1, +1, -1};
-const int dy[] = { 0, +1,  0, -1, +1, +1, -1, -1};
-
-static inline void DepthFirstSearch(int x, int y, int current_label, int NrPixels, int **BoolImage, int **ConnectedComponents,int **Positions, int *PositionTrackers)
-{
-	if (x < 0 || x == NrPixels) return;
-	if (y < 0 || y == NrPixels) return;
-	if ((ConnectedComponents[x][y]!=0)||(BoolImage[x][y]==0)) return;
-	
-	ConnectedComponents[x][y] = current_label;
-	Positions[current_label][PositionTrackers[current_label]] = (x*NrPixels) + y;
-	PositionTrackers[current_label] += 1;
-	int direction;
-	for (direction=0;direction<8;++direction){
-		DepthFirstSearch(x + dx[direction], y + dy[direction], current_label, NrPixels, BoolImage, ConnectedComponents,Positions,PositionTrackers);
-	}
-}
-
-static inline int FindConnectedComponents(int **BoolImage, int NrPixels, int **ConnectedComponents, int **Positions, int *PositionTrackers){
-	int i,j;
-	for (i=0;i<NrPixels;i++){
-		for (j=0;j<NrPixels;j++){
-			ConnectedComponents[i][j] = 0;
-		}
-	}
-	int component = 0;
-	for (i=0;i<NrPixels;++i) {
-		for (j=0;j<NrPixels;++j) {
-			if ((ConnectedComponents[i][j]==0) && (BoolImage[i][j] == 1)){
-				DepthFirstSearch(i,j,++component,NrPixels,BoolImage,ConnectedComponents,Positions,PositionTrackers);
-			}
-		}
-	}
-	return component;
-}
 
 static void
 usage(void)
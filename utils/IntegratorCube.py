@@ -0,0 +1,105 @@
+import numpy as np
+import struct
+import sys
+
+# Read the <ImageName>_integrated.bin written by Integrator: the header, the
+# axes and the float32 cube Intensity[nFrames][nRBins][nEtaBins].
+# readIntegratorLive reads the newest frames Integrator publishes in LiveMode
+# to /dev/shm/<LiveShm>.
+# Usage: python IntegratorCube.py file_integrated.bin [frameNr]
+#        python IntegratorCube.py --live [LiveShm]
+
+headerFmt = '<IIiiiidddddd'
+headerSize = struct.calcsize(headerFmt)
+dataOffset = 4096
+magic = 0x42554349
+
+def readIntegratorCube(fn):
+	f = open(fn,'rb')
+	h = struct.unpack(headerFmt,f.read(headerSize))
+	if h[0] != magic:
+		f.close()
+		raise ValueError(fn + ' is not an Integrator output.')
+	header = {'Version':h[1],'nFrames':h[2],'nRBins':h[3],'nEtaBins':h[4],'Normalize':h[5],
+		'RMin':h[6],'RBinSize':h[7],'EtaMin':h[8],'EtaBinSize':h[9],'Lsd':h[10],'px':h[11]}
+	nR = header['nRBins']
+	nEta = header['nEtaBins']
+	f.seek(dataOffset)
+	axes = {}
+	axes['RMean'] = np.fromfile(f,dtype='<f8',count=nR)
+	axes['TwoTheta'] = np.fromfile(f,dtype='<f8',count=nR)
+	axes['EtaMean'] = np.fromfile(f,dtype='<f8',count=nEta)
+	axes['Area'] = np.fromfile(f,dtype='<f8',count=nR*nEta).reshape(nR,nEta)
+	f.close()
+	cubeOffset = dataOffset + 8*(2*nR+nEta+nR*nEta)
+	cube = np.memmap(fn,dtype='<f4',mode='r',offset=cubeOffset,shape=(header['nFrames'],nR,nEta))
+	return header, axes, cube
+
+liveHeaderFmt = '<IIiiiiQ'
+liveMagic = 0x45564c49
+liveSlotHeaderFmt = '<Qqii'
+liveSlotHeaderSize = 64
+
+class IntegratorLive:
+	def __init__(self,name='IntegratorLive'):
+		self.mm = np.memmap('/dev/shm/'+name,dtype=np.uint8,mode='r')
+		h = struct.unpack_from(liveHeaderFmt,self.mm,0)
+		if h[0] != liveMagic:
+			raise ValueError(name + ' is not an Integrator live region.')
+		self.nSlots, self.nRBins, self.nEtaBins, self.normalize = h[2:6]
+		nR = self.nRBins
+		nEta = self.nEtaBins
+		pos = dataOffset
+		self.axes = {}
+		for key, n in (('RMean',nR),('TwoTheta',nR),('EtaMean',nEta),('Area',nR*nEta)):
+			self.axes[key] = np.frombuffer(self.mm,dtype='<f8',count=n,offset=pos).copy()
+			pos += 8*n
+		self.axes['Area'] = self.axes['Area'].reshape(nR,nEta)
+		self.slotOffset = (pos+63)//64*64
+		self.slotSize = (liveSlotHeaderSize + 4*nR*nEta + 63)//64*64
+
+	def nPublished(self):
+		return struct.unpack_from('<Q',self.mm,struct.calcsize(liveHeaderFmt)-8)[0]
+
+	# Frame frameNr (count from the start of the run) as (info, Intensity[nRBins][nEtaBins]),
+	# None if it was already overwritten or not published yet.
+	def frame(self,frameNr):
+		if frameNr < 0 or frameNr >= self.nPublished() or frameNr < self.nPublished() - self.nSlots:
+			return None
+		off = self.slotOffset + (frameNr % self.nSlots)*self.slotSize
+		while True:
+			seq = struct.unpack_from('<Q',self.mm,off)[0]
+			if seq % 2 == 1:
+				continue
+			h = struct.unpack_from(liveSlotHeaderFmt,self.mm,off)
+			data = np.frombuffer(self.mm,dtype='<f4',count=self.nRBins*self.nEtaBins,
+				offset=off+liveSlotHeaderSize).copy()
+			if struct.unpack_from('<Q',self.mm,off)[0] == seq:
+				break
+		if h[1] != frameNr:
+			return None
+		info = {'FrameNr':h[1],'FileNr':h[2],'FileFrameNr':h[3]}
+		return info, data.reshape(self.nRBins,self.nEtaBins)
+
+	def latest(self):
+		return self.frame(self.nPublished()-1)
+
+def readIntegratorLive(name='IntegratorLive'):
+	return IntegratorLive(name)
+
+if __name__ == '__main__' and len(sys.argv) > 1 and sys.argv[1] == '--live':
+	live = readIntegratorLive(sys.argv[2] if len(sys.argv) > 2 else 'IntegratorLive')
+	last = live.latest()
+	print('%d frames published' % live.nPublished())
+	if last is not None:
+		print(last[0])
+		for r, tth, i in zip(live.axes['RMean'],live.axes['TwoTheta'],last[1].mean(axis=1)):
+			print('%f\t%f\t%f' % (r,tth,i))
+elif __name__ == '__main__':
+	header, axes, cube = readIntegratorCube(sys.argv[1])
+	print(header)
+	if len(sys.argv) > 2:
+		frameNr = int(sys.argv[2])
+		# The 1d lineout as in the .1d.csv files: mean over eta.
+		for r, tth, i in zip(axes['RMean'],axes['TwoTheta'],cube[frameNr].mean(axis=1)):
+			print('%f\t%f\t%f' % (r,tth,i))
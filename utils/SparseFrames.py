@@ -0,0 +1,53 @@
+import numpy as np
+import struct
+import sys
+
+# Read the .sparse stores written by PeaksFittingPerFile (SparseFolder) and
+# ForwardSimulation (SparseFolder), one file per scan and ring holding all
+# frames. Row is y and Col is z of the corrected, transposed image
+# PeaksFittingPerFile fits.
+# Usage: python SparseFrames.py store.sparse [FrameNr out.bin]
+
+storeFmt = '<IIiiQ'
+storeSize = struct.calcsize(storeFmt)
+recordFmt = '<iiddQ'
+recordSize = struct.calcsize(recordFmt)
+pixelType = np.dtype([('Row','<u2'),('Col','<u2'),('Intensity','<f4')])
+magic = 0x4652504d
+version = 2
+
+def readSparseStore(fn):
+	# Returns the store header and {FrameNr: (header, pixels)}, a later record of a frame wins.
+	f = open(fn,'rb')
+	h = struct.unpack(storeFmt,f.read(storeSize))
+	if h[0] != magic or h[1] != version:
+		f.close()
+		raise ValueError(fn + ' is not a sparse store.')
+	store = {'Version':h[1],'NrPixels':h[2],'RingNr':h[3],'Key':h[4]}
+	frames = {}
+	while True:
+		b = f.read(recordSize)
+		if len(b) < recordSize:
+			break
+		r = struct.unpack(recordFmt,b)
+		header = {'FrameNr':r[0],'nPixels':r[1],'Omega':r[2],'Threshold':r[3],'Key':r[4],'NrPixels':store['NrPixels']}
+		pixels = np.fromfile(f,dtype=pixelType,count=header['nPixels'])
+		if len(pixels) < header['nPixels']:
+			break
+		frames[header['FrameNr']] = (header, pixels)
+	f.close()
+	return store, frames
+
+def sparseToDense(header,pixels):
+	image = np.zeros((header['NrPixels'],header['NrPixels']),dtype=np.float32)
+	image[pixels['Row'],pixels['Col']] = pixels['Intensity']
+	return image
+
+if __name__ == '__main__':
+	store, frames = readSparseStore(sys.argv[1])
+	print(store)
+	for frameNr in sorted(frames):
+		print(frames[frameNr][0])
+	if len(sys.argv) > 3:
+		header, pixels = frames[int(sys.argv[2])]
+		sparseToDense(header,pixels).tofile(sys.argv[3])